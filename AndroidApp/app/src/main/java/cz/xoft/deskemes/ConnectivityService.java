@@ -4,6 +4,7 @@ import android.app.ActivityManager;
 import android.app.Service;
 import android.content.Context;
 import android.content.Intent;
+import android.net.wifi.WifiManager;
 import android.os.Binder;
 import android.os.IBinder;
 import android.util.Log;
@@ -52,6 +53,9 @@ public class ConnectivityService extends Service
 	/** The manager of the approved peers. */
 	private ApprovedPeers mApprovedPeers;
 
+	/** Keeps the Wi-Fi from filtering out the multicast beacons (see UdpListenerThread), null if not available. */
+	private WifiManager.MulticastLock mMulticastLock;
+
 	/** The Binder used to access the service through binding. */
 	private IBinder mBinder = new Binder(this);
 
@@ -120,6 +124,15 @@ public class ConnectivityService extends Service
 		mUdpListenerThread.setBeaconNotificationConsumer(mAddressBlacklistBeaconFilter);
 		mConnectionMgr.setAddressBlacklist(mAddressBlacklistBeaconFilter);
 		mConnectionMgr.start();
+
+		// Many Wi-Fi drivers drop the multicast packets unless an app holds the lock:
+		WifiManager wifiManager = (WifiManager) getApplicationContext().getSystemService(Context.WIFI_SERVICE);
+		if (wifiManager != null)
+		{
+			mMulticastLock = wifiManager.createMulticastLock(TAG);
+			mMulticastLock.setReferenceCounted(false);
+			mMulticastLock.acquire();
+		}
 		mUdpListenerThread.start();
 	}
 
@@ -145,6 +158,11 @@ public class ConnectivityService extends Service
 			}
 			mUdpListenerThread = null;
 		}
+		if (mMulticastLock != null)
+		{
+			mMulticastLock.release();
+			mMulticastLock = null;
+		}
 
 		// Terminate the ConnectionMgr:
 		if (mConnectionMgr != null)
@@ -3,9 +3,15 @@ package cz.xoft.deskemes;
 import android.util.Log;
 
 import java.net.DatagramPacket;
-import java.net.DatagramSocket;
+import java.net.Inet6Address;
+import java.net.InetAddress;
 import java.net.InetSocketAddress;
+import java.net.MulticastSocket;
+import java.net.NetworkInterface;
 import java.net.SocketAddress;
+import java.net.SocketTimeoutException;
+import java.util.Collections;
+import java.util.HashSet;
 
 
 
@@ -13,7 +19,10 @@ import java.net.SocketAddress;
 
 /** A thread that runs in the background all the time (through ConnectivityService) and listens
 for broadcasted UDP beacons from Deskemes.
-Tries to listen on the PRIMARY_PORT; if that is not available, tries ALTERNATE_PORT. */
+Tries to listen on the PRIMARY_PORT; if that is not available, tries ALTERNATE_PORT.
+Also joins the multicast groups to which Deskemes sends the beacons in its multicast mode (the UdpBroadcaster/Multicast
+setting), on all the multicast-capable interfaces; the interfaces are re-checked periodically, so that the groups
+are joined on the networks that come up later. */
 public class UdpListenerThread extends Thread
 {
 	/** The interface that is used to report the received UDP beacons to. */
@@ -37,8 +46,20 @@ public class UdpListenerThread extends Thread
 	/** The UDP port on which the service listens if the primary port is not available. */
 	private final static int ALTERNATE_PORT = 4816;
 
+	/** The IPv4 multicast group to which Deskemes sends the beacons in the multicast mode. */
+	private final static String MULTICAST_GROUP_IPV4 = "239.255.48.16";
+
+	/** The IPv6 (link-local) multicast group to which Deskemes sends the beacons in the multicast mode. */
+	private final static String MULTICAST_GROUP_IPV6 = "ff02::4816";
+
+	/** The interval in which the interfaces are re-checked for joining the multicast groups. */
+	private final static int MULTICAST_REJOIN_INTERVAL_MSEC = 10000;
+
 	/** The UDP socket used for listening. */
-	private DatagramSocket mSocket;
+	private MulticastSocket mSocket;
+
+	/** The multicast groups already joined, as "<interface name>/<group>". */
+	private HashSet<String> mJoinedGroups = new HashSet<>();
 
 	/** Flag that is set to true to terminate the listening thread. */
 	private boolean mShouldTerminate = false;
@@ -68,21 +89,32 @@ public class UdpListenerThread extends Thread
 			try
 			{
 				SocketAddress sa = new InetSocketAddress(PRIMARY_PORT);
-				mSocket = new DatagramSocket(sa);
+				mSocket = new MulticastSocket(sa);
 			}
 			catch (Exception exc)
 			{
 				SocketAddress sa = new InetSocketAddress(ALTERNATE_PORT);
-				mSocket = new DatagramSocket(sa);
+				mSocket = new MulticastSocket(sa);
 			}
 			Log.d(TAG, "Listening on " + mSocket.getLocalSocketAddress());
 			mSocket.setBroadcast(true);
+			mSocket.setSoTimeout(MULTICAST_REJOIN_INTERVAL_MSEC);
+			joinMulticastGroups();
 			while (!mShouldTerminate)
 			{
 				final int MAX_PACKET_LENGTH = 1000;
 				byte[] packetData = new byte[MAX_PACKET_LENGTH];
 				DatagramPacket packet = new DatagramPacket(packetData, packetData.length);
-				mSocket.receive(packet);
+				try
+				{
+					mSocket.receive(packet);
+				}
+				catch (SocketTimeoutException exc)
+				{
+					// No beacon for a while, check for new networks:
+					joinMulticastGroups();
+					continue;
+				}
 				processPacket(packet);
 			}
 		}
@@ -96,6 +128,76 @@ public class UdpListenerThread extends Thread
 
 
 
+	/** Joins the multicast groups on all the multicast-capable interfaces on which they haven't been joined yet.
+	The IPv6 group is link-local, so it is joined only on the interfaces that have an IPv6 address.
+	The groups joined on the interfaces that have gone away are forgotten, so that they are re-joined if the
+	interface comes back. */
+	private void joinMulticastGroups()
+	{
+		HashSet<String> joined = new HashSet<>();
+		try
+		{
+			InetAddress group4 = InetAddress.getByName(MULTICAST_GROUP_IPV4);
+			InetAddress group6 = InetAddress.getByName(MULTICAST_GROUP_IPV6);
+			for (NetworkInterface iface: Collections.list(NetworkInterface.getNetworkInterfaces()))
+			{
+				if (!iface.isUp() || iface.isLoopback() || !iface.supportsMulticast())
+				{
+					continue;
+				}
+				boolean hasIPv6 = false;
+				for (InetAddress addr: Collections.list(iface.getInetAddresses()))
+				{
+					if (addr instanceof Inet6Address)
+					{
+						hasIPv6 = true;
+					}
+				}
+				joinMulticastGroup(group4, iface, joined);
+				if (hasIPv6)
+				{
+					joinMulticastGroup(group6, iface, joined);
+				}
+			}
+		}
+		catch (Exception exc)
+		{
+			Log.d(TAG, "Cannot enumerate the interfaces for joining the multicast groups", exc);
+			return;
+		}
+		mJoinedGroups = joined;
+	}
+
+
+
+
+
+	/** Joins the multicast group on the interface, unless already joined (in mJoinedGroups).
+	Adds the group to aJoined if it is joined (now or before). */
+	private void joinMulticastGroup(InetAddress aGroup, NetworkInterface aInterface, HashSet<String> aJoined)
+	{
+		String key = aInterface.getName() + "/" + aGroup.getHostAddress();
+		if (mJoinedGroups.contains(key))
+		{
+			aJoined.add(key);
+			return;
+		}
+		try
+		{
+			mSocket.joinGroup(new InetSocketAddress(aGroup, 0), aInterface);
+			Log.d(TAG, "Joined the multicast group " + key);
+			aJoined.add(key);
+		}
+		catch (Exception exc)
+		{
+			Log.d(TAG, "Cannot join the multicast group " + key, exc);
+		}
+	}
+
+
+
+
+
 	/** Processes the received UDP packet.
 	Called by mThread when a UDP packet is received. */
 	private void processPacket(DatagramPacket aPacket)
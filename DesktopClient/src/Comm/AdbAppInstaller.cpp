@@ -1,11 +1,35 @@
 #include "AdbAppInstaller.hpp"
+#include <QFileInfo>
+#include "AdbCommunicator.hpp"
+#include "../Logger.hpp"
 
 
 
 
 
-AdbAppInstaller::AdbAppInstaller():
-	mAdbProcess(nullptr),
+/** The folder on the device where the APK is uploaded before installing.
+It is writable by the ADB shell user on all devices. */
+static const char REMOTE_TEMP_FOLDER[] = "/data/local/tmp/";
+
+
+
+
+
+/** Returns the string quoted for the device's (posix) shell. */
+static QByteArray shellQuote(const QByteArray & aString)
+{
+	auto res = aString;
+	res.replace("'", "'\\''");
+	return "'" + res + "'";
+}
+
+
+
+
+
+AdbAppInstaller::AdbAppInstaller(Logger & aLogger):
+	mLogger(aLogger),
+	mComm(nullptr),
 	mShouldAutoDeleteSelf(false)
 {
 }
@@ -14,18 +38,26 @@ AdbAppInstaller::AdbAppInstaller():
 
 
 
+AdbAppInstaller::~AdbAppInstaller()
+{
+	releaseComm();
+}
+
+
+
+
+
 void AdbAppInstaller::installAppFromFile(const QByteArray & aDeviceID, const QString & aApkFileName)
 {
-	if (mAdbProcess != nullptr)
+	if (mComm != nullptr)
 	{
 		throw std::logic_error("An installation is already in progress.");
 	}
-	mAdbProcess = new QProcess;
-	connect(mAdbProcess, QOverload<int, QProcess::ExitStatus>::of(&QProcess::finished), this, &AdbAppInstaller::adbProcessFinished);
-	connect(mAdbProcess, &QProcess::errorOccurred, this, &AdbAppInstaller::adbProcessErrorOccurred);
-	QStringList args;
-	args << "-s" << aDeviceID << "install" << aApkFileName;
-	mAdbProcess->start("adb", args);
+	mDeviceID = aDeviceID;
+	mRemotePath = REMOTE_TEMP_FOLDER + QFileInfo(aApkFileName).fileName().toUtf8();
+	mPmOutput.clear();
+	mLogger.log("Installing %1 to device %2...", aApkFileName, aDeviceID);
+	pushApk(aApkFileName);
 }
 
 
@@ -41,68 +73,116 @@ void AdbAppInstaller::autoDeleteSelf()
 
 
 
-void AdbAppInstaller::adbProcessFinished(int aExitCode, QProcess::ExitStatus aExitStatus)
+void AdbAppInstaller::startComm(std::function<void()> aOnAssigned)
+{
+	releaseComm();
+	mComm = new AdbCommunicator(mLogger);
+	connect(mComm, &AdbCommunicator::connected,      this, [this](){ mComm->assignDevice(mDeviceID); });
+	connect(mComm, &AdbCommunicator::deviceAssigned, this, aOnAssigned);
+	connect(mComm, &AdbCommunicator::error,          this, &AdbAppInstaller::finish);
+	mComm->start();
+}
+
+
+
+
+
+void AdbAppInstaller::releaseComm()
 {
-	// Free up the process instance, allow another install operation
-	if (mAdbProcess == nullptr)
+	if (mComm == nullptr)
 	{
 		return;
 	}
-	mAdbProcess->deleteLater();
-	auto proc = mAdbProcess;
-	mAdbProcess = nullptr;
+	mComm->disconnect(this);
+	mComm->close();
+	mComm->deleteLater();
+	mComm = nullptr;
+}
 
-	if (aExitStatus == QProcess::NormalExit)
-	{
-		if (aExitCode == 0)
+
+
+
+
+void AdbAppInstaller::pushApk(const QString & aApkFileName)
+{
+	startComm([this]() { mComm->startSync(); });
+	connect(mComm, &AdbCommunicator::syncReady, this,
+		[this, aApkFileName]()
 		{
-			Q_EMIT installed();
+			mComm->syncPush(aApkFileName, mRemotePath);
 		}
-		else
+	);
+	connect(mComm, &AdbCommunicator::syncProgress, this, &AdbAppInstaller::progress);
+	connect(mComm, &AdbCommunicator::syncPushFinished, this, &AdbAppInstaller::runPackageManager);
+	connect(mComm, &AdbCommunicator::disconnected, this,
+		[this]()
 		{
-			// Report an error based on ADB output
-			auto out = proc->readAllStandardOutput();
-			auto err = proc->readAllStandardError();
-			Q_EMIT errorOccurred(tr("The ADB process reported an error:\n%1\n%2").arg(QString::fromUtf8(err), QString::fromUtf8(out)));
+			finish(tr("The ADB connection was closed while uploading the APK."));
 		}
-	}
-	else
-	{
-		Q_EMIT errorOccurred(tr("The underlying ADB process crashed."));
-	}
+	);
+}
 
-	// Auto-delete self, if requested to do so:
-	if (mShouldAutoDeleteSelf)
-	{
-		deleteLater();
-	}
+
+
+
+
+void AdbAppInstaller::runPackageManager()
+{
+	// The sync connection cannot run other services, use a new one for the shell:
+	mLogger.log("APK uploaded to %1, installing...", mRemotePath);
+	startComm(
+		[this]()
+		{
+			auto quotedPath = shellQuote(mRemotePath);
+			mComm->shellExecuteV1("pm install -r " + quotedPath + "; rm -f " + quotedPath);
+		}
+	);
+	connect(mComm, &AdbCommunicator::shellIncomingData, this,
+		[this](const QByteArray & aDeviceID, const QByteArray & aOutput)
+		{
+			Q_UNUSED(aDeviceID);
+			mPmOutput.append(aOutput);
+		}
+	);
+	connect(mComm, &AdbCommunicator::disconnected, this,
+		[this]()
+		{
+			// The package manager reports "Success" on the last line, or "Failure [reason]":
+			if (mPmOutput.contains("Success"))
+			{
+				finish({});
+			}
+			else
+			{
+				finish(tr("The package manager reported an error:\n%1").arg(QString::fromUtf8(mPmOutput.trimmed())));
+			}
+		}
+	);
 }
 
 
 
 
 
-void AdbAppInstaller::adbProcessErrorOccurred(QProcess::ProcessError aProcessError)
+void AdbAppInstaller::finish(const QString & aErrorDesc)
 {
-	// Free up the process instance, allow another install operation
-	if (mAdbProcess == nullptr)
+	// Free up the connection, allow another install operation
+	if (mComm == nullptr)
 	{
 		return;
 	}
-	mAdbProcess->deleteLater();
-	mAdbProcess = nullptr;
+	releaseComm();
 
-	QString err;
-	switch (aProcessError)
+	if (aErrorDesc.isEmpty())
+	{
+		mLogger.log("App installed to device %1.", mDeviceID);
+		Q_EMIT installed();
+	}
+	else
 	{
-		case QProcess::FailedToStart: err = tr("The underlying ADB process failed to start."); break;
-		case QProcess::Crashed:       err = tr("The underlying ADB process crashed."); break;
-		case QProcess::Timedout:      err = tr("The underlying ADB process seems to have frozen."); break;
-		case QProcess::WriteError:    err = tr("Failed to send data to the underlying ADB process."); break;
-		case QProcess::ReadError:     err = tr("Failed to read data from the underlying ADB process."); break;
-		case QProcess::UnknownError:  err = tr("Unknown error in the underlying ADB process."); break;
+		mLogger.log("Installing the app to device %1 failed: %2", mDeviceID, aErrorDesc);
+		Q_EMIT errorOccurred(aErrorDesc);
 	}
-	Q_EMIT errorOccurred(err);
 
 	// Auto-delete self, if requested to do so:
 	if (mShouldAutoDeleteSelf)
@@ -1,13 +1,23 @@
 #pragma once
 
+#include <functional>
 #include <QObject>
-#include <QProcess>
+
+
+
+
+
+// fwd:
+class AdbCommunicator;
+class Logger;
 
 
 
 
 
 /** Takes care of installing apps through ADB asynchronously.
+The APK is pushed to a temporary location on the device using the ADB sync protocol and then installed by running
+the device's package manager ("pm install") through the ADB shell; no external ADB process is spawned.
 A single instance can install one app at a time.
 Progress, success or failure is reported using Qt signals. */
 class AdbAppInstaller:
@@ -18,11 +28,13 @@ class AdbAppInstaller:
 
 public:
 
-	explicit AdbAppInstaller();
+	explicit AdbAppInstaller(Logger & aLogger);
+
+	virtual ~AdbAppInstaller() override;
 
 	/** Tries to install the app from the specified APK to the specified device.
 	Works asynchonously in the background.
-	Emits either the installed() or the errorOccurred() signal. */
+	Emits progress() while uploading the APK, then either the installed() or the errorOccurred() signal. */
 	void installAppFromFile(const QByteArray & aDeviceID, const QString & aApkFileName);
 
 	/** After this call, when the installation is finished (or error occurs), this instance auto-deletes itself. */
@@ -37,23 +49,45 @@ Q_SIGNALS:
 	/** Emittd is the installation fails, either by not having an ADB available or it reports a problem. */
 	void errorOccurred(QString aErrorDesc);
 
+	/** Emitted repeatedly while the APK is being uploaded to the device. */
+	void progress(qint64 aNumBytesUploaded, qint64 aTotalBytes);
+
 
 private:
 
-	/** The ADB process handling the actual installation.
+	/** The logger used for all messages produced by this class. */
+	Logger & mLogger;
+
+	/** The ADB serial of the device to which the app is being installed. */
+	QByteArray mDeviceID;
+
+	/** The path on the device where the APK is uploaded. */
+	QByteArray mRemotePath;
+
+	/** The ADB connection used by the current installation step (pushing the APK, then running the package manager).
 	nullptr while there's no installation in progress. */
-	QProcess * mAdbProcess;
+	AdbCommunicator * mComm;
+
+	/** The output of the package manager received so far. */
+	QByteArray mPmOutput;
 
 	/** If true, the object will auto-delete self once the installation finishes or an error occurs. */
 	bool mShouldAutoDeleteSelf;
 
 
-private Q_SLOTS:
+	/** Creates a new connection to the ADB server in mComm, assigns it to mDeviceID and then calls aOnAssigned. */
+	void startComm(std::function<void()> aOnAssigned);
 
-	/** Invoked by mAdbProcess when the ADB process finishes. */
-	void adbProcessFinished(int aExitCode, QProcess::ExitStatus aExitStatus);
+	/** Closes and schedules mComm for deletion. */
+	void releaseComm();
 
-	/** Invoked by mAdbProcess when the ADB process reports an error. */
-	void adbProcessErrorOccurred(QProcess::ProcessError aProcessError);
-};
+	/** Pushes the APK file to mRemotePath on the device. Once pushed, continues with runPackageManager(). */
+	void pushApk(const QString & aApkFileName);
+
+	/** Runs the package manager on the device to install the pushed APK, then removes the APK. */
+	void runPackageManager();
 
+	/** Finishes the installation, emits the installed() or errorOccurred() signal and auto-deletes self, if requested.
+	aErrorDesc is empty on success. */
+	void finish(const QString & aErrorDesc);
+};
@@ -1,17 +1,55 @@
 #include "AdbCommunicator.hpp"
 #include <cassert>
+#include <algorithm>
 #include <limits>
 #include <thread>
 #include <QDir>
+#include <QDateTime>
 #include "../Utils.hpp"
 
 
 
 
 
-/** The port on which the ADB server listens on a computer. */
+/** The default port on which the ADB server listens on a computer.
+Can be overridden by the ANDROID_ADB_SERVER_PORT environment variable, same as with the adb tool. */
 #define ADB_LOCAL_PORT 5037
 
+/** The maximum width and height of a framebuffer that is accepted from the device. */
+static const uint32_t MAX_FRAMEBUFFER_DIMENSION = 16384;
+
+/** The size of the chunks in which the framebuffer data is read from the socket, when converting the pixels. */
+static const int FRAMEBUFFER_READ_SIZE = 64 * 1024;
+
+/** The size of the chunks in which the ShellV2 data is read from the socket. */
+static const int SHELL_READ_SIZE = 16 * 1024;
+
+/** The maximum size of a single ShellV2 packet accepted from the device (adbd uses much smaller ones). */
+static const uint32_t SHELL_MAX_PACKET_SIZE = 1024 * 1024;
+
+/** The IDs of the ShellV2 packets (adb's shell_protocol.h). */
+enum
+{
+	SHELL_ID_STDIN = 0,
+	SHELL_ID_STDOUT = 1,
+	SHELL_ID_STDERR = 2,
+	SHELL_ID_EXIT = 3,
+	SHELL_ID_CLOSE_STDIN = 4,
+};
+
+/** The maximum size of a single DATA packet in the sync protocol (both directions). */
+static const uint32_t SYNC_DATA_CHUNK_SIZE = 64 * 1024;
+
+/** The maximum number of bytes queued in the socket's outgoing buffer while pushing a file.
+More file data is sent only once the buffer drains below this limit. */
+static const qint64 SYNC_MAX_PENDING_WRITE = 4 * SYNC_DATA_CHUNK_SIZE;
+
+/** The maximum length of the remote path in the sync protocol requests. */
+static const int SYNC_MAX_PATH_LENGTH = 1024;
+
+/** The unix file-type bits of a regular file, sent along with the permissions when pushing a file. */
+static const uint32_t SYNC_MODE_REGULAR_FILE = 0100000;
+
 
 
 
@@ -95,16 +133,32 @@ static uint32_t decodeLEUInt32(const char * aData)
 	auto d = reinterpret_cast<const unsigned char *>(aData);
 	return
 	(
-		static_cast<uint32_t>(d[0] << 24) |
-		static_cast<uint32_t>(d[1] << 16) |
-		static_cast<uint32_t>(d[2] << 8) |
-		static_cast<uint32_t>(d[3])
+		static_cast<uint32_t>(d[0]) |
+		static_cast<uint32_t>(d[1] << 8) |
+		static_cast<uint32_t>(d[2] << 16) |
+		static_cast<uint32_t>(d[3] << 24)
 	);
 }
 
 
 
 
+/** Encodes the specified value as LE UInt32. */
+static QByteArray encodeLEUInt32(uint32_t aValue)
+{
+	QByteArray res;
+	res.resize(4);
+	res[0] = static_cast<char>(aValue & 0xff);
+	res[1] = static_cast<char>((aValue >> 8) & 0xff);
+	res[2] = static_cast<char>((aValue >> 16) & 0xff);
+	res[3] = static_cast<char>((aValue >> 24) & 0xff);
+	return res;
+}
+
+
+
+
+
 /** Returns the contents of the ADB public key file.
 Returns an empty QByteArray if the pub key file cannot be read. */
 static QByteArray loadAdbPubKeyFile()
@@ -123,14 +177,45 @@ static QByteArray loadAdbPubKeyFile()
 
 
 
+/** Returns the port on which the local ADB server listens.
+Uses the ANDROID_ADB_SERVER_PORT environment variable, if set to a valid port (so that the client can be pointed
+to a different ADB server, such as the tests/FakeAdbServer tool); the default ADB port otherwise. */
+static quint16 adbServerPort()
+{
+	static const quint16 port = []()
+	{
+		bool isOK = false;
+		auto port = qEnvironmentVariableIntValue("ANDROID_ADB_SERVER_PORT", &isOK);
+		if (!isOK || (port <= 0) || (port > 65535))
+		{
+			return static_cast<quint16>(ADB_LOCAL_PORT);
+		}
+		return static_cast<quint16>(port);
+	}();
+	return port;
+}
+
+
+
+
+
 ////////////////////////////////////////////////////////////////////////////////
 // AdbCommunicator:
 
 AdbCommunicator::AdbCommunicator(Logger & aLogger):
 	Super(nullptr),
 	mState(csCreated),
+	mFramebufferBpp(0),
 	mFramebufferSize(0),
-	mLogger(aLogger)
+	mFramebufferWidth(0),
+	mFramebufferHeight(0),
+	mFramebufferReceived(0),
+	mSyncFileData(nullptr),
+	mSyncFileSize(0),
+	mSyncTransferred(0),
+	mSyncIsDoneSent(false),
+	mSyncChunkRemaining(0),
+	mLogger(&aLogger)
 {
 }
 
@@ -149,7 +234,18 @@ void AdbCommunicator::start()
 	connect(&mSocket, &QTcpSocket::connected,     this, &AdbCommunicator::onSocketConnected);
 	connect(&mSocket, &QTcpSocket::disconnected,  this, &AdbCommunicator::onSocketDisconnected);
 	connect(&mSocket, &QTcpSocket::readyRead,     this, &AdbCommunicator::onSocketReadyRead);
-	mSocket.connectToHost("localhost", ADB_LOCAL_PORT);
+	connect(&mSocket, &QTcpSocket::bytesWritten,  this, &AdbCommunicator::onSocketBytesWritten);
+	mSocket.connectToHost("localhost", adbServerPort());
+}
+
+
+
+
+
+void AdbCommunicator::close()
+{
+	mState = csBroken;
+	mSocket.abort();
 }
 
 
@@ -160,7 +256,7 @@ void AdbCommunicator::listDevices()
 {
 	assert(mState == csReady);
 	mState = csListingDevicesStart;
-	mLogger.log("Requesting device list...");
+	mLogger->log("Requesting device list...");
 	writeHex4("host:devices");
 	/*
 	Expected response:
@@ -178,7 +274,7 @@ void AdbCommunicator::trackDevices()
 {
 	assert(mState == csReady);
 	mState = csTrackingDevicesStart;
-	mLogger.log("Requesting device tracking...");
+	mLogger->log("Requesting device tracking...");
 	writeHex4("host:track-devices");
 	/*
 	Expected response:
@@ -197,7 +293,7 @@ void AdbCommunicator::trackDevices()
 
 void AdbCommunicator::assignDevice(const QByteArray & aDeviceID)
 {
-	mLogger.log("Assigning device %1.", aDeviceID);
+	mLogger->log("Assigning device %1.", aDeviceID);
 	switch (mState)
 	{
 		case csReady:
@@ -219,35 +315,30 @@ void AdbCommunicator::assignDevice(const QByteArray & aDeviceID)
 
 
 
-void AdbCommunicator::takeScreenshot()
+void AdbCommunicator::takeScreenshot(QImage aReuseImage)
 {
 	switch (mState)
 	{
 		case csDeviceAssigned:
 		{
 			// Start the screenshotting:
+			mScreenshot = std::move(aReuseImage);
 			mState = csScreenshottingStart;
-			writeHex4("framebuffer");
+			writeHex4("framebuffer:");
 			break;
 		}
 
 		case csScreenshottingStart:
-		{
-			// We're already waiting for a screenshot, no need to request a new one.
-			break;
-		}
-
+		case csScreenshottingHeader:
 		case csScreenshotting:
 		{
-			// We're already screenshotting, request another one
-			mLogger.logHex("s", "Writing data");
-			mSocket.write("s");
+			// We're already waiting for a screenshot, no need to request a new one.
 			break;
 		}
 
 		default:
 		{
-			assert("!Invalid state");
+			assert(!"Invalid state");
 			break;
 		}
 	}
@@ -259,7 +350,7 @@ void AdbCommunicator::takeScreenshot()
 
 void AdbCommunicator::portReverse(quint16 aDevicePort, quint16 aLocalPort)
 {
-	mLogger.log("Setting up port-reversing...");
+	mLogger->log("Setting up port-reversing...");
 	assert(mState == csDeviceAssigned);
 	writeHex4(QString::fromUtf8("reverse:forward:tcp:%1;tcp:%2").arg(aDevicePort).arg(aLocalPort).toUtf8());
 	mState = csPortReversing;
@@ -269,9 +360,40 @@ void AdbCommunicator::portReverse(quint16 aDevicePort, quint16 aLocalPort)
 
 
 
+void AdbCommunicator::listPortReverses()
+{
+	mLogger->log("Listing port-reversing...");
+	assert(mState == csDeviceAssigned);
+	writeHex4("reverse:list-forward");
+	mState = csListingPortReversesStart;
+}
+
+
+
+
+
+void AdbCommunicator::queryFeatures(const QByteArray & aDeviceID)
+{
+	assert(mState == csReady);
+	mState = csQueryingFeaturesStart;
+	mAssignedDeviceID = aDeviceID;
+	mLogger->log("Querying the features of device %1...", aDeviceID);
+	writeHex4("host-serial:" + aDeviceID + ":features");
+	/*
+	Expected response:
+	OKAY
+	<len><feature>,<feature>,...
+	(socket close)
+	*/
+}
+
+
+
+
+
 void AdbCommunicator::shellExecuteV1(const QByteArray & aCommand)
 {
-	mLogger.log("Sending V1 shell command: \"%1\".", aCommand);
+	mLogger->log("Sending V1 shell command: \"%1\".", aCommand);
 	assert(mState == csDeviceAssigned);
 	writeHex4("shell:" + aCommand);
 	mState = csExecutingShellV1;
@@ -281,6 +403,132 @@ void AdbCommunicator::shellExecuteV1(const QByteArray & aCommand)
 
 
 
+void AdbCommunicator::shellExecuteV2(const QByteArray & aCommand)
+{
+	mLogger->log("Sending V2 shell command: \"%1\".", aCommand);
+	assert(mState == csDeviceAssigned);
+	writeHex4("shell,v2,raw:" + aCommand);
+	mState = csExecutingShellV2Start;
+	/*
+	Expected response:
+	OKAY
+	Then packets of <id:1 byte> <length:LE uint32> <data>, with the id being stdout, stderr or exit (1 byte exit code).
+	*/
+}
+
+
+
+
+
+void AdbCommunicator::startSync()
+{
+	mLogger->log("Switching to the sync mode...");
+	assert(mState == csDeviceAssigned);
+	writeHex4("sync:");
+	mState = csSyncStart;
+	/*
+	Expected response:
+	OKAY
+	Then the connection uses the sync protocol, each packet is a 4-char ID followed by a LE uint32 length or value:
+	SEND <len> <path,mode>  DATA <len> <data> ... DONE <mtime>  ->  OKAY <0> | FAIL <len> <msg>
+	RECV <len> <path>  ->  DATA <len> <data> ... DONE <0> | FAIL <len> <msg>
+	STAT <len> <path>  ->  STAT <mode> <size> <mtime>
+	LIST <len> <path>  ->  DENT <mode> <size> <mtime> <namelen> <name> ... DONE <0> <0> <0> <0>
+	*/
+}
+
+
+
+
+
+void AdbCommunicator::syncPush(const QString & aLocalFileName, const QByteArray & aRemotePath, uint32_t aMode)
+{
+	mLogger->log("Pushing file %1 to %2...", aLocalFileName, aRemotePath);
+	mSyncFile.setFileName(aLocalFileName);
+	if (!mSyncFile.open(QIODevice::ReadOnly))
+	{
+		Q_EMIT error(tr("Cannot open file %1: %2").arg(aLocalFileName, mSyncFile.errorString()));
+		return;
+	}
+	mSyncFileSize = mSyncFile.size();
+	if (mSyncFileSize > std::numeric_limits<uint32_t>::max())
+	{
+		mSyncFile.close();
+		Q_EMIT error(tr("File %1 is too large to be pushed").arg(aLocalFileName));
+		return;
+	}
+	mSyncFileData = nullptr;
+	if (mSyncFileSize > 0)
+	{
+		// Map the file instead of reading it, the OS pages the data in as it is being sent:
+		mSyncFileData = mSyncFile.map(0, mSyncFileSize);
+		if (mSyncFileData == nullptr)
+		{
+			mSyncFile.close();
+			Q_EMIT error(tr("Cannot map file %1: %2").arg(aLocalFileName, mSyncFile.errorString()));
+			return;
+		}
+	}
+	auto request = aRemotePath + "," + QByteArray::number(SYNC_MODE_REGULAR_FILE | (aMode & 0777));
+	if (!startSyncOperation("SEND", aRemotePath, request, csSyncPushing))
+	{
+		if (mSyncFileData != nullptr)
+		{
+			mSyncFile.unmap(mSyncFileData);
+			mSyncFileData = nullptr;
+		}
+		mSyncFile.close();
+		return;
+	}
+	syncPushMoreData();
+}
+
+
+
+
+
+void AdbCommunicator::syncPull(const QByteArray & aRemotePath, const QString & aLocalFileName)
+{
+	mLogger->log("Pulling file %1 to %2...", aRemotePath, aLocalFileName);
+	mSyncFile.setFileName(aLocalFileName);
+	if (!mSyncFile.open(QIODevice::WriteOnly | QIODevice::Truncate))
+	{
+		Q_EMIT error(tr("Cannot open file %1 for writing: %2").arg(aLocalFileName, mSyncFile.errorString()));
+		return;
+	}
+	mSyncChunkRemaining = 0;
+	if (!startSyncOperation("RECV", aRemotePath, aRemotePath, csSyncPulling))
+	{
+		mSyncFile.close();
+		mSyncFile.remove();
+	}
+}
+
+
+
+
+
+void AdbCommunicator::syncStat(const QByteArray & aRemotePath)
+{
+	mLogger->log("Querying stat of %1...", aRemotePath);
+	startSyncOperation("STAT", aRemotePath, aRemotePath, csSyncStatting);
+}
+
+
+
+
+
+void AdbCommunicator::syncList(const QByteArray & aRemotePath)
+{
+	mLogger->log("Listing %1...", aRemotePath);
+	mSyncDirEntries.clear();
+	startSyncOperation("LIST", aRemotePath, aRemotePath, csSyncListing);
+}
+
+
+
+
+
 QByteArray AdbCommunicator::getAdbPubKey()
 {
 	auto pubKeyFile = loadAdbPubKeyFile();
@@ -306,7 +554,7 @@ void AdbCommunicator::writeHex4(const QByteArray & aMessage)
 	assert(len <= std::numeric_limits<uint16_t>::max());
 	auto hex4 = numberToHex4(static_cast<uint16_t>(len));
 	auto msg = hex4 + aMessage;
-	mLogger.logHex(msg, "Writing data");
+	mLogger->logHex(msg, "Writing data");
 	mSocket.write(msg);
 }
 
@@ -316,42 +564,37 @@ void AdbCommunicator::writeHex4(const QByteArray & aMessage)
 
 void AdbCommunicator::parseDeviceList(const QByteArray & aMessage)
 {
-	auto lines = aMessage.split('\n');
-	QList<QByteArray> onlineIDs, unauthIDs, otherIDs;
-	for (const auto & line: lines)
+	auto list = AdbDeviceList::parse(aMessage, *mLogger);
+	auto numOnline = list.idsWithStatus(AdbDeviceList::adsOnline).size();
+	mLogger->log("Updating device list: %1 online, %2 unauth, %3 otherIDs.",
+		numOnline, list.mNumUnauthorized, list.mDevices.size() - numOnline - static_cast<size_t>(list.mNumUnauthorized)
+	);
+	Q_EMIT updateDeviceList(list);
+}
+
+
+
+
+
+void AdbCommunicator::parsePortReverseList(const QByteArray & aMessage)
+{
+	// Each line is "<transport> <device side> <local side>":
+	std::vector<PortReverse> reverses;
+	for (const auto & line: aMessage.split('\n'))
 	{
-		if (line.isEmpty())
-		{
-			continue;
-		}
-		auto parts = line.split('\t');
-		if (parts.size() < 2)
-		{
-			mLogger.logHex(line, "ERROR: Bad DeviceList line received");
-			continue;
-		}
-		if (parts[0].size() < 8)
+		auto fields = line.simplified().split(' ');
+		if (fields.size() != 3)
 		{
-			// Suspiciously short ID
-			mLogger.logHex(line, "ERROR: Suspiciously short DeviceID received in line");
+			if (!line.trimmed().isEmpty())
+			{
+				mLogger->logHex(line, "ERROR: Bad port-reversing list line received");
+			}
 			continue;
 		}
-		const auto & status = parts[1];
-		if (status == "device")
-		{
-			onlineIDs.push_back(parts[0]);
-		}
-		else if ((status == "authorizing") || (status == "unauthorized"))
-		{
-			unauthIDs.push_back(parts[0]);
-		}
-		else
-		{
-			otherIDs.push_back(parts[0]);
-		}
+		reverses.push_back({fields[1], fields[2]});
 	}
-	mLogger.log("Updating device list: %1 online, %2 unauth, %3 otherIDs.", onlineIDs.size(), unauthIDs.size(), otherIDs.size());
-	Q_EMIT updateDeviceList(onlineIDs, unauthIDs, otherIDs);
+	mLogger->log("Received %1 port-reversing rules.", reverses.size());
+	Q_EMIT portReversesListed(mAssignedDeviceID, reverses);
 }
 
 
@@ -380,7 +623,12 @@ bool AdbCommunicator::extractOkayOrFail()
 		}
 		auto err = mIncomingData.mid(8, length);
 		mIncomingData = mIncomingData.mid(length + 8);
-		mLogger.log("Received an error: %1.", err);
+		mLogger->log("Received an error: %1.", err);
+		if ((mState == csExecutingShellV2Start) && (err == "closed"))
+		{
+			// The ADB server reports an unknown service on the device this way:
+			Q_EMIT shellV2Refused(mAssignedDeviceID, QString::fromUtf8(err));
+		}
 		Q_EMIT error(QString::fromUtf8(err));
 		return false;
 	}
@@ -393,7 +641,7 @@ bool AdbCommunicator::extractOkayOrFail()
 	{
 		mState = csBroken;
 		mSocket.abort();
-		mLogger.log("ERROR: Malformed response received from ADB server.");
+		mLogger->log("ERROR: Malformed response received from ADB server.");
 		Q_EMIT error(tr("Malformed response received from ADB server"));
 		return false;
 	}
@@ -426,92 +674,625 @@ std::pair<bool, QByteArray> AdbCommunicator::extractHex4Packet()
 
 
 
-void AdbCommunicator::processScreenshot()
+void AdbCommunicator::parseFramebufferHeader()
 {
-	assert(static_cast<uint32_t>(mIncomingData.size()) >= mFramebufferSize);
-	QImage img(
-		reinterpret_cast<uchar *>(mIncomingData.data()),
-		static_cast<int>(mFramebufferWidth),
-		static_cast<int>(mFramebufferHeight),
-		QImage::Format_RGB16
-	);
-	Q_EMIT screenshotReceived(mAssignedDeviceID, img);
-	mIncomingData = mIncomingData.mid(static_cast<int>(mFramebufferSize));
+	/*
+	The header consists of LE uint32 values: the version, then for version 16 (legacy, RGB565): size, width, height;
+	for version 1: bpp, size, width, height, red offset, red length, blue offset, blue length, green offset,
+	green length, alpha offset, alpha length; version 2 has an additional colorspace value after bpp.
+	*/
+	if (mIncomingData.size() < 4)
+	{
+		return;
+	}
+	auto version = decodeLEUInt32(mIncomingData.constData());
+	int headerSize;
+	switch (version)
+	{
+		case 16: headerSize = 4 * 4;  break;
+		case 1:  headerSize = 13 * 4; break;
+		case 2:  headerSize = 14 * 4; break;
+		default:
+		{
+			mState = csBroken;
+			Q_EMIT error(tr("Unsupported framebuffer version: %1").arg(version));
+			return;
+		}
+	}
+	if (mIncomingData.size() < headerSize)
+	{
+		return;
+	}
+	auto header = mIncomingData.constData() + 4;
+	FramebufferConverter::Layout layout;
+	if (version == 16)
+	{
+		mFramebufferBpp    = 16;
+		mFramebufferSize   = decodeLEUInt32(header);
+		mFramebufferWidth  = decodeLEUInt32(header + 4);
+		mFramebufferHeight = decodeLEUInt32(header + 8);
+		layout = {16, {11, 5}, {5, 6}, {0, 5}, {0, 0}};
+	}
+	else
+	{
+		mFramebufferBpp = decodeLEUInt32(header);
+		header += (version == 2) ? 8 : 4;  // Skip the colorspace
+		mFramebufferSize   = decodeLEUInt32(header);
+		mFramebufferWidth  = decodeLEUInt32(header + 4);
+		mFramebufferHeight = decodeLEUInt32(header + 8);
+		layout.mBpp   = mFramebufferBpp;
+		layout.mRed   = {decodeLEUInt32(header + 12), decodeLEUInt32(header + 16)};
+		layout.mBlue  = {decodeLEUInt32(header + 20), decodeLEUInt32(header + 24)};
+		layout.mGreen = {decodeLEUInt32(header + 28), decodeLEUInt32(header + 32)};
+		layout.mAlpha = {decodeLEUInt32(header + 36), decodeLEUInt32(header + 40)};
+	}
+	mIncomingData.remove(0, headerSize);
+	mLogger->log("Framebuffer: %1 * %2 px, %3 bpp, %4 bytes.", mFramebufferWidth, mFramebufferHeight, mFramebufferBpp, mFramebufferSize);
+
+	// Sanity checks:
+	if (
+		(mFramebufferWidth == 0) || (mFramebufferWidth > MAX_FRAMEBUFFER_DIMENSION) ||
+		(mFramebufferHeight == 0) || (mFramebufferHeight > MAX_FRAMEBUFFER_DIMENSION) ||
+		!mFramebufferConverter.setLayout(layout) ||
+		(static_cast<quint64>(mFramebufferSize) != static_cast<quint64>(mFramebufferWidth) * mFramebufferHeight * mFramebufferBpp / 8)
+	)
+	{
+		mState = csBroken;
+		Q_EMIT error(tr("Invalid framebuffer header"));
+		return;
+	}
+
+	// Always decode into RGB32, the native format for painting, so that the frames aren't converted again on each paint.
+	// Reuse the image provided by the caller, if it fits:
+	auto width = static_cast<int>(mFramebufferWidth);
+	auto height = static_cast<int>(mFramebufferHeight);
+	if ((mScreenshot.width() != width) || (mScreenshot.height() != height) || (mScreenshot.format() != QImage::Format_RGB32))
+	{
+		mScreenshot = QImage(width, height, QImage::Format_RGB32);
+		if (mScreenshot.isNull())
+		{
+			mState = csBroken;
+			Q_EMIT error(tr("Cannot allocate the image for the framebuffer"));
+			return;
+		}
+	}
+	mFramebufferReceived = 0;
+	mPixelCarry.clear();
+
+	// Older devices wait for a "nudge" byte before sending the data, newer ones ignore it:
+	mSocket.write("\0", 1);
+	mState = csScreenshotting;
 }
 
 
 
 
 
-void AdbCommunicator::onSocketConnected()
+void AdbCommunicator::receiveFramebufferData()
 {
-	assert(mState == csConnecting);
-	mState = csReady;
-	Q_EMIT connected();
+	// Decode any leftover data that has arrived together with the header:
+	if (!mIncomingData.isEmpty())
+	{
+		auto leftover = std::move(mIncomingData);
+		mIncomingData.clear();
+		decodeFramebufferData(leftover.constData(), leftover.size());
+	}
+
+	// Decode the rest directly from the socket:
+	while ((mState == csScreenshotting) && (mSocket.bytesAvailable() > 0))
+	{
+		mReadBuffer.resize(FRAMEBUFFER_READ_SIZE);
+		auto numRead = mSocket.read(mReadBuffer.data(), mReadBuffer.size());
+		if (numRead <= 0)
+		{
+			break;
+		}
+		decodeFramebufferData(mReadBuffer.constData(), static_cast<int>(numRead));
+	}
 }
 
 
 
 
 
-void AdbCommunicator::onSocketError(QAbstractSocket::SocketError aError)
+void AdbCommunicator::decodeFramebufferData(const char * aData, int aSize)
 {
-	if (aError == QAbstractSocket::RemoteHostClosedError)
+	auto bytesPerPixel = mFramebufferConverter.bytesPerPixel();
+	while ((aSize > 0) && (mState == csScreenshotting))
 	{
-		// This is an expected state, don't log or emit anything
-		return;
-	}
+		// Complete the pixel carried over from the previous chunk:
+		auto pixelIndex = mFramebufferReceived / static_cast<uint32_t>(bytesPerPixel);
+		auto row = static_cast<int>(pixelIndex / mFramebufferWidth);
+		auto col = static_cast<int>(pixelIndex % mFramebufferWidth);
+		auto dst = reinterpret_cast<QRgb *>(mScreenshot.scanLine(row)) + col;
+		if (!mPixelCarry.isEmpty())
+		{
+			auto numBytes = std::min(aSize, bytesPerPixel - mPixelCarry.size());
+			mPixelCarry.append(aData, numBytes);
+			aData += numBytes;
+			aSize -= numBytes;
+			if (mPixelCarry.size() < bytesPerPixel)
+			{
+				break;
+			}
+			mFramebufferConverter.convert(mPixelCarry.constData(), 1, dst);
+			mPixelCarry.clear();
+			framebufferBytesReceived(static_cast<uint32_t>(bytesPerPixel));
+			continue;
+		}
 
-	auto err = mSocket.errorString();
-	mLogger.log("Socket error: %1.", err);
-	mState = csBroken;
-	mSocket.abort();
-	Q_EMIT error(tr("Error on the underlying TCP socket: %1").arg(err));
+		// Convert the whole pixels up to the end of the current scanline:
+		auto numPixels = std::min(aSize / bytesPerPixel, static_cast<int>(mFramebufferWidth) - col);
+		if (numPixels == 0)
+		{
+			mPixelCarry.append(aData, aSize);
+			break;
+		}
+		mFramebufferConverter.convert(aData, numPixels, dst);
+		aData += numPixels * bytesPerPixel;
+		aSize -= numPixels * bytesPerPixel;
+		framebufferBytesReceived(static_cast<uint32_t>(numPixels * bytesPerPixel));
+	}
 }
 
 
 
 
 
-void AdbCommunicator::onSocketDisconnected()
+void AdbCommunicator::framebufferBytesReceived(uint32_t aNumBytes)
 {
-	mLogger.log("Socket disconnected: %1.", mSocket.errorString());
+	mFramebufferReceived += aNumBytes;
+	if (mFramebufferReceived < mFramebufferSize)
+	{
+		return;
+	}
+
+	// The device closes the connection after sending a single frame:
 	mState = csBroken;
-	mSocket.abort();
-	Q_EMIT disconnected();
+	auto img = std::move(mScreenshot);
+	mScreenshot = QImage();
+	Q_EMIT screenshotReceived(mAssignedDeviceID, img);
 }
 
 
 
 
 
-void AdbCommunicator::onSocketReadyRead()
+void AdbCommunicator::receiveShellV2Data()
 {
-	// Append the incoming data:
 	while (true)
 	{
-		auto dataRead = mSocket.read(3000);
-		if (dataRead.isEmpty())
+		auto dest = mShellData.prepareWrite(SHELL_READ_SIZE);
+		auto numRead = mSocket.read(dest, SHELL_READ_SIZE);
+		if (numRead <= 0)
 		{
 			break;
 		}
-		mLogger.logHex(dataRead, "Received data");
-		mIncomingData.append(dataRead);
+		mShellData.commitWrite(static_cast<int>(numRead));
 	}
+	parseShellV2Packets();
+	mShellData.compact();
+}
 
-	// Try parsing packets:
-	int prevBytesLeft = 0;
-	while (mIncomingData.size() != prevBytesLeft)
+
+
+
+
+void AdbCommunicator::parseShellV2Packets()
+{
+	while ((mState == csExecutingShellV2) && (mShellData.size() >= 5))
 	{
-		prevBytesLeft = mIncomingData.size();
-		switch (mState)
+		auto length = decodeLEUInt32(mShellData.data() + 1);
+		if (length > SHELL_MAX_PACKET_SIZE)
 		{
-			case csCreated:
-			case csConnecting:
-			case csReady:
-			{
-				// Invalid state, break the connection
-				mState = csBroken;
+			mState = csBroken;
+			mLogger->log("ERROR: Malformed ShellV2 packet received, length %1.", length);
+			Q_EMIT error(tr("Malformed shell packet received from the device"));
+			return;
+		}
+		auto packetSize = 5 + static_cast<int>(length);
+		if (mShellData.size() < packetSize)
+		{
+			// Need more data
+			return;
+		}
+		switch (mShellData.bytes()[0])
+		{
+			case SHELL_ID_STDOUT:
+			{
+				Q_EMIT shellStdOut(mAssignedDeviceID, mShellData.copy(5, static_cast<int>(length)));
+				break;
+			}
+			case SHELL_ID_STDERR:
+			{
+				Q_EMIT shellStdErr(mAssignedDeviceID, mShellData.copy(5, static_cast<int>(length)));
+				break;
+			}
+			case SHELL_ID_EXIT:
+			{
+				// The device closes the connection after sending the exit code:
+				auto exitCode = (length > 0) ? static_cast<int>(mShellData.bytes()[5]) : -1;
+				mLogger->log("The V2 shell command has finished, exit code %1.", exitCode);
+				mShellData.consume(packetSize);
+				mState = csBroken;
+				Q_EMIT shellFinished(mAssignedDeviceID, exitCode);
+				return;
+			}
+			default:
+			{
+				mLogger->log("Ignoring an unexpected ShellV2 packet, id %1.", static_cast<int>(mShellData.bytes()[0]));
+				break;
+			}
+		}
+		mShellData.consume(packetSize);
+	}
+}
+
+
+
+
+
+bool AdbCommunicator::startSyncOperation(
+	const char * aRequestID,
+	const QByteArray & aRemotePath,
+	const QByteArray & aRequestData,
+	EState aNewState
+)
+{
+	if (mState != csSyncReady)
+	{
+		assert(!"Invalid state");
+		Q_EMIT error(tr("Not in the sync mode"));
+		return false;
+	}
+	if (aRemotePath.isEmpty() || (aRequestData.size() > SYNC_MAX_PATH_LENGTH))
+	{
+		Q_EMIT error(tr("Invalid remote path: %1").arg(QString::fromUtf8(aRemotePath)));
+		return false;
+	}
+	mSyncRemotePath = aRemotePath;
+	mSyncTransferred = 0;
+	mSyncIsDoneSent = false;
+	auto request = QByteArray(aRequestID) + encodeLEUInt32(static_cast<uint32_t>(aRequestData.size())) + aRequestData;
+	mLogger->logHex(request, "Writing data");
+	mSocket.write(request);
+	mState = aNewState;
+	return true;
+}
+
+
+
+
+
+void AdbCommunicator::syncPushMoreData()
+{
+	while (
+		(mState == csSyncPushing) &&
+		!mSyncIsDoneSent &&
+		(mSocket.bytesToWrite() < SYNC_MAX_PENDING_WRITE)
+	)
+	{
+		auto numBytes = std::min<qint64>(mSyncFileSize - mSyncTransferred, SYNC_DATA_CHUNK_SIZE);
+		if (numBytes == 0)
+		{
+			// All the data has been sent, finish with the file's modification time:
+			auto modificationTime = mSyncFile.fileTime(QFileDevice::FileModificationTime).toSecsSinceEpoch();
+			mSocket.write("DONE" + encodeLEUInt32(static_cast<uint32_t>(modificationTime)));
+			mSyncIsDoneSent = true;
+			if (mSyncFileData != nullptr)
+			{
+				mSyncFile.unmap(mSyncFileData);
+				mSyncFileData = nullptr;
+			}
+			mSyncFile.close();
+			break;
+		}
+		mSocket.write("DATA" + encodeLEUInt32(static_cast<uint32_t>(numBytes)));
+		mSocket.write(reinterpret_cast<const char *>(mSyncFileData + mSyncTransferred), numBytes);
+		mSyncTransferred += numBytes;
+		Q_EMIT syncProgress(mSyncTransferred, mSyncFileSize);
+	}
+}
+
+
+
+
+
+bool AdbCommunicator::extractSyncFail()
+{
+	if (!mIncomingData.startsWith("FAIL"))
+	{
+		return false;
+	}
+	if (mIncomingData.size() < 8)
+	{
+		// Need more data
+		return true;
+	}
+	auto length = decodeLEUInt32(mIncomingData.constData() + 4);
+	if (length > SYNC_DATA_CHUNK_SIZE)
+	{
+		failSyncOperation(tr("Malformed sync response received from the device"));
+		return true;
+	}
+	if (static_cast<uint32_t>(mIncomingData.size()) < length + 8)
+	{
+		// Need more data
+		return true;
+	}
+	auto msg = mIncomingData.mid(8, static_cast<int>(length));
+	mIncomingData.clear();
+	failSyncOperation(tr("The device reported a failure: %1").arg(QString::fromUtf8(msg)));
+	return true;
+}
+
+
+
+
+
+void AdbCommunicator::parseSyncPushResponse()
+{
+	// The device may refuse the file even before all the data is sent:
+	if (extractSyncFail() || (mIncomingData.size() < 8))
+	{
+		return;
+	}
+	if (!mIncomingData.startsWith("OKAY") || !mSyncIsDoneSent)
+	{
+		failSyncOperation(tr("Malformed sync response received from the device"));
+		return;
+	}
+	mIncomingData.remove(0, 8);
+	mLogger->log("File %1 pushed, %2 bytes.", mSyncRemotePath, mSyncTransferred);
+	auto remotePath = mSyncRemotePath;
+	finishSyncOperation();
+	Q_EMIT syncPushFinished(remotePath);
+}
+
+
+
+
+
+void AdbCommunicator::parseSyncPullData()
+{
+	while ((mState == csSyncPulling) && !mIncomingData.isEmpty())
+	{
+		// Write the rest of the current DATA packet into the file:
+		if (mSyncChunkRemaining > 0)
+		{
+			auto numBytes = std::min(mIncomingData.size(), static_cast<int>(mSyncChunkRemaining));
+			if (mSyncFile.write(mIncomingData.constData(), numBytes) != numBytes)
+			{
+				failSyncOperation(tr("Cannot write to file %1: %2").arg(mSyncFile.fileName(), mSyncFile.errorString()));
+				return;
+			}
+			mIncomingData.remove(0, numBytes);
+			mSyncChunkRemaining -= static_cast<uint32_t>(numBytes);
+			mSyncTransferred += numBytes;
+			Q_EMIT syncProgress(mSyncTransferred, -1);
+			continue;
+		}
+
+		// Parse the next packet header:
+		if (extractSyncFail() || (mIncomingData.size() < 8))
+		{
+			return;
+		}
+		auto length = decodeLEUInt32(mIncomingData.constData() + 4);
+		if (mIncomingData.startsWith("DATA") && (length <= SYNC_DATA_CHUNK_SIZE))
+		{
+			mIncomingData.remove(0, 8);
+			mSyncChunkRemaining = length;
+		}
+		else if (mIncomingData.startsWith("DONE"))
+		{
+			mIncomingData.remove(0, 8);
+			mSyncFile.close();
+			mLogger->log("File %1 pulled, %2 bytes.", mSyncRemotePath, mSyncTransferred);
+			auto remotePath = mSyncRemotePath;
+			finishSyncOperation();
+			Q_EMIT syncPullFinished(remotePath);
+			return;
+		}
+		else
+		{
+			failSyncOperation(tr("Malformed sync response received from the device"));
+			return;
+		}
+	}
+}
+
+
+
+
+
+void AdbCommunicator::parseSyncStatResponse()
+{
+	if (mIncomingData.size() < 16)
+	{
+		return;
+	}
+	if (!mIncomingData.startsWith("STAT"))
+	{
+		failSyncOperation(tr("Malformed sync response received from the device"));
+		return;
+	}
+	auto mode = decodeLEUInt32(mIncomingData.constData() + 4);
+	auto size = decodeLEUInt32(mIncomingData.constData() + 8);
+	auto modificationTime = decodeLEUInt32(mIncomingData.constData() + 12);
+	mIncomingData.remove(0, 16);
+	auto remotePath = mSyncRemotePath;
+	finishSyncOperation();
+	Q_EMIT syncStatReceived(remotePath, mode, size, modificationTime);
+}
+
+
+
+
+
+void AdbCommunicator::parseSyncListData()
+{
+	while ((mState == csSyncListing) && (mIncomingData.size() >= 20))
+	{
+		if (mIncomingData.startsWith("DONE"))
+		{
+			mIncomingData.remove(0, 20);
+			auto remotePath = mSyncRemotePath;
+			auto entries = std::move(mSyncDirEntries);
+			mSyncDirEntries.clear();
+			finishSyncOperation();
+			Q_EMIT syncListReceived(remotePath, entries);
+			return;
+		}
+		auto nameLength = decodeLEUInt32(mIncomingData.constData() + 16);
+		if (!mIncomingData.startsWith("DENT") || (nameLength > static_cast<uint32_t>(SYNC_MAX_PATH_LENGTH)))
+		{
+			failSyncOperation(tr("Malformed sync response received from the device"));
+			return;
+		}
+		if (static_cast<uint32_t>(mIncomingData.size()) < 20 + nameLength)
+		{
+			// Need more data
+			return;
+		}
+		SyncDirEntry entry;
+		entry.mMode = decodeLEUInt32(mIncomingData.constData() + 4);
+		entry.mSize = decodeLEUInt32(mIncomingData.constData() + 8);
+		entry.mModificationTime = decodeLEUInt32(mIncomingData.constData() + 12);
+		entry.mName = mIncomingData.mid(20, static_cast<int>(nameLength));
+		mIncomingData.remove(0, 20 + static_cast<int>(nameLength));
+		mSyncDirEntries.push_back(std::move(entry));
+	}
+}
+
+
+
+
+
+void AdbCommunicator::finishSyncOperation()
+{
+	if (mSyncFileData != nullptr)
+	{
+		mSyncFile.unmap(mSyncFileData);
+		mSyncFileData = nullptr;
+	}
+	mSyncFile.close();
+	mSyncChunkRemaining = 0;
+	if (mState != csBroken)
+	{
+		mState = csSyncReady;
+	}
+}
+
+
+
+
+
+void AdbCommunicator::failSyncOperation(const QString & aErrorText)
+{
+	auto wasPulling = (mState == csSyncPulling);
+	mState = csBroken;
+	finishSyncOperation();
+	if (wasPulling)
+	{
+		// Don't leave a partial file behind:
+		mSyncFile.remove();
+	}
+	mLogger->log("Sync operation on %1 failed: %2", mSyncRemotePath, aErrorText);
+	Q_EMIT error(aErrorText);
+}
+
+
+
+
+
+void AdbCommunicator::onSocketConnected()
+{
+	assert(mState == csConnecting);
+	mState = csReady;
+	Q_EMIT connected();
+}
+
+
+
+
+
+void AdbCommunicator::onSocketError(QAbstractSocket::SocketError aError)
+{
+	if (aError == QAbstractSocket::RemoteHostClosedError)
+	{
+		// This is an expected state, don't log or emit anything
+		return;
+	}
+
+	auto err = mSocket.errorString();
+	mLogger->log("Socket error: %1.", err);
+	mState = csBroken;
+	mSocket.abort();
+	Q_EMIT error(tr("Error on the underlying TCP socket: %1").arg(err));
+}
+
+
+
+
+
+void AdbCommunicator::onSocketDisconnected()
+{
+	mLogger->log("Socket disconnected: %1.", mSocket.errorString());
+	mState = csBroken;
+	mSocket.abort();
+	Q_EMIT disconnected();
+}
+
+
+
+
+
+void AdbCommunicator::onSocketReadyRead()
+{
+	// The framebuffer data is decoded directly from the socket:
+	if (mState == csScreenshotting)
+	{
+		receiveFramebufferData();
+		return;
+	}
+
+	// The ShellV2 packets are parsed in-place, without accumulating the data in mIncomingData:
+	if (mState == csExecutingShellV2)
+	{
+		receiveShellV2Data();
+		return;
+	}
+
+	// Append the incoming data:
+	while (true)
+	{
+		auto dataRead = mSocket.read(3000);
+		if (dataRead.isEmpty())
+		{
+			break;
+		}
+		if (mState != csSyncPulling)
+		{
+			// Don't log the (possibly huge) file contents
+			mLogger->logHex(dataRead, "Received data");
+		}
+		mIncomingData.append(dataRead);
+	}
+
+	// Try parsing packets:
+	int prevBytesLeft = 0;
+	while (mIncomingData.size() != prevBytesLeft)
+	{
+		prevBytesLeft = mIncomingData.size();
+		switch (mState)
+		{
+			case csCreated:
+			case csConnecting:
+			case csReady:
+			{
+				// Invalid state, break the connection
+				mState = csBroken;
 				Q_EMIT error(tr("Unexpected data received on the socket"));
 				break;
 			}
@@ -573,38 +1354,32 @@ void AdbCommunicator::onSocketReadyRead()
 
 			case csDeviceAssigned:
 			{
-				mLogger.log("Unexpected packet received in csDeviceAssigned state.");
+				mLogger->log("Unexpected packet received in csDeviceAssigned state.");
 				break;
 			}
 
 			case csScreenshottingStart:
 			{
-				// Check if failure is reported:
-				if (!extractOkayOrFail())
+				if (extractOkayOrFail())
 				{
-					break;
+					mState = csScreenshottingHeader;
 				}
+				break;
+			}
 
-				// Look for the 32-byte header:
-				if (mIncomingData.size() < 32)
+			case csScreenshottingHeader:
+			{
+				parseFramebufferHeader();
+				if (mState == csScreenshotting)
 				{
-					break;
+					receiveFramebufferData();
 				}
-				mFramebufferDepth  = decodeLEUInt32(mIncomingData.constData());
-				mFramebufferSize   = decodeLEUInt32(mIncomingData.constData() + 4);
-				mFramebufferWidth  = decodeLEUInt32(mIncomingData.constData() + 8);
-				mFramebufferHeight = decodeLEUInt32(mIncomingData.constData() + 12);
-				mIncomingData = mIncomingData.mid(32);
 				break;
 			}
 
 			case csScreenshotting:
 			{
-				if (static_cast<uint32_t>(mIncomingData.size()) < mFramebufferSize)
-				{
-					break;
-				}
-				processScreenshot();
+				receiveFramebufferData();
 				break;
 			}
 
@@ -618,12 +1393,146 @@ void AdbCommunicator::onSocketReadyRead()
 				break;
 			}
 
+			case csListingPortReversesStart:
+			{
+				if (extractOkayOrFail())
+				{
+					mState = csListingPortReversesResult;
+				}
+				break;
+			}
+
+			case csListingPortReversesResult:
+			{
+				if (extractOkayOrFail())
+				{
+					mState = csListingPortReverses;
+				}
+				break;
+			}
+
+			case csListingPortReverses:
+			{
+				auto packet = extractHex4Packet();
+				if (packet.first)
+				{
+					mState = csBroken;  // The connection will be terminated from the device side
+					parsePortReverseList(packet.second);
+				}
+				break;
+			}
+
+			case csQueryingFeaturesStart:
+			{
+				if (extractOkayOrFail())
+				{
+					mState = csQueryingFeatures;
+				}
+				break;
+			}
+
+			case csQueryingFeatures:
+			{
+				auto packet = extractHex4Packet();
+				if (packet.first)
+				{
+					mState = csBroken;  // The ADB server closes the connection
+					auto features = packet.second.trimmed().split(',');
+					features.removeAll(QByteArray());
+					mLogger->log("Device %1 has features %2.", mAssignedDeviceID, packet.second);
+					Q_EMIT featuresReceived(mAssignedDeviceID, features);
+				}
+				break;
+			}
+
 			case csExecutingShellV1:
 			{
 				Q_EMIT shellIncomingData(mAssignedDeviceID, mIncomingData);
 				mIncomingData.clear();
 				break;
 			}
+
+			case csExecutingShellV2Start:
+			{
+				if (extractOkayOrFail())
+				{
+					mState = csExecutingShellV2;
+
+					// The commands get no input, close their stdin so that they don't wait for it:
+					static const char closeStdin[] = {SHELL_ID_CLOSE_STDIN, 0, 0, 0, 0};
+					mSocket.write(closeStdin, sizeof(closeStdin));
+
+					// Parse any packets that have arrived together with the OKAY:
+					mShellData.append(mIncomingData);
+					mIncomingData.clear();
+					parseShellV2Packets();
+					mShellData.compact();
+				}
+				break;
+			}
+
+			case csExecutingShellV2:
+			{
+				// Not expected, the data is read directly into mShellData; hand any over to the shell parser anyway:
+				mShellData.append(mIncomingData);
+				mIncomingData.clear();
+				parseShellV2Packets();
+				mShellData.compact();
+				break;
+			}
+
+			case csSyncStart:
+			{
+				if (extractOkayOrFail())
+				{
+					mState = csSyncReady;
+					Q_EMIT syncReady(mAssignedDeviceID);
+				}
+				break;
+			}
+
+			case csSyncReady:
+			{
+				mLogger->log("Unexpected packet received in csSyncReady state.");
+				break;
+			}
+
+			case csSyncPushing:
+			{
+				parseSyncPushResponse();
+				break;
+			}
+
+			case csSyncPulling:
+			{
+				parseSyncPullData();
+				break;
+			}
+
+			case csSyncStatting:
+			{
+				parseSyncStatResponse();
+				break;
+			}
+
+			case csSyncListing:
+			{
+				parseSyncListData();
+				break;
+			}
 		}
 	}
 }
+
+
+
+
+
+void AdbCommunicator::onSocketBytesWritten(qint64 aNumBytes)
+{
+	Q_UNUSED(aNumBytes);
+	if (mState == csSyncPushing)
+	{
+		syncPushMoreData();
+	}
+}
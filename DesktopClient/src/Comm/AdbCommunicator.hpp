@@ -1,9 +1,15 @@
 #pragma once
 
+#include <map>
 #include <memory>
+#include <vector>
 #include <QTcpSocket>
 #include <QImage>
+#include <QFile>
 #include "../Exception.hpp"
+#include "AdbDeviceList.hpp"
+#include "FramebufferConverter.hpp"
+#include "ReceiveBuffer.hpp"
 
 
 
@@ -13,7 +19,8 @@
 Connects to the localhost ADB server and issues command to it according to the functions called.
 All operations are performed asynchronously.
 Note that each operation takes exclusive ownership of the connection and it is then no longer possible to
-request another operation. You need to create a new instance in order to request a different operation. */
+request another operation. You need to create a new instance in order to request a different operation.
+Use AdbConnectionPool to get an already connected instance and to queue the operations per device. */
 class AdbCommunicator:
 	public QObject
 {
@@ -24,9 +31,35 @@ class AdbCommunicator:
 
 public:
 
+	/** A snapshot of the device list, as reported by ADB. */
+	using DeviceList = AdbDeviceList;
+
+
+	/** A single entry of a remote directory listing, as reported by syncList(). */
+	struct SyncDirEntry
+	{
+		QByteArray mName;
+		uint32_t mMode;              ///< The unix st_mode (file type and permissions)
+		uint32_t mSize;              ///< Size of the file, in bytes
+		uint32_t mModificationTime;  ///< Unix timestamp of the last modification
+	};
+
+
+	/** A single port-reversing rule set up on a device, as reported by listPortReverses(). */
+	struct PortReverse
+	{
+		QByteArray mDeviceSide;  ///< The socket on the device, such as "tcp:1234"
+		QByteArray mLocalSide;   ///< The socket on the local machine to which the connections are forwarded, such as "tcp:1234"
+	};
+
+
 	/** Creates a new instance of a communicator. */
 	explicit AdbCommunicator(Logger & aLogger);
 
+	/** Sets the logger to use for all the further messages.
+	Used when a pre-connected communicator is handed over to an operation for a specific device. */
+	void setLogger(Logger & aLogger) { mLogger = &aLogger; }
+
 
 public Q_SLOTS:
 
@@ -34,6 +67,10 @@ public Q_SLOTS:
 	A connected() signal is emitted once connected. The error() signal is emitted on error. */
 	void start();
 
+	/** Closes the connection to the ADB server, abandoning any operation in progress.
+	The disconnected() signal is emitted if the connection was established. */
+	void close();
+
 	/** Asks ADB for the list of devices.
 	The devices are reported back using the updateDeviceList() signal.
 	ADB closes the connection after sending the whole device list. */
@@ -50,11 +87,13 @@ public Q_SLOTS:
 	Once the switch is confirmed by the ADB server, the deviceAssigned() signal is emitted. */
 	void assignDevice(const QByteArray & aDeviceID);
 
-	/** Instructs the device to send a screenshot.
-	Needs a device assigned first. Multiple successive screenshots can be requested using one object instance.
+	/** Instructs the device to send a screenshot (the ADB "framebuffer:" service).
+	Needs a device assigned first. The device sends a single frame and then closes the connection.
+	The pixels are decoded into aReuseImage as they arrive, if its size and format fit the framebuffer (the caller
+	should hand over its only reference, so that the image isn't detached); otherwise a new image is allocated.
 	Once the screenshot is received, the screenshotReceived() signal is emitted.
 	If the screenshotting fails, the regular error() signal is emitted. */
-	void takeScreenshot();
+	void takeScreenshot(QImage aReuseImage = QImage());
 
 	/** Sets up port reversing - a TCP server on the device, forwarding incoming connections to the local machine.
 	Needs a device assigned first.
@@ -65,6 +104,20 @@ public Q_SLOTS:
 		quint16 aLocalPort
 	);
 
+	/** Asks the device for the list of the port-reversing rules currently set up ("reverse:list-forward").
+	Needs a device assigned first.
+	The rules are reported back using the portReversesListed() signal, then the device closes the connection.
+	The rules are lost when the device disconnects or the ADB server restarts, so the list tells whether the
+	reversing set up earlier is still in place.
+	If the device responds with an error, the regular error() signal is emitted. */
+	void listPortReverses();
+
+	/** Asks the ADB server for the features of the specified device ("host-serial:<serial>:features"), such as
+	"shell_v2". Sent on a plain connection to the server (csReady), no device needs to be assigned.
+	The features are reported back using the featuresReceived() signal, then the ADB server closes the connection.
+	If the ADB server responds with an error (device not found, old server), the regular error() signal is emitted. */
+	void queryFeatures(const QByteArray & aDeviceID);
+
 
 	/** Executes the specified command through the device's shell, the original V1 protocol.
 	Needs a device assigned first.
@@ -73,6 +126,50 @@ public Q_SLOTS:
 	If the device responds with an error, the regular error() signal is emitted. */
 	void shellExecuteV1(const QByteArray & aCommand);
 
+	/** Executes the specified command through the device's shell, using the V2 protocol ("shell,v2,raw:").
+	Needs a device assigned first.
+	The command's stdout and stderr are delivered separately, in the shellStdOut() and shellStdErr() signals,
+	as they arrive. Once the command terminates, the shellFinished() signal is emitted with its exit code and the
+	device closes the connection.
+	Use queryFeatures() first to find out whether the device supports the V2 protocol ("shell_v2").
+	If the device's ADB daemon doesn't know the V2 shell service (before Android 7), the ADB server reports the
+	"closed" failure and the shellV2Refused() signal is emitted, followed by the regular error() signal. Any other
+	failure (such as the device going offline) emits only the error() signal. */
+	void shellExecuteV2(const QByteArray & aCommand);
+
+	/** Switches the connection into the file-sync mode (the ADB "sync:" service).
+	Needs a device assigned first.
+	Once the device confirms, the syncReady() signal is emitted; then the syncPush(), syncPull(), syncStat()
+	and syncList() operations can be used, one at a time (each returns back to the sync mode once finished).
+	If the device responds with an error, the regular error() signal is emitted. */
+	void startSync();
+
+	/** Pushes the local file to the device, storing it under the specified remote path, with the specified
+	permissions (unix mode bits, the file is always created as a regular file).
+	Needs the sync mode (see startSync()).
+	The file is memory-mapped and sent in 64 KiB chunks, paced by the socket's write progress, so that the whole
+	file never sits in memory. Emits syncProgress() after each chunk is sent, then syncPushFinished() once the device
+	confirms storing the file.
+	Emits the error() signal if the local file cannot be read, or if the device reports a failure. */
+	void syncPush(const QString & aLocalFileName, const QByteArray & aRemotePath, uint32_t aMode = 0644);
+
+	/** Pulls the remote file from the device, storing it into the specified local file (overwritten).
+	Needs the sync mode (see startSync()).
+	The data is written into the local file as it arrives, emitting syncProgress() (with unknown total size, -1),
+	then syncPullFinished() once the whole file is received.
+	Emits the error() signal if the local file cannot be written, or if the device reports a failure. */
+	void syncPull(const QByteArray & aRemotePath, const QString & aLocalFileName);
+
+	/** Queries the mode, size and modification time of the remote file.
+	Needs the sync mode (see startSync()).
+	The result is reported by the syncStatReceived() signal (all zeroes if the file doesn't exist). */
+	void syncStat(const QByteArray & aRemotePath);
+
+	/** Lists the contents of the remote directory.
+	Needs the sync mode (see startSync()).
+	The result is reported by the syncListReceived() signal. */
+	void syncList(const QByteArray & aRemotePath);
+
 	/** Tries to load the contents of the ADB pub key file (~/.android/adbkey.pub).
 	Returns the loaded un-base64-ed key on success, empty string on failure. */
 	static QByteArray getAdbPubKey();
@@ -89,30 +186,68 @@ Q_SIGNALS:
 	/** Emitted whenever an error occurs, either while connecting, or while communicating. */
 	void error(const QString & aErrorText);
 
-	/** Emitted whenever the ADB sends an updated device list after "host:track-devices".
-	The OnlineDeviceIDs lists devices that are online and may be communicated with.
-	The UnauthDeviceIDs lists devices that requires ADB authentication before communication.
-	The OtherDeviceIDs lists devices that are known but unavailable (ADB "offline", "bootloader" etc.) */
-	void updateDeviceList(
-		const QList<QByteArray> & aOnlineDeviceIDs,
-		const QList<QByteArray> & aUnauthDeviceIDs,
-		const QList<QByteArray> & aOtherDeviceIDs
-	);
+	/** Emitted whenever the ADB sends a device list, after listDevices() or (repeatedly) after trackDevices().
+	The list is always complete, it is up to the receiver to diff it against the previous one. */
+	void updateDeviceList(const AdbCommunicator::DeviceList & aDeviceList);
 
 	/** Emitted after the ADB server confirms assigning a device to this connection (see assignDevice()). */
 	void deviceAssigned(const QByteArray & aDeviceID);
 
-	/** Emitted after a new screenshot is received from the device after takeScreenshot(). */
+	/** Emitted after a new screenshot is received from the device after takeScreenshot().
+	The communicator doesn't keep any reference to the image afterwards. */
 	void screenshotReceived(const QByteArray & aDeviceID, const QImage & aImage);
 
 	/** Emitted after the device confirms port reversing.
 	The connection is then terminated from the device side. */
 	void portReversingEstablished(const QByteArray & aDeviceID);
 
+	/** Emitted after the device sends the list of port-reversing rules requested by listPortReverses(). */
+	void portReversesListed(const QByteArray & aDeviceID, const std::vector<AdbCommunicator::PortReverse> & aReverses);
+
+	/** Emitted after the ADB server sends the device's features requested by queryFeatures(). */
+	void featuresReceived(const QByteArray & aDeviceID, const QList<QByteArray> & aFeatures);
+
 	/** Emitted after receiving StdOut or StdErr data from the device while in ShellV1 mode (no protocol support for split delivery).
 	May be emitted multiple times when more data is received. */
 	void shellIncomingData(const QByteArray & aDeviceID, const QByteArray & aStdOutOrErr);
 
+	/** Emitted after receiving StdOut data from the device while in ShellV2 mode.
+	May be emitted multiple times when more data is received. */
+	void shellStdOut(const QByteArray & aDeviceID, const QByteArray & aData);
+
+	/** Emitted after receiving StdErr data from the device while in ShellV2 mode.
+	May be emitted multiple times when more data is received. */
+	void shellStdErr(const QByteArray & aDeviceID, const QByteArray & aData);
+
+	/** Emitted when the ADB server answers shellExecuteV2() with the "closed" FAIL (the device doesn't know the
+	ShellV2 service), just before the error() signal. Lets the caller tell this from the other errors (device offline
+	etc.) and fall back to ShellV1. */
+	void shellV2Refused(const QByteArray & aDeviceID, const QString & aErrorText);
+
+	/** Emitted after the shell command executed by shellExecuteV2() terminates, with its exit code.
+	The device then closes the connection. */
+	void shellFinished(const QByteArray & aDeviceID, int aExitCode);
+
+	/** Emitted after the device confirms switching into the sync mode (see startSync()). */
+	void syncReady(const QByteArray & aDeviceID);
+
+	/** Emitted while pushing or pulling a file, after each chunk of the data is transferred.
+	aTotalBytes is -1 if the total size is not known (pulling). */
+	void syncProgress(qint64 aNumBytesTransferred, qint64 aTotalBytes);
+
+	/** Emitted after the device confirms storing the file pushed by syncPush(). */
+	void syncPushFinished(const QByteArray & aRemotePath);
+
+	/** Emitted after the whole file requested by syncPull() has been received and stored locally. */
+	void syncPullFinished(const QByteArray & aRemotePath);
+
+	/** Emitted after the device responds to syncStat().
+	All the values are zero if the remote file doesn't exist. */
+	void syncStatReceived(const QByteArray & aRemotePath, uint32_t aMode, uint32_t aSize, uint32_t aModificationTime);
+
+	/** Emitted after the device sends the whole directory listing requested by syncList(). */
+	void syncListReceived(const QByteArray & aRemotePath, const std::vector<AdbCommunicator::SyncDirEntry> & aEntries);
+
 
 protected:
 
@@ -133,12 +268,30 @@ protected:
 		csAssignDevice,    ///< after assignDevice() has been called, waiting for the OKAY response.
 		csDeviceAssigned,  ///< after assignDevice has succeeded
 
-		csScreenshottingStart,  ///< after takeScreenshot() has been called, waiting for the framebuffer geometry
-		csScreenshotting,       ///< after takeScreenshot() has been called, waiting for the framebuffer contents.
+		csScreenshottingStart,   ///< after takeScreenshot() has been called, waiting for the OKAY response
+		csScreenshottingHeader,  ///< after takeScreenshot() has been called, waiting for the framebuffer header
+		csScreenshotting,        ///< after takeScreenshot() has been called, receiving the framebuffer contents.
 
 		csPortReversing,  ///< after portReverse() has been called
 
+		csListingPortReversesStart,   ///< after listPortReverses() has been called, waiting for the OKAY response to opening the service.
+		csListingPortReversesResult,  ///< after listPortReverses() has been called, waiting for the OKAY response to the request.
+		csListingPortReverses,        ///< after listPortReverses() has been called, waiting for the list.
+
+		csQueryingFeaturesStart,  ///< after queryFeatures() has been called, waiting for the OKAY response.
+		csQueryingFeatures,       ///< after queryFeatures() has been called, waiting for the feature list.
+
 		csExecutingShellV1,  ///< after shellExecuteV1() has been called, executing a shell command and relaying stdout + stderr
+
+		csExecutingShellV2Start,  ///< after shellExecuteV2() has been called, waiting for the OKAY response.
+		csExecutingShellV2,       ///< after shellExecuteV2() has been called, relaying stdout and stderr until the exit code arrives.
+
+		csSyncStart,     ///< after startSync() has been called, waiting for the OKAY response.
+		csSyncReady,     ///< in the sync mode, ready for a sync operation.
+		csSyncPushing,   ///< after syncPush() has been called, sending the file data and waiting for the device's confirmation.
+		csSyncPulling,   ///< after syncPull() has been called, receiving the file data.
+		csSyncStatting,  ///< after syncStat() has been called, waiting for the response.
+		csSyncListing,   ///< after syncList() has been called, receiving the directory entries.
 	};
 
 	/** The TCP socket to the ADB server, used for communication. */
@@ -153,14 +306,58 @@ protected:
 	/** The device to which this connection is assigned, if any (see assignDevice()). */
 	QByteArray mAssignedDeviceID;
 
-	// Dimensions of the framebuffer, when screenshotting (see takeScreenshot()):
-	uint32_t mFramebufferDepth;   // bits-per-pixel
+	// The framebuffer geometry, when screenshotting (see takeScreenshot()):
+	uint32_t mFramebufferBpp;     // bits-per-pixel
 	uint32_t mFramebufferSize;    // bytes
 	uint32_t mFramebufferWidth;   // pixels
 	uint32_t mFramebufferHeight;  // pixels
 
-	/** The logger used for all messages produced by this class. */
-	Logger & mLogger;
+	/** Converts the framebuffer pixels into mScreenshot's RGB32 pixels, set up by the framebuffer header. */
+	FramebufferConverter mFramebufferConverter;
+
+	/** The number of framebuffer bytes received so far, when screenshotting. */
+	uint32_t mFramebufferReceived;
+
+	/** The image into which the screenshot is being decoded. */
+	QImage mScreenshot;
+
+	/** The bytes of an incomplete pixel received at the end of the last chunk. */
+	QByteArray mPixelCarry;
+
+	/** The buffer for reading the framebuffer data from the socket.
+	Kept between the reads to avoid reallocating. */
+	QByteArray mReadBuffer;
+
+	/** The incoming ShellV2 packets, read directly from the socket and parsed in-place. */
+	ReceiveBuffer mShellData;
+
+	/** The remote path of the current sync operation. */
+	QByteArray mSyncRemotePath;
+
+	/** The local file being pushed or pulled by the current sync operation. */
+	QFile mSyncFile;
+
+	/** The memory-mapped contents of mSyncFile, when pushing (nullptr for empty files). */
+	uchar * mSyncFileData;
+
+	/** The size of mSyncFile, when pushing. */
+	qint64 mSyncFileSize;
+
+	/** The number of file bytes transferred so far by the current sync operation. */
+	qint64 mSyncTransferred;
+
+	/** When pushing, set to true once the final DONE packet has been sent. */
+	bool mSyncIsDoneSent;
+
+	/** When pulling, the number of bytes of the current DATA packet that are yet to be received. */
+	uint32_t mSyncChunkRemaining;
+
+	/** The directory entries received so far, when listing. */
+	std::vector<SyncDirEntry> mSyncDirEntries;
+
+	/** The logger used for all messages produced by this class.
+	Never nullptr; changed by setLogger() when the communicator is handed over to another user. */
+	Logger * mLogger;
 
 
 	/** Writes the hex4-formatted length and then the message to the connection. */
@@ -170,6 +367,10 @@ protected:
 	Emits updateDeviceList() accordingly. */
 	void parseDeviceList(const QByteArray & aMessage);
 
+	/** Parses the list of port-reversing rules (as received from "reverse:list-forward").
+	Emits portReversesListed() accordingly. */
+	void parsePortReverseList(const QByteArray & aMessage);
+
 	/** Looks into mIncomingData if there's an OKAY or FAIL<len><reason> response in there.
 	If so, removes it from mIncomingData and in case of failure, emits the error() signal.
 	Returns true if an OKAY was extracted, false otherwise. */
@@ -180,9 +381,58 @@ protected:
 	and if so, the packet itself is returned as the second field. */
 	std::pair<bool, QByteArray> extractHex4Packet();
 
-	/** Decodes the image received in mIncomingData and removes its data from the buffer.
-	Emits the screenshotReceived() signal with the received image. */
-	void processScreenshot();
+	/** Parses the framebuffer header from mIncomingData, if it has been received completely.
+	Prepares mScreenshot for the framebuffer contents and switches to csScreenshotting.
+	Emits the error() signal if the header is not supported or is invalid. */
+	void parseFramebufferHeader();
+
+	/** Decodes all the framebuffer data received so far into mScreenshot - first any leftover in mIncomingData,
+	then reads directly from the socket, without accumulating the data in mIncomingData. */
+	void receiveFramebufferData();
+
+	/** Decodes the specified framebuffer data into mScreenshot. */
+	void decodeFramebufferData(const char * aData, int aSize);
+
+	/** Marks the specified number of framebuffer bytes as received.
+	If the whole framebuffer has been received, emits the screenshotReceived() signal with the image. */
+	void framebufferBytesReceived(uint32_t aNumBytes);
+
+	/** Reads all the available data from the socket into mShellData and parses the ShellV2 packets in it. */
+	void receiveShellV2Data();
+
+	/** Parses the ShellV2 packets in mShellData, emitting the stdout, stderr and exit code signals.
+	Incomplete packets are left in the buffer until more data arrives. */
+	void parseShellV2Packets();
+
+	/** Checks the remote path and starts the specified sync operation by sending its request.
+	Returns false (and emits error()) if not in the sync mode or the path is invalid. */
+	bool startSyncOperation(const char * aRequestID, const QByteArray & aRemotePath, const QByteArray & aRequestData, EState aNewState);
+
+	/** Sends more file data while pushing, as long as the socket's outgoing buffer is not full.
+	Sends the DONE packet after the last data. */
+	void syncPushMoreData();
+
+	/** If mIncomingData starts with a sync FAIL packet, fails the current sync operation with its message.
+	Returns true if the FAIL packet was found, even if it hasn't been received completely yet. */
+	bool extractSyncFail();
+
+	/** Parses the device's response to syncPush(). */
+	void parseSyncPushResponse();
+
+	/** Parses the file data received after syncPull() and writes it into mSyncFile. */
+	void parseSyncPullData();
+
+	/** Parses the device's response to syncStat(). */
+	void parseSyncStatResponse();
+
+	/** Parses the directory entries received after syncList(). */
+	void parseSyncListData();
+
+	/** Cleans up after a sync operation and returns to the sync mode. */
+	void finishSyncOperation();
+
+	/** Cleans up after a sync operation that has failed, breaks the connection and emits error(). */
+	void failSyncOperation(const QString & aErrorText);
 
 
 protected Q_SLOTS:
@@ -198,4 +448,7 @@ protected Q_SLOTS:
 
 	/** Emitted by mSocket when there's incoming data available for reading. */
 	void onSocketReadyRead();
+
+	/** Called by the socket when data has been written to the network; pushes more of the sync data, if pushing. */
+	void onSocketBytesWritten(qint64 aNumBytes);
 };
@@ -0,0 +1,455 @@
+#include "AdbConnectionPool.hpp"
+#include <cassert>
+#include <algorithm>
+#include <memory>
+#include "AdbCommunicator.hpp"
+#include "../Logger.hpp"
+#include "../Settings.hpp"
+
+
+
+
+
+AdbConnectionPool::AdbConnectionPool(
+	Logger & aLogger,
+	DeviceLoggerFactory aDeviceLogger,
+	QObject * aParent
+):
+	Super(aParent),
+	mLogger(aLogger),
+	mDeviceLogger(std::move(aDeviceLogger)),
+	mNumWarmConnections(static_cast<size_t>(std::max(Settings::loadValue("AdbConnectionPool", "NumWarmConnections", 2).toInt(), 0))),
+	mMaxRunningOperations(static_cast<size_t>(std::max(Settings::loadValue("AdbConnectionPool", "MaxRunningOperations", 8).toInt(), 1)))
+{
+}
+
+
+
+
+
+AdbConnectionPool::~AdbConnectionPool()
+{
+	// Delete the communicators now, while the pool is still intact, so that their last signals
+	// (the sockets' disconnection) don't reach a half-destroyed pool:
+	for (auto comm: findChildren<AdbCommunicator *>(QString(), Qt::FindDirectChildrenOnly))
+	{
+		comm->disconnect(this);
+		delete comm;
+	}
+}
+
+
+
+
+
+void AdbConnectionPool::enqueue(
+	const QByteArray & aDeviceID,
+	const QString & aName,
+	OperationStart aStart,
+	OperationError aOnError
+)
+{
+	enqueueOperation(aDeviceID, {aName, std::move(aStart), std::move(aOnError), false, false});
+}
+
+
+
+
+
+void AdbConnectionPool::enqueueDeviceCommand(
+	const QByteArray & aDeviceID,
+	const QString & aName,
+	OperationStart aStart,
+	OperationError aOnError
+)
+{
+	assert(!aDeviceID.isEmpty());
+	enqueueOperation(aDeviceID, {aName, std::move(aStart), std::move(aOnError), true, false});
+}
+
+
+
+
+
+void AdbConnectionPool::startDeviceStream(
+	const QByteArray & aDeviceID,
+	const QString & aName,
+	OperationStart aStart,
+	OperationError aOnError
+)
+{
+	assert(!aDeviceID.isEmpty());
+	auto operation = std::make_shared<Operation>(Operation{aName, std::move(aStart), std::move(aOnError), true, true});
+
+	// Start asynchronously, same as the queued operations:
+	QMetaObject::invokeMethod(this,
+		[this, aDeviceID, operation]()
+		{
+			startOperation(aDeviceID, std::move(*operation));
+		},
+		Qt::QueuedConnection
+	);
+}
+
+
+
+
+
+void AdbConnectionPool::beginTransportSession(const QByteArray & aDeviceID)
+{
+	if (mSessions.find(aDeviceID) != mSessions.end())
+	{
+		return;
+	}
+	mSessions[aDeviceID] = {nullptr, false};
+	prepareSessionSpare(aDeviceID);
+}
+
+
+
+
+
+void AdbConnectionPool::endTransportSession(const QByteArray & aDeviceID)
+{
+	auto itr = mSessions.find(aDeviceID);
+	if (itr == mSessions.end())
+	{
+		return;
+	}
+	auto spare = itr->second.mSpare;
+	mSessions.erase(itr);
+	if (spare != nullptr)
+	{
+		spare->disconnect(this);
+		spare->close();
+		spare->deleteLater();
+	}
+}
+
+
+
+
+
+Logger & AdbConnectionPool::loggerForDevice(const QByteArray & aDeviceID)
+{
+	if (aDeviceID.isEmpty() || !mDeviceLogger)
+	{
+		return mLogger;
+	}
+	return mDeviceLogger(aDeviceID);
+}
+
+
+
+
+
+void AdbConnectionPool::enqueueOperation(const QByteArray & aDeviceID, Operation && aOperation)
+{
+	mQueues[aDeviceID].push_back(std::move(aOperation));
+
+	// Start asynchronously, enqueue() may be called from within another operation's start:
+	QMetaObject::invokeMethod(this, [this]() { startQueued(); }, Qt::QueuedConnection);
+}
+
+
+
+
+
+size_t AdbConnectionPool::numQueued(const QByteArray & aDeviceID) const
+{
+	auto itr = mQueues.find(aDeviceID);
+	if (itr == mQueues.end())
+	{
+		return 0;
+	}
+	return itr->second.size();
+}
+
+
+
+
+
+void AdbConnectionPool::startQueued()
+{
+	auto itr = mQueues.begin();
+	while ((itr != mQueues.end()) && (mBusyDevices.size() < mMaxRunningOperations))
+	{
+		if (itr->second.empty())
+		{
+			itr = mQueues.erase(itr);
+			continue;
+		}
+		if (mBusyDevices.find(itr->first) != mBusyDevices.end())
+		{
+			++itr;
+			continue;
+		}
+		auto deviceID = itr->first;
+		auto operation = std::move(itr->second.front());
+		itr->second.pop_front();
+		++itr;
+		mBusyDevices.insert(deviceID);
+		startOperation(deviceID, std::move(operation));
+	}
+}
+
+
+
+
+
+void AdbConnectionPool::startOperation(const QByteArray & aDeviceID, Operation && aOperation)
+{
+	// Use the session's spare communicator, if it is ready:
+	if (aOperation.mNeedsTransport)
+	{
+		auto sessionItr = mSessions.find(aDeviceID);
+		if ((sessionItr != mSessions.end()) && sessionItr->second.mIsSpareReady)
+		{
+			auto comm = sessionItr->second.mSpare;
+			sessionItr->second.mSpare = nullptr;
+			sessionItr->second.mIsSpareReady = false;
+			comm->disconnect(this);
+			runOperation(aDeviceID, std::move(aOperation), comm);
+			prepareSessionSpare(aDeviceID);
+			return;
+		}
+	}
+
+	// Use a warm communicator, if available:
+	if (!mWarm.empty())
+	{
+		auto comm = mWarm.front();
+		mWarm.pop_front();
+		comm->disconnect(this);
+		comm->setLogger(loggerForDevice(aDeviceID));
+		startOperationOnConnected(aDeviceID, std::move(aOperation), comm);
+		replenish();
+		return;
+	}
+
+	// No warm communicator, connect a new one:
+	auto comm = new AdbCommunicator(loggerForDevice(aDeviceID));
+	comm->setParent(this);
+	auto operation = std::make_shared<Operation>(std::move(aOperation));
+	connect(comm, &AdbCommunicator::connected, this,
+		[this, comm, aDeviceID, operation]()
+		{
+			comm->disconnect(this);
+			startOperationOnConnected(aDeviceID, std::move(*operation), comm);
+			replenish();
+		}
+	);
+	connect(comm, &AdbCommunicator::error, this,
+		[this, comm, aDeviceID, operation](const QString & aErrorText)
+		{
+			mLogger.log("Cannot connect to ADB for operation \"%1\" on device \"%2\": %3",
+				operation->mName, aDeviceID, aErrorText
+			);
+			comm->disconnect(this);
+			comm->deleteLater();
+			if (operation->mOnError)
+			{
+				operation->mOnError(aErrorText);
+			}
+			operationFinished(aDeviceID, operation->mIsStream);
+		}
+	);
+	comm->start();
+}
+
+
+
+
+
+void AdbConnectionPool::startOperationOnConnected(const QByteArray & aDeviceID, Operation && aOperation, AdbCommunicator * aComm)
+{
+	if (!aOperation.mNeedsTransport)
+	{
+		runOperation(aDeviceID, std::move(aOperation), aComm);
+		return;
+	}
+
+	// Switch to the device's transport first:
+	auto operation = std::make_shared<Operation>(std::move(aOperation));
+	connect(aComm, &AdbCommunicator::deviceAssigned, this,
+		[this, aComm, aDeviceID, operation]()
+		{
+			aComm->disconnect(this);
+			runOperation(aDeviceID, std::move(*operation), aComm);
+		}
+	);
+	auto onFailed = [this, aComm, aDeviceID, operation](const QString & aErrorText)
+	{
+		mLogger.log("Cannot switch to device \"%1\" for operation \"%2\": %3",
+			aDeviceID, operation->mName, aErrorText
+		);
+		aComm->disconnect(this);
+		aComm->close();
+		aComm->deleteLater();
+		if (operation->mOnError)
+		{
+			operation->mOnError(aErrorText);
+		}
+		operationFinished(aDeviceID, operation->mIsStream);
+	};
+	connect(aComm, &AdbCommunicator::error,        this, onFailed);
+	connect(aComm, &AdbCommunicator::disconnected, this, [onFailed]() { onFailed(tr("The ADB server closed the connection.")); });
+	aComm->assignDevice(aDeviceID);
+}
+
+
+
+
+
+void AdbConnectionPool::runOperation(const QByteArray & aDeviceID, Operation && aOperation, AdbCommunicator * aComm)
+{
+	mLogger.log("Starting operation \"%1\" on device \"%2\".", aOperation.mName, aDeviceID);
+	aOperation.mStart(*aComm);
+
+	// The operation's handlers are connected by now, so they get to see the signals before the pool finishes the operation:
+	auto isFinished = std::make_shared<bool>(false);
+	auto isStream = aOperation.mIsStream;
+	auto finish = [this, aComm, aDeviceID, isFinished, isStream]()
+	{
+		if (*isFinished)
+		{
+			return;
+		}
+		*isFinished = true;
+		aComm->disconnect(this);
+		aComm->deleteLater();
+		operationFinished(aDeviceID, isStream);
+	};
+	connect(aComm, &AdbCommunicator::disconnected, this, finish);
+	connect(aComm, &AdbCommunicator::error, this,
+		[aComm, finish]()
+		{
+			aComm->close();
+			finish();
+		}
+	);
+}
+
+
+
+
+
+void AdbConnectionPool::operationFinished(const QByteArray & aDeviceID, bool aIsStream)
+{
+	if (!aIsStream)
+	{
+		mBusyDevices.erase(aDeviceID);
+	}
+	startQueued();
+}
+
+
+
+
+
+void AdbConnectionPool::replenish()
+{
+	while (mWarm.size() + mWarming.size() < mNumWarmConnections)
+	{
+		auto comm = new AdbCommunicator(mLogger);
+		comm->setParent(this);
+		mWarming.insert(comm);
+		connect(comm, &AdbCommunicator::connected, this,
+			[this, comm]()
+			{
+				mWarming.erase(comm);
+				mWarm.push_back(comm);
+				startQueued();
+			}
+		);
+		connect(comm, &AdbCommunicator::error,        this, [this, comm]() { dropWarm(comm); });
+		connect(comm, &AdbCommunicator::disconnected, this, [this, comm]() { dropWarm(comm); });
+		comm->start();
+	}
+}
+
+
+
+
+
+void AdbConnectionPool::dropWarm(AdbCommunicator * aComm)
+{
+	// Not replenished right away; if ADB is gone, the next operation's connection will fail and report it.
+	mWarming.erase(aComm);
+	for (auto itr = mWarm.begin(); itr != mWarm.end(); ++itr)
+	{
+		if (*itr == aComm)
+		{
+			mWarm.erase(itr);
+			break;
+		}
+	}
+	aComm->disconnect(this);
+	aComm->deleteLater();
+}
+
+
+
+
+
+void AdbConnectionPool::prepareSessionSpare(const QByteArray & aDeviceID)
+{
+	auto itr = mSessions.find(aDeviceID);
+	if ((itr == mSessions.end()) || (itr->second.mSpare != nullptr))
+	{
+		return;
+	}
+
+	// Take a warm communicator, if available, so that only the transport switch is needed:
+	AdbCommunicator * comm;
+	if (!mWarm.empty())
+	{
+		comm = mWarm.front();
+		mWarm.pop_front();
+		comm->disconnect(this);
+		comm->setLogger(loggerForDevice(aDeviceID));
+		comm->assignDevice(aDeviceID);
+		replenish();
+	}
+	else
+	{
+		comm = new AdbCommunicator(loggerForDevice(aDeviceID));
+		comm->setParent(this);
+		connect(comm, &AdbCommunicator::connected, this, [comm, aDeviceID]() { comm->assignDevice(aDeviceID); });
+		comm->start();
+	}
+	itr->second.mSpare = comm;
+	itr->second.mIsSpareReady = false;
+	connect(comm, &AdbCommunicator::deviceAssigned, this,
+		[this, comm, aDeviceID]()
+		{
+			auto sessionItr = mSessions.find(aDeviceID);
+			if ((sessionItr != mSessions.end()) && (sessionItr->second.mSpare == comm))
+			{
+				sessionItr->second.mIsSpareReady = true;
+				startQueued();
+			}
+		}
+	);
+
+	// Not re-prepared on failure; if the device is gone, the next command's own transport switch will report it.
+	connect(comm, &AdbCommunicator::error,        this, [this, comm, aDeviceID]() { dropSessionSpare(aDeviceID, comm); });
+	connect(comm, &AdbCommunicator::disconnected, this, [this, comm, aDeviceID]() { dropSessionSpare(aDeviceID, comm); });
+}
+
+
+
+
+
+void AdbConnectionPool::dropSessionSpare(const QByteArray & aDeviceID, AdbCommunicator * aComm)
+{
+	auto itr = mSessions.find(aDeviceID);
+	if ((itr != mSessions.end()) && (itr->second.mSpare == aComm))
+	{
+		itr->second.mSpare = nullptr;
+		itr->second.mIsSpareReady = false;
+	}
+	aComm->disconnect(this);
+	aComm->close();
+	aComm->deleteLater();
+}
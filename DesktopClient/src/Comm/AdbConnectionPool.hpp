@@ -0,0 +1,211 @@
+#pragma once
+
+#include <deque>
+#include <functional>
+#include <map>
+#include <set>
+#include <QObject>
+
+
+
+
+
+// fwd:
+class AdbCommunicator;
+class Logger;
+
+
+
+
+
+/** Hands out connections to the local ADB server to operations, queued per device.
+The ADB server closes the connection once it finishes a host service ("host:devices", ...) or once
+the device side of a transport-switched connection ("host:transport:<serial>" + "shell:", "reverse:", ...)
+terminates, so an AdbCommunicator can serve only a single operation. To avoid paying the connection setup
+for each operation, the pool keeps a few spare connections already connected ("warm") and hands them out
+to the operations as they start, replenishing the spares in the background.
+The operations for a single device are executed one after another (so that 20 devices on a hub don't each
+have several connections open at the same time), operations for different devices run in parallel,
+up to a configured limit.
+Device commands (enqueueDeviceCommand()) are handed a communicator already switched to the device's transport.
+A caller that is about to run several device commands in a row (such as the USB onboarding) can open a transport
+session for the device; while the session is open, the pool keeps a spare connection switched to the device, so
+that each command can be sent right away, without waiting for the connection and the transport switch.
+(The ADB server cannot run several services over a single connection, nor does it accept a service request
+pipelined right after the transport switch, so a spare connection is the closest to batching the commands.)
+All the functions are to be called from the thread in which the pool lives. */
+class AdbConnectionPool:
+	public QObject
+{
+	using Super = QObject;
+
+	Q_OBJECT
+
+
+public:
+
+	/** The function that starts a single operation.
+	It receives a connected AdbCommunicator (in the csReady state) on which it connects its signal handlers
+	and issues its first command. The communicator is owned by the pool; the operation is considered finished
+	once the communicator disconnects or reports an error, then the next operation for the device is started. */
+	using OperationStart = std::function<void(AdbCommunicator & aComm)>;
+
+	/** The function called when an operation couldn't be started because the pool failed to connect to ADB. */
+	using OperationError = std::function<void(const QString & aErrorText)>;
+
+	/** The function that returns the logger to be used by the communicators running the specified device's
+	operations, so that each device's ADB traffic is logged separately. */
+	using DeviceLoggerFactory = std::function<Logger & (const QByteArray & aDeviceID)>;
+
+
+	/** Creates a new pool, loads its settings.
+	aLogger is used for the pool's own messages and for the host-only operations. If aDeviceLogger is given,
+	the communicators running a device's operations log to the logger it returns for the device, otherwise to aLogger.
+	No connections are made until the first operation is enqueued. */
+	explicit AdbConnectionPool(
+		Logger & aLogger,
+		DeviceLoggerFactory aDeviceLogger = DeviceLoggerFactory(),
+		QObject * aParent = nullptr
+	);
+
+	virtual ~AdbConnectionPool() override;
+
+	/** Adds the specified operation to the queue of the specified device.
+	An empty aDeviceID denotes the host-only operations (such as "host:devices"), those are serialized as well.
+	aName is used for logging only. */
+	void enqueue(
+		const QByteArray & aDeviceID,
+		const QString & aName,
+		OperationStart aStart,
+		OperationError aOnError
+	);
+
+	/** Adds the specified device command to the queue of the specified device.
+	Same as enqueue(), but the communicator handed to aStart is already switched to the device's transport
+	(csDeviceAssigned), so aStart issues the device command directly. If the transport switch fails (device gone),
+	aOnError is called instead of aStart. */
+	void enqueueDeviceCommand(
+		const QByteArray & aDeviceID,
+		const QString & aName,
+		OperationStart aStart,
+		OperationError aOnError
+	);
+
+	/** Starts a long-running device command (a stream, such as the screen mirroring) for the specified device.
+	Same as enqueueDeviceCommand(), but the stream doesn't wait in the device's queue and doesn't hold it while
+	it is running, so that the device's regular operations can still run alongside it (each on its own connection).
+	Started asynchronously; aStart is called once the communicator is switched to the device's transport. */
+	void startDeviceStream(
+		const QByteArray & aDeviceID,
+		const QString & aName,
+		OperationStart aStart,
+		OperationError aOnError
+	);
+
+	/** Opens a transport session for the specified device: from now on until endTransportSession(), the pool keeps
+	a spare connection switched to the device's transport, used by the device's next enqueueDeviceCommand().
+	Does nothing if the session is already open. */
+	void beginTransportSession(const QByteArray & aDeviceID);
+
+	/** Closes the transport session for the specified device, dropping its spare connection.
+	Does nothing if there's no session open. */
+	void endTransportSession(const QByteArray & aDeviceID);
+
+	/** Returns the number of operations queued (not started yet) for the specified device. */
+	size_t numQueued(const QByteArray & aDeviceID) const;
+
+
+protected:
+
+	/** A single queued operation. */
+	struct Operation
+	{
+		QString mName;
+		OperationStart mStart;
+		OperationError mOnError;
+
+		/** If true, the communicator is switched to the device's transport before mStart is called. */
+		bool mNeedsTransport;
+
+		/** If true, the operation is a stream (startDeviceStream()) that doesn't hold the device's queue. */
+		bool mIsStream;
+	};
+
+
+	/** A transport session of a single device (see beginTransportSession()). */
+	struct Session
+	{
+		/** The spare communicator, being switched to, or already switched to, the device's transport.
+		nullptr if there's none (taken by a command, or failed). */
+		AdbCommunicator * mSpare;
+
+		/** True once mSpare has been switched to the device's transport. */
+		bool mIsSpareReady;
+	};
+
+
+	/** The logger used for all messages produced by this class (and by the warm communicators). */
+	Logger & mLogger;
+
+	/** Returns the logger for the communicators running a specific device's operations; may be empty. */
+	DeviceLoggerFactory mDeviceLogger;
+
+	/** The number of warm connections to keep ready for the operations. */
+	size_t mNumWarmConnections;
+
+	/** The maximum number of operations running at the same time, across all devices. */
+	size_t mMaxRunningOperations;
+
+	/** The connected communicators waiting for an operation. */
+	std::deque<AdbCommunicator *> mWarm;
+
+	/** The communicators being connected to become warm. */
+	std::set<AdbCommunicator *> mWarming;
+
+	/** The queued operations, per device. */
+	std::map<QByteArray, std::deque<Operation>> mQueues;
+
+	/** The devices that have an operation running (or waiting for its connection). */
+	std::set<QByteArray> mBusyDevices;
+
+	/** The open transport sessions, per device. */
+	std::map<QByteArray, Session> mSessions;
+
+
+	/** Returns the logger to be used by the communicators running the specified device's operations. */
+	Logger & loggerForDevice(const QByteArray & aDeviceID);
+
+	/** Adds the operation to the queue of the specified device and schedules starting the queued operations. */
+	void enqueueOperation(const QByteArray & aDeviceID, Operation && aOperation);
+
+	/** Starts as many queued operations as allowed by the limits. */
+	void startQueued();
+
+	/** Starts the specified operation of the specified device on the device's session spare communicator,
+	on a warm communicator, or, if there's none, on a newly connected one. */
+	void startOperation(const QByteArray & aDeviceID, Operation && aOperation);
+
+	/** Continues starting the operation on the (connected) communicator: switches it to the device's transport,
+	if the operation needs it, and then runs the operation. */
+	void startOperationOnConnected(const QByteArray & aDeviceID, Operation && aOperation, AdbCommunicator * aComm);
+
+	/** Runs the specified operation on the (connected) communicator.
+	Takes care of finishing the operation once the communicator disconnects or fails. */
+	void runOperation(const QByteArray & aDeviceID, Operation && aOperation, AdbCommunicator * aComm);
+
+	/** Marks the operation of the specified device as finished and starts the next queued ones.
+	A finished stream (aIsStream) doesn't release the device, it never held it. */
+	void operationFinished(const QByteArray & aDeviceID, bool aIsStream);
+
+	/** Starts connecting new communicators until there are mNumWarmConnections of them warm or warming. */
+	void replenish();
+
+	/** Removes the specified communicator from the warm ones (it has failed or been disconnected by ADB). */
+	void dropWarm(AdbCommunicator * aComm);
+
+	/** Starts preparing a new spare communicator for the specified device's session, unless it already has one. */
+	void prepareSessionSpare(const QByteArray & aDeviceID);
+
+	/** Removes the specified communicator from being the spare of the device's session, and deletes it. */
+	void dropSessionSpare(const QByteArray & aDeviceID, AdbCommunicator * aComm);
+};
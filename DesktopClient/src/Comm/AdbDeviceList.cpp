@@ -0,0 +1,109 @@
+#include "AdbDeviceList.hpp"
+#include "../Logger.hpp"
+
+
+
+
+
+AdbDeviceList AdbDeviceList::parse(const QByteArray & aMessage, Logger & aLogger)
+{
+	AdbDeviceList res;
+	int lineStart = 0;
+	while (lineStart < aMessage.size())
+	{
+		auto lineEnd = aMessage.indexOf('\n', lineStart);
+		if (lineEnd < 0)
+		{
+			lineEnd = aMessage.size();
+		}
+		auto line = QByteArray::fromRawData(aMessage.constData() + lineStart, lineEnd - lineStart);
+		lineStart = lineEnd + 1;
+		if (line.isEmpty())
+		{
+			continue;
+		}
+		auto tab = line.indexOf('\t');
+		if (tab < 0)
+		{
+			aLogger.logHex(line, "ERROR: Bad DeviceList line received");
+			continue;
+		}
+		if (tab < 8)
+		{
+			// Suspiciously short ID
+			aLogger.logHex(line, "ERROR: Suspiciously short DeviceID received in line");
+			continue;
+		}
+		auto id = line.left(tab);  // Deep copy, the line is only a view into aMessage
+		auto status = QByteArray::fromRawData(line.constData() + tab + 1, line.size() - tab - 1);
+		if (status == "device")
+		{
+			res.mDevices[id] = adsOnline;
+		}
+		else if ((status == "authorizing") || (status == "unauthorized"))
+		{
+			res.mDevices[id] = adsUnauthorized;
+			res.mNumUnauthorized += 1;
+		}
+		else
+		{
+			res.mDevices[id] = adsOther;
+		}
+	}
+	return res;
+}
+
+
+
+
+
+std::vector<AdbDeviceList::Change> AdbDeviceList::diff(const AdbDeviceList & aOld, const AdbDeviceList & aNew)
+{
+	std::vector<Change> res;
+	const auto & oldDevices = aOld.mDevices;
+	const auto & newDevices = aNew.mDevices;
+	auto oldItr = oldDevices.cbegin();
+	auto newItr = newDevices.cbegin();
+	while ((oldItr != oldDevices.cend()) || (newItr != newDevices.cend()))
+	{
+		if ((newItr == newDevices.cend()) || ((oldItr != oldDevices.cend()) && (oldItr->first < newItr->first)))
+		{
+			// The device is no longer listed:
+			res.push_back({oldItr->first, true, adsOther});
+			++oldItr;
+			continue;
+		}
+		if ((oldItr != oldDevices.cend()) && (oldItr->first == newItr->first))
+		{
+			auto isSameStatus = (oldItr->second == newItr->second);
+			++oldItr;
+			if (isSameStatus)
+			{
+				++newItr;
+				continue;
+			}
+		}
+
+		// The device is new, or its status has changed:
+		res.push_back({newItr->first, false, newItr->second});
+		++newItr;
+	}
+	return res;
+}
+
+
+
+
+
+std::vector<QByteArray> AdbDeviceList::idsWithStatus(EDeviceStatus aStatus) const
+{
+	std::vector<QByteArray> res;
+	for (const auto & dev: mDevices)
+	{
+		if (dev.second == aStatus)
+		{
+			res.push_back(dev.first);
+		}
+	}
+	return res;
+}
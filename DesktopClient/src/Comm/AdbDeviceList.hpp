@@ -0,0 +1,73 @@
+#pragma once
+
+#include <map>
+#include <vector>
+#include <QByteArray>
+
+
+
+
+
+// fwd:
+class Logger;
+
+
+
+
+
+/** A snapshot of the device list, as reported by ADB ("host:devices", "host:track-devices").
+The devices are kept sorted by their ID, so that two snapshots can be diffed in a single pass. */
+class AdbDeviceList
+{
+public:
+
+	/** The status of a single device, as reported by ADB in the device list. */
+	enum EDeviceStatus
+	{
+		adsOnline,        ///< The device is online and may be communicated with ("device").
+		adsUnauthorized,  ///< The device requires ADB authentication before communication ("authorizing", "unauthorized").
+		adsOther,         ///< The device is known but unavailable ("offline", "bootloader", etc.).
+	};
+
+
+	/** A single difference between two snapshots, as reported by diff(). */
+	struct Change
+	{
+		/** The ID of the device that has changed. */
+		QByteArray mDeviceID;
+
+		/** True if the device is no longer listed; mNewStatus is then meaningless. */
+		bool mIsRemoved;
+
+		/** The status of the device in the newer snapshot (the device is new, or its status has changed). */
+		EDeviceStatus mNewStatus;
+	};
+
+
+	/** The status of each device, by its ID. */
+	std::map<QByteArray, EDeviceStatus> mDevices;
+
+	/** The number of devices in mDevices with the adsUnauthorized status. */
+	int mNumUnauthorized;
+
+
+	AdbDeviceList():
+		mNumUnauthorized(0)
+	{
+	}
+
+	bool operator == (const AdbDeviceList & aOther) const { return (mDevices == aOther.mDevices); }
+	bool operator != (const AdbDeviceList & aOther) const { return (mDevices != aOther.mDevices); }
+
+	/** Parses the device list, as sent by ADB (one "<id>\t<status>" line per device).
+	The malformed lines are logged into aLogger and skipped; the valid lines are not logged, it is up to the caller
+	to log the result (the parsing is on the hot path of the device tracking). */
+	static AdbDeviceList parse(const QByteArray & aMessage, Logger & aLogger);
+
+	/** Returns the differences between aOld and aNew, in the order of the device IDs.
+	Walks both (sorted) lists at once, so the cost is linear in the number of the devices. */
+	static std::vector<Change> diff(const AdbDeviceList & aOld, const AdbDeviceList & aNew);
+
+	/** Returns the IDs of all the devices with the specified status. */
+	std::vector<QByteArray> idsWithStatus(EDeviceStatus aStatus) const;
+};
@@ -0,0 +1,429 @@
+#include "AdbScreenMirror.hpp"
+#include <cassert>
+#include <algorithm>
+#include <cstring>
+#include "AdbCommunicator.hpp"
+#include "AdbConnectionPool.hpp"
+#include "UsbDeviceEnumerator.hpp"
+#include "../Logger.hpp"
+#include "../Settings.hpp"
+
+
+
+
+
+/** The number of bytes per pixel in screenrecord's raw frames (RGB888). */
+static const int STREAM_BYTES_PER_PIXEL = 3;
+
+
+
+
+
+AdbScreenMirror::AdbScreenMirror(UsbDeviceEnumerator & aEnumerator, const QByteArray & aDeviceID, Logger & aLogger):
+	Super(nullptr),
+	mEnumerator(aEnumerator),
+	mDeviceID(aDeviceID),
+	mLogger(aLogger),
+	mMaxStreamWidth(std::max(Settings::loadValue("AdbScreenMirror", "StreamWidth", 480).toInt(), 8)),
+	mMode(mdInitialFrame),
+	mMinFrameIntervalMsec(100),
+	mIsRunning(false),
+	mIsRequestInProgress(false),
+	mStreamFrameBytes(0),
+	mNumStreamedFrames(0),
+	mFps(0),
+	mNextFrameTimer(this)
+{
+	mNextFrameTimer.setSingleShot(true);
+	connect(&mNextFrameTimer, &QTimer::timeout, this, &AdbScreenMirror::requestFrame);
+	moveToThread(&aEnumerator);
+}
+
+
+
+
+
+void AdbScreenMirror::start(int aMaxFps)
+{
+	QMetaObject::invokeMethod(this, [this, aMaxFps]() { doStart(aMaxFps); }, Qt::QueuedConnection);
+}
+
+
+
+
+
+void AdbScreenMirror::stop()
+{
+	QMetaObject::invokeMethod(this, [this]() { doStop(); }, Qt::QueuedConnection);
+}
+
+
+
+
+
+AdbConnectionPool * AdbScreenMirror::pool()
+{
+	auto res = mEnumerator.adbPool();
+	if (res == nullptr)
+	{
+		fail(tr("ADB is not available"));
+	}
+	return res;
+}
+
+
+
+
+
+bool AdbScreenMirror::isStillWanted(AdbScreenMirror * aMirror, AdbCommunicator & aComm)
+{
+	if ((aMirror != nullptr) && aMirror->mIsRunning)
+	{
+		return true;
+	}
+
+	// Close the connection once the pool has connected its handlers to it, so that the pool finishes the operation:
+	auto comm = &aComm;
+	QMetaObject::invokeMethod(comm, [comm]() { comm->close(); }, Qt::QueuedConnection);
+	if (aMirror != nullptr)
+	{
+		aMirror->mIsRequestInProgress = false;
+	}
+	return false;
+}
+
+
+
+
+
+void AdbScreenMirror::doStart(int aMaxFps)
+{
+	mMinFrameIntervalMsec = 1000 / std::max(aMaxFps, 1);
+	mLogger.log("Starting mirroring device %1, max %2 fps.", mDeviceID, aMaxFps);
+	mIsRunning = true;
+	mMode = mdInitialFrame;
+	mFps = 0;
+	mSinceLastFrame.invalidate();
+	if (!mIsRequestInProgress)
+	{
+		requestFrame();
+	}
+}
+
+
+
+
+
+void AdbScreenMirror::doStop()
+{
+	mLogger.log("Stopping mirroring device %1.", mDeviceID);
+	mIsRunning = false;
+	mNextFrameTimer.stop();
+	if (mStreamComm != nullptr)
+	{
+		mStreamComm->disconnect(this);
+		mStreamComm->close();
+		mStreamComm = nullptr;
+		mIsRequestInProgress = false;
+	}
+}
+
+
+
+
+
+void AdbScreenMirror::requestFrame()
+{
+	if (!mIsRunning || mIsRequestInProgress)
+	{
+		return;
+	}
+	if (mMode == mdStream)
+	{
+		startStream();
+		return;
+	}
+	auto adbPool = pool();
+	if (adbPool == nullptr)
+	{
+		return;
+	}
+	mIsRequestInProgress = true;
+	mSinceLastRequest.start();
+	QPointer<AdbScreenMirror> self(this);
+	adbPool->enqueueDeviceCommand(mDeviceID, "mirrorFrame",
+		[self](AdbCommunicator & aComm)
+		{
+			auto mirror = self.data();
+			if (!isStillWanted(mirror, aComm))
+			{
+				return;
+			}
+			auto comm = &aComm;
+			connect(comm, &AdbCommunicator::screenshotReceived, mirror,
+				[mirror](const QByteArray & aDeviceID, const QImage & aFrame)
+				{
+					Q_UNUSED(aDeviceID);
+					mirror->onFramebufferFrame(aFrame);
+				}
+			);
+			connect(comm, &AdbCommunicator::error, mirror,
+				[mirror, comm](const QString & aErrorText)
+				{
+					comm->disconnect(mirror);
+					mirror->mIsRequestInProgress = false;
+					mirror->fail(aErrorText);
+				}
+			);
+			connect(comm, &AdbCommunicator::disconnected, mirror,
+				[mirror]()
+				{
+					mirror->mIsRequestInProgress = false;
+					mirror->scheduleNextFrame();
+				}
+			);
+
+			// Hand over the back buffer; the communicator decodes the frame right into it:
+			comm->takeScreenshot(std::move(mirror->mSpareFrame));
+			mirror->mSpareFrame = QImage();
+		},
+		[self](const QString & aErrorText)
+		{
+			if (self != nullptr)
+			{
+				self->mIsRequestInProgress = false;
+				self->fail(aErrorText);
+			}
+		}
+	);
+}
+
+
+
+
+
+void AdbScreenMirror::scheduleNextFrame()
+{
+	if (!mIsRunning)
+	{
+		return;
+	}
+	if (mMode == mdStream)
+	{
+		// The stream delivers the frames on its own pace, start it right away:
+		mNextFrameTimer.start(0);
+		return;
+	}
+	auto elapsed = static_cast<int>(mSinceLastRequest.elapsed());
+	mNextFrameTimer.start(std::max(mMinFrameIntervalMsec - elapsed, 0));
+}
+
+
+
+
+
+void AdbScreenMirror::onFramebufferFrame(const QImage & aFrame)
+{
+	mSpareFrame = aFrame;
+	deliverSpareFrame();
+	if (mMode != mdInitialFrame)
+	{
+		return;
+	}
+
+	// Stream the following frames downscaled to the max width, keeping the aspect ratio. The width is a multiple of 8,
+	// so that the RGB888 rows have no padding in the QImage either:
+	auto width = std::min(aFrame.width(), mMaxStreamWidth) & ~7;
+	auto height = (aFrame.height() * width / std::max(aFrame.width(), 1)) & ~1;
+	if ((width <= 0) || (height <= 0))
+	{
+		fallBackToFramebuffer(tr("Unexpected screen size %1 x %2").arg(aFrame.width()).arg(aFrame.height()));
+		return;
+	}
+	mStreamSize = QSize(width, height);
+	mMode = mdStream;
+}
+
+
+
+
+
+void AdbScreenMirror::startStream()
+{
+	auto adbPool = pool();
+	if (adbPool == nullptr)
+	{
+		return;
+	}
+	mIsRequestInProgress = true;
+	mStreamFrameBytes = 0;
+	mNumStreamedFrames = 0;
+	mStreamStdErr.clear();
+	auto cmd = QString("screenrecord --output-format=raw-frames --size %1x%2 -")
+		.arg(mStreamSize.width())
+		.arg(mStreamSize.height())
+		.toUtf8();
+	QPointer<AdbScreenMirror> self(this);
+	adbPool->startDeviceStream(mDeviceID, "mirrorStream",
+		[self, cmd](AdbCommunicator & aComm)
+		{
+			auto mirror = self.data();
+			if (!isStillWanted(mirror, aComm))
+			{
+				return;
+			}
+			auto comm = &aComm;
+			mirror->mStreamComm = comm;
+			connect(comm, &AdbCommunicator::shellStdOut, mirror,
+				[mirror](const QByteArray & aDeviceID, const QByteArray & aData)
+				{
+					Q_UNUSED(aDeviceID);
+					mirror->onStreamData(aData);
+				}
+			);
+			connect(comm, &AdbCommunicator::shellStdErr, mirror,
+				[mirror](const QByteArray & aDeviceID, const QByteArray & aData)
+				{
+					Q_UNUSED(aDeviceID);
+					mirror->mStreamStdErr.append(aData);
+				}
+			);
+			auto onFinished = [mirror, comm]()
+			{
+				comm->disconnect(mirror);
+				if (mirror->mStreamComm == comm)
+				{
+					mirror->mStreamComm = nullptr;
+					mirror->mIsRequestInProgress = false;
+					mirror->onStreamFinished();
+				}
+			};
+			connect(comm, &AdbCommunicator::error,        mirror, onFinished);
+			connect(comm, &AdbCommunicator::disconnected, mirror, onFinished);
+			comm->shellExecuteV2(cmd);
+		},
+		[self](const QString & aErrorText)
+		{
+			if (self != nullptr)
+			{
+				self->mIsRequestInProgress = false;
+				self->fail(aErrorText);
+			}
+		}
+	);
+}
+
+
+
+
+
+void AdbScreenMirror::onStreamData(const QByteArray & aData)
+{
+	auto frameSize = mStreamSize.width() * mStreamSize.height() * STREAM_BYTES_PER_PIXEL;
+	auto src = aData.constData();
+	auto size = aData.size();
+	while (size > 0)
+	{
+		// Start a new frame; reuse the back buffer only if nobody else references it, writing into a shared image
+		// would copy it first:
+		if (mStreamFrameBytes == 0)
+		{
+			if (
+				(mSpareFrame.size() != mStreamSize) ||
+				(mSpareFrame.format() != QImage::Format_RGB888) ||
+				!mSpareFrame.isDetached()
+			)
+			{
+				mSpareFrame = QImage(mStreamSize, QImage::Format_RGB888);
+				if (mSpareFrame.isNull())
+				{
+					fail(tr("Cannot allocate the frame"));
+					return;
+				}
+			}
+			assert(mSpareFrame.bytesPerLine() == mStreamSize.width() * STREAM_BYTES_PER_PIXEL);
+		}
+		auto toCopy = std::min(size, frameSize - mStreamFrameBytes);
+		memcpy(mSpareFrame.bits() + mStreamFrameBytes, src, static_cast<size_t>(toCopy));
+		mStreamFrameBytes += toCopy;
+		src += toCopy;
+		size -= toCopy;
+		if (mStreamFrameBytes == frameSize)
+		{
+			// A complete frame; deliver it, or overwrite it with the next one if it's too early:
+			mStreamFrameBytes = 0;
+			mNumStreamedFrames += 1;
+			deliverSpareFrame();
+		}
+	}
+}
+
+
+
+
+
+void AdbScreenMirror::onStreamFinished()
+{
+	if (!mIsRunning)
+	{
+		return;
+	}
+	if (mNumStreamedFrames > 0)
+	{
+		// screenrecord has a time limit (3 minutes by default), continue with a new stream:
+		mLogger.log("The mirroring stream of device %1 has ended after %2 frames, restarting.", mDeviceID, mNumStreamedFrames);
+		scheduleNextFrame();
+		return;
+	}
+	fallBackToFramebuffer(tr("The stream didn't produce any frames: %1").arg(QString::fromUtf8(mStreamStdErr.trimmed())));
+}
+
+
+
+
+
+void AdbScreenMirror::fallBackToFramebuffer(const QString & aReason)
+{
+	mLogger.log("Cannot stream the screen of device %1, requesting the framebuffer for each frame instead. %2",
+		mDeviceID, aReason
+	);
+	mMode = mdFramebuffer;
+	mSinceLastRequest.start();
+	scheduleNextFrame();
+}
+
+
+
+
+
+void AdbScreenMirror::deliverSpareFrame()
+{
+	// Measure the frame rate, cap it:
+	if (mSinceLastFrame.isValid())
+	{
+		auto elapsed = mSinceLastFrame.elapsed();
+		if ((mMode == mdStream) && (elapsed < mMinFrameIntervalMsec))
+		{
+			return;
+		}
+		auto currentFps = 1000.0 / static_cast<double>(std::max<qint64>(elapsed, 1));
+		mFps = (mFps == 0) ? currentFps : (mFps * 7 + currentFps) / 8;
+	}
+	mSinceLastFrame.start();
+
+	// Swap the buffers. The receivers replace their previous frame with this one, so once they process the signal,
+	// the previous frame is referenced only by mSpareFrame and can be reused without detaching:
+	std::swap(mCurrentFrame, mSpareFrame);
+	emit frameReceived(mCurrentFrame, mFps);
+}
+
+
+
+
+
+void AdbScreenMirror::fail(const QString & aErrorText)
+{
+	mLogger.log("Mirroring device %1 failed: %2", mDeviceID, aErrorText);
+	doStop();
+	emit failed(aErrorText);
+}
@@ -0,0 +1,181 @@
+#pragma once
+
+#include <QObject>
+#include <QImage>
+#include <QTimer>
+#include <QElapsedTimer>
+#include <QPointer>
+
+
+
+
+
+// fwd:
+class AdbCommunicator;
+class AdbConnectionPool;
+class Logger;
+class UsbDeviceEnumerator;
+
+
+
+
+
+/** Continuously mirrors the screen of a single device connected over ADB.
+Shares the UsbDeviceEnumerator's AdbConnectionPool, so the mirror lives in the enumerator's thread; start() and stop()
+can be called from any thread, and the frames are delivered through the frameReceived() signal (queued to the
+receivers in other threads). Delete the mirror using deleteLater().
+The first frame is taken through the "framebuffer:" service, it shows the screen right away and tells the screen size.
+Then the frames are streamed over a single connection by running the device's screenrecord in the raw-frames
+format, downscaled on the device to at most the configured width (AdbScreenMirror/StreamWidth), which cuts the amount
+of data per frame to a fraction of the full-size framebuffer and avoids a new connection per frame. The device sends
+a new frame only when the screen content changes. Devices that cannot stream (without ShellV2, since ShellV1 isn't
+binary-safe, or without screenrecord's raw-frames support, before Android 5) fall back to requesting the framebuffer
+repeatedly, each frame over a new connection from the pool.
+The frames are decoded into two preallocated images that are swapped after each delivered frame (double-buffering);
+the back buffer is reused once the receivers have released it. The delivered frame rate is capped; the frames
+streamed in between are received but not delivered. */
+class AdbScreenMirror:
+	public QObject
+{
+	using Super = QObject;
+
+	Q_OBJECT
+
+
+public:
+
+	/** Creates a new mirror for the specified device (ADB serial), moves it to the enumerator's thread.
+	Nothing is requested until start() is called. */
+	AdbScreenMirror(UsbDeviceEnumerator & aEnumerator, const QByteArray & aDeviceID, Logger & aLogger);
+
+	/** Starts mirroring, delivering at most aMaxFps frames per second.
+	Thread-safe, the mirror is started asynchronously in its thread. */
+	void start(int aMaxFps);
+
+	/** Stops mirroring, closes the stream. A frame already being received from the framebuffer is still delivered.
+	Thread-safe, the mirror is stopped asynchronously in its thread. */
+	void stop();
+
+
+protected:
+
+	/** The way the frames are received from the device. */
+	enum Mode
+	{
+		mdInitialFrame,  ///< Taking the first frame through the "framebuffer:" service, to learn the screen size
+		mdStream,        ///< Streaming the frames from the screenrecord command over a single connection
+		mdFramebuffer,   ///< Fallback: requesting the "framebuffer:" service for each frame
+	};
+
+
+	/** The enumerator whose pool is used for the connections to ADB. */
+	UsbDeviceEnumerator & mEnumerator;
+
+	/** The ADB serial of the device being mirrored. */
+	const QByteArray mDeviceID;
+
+	/** The logger used for all messages produced by this class. */
+	Logger & mLogger;
+
+	/** The maximum width of the streamed frames (AdbScreenMirror/StreamWidth setting). */
+	const int mMaxStreamWidth;
+
+	/** The way the frames are currently received. */
+	Mode mMode;
+
+	/** The minimum interval between two delivered frames, derived from the max fps. */
+	int mMinFrameIntervalMsec;
+
+	/** True while the frames should be requested. */
+	bool mIsRunning;
+
+	/** True while a framebuffer request or the stream is in progress. */
+	bool mIsRequestInProgress;
+
+	/** The communicator running the stream, to be closed on stop(). nullptr when not streaming. */
+	QPointer<AdbCommunicator> mStreamComm;
+
+	/** The size of the streamed frames. */
+	QSize mStreamSize;
+
+	/** The number of bytes of the frame being streamed received so far. */
+	int mStreamFrameBytes;
+
+	/** The number of frames received through the current stream (including those not delivered). */
+	int mNumStreamedFrames;
+
+	/** The stderr output of the stream's command, for the diagnostics if the stream fails. */
+	QByteArray mStreamStdErr;
+
+	/** The last delivered frame (the front buffer), shared with the receivers of the frameReceived() signal. */
+	QImage mCurrentFrame;
+
+	/** The image into which the next frame is decoded (the back buffer). */
+	QImage mSpareFrame;
+
+	/** Measures the time since the last framebuffer request, for the frame rate cap in the mdFramebuffer mode. */
+	QElapsedTimer mSinceLastRequest;
+
+	/** Measures the time since the last delivered frame, for the frame rate cap and the fps measurement. */
+	QElapsedTimer mSinceLastFrame;
+
+	/** The smoothed measured rate of the delivered frames. */
+	double mFps;
+
+	/** Fires when the next framebuffer should be requested. */
+	QTimer mNextFrameTimer;
+
+
+	/** Returns the enumerator's pool; reports the failure and returns nullptr if the enumerator isn't running. */
+	AdbConnectionPool * pool();
+
+	/** Returns true if the mirror (nullptr if already deleted) still wants the operation that is starting on aComm.
+	If not, schedules closing the connection, so that the pool finishes the operation. */
+	static bool isStillWanted(AdbScreenMirror * aMirror, AdbCommunicator & aComm);
+
+	/** Implementation of start(), runs in the mirror's thread. */
+	void doStart(int aMaxFps);
+
+	/** Implementation of stop(), runs in the mirror's thread. */
+	void doStop();
+
+	/** Requests a new frame from the device through the "framebuffer:" service. */
+	void requestFrame();
+
+	/** Schedules the next framebuffer request (or the stream start), respecting the frame rate cap. */
+	void scheduleNextFrame();
+
+	/** Called when a frame has been received through the "framebuffer:" service.
+	Delivers the frame; after the initial frame, starts the stream. */
+	void onFramebufferFrame(const QImage & aFrame);
+
+	/** Starts streaming the frames through screenrecord, downscaled to fit mMaxStreamWidth. */
+	void startStream();
+
+	/** Processes the data received from the stream, assembling the frames in the back buffer. */
+	void onStreamData(const QByteArray & aData);
+
+	/** Called when the stream's connection is closed. Restarts the stream if it has been delivering the frames
+	(screenrecord has a time limit), otherwise falls back to the mdFramebuffer mode. */
+	void onStreamFinished();
+
+	/** Switches to the mdFramebuffer mode, logging the reason. */
+	void fallBackToFramebuffer(const QString & aReason);
+
+	/** Delivers the frame decoded in the back buffer, if the frame rate cap allows it: swaps the buffers,
+	updates the fps and emits frameReceived(). */
+	void deliverSpareFrame();
+
+	/** Reports the failure and stops the mirroring. */
+	void fail(const QString & aErrorText);
+
+
+signals:
+
+	/** Emitted for each delivered frame, with the smoothed measured frame rate.
+	Receivers should replace their previous frame with this one (not copy into it), so that its buffer can be reused. */
+	void frameReceived(const QImage & aFrame, double aFps);
+
+	/** Emitted when the mirroring fails; the mirror is stopped. */
+	void failed(const QString & aErrorText);
+};
@@ -1,10 +1,114 @@
 #include "Connection.hpp"
 #include <cassert>
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstring>
+#include <vector>
 #include <QTimer>
+#include <QtAlgorithms>
 #include <QDateTime>
+#include <QThread>
 #include "../InstallConfiguration.hpp"
+#include "../Settings.hpp"
 #include "../Utils.hpp"
 #include "../DB/DevicePairings.hpp"
+#include "TlsSessionCache.hpp"
+
+
+
+
+
+/** The protocol version sent in our identification. */
+static const quint16 PROTOCOL_VERSION = 3;
+
+/** The lowest protocol version of the remote that uses TLS after "stls".
+Older remotes use the muxed protocol in cleartext. */
+static const quint16 PROTOCOL_VERSION_TLS = 2;
+
+/** The lowest protocol version of the remote that supports the fragmented mux messages.
+Larger messages cannot be sent to older remotes at all. */
+static const quint16 PROTOCOL_VERSION_FRAGMENTS = 3;
+
+/** The maximum size of the data in a single mux frame. */
+static const int MAX_FRAME_DATA_SIZE = 0xffff;
+
+static_assert(static_cast<int>(Connection::MIN_REMOTE_WINDOW) >= MAX_FRAME_DATA_SIZE, "The minimum window must fit the largest frame");
+const quint32 Connection::MIN_REMOTE_WINDOW;
+
+/** The flag in the mux frame's ChannelID that marks a fragment of a larger message. */
+static const quint16 FRAGMENT_FLAG = 0x8000;
+
+/** The size of the data in each fragment frame that we send.
+Smaller than the maximum, so that the other channels' frames can interleave at a finer granularity. */
+static const int FRAGMENT_DATA_SIZE = 16 * 1024;
+
+/** The maximum size of a fragmented message, both sent and accepted from the remote. */
+static const quint32 MAX_FRAGMENTED_MESSAGE_SIZE = 8 * 1024 * 1024;
+
+/** The maximum amount of data in all the fragmented messages being reassembled at the same time.
+A remote that sends more (e.g. by starting messages on many channels) is disconnected. */
+static const int MAX_FRAGMENTED_BYTES_IN_FLIGHT = 8 * 1024 * 1024;
+
+/** The maximum amount of data in the IO's write buffer. No more frames are written to the IO until it
+drains below this limit, so that the frames of a higher priority don't have to wait behind a lot of data. */
+static const qint64 MAX_IO_WRITE_BUFFER = 64 * 1024;
+
+/** The size of the chunks in which the incoming data is read from the IO into the incoming buffer. */
+static const int READ_CHUNK_SIZE = 64 * 1024;
+
+/** The capacity of the incoming buffer that is kept after processing a burst, larger buffers are shrunk once
+mostly empty (see ReceiveBuffer::shrink()). */
+static const int INCOMING_BUFFER_KEEP_CAPACITY = 4 * READ_CHUNK_SIZE;
+
+/** The amount of pending data that is written to the IO right away, without waiting for more data
+to coalesce with. Matches the maximum TLS record size, so that a full batch is a single TLS record. */
+static const int WRITE_COALESCE_THRESHOLD = 16 * 1024;
+
+/** The DRR quantum for a channel of weight 1, in bytes.
+Each channel gets (quantum * weight) bytes' worth of sending in each scheduling round. */
+static const int DRR_QUANTUM = 4 * 1024;
+
+/** The time constant of the recent throughput's exponential moving average, in msec.
+The bytes are accumulated over slices of at least this length, then folded into the average, so that the throughput
+follows the changes of the link within a few seconds, rather than being averaged over the connection's lifetime. */
+static const qint64 THROUGHPUT_SLICE_MSEC = 1000;
+
+
+
+
+
+/** Returns the DRR scheduling weight for the specified channel priority. */
+static int weightFromPriority(Connection::Channel::Priority aPriority)
+{
+	switch (aPriority)
+	{
+		case Connection::Channel::prBulk:        return 1;
+		case Connection::Channel::prNormal:      return 4;
+		case Connection::Channel::prInteractive: return 16;
+		case Connection::Channel::prControl:     return 16;  // Not used by the DRR, ChannelZero is always sent first
+	}
+	return 1;
+}
+
+
+
+
+
+/** Folds the data transferred over the last slice (aNumBytes over aElapsedMsec) into the exponential moving average
+of the throughput (aThroughput, bytes per second; -1 if there's no average yet). Returns the new average.
+The weight of the slice grows with its length, so that a long idle period decays the average accordingly. */
+static qint64 foldThroughput(qint64 aThroughput, quint64 aNumBytes, qint64 aElapsedMsec)
+{
+	assert(aElapsedMsec > 0);
+	auto sliceThroughput = static_cast<double>(aNumBytes) * 1000 / static_cast<double>(aElapsedMsec);
+	if (aThroughput < 0)
+	{
+		return static_cast<qint64>(sliceThroughput);
+	}
+	auto weight = 1 - std::pow(0.75, static_cast<double>(aElapsedMsec) / THROUGHPUT_SLICE_MSEC);
+	return static_cast<qint64>(static_cast<double>(aThroughput) + weight * (sliceThroughput - static_cast<double>(aThroughput)));
+}
 
 
 
@@ -25,15 +129,27 @@ class ChannelZero:
 public:
 
 	ChannelZero(Connection & aConnection):
-		Super(aConnection)
+		Super(aConnection),
+		mNumPendingRequests(0),
+		mNextRequestID(0),
+		mNextSerial(0),
+		mCurrentTick(0)
 	{
 		// Set the fixed channel ID, no opening necessary for this special channel:
 		mChannelID = 0;
 		mIsOpen = true;
+		mPriority = prControl;
+
+		// All the request IDs are free:
+		mFreeRequestIDs.fill(~0ULL);
 
 		// Add a ping-timer
 		connect(&mTimer, &QTimer::timeout, this, &ChannelZero::sendPing);
 		mTimer.start(1000);  // 1 second
+
+		// Add the timer driving the request timeouts:
+		connect(&mTimeoutTimer, &QTimer::timeout, this, &ChannelZero::expireRequests);
+		mTimeoutTimer.start(TIMEOUT_TICK_MSEC);
 	}
 
 
@@ -41,14 +157,18 @@ public:
 
 	virtual ~ChannelZero() override
 	{
-		// Stop the ping-timer:
+		// Stop the timers:
 		mTimer.stop();
+		mTimeoutTimer.stop();
 
 		// Call the failure handler of each pending request:
 		QMutexLocker lock(&mMtx);
 		for (auto & req: mPendingRequests)
 		{
-			(*req.second).mErrorHandler(ERR_DISCONNECTED, "The connection was lost");
+			if (req != nullptr)
+			{
+				req->mErrorHandler(ERR_DISCONNECTED, "The connection was lost");
+			}
 		}
 	}
 
@@ -95,6 +215,41 @@ public:
 
 
 
+	/** Sends the request to close the specified open channel.
+	The channel is removed from the connection once the remote answers (regardless of the answer; an error
+	means the remote doesn't know the channel anyway), and its closed() signal is emitted. */
+	void closeChannel(Connection::ChannelPtr aChannel)
+	{
+		assert(aChannel->mIsOpen);
+		assert(aChannel->channelID() != 0);
+
+		QByteArray req;
+		Utils::writeBE16(req, aChannel->channelID());
+		sendRequest("clse"_4cc,
+			// Success handler:
+			[this, aChannel](const QByteArray & aAdditionalData)
+			{
+				Q_UNUSED(aAdditionalData);
+				mConnection.logger().log("Channel #%1 closed.", aChannel->channelID());
+				mConnection.removeChannel(aChannel);
+			},
+
+			// Failure handler:
+			[this, aChannel](const quint16 aErrorCode, const QByteArray & aErrorMessage)
+			{
+				mConnection.logger().log("Closing channel #%1 returned an error: %2; %3",
+					aChannel->channelID(), aErrorCode, aErrorMessage
+				);
+				mConnection.removeChannel(aChannel);
+			},
+			req
+		);
+	}
+
+
+
+
+
 signals:
 
 	/** Emitted after the device acknowledges opening the specified new channel. */
@@ -114,24 +269,80 @@ protected:
 		SuccessHandler mSuccessHandler;
 		ErrorHandler mErrorHandler;
 
+		/** The unique serial number of the request, distinguishes it from other requests that have used
+		(or will use) the same request ID. */
+		quint64 mSerial;
+
+		/** The timeout tick at which the request times out. */
+		quint64 mDeadlineTick;
+
 		PendingRequest(
 			quint8 aRequestID,
 			SuccessHandler aSuccessHandler,
-			ErrorHandler aErrorHandler
+			ErrorHandler aErrorHandler,
+			quint64 aSerial,
+			quint64 aDeadlineTick
 		):
 			mRequestID(aRequestID),
 			mSuccessHandler(aSuccessHandler),
-			mErrorHandler(aErrorHandler)
+			mErrorHandler(aErrorHandler),
+			mSerial(aSerial),
+			mDeadlineTick(aDeadlineTick)
 		{
 		}
 	};
 
 
-	/** The requests that have been sent to the remote and haven't been answered yet.
+	/** The number of distinct request IDs. */
+	static const int NUM_REQUEST_IDS = 256;
+
+	/** The number of 64-bit words in the free request ID bitmap. */
+	static const int NUM_FREE_ID_WORDS = NUM_REQUEST_IDS / 64;
+
+	/** The interval between the timeout ticks, in msec. The granularity of the request timeouts. */
+	static const int TIMEOUT_TICK_MSEC = 250;
+
+	/** The number of slots in the timeout wheel.
+	Deadlines further in the future than the wheel covers (16 seconds) stay in their slot for more rounds. */
+	static const int NUM_TIMEOUT_SLOTS = 64;
+
+	/** The default time for the remote to answer a request, in msec. */
+	static const int DEFAULT_REQUEST_TIMEOUT_MSEC = 30000;
+
+
+	/** The requests that have been sent to the remote and haven't been answered yet, indexed by their request ID.
+	Protected against multithreaded access by mMtx. */
+	std::array<std::unique_ptr<PendingRequest>, NUM_REQUEST_IDS> mPendingRequests;
+
+	/** The bitmap of the free request IDs, a set bit means the ID is free.
+	Protected against multithreaded access by mMtx. */
+	std::array<quint64, NUM_FREE_ID_WORDS> mFreeRequestIDs;
+
+	/** The number of requests in mPendingRequests.
+	Protected against multithreaded access by mMtx. */
+	int mNumPendingRequests;
+
+	/** The request ID from which the search for the next free ID starts.
+	The IDs are allocated round-robin, so that an ID of a timed-out request is not reused soon,
+	in case the remote answers it late.
+	Protected against multithreaded access by mMtx. */
+	quint8 mNextRequestID;
+
+	/** The serial number to assign to the next request.
+	Protected against multithreaded access by mMtx. */
+	quint64 mNextSerial;
+
+	/** The timeout wheel. Each slot contains the (request ID, serial) pairs of the requests whose deadline
+	maps to the slot. Entries of the requests that have been answered meanwhile are left in place and skipped
+	when their slot is processed (detected by the serial mismatch).
+	Protected against multithreaded access by mMtx. */
+	std::array<std::vector<std::pair<quint8, quint64>>, NUM_TIMEOUT_SLOTS> mTimeoutWheel;
+
+	/** The number of timeout ticks since the channel was created.
 	Protected against multithreaded access by mMtx. */
-	std::map<quint8, std::unique_ptr<PendingRequest>> mPendingRequests;
+	quint64 mCurrentTick;
 
-	/** The mutex protecting mPendingRequests against multithreaded access. */
+	/** The mutex protecting mPendingRequests and the related members against multithreaded access. */
 	QMutex mMtx;
 
 
@@ -192,6 +403,11 @@ protected:
 				sendResponse(reqID, aMessage.mid(6));
 				break;
 			}
+			case "wndu"_4cc:
+			{
+				handleWindowUpdate(reqID, aMessage);
+				break;
+			}
 			// "open" and "clse" requests are not supported, handled in "default"
 			default:
 			{
@@ -206,6 +422,45 @@ protected:
 
 
 
+	/** Handles the "wndu" request from the remote, granting us more credit for sending on a channel.
+	The aMessage contains the entire serialized message (incl. MsgType, ReqID and ReqType). */
+	void handleWindowUpdate(const quint8 aRequestID, const QByteArray & aMessage)
+	{
+		if (aMessage.size() < 12)
+		{
+			qWarning() << "Window update too small: " << aMessage.size();
+			return;
+		}
+		auto channelID = Utils::readBE16(aMessage, 6);
+		auto credit = Utils::readBE32(aMessage, 8);
+		switch (mConnection.addRemoteCredit(channelID, credit))
+		{
+			case Connection::crAdded:
+			{
+				break;
+			}
+			case Connection::crNoSuchChannel:
+			{
+				// The channel may have been closed meanwhile, no need to report anything
+				mConnection.logger().log("Received a window update for non-existent channel %1.", channelID);
+				break;
+			}
+			case Connection::crWindowTooSmall:
+			{
+				mConnection.logger().log("Rejecting the initial window of %1 bytes for channel %2, the minimum is %3.",
+					credit, channelID, Connection::MIN_REMOTE_WINDOW
+				);
+				sendError(aRequestID, ERR_WINDOW_TOO_SMALL);
+				return;
+			}
+		}
+		sendResponse(aRequestID);
+	}
+
+
+
+
+
 	/** Handles a Response message from the remote.
 	The aMessage contains the entire serialized message (incl. MsgType and ReqID). */
 	void handleResponse(const QByteArray & aMessage)
@@ -217,15 +472,13 @@ protected:
 		}
 		auto requestID = static_cast<quint8>(aMessage[1]);
 		QMutexLocker lock(&mMtx);
-		auto itr = mPendingRequests.find(requestID);
-		if (itr == mPendingRequests.end())
+		auto req = releaseRequest(requestID);
+		lock.unlock();
+		if (req == nullptr)
 		{
 			qWarning() << "Received a response for a non-existent request ID " << requestID;
 			return;
 		}
-		auto req = std::move(itr->second);
-		mPendingRequests.erase(itr);
-		lock.unlock();
 		req->mSuccessHandler(aMessage.mid(2));
 	}
 
@@ -245,15 +498,13 @@ protected:
 		auto requestID = static_cast<quint8>(aMessage[1]);
 		auto errorCode = Utils::readBE16(aMessage, 2);
 		QMutexLocker lock(&mMtx);
-		auto itr = mPendingRequests.find(requestID);
-		if (itr == mPendingRequests.end())
+		auto req = releaseRequest(requestID);
+		lock.unlock();
+		if (req == nullptr)
 		{
 			qWarning() << "Received an error response for a non-existent request ID " << requestID;
 			return;
 		}
-		auto req = std::move(itr->second);
-		mPendingRequests.erase(itr);
-		lock.unlock();
 		req->mErrorHandler(errorCode, aMessage.mid(4));
 	}
 
@@ -296,39 +547,37 @@ protected:
 
 	/** Sends a request and calls the specified handler when response or error is received.
 	Automatically assigns a request ID.
-	The error handler is called immediately if there's no free request IDs, with ERR_NO_REQUEST_ID. */
+	The error handler is called immediately if there's no free request IDs, with ERR_NO_REQUEST_ID.
+	If the remote doesn't answer within aTimeoutMsec, the error handler is called with ERR_TIMEOUT. */
 	void sendRequest(
 		const quint32 aRequestType,
 		PendingRequest::SuccessHandler aSuccessHandler,
 		PendingRequest::ErrorHandler aErrorHandler,
-		const QByteArray & aAdditionalData = QByteArray()
+		const QByteArray & aAdditionalData = QByteArray(),
+		int aTimeoutMsec = DEFAULT_REQUEST_TIMEOUT_MSEC
 	)
 	{
 		QMutexLocker lock(&mMtx);
-		if (mPendingRequests.size() >= 255)
+		auto id = allocateRequestID();
+		if (id < 0)
 		{
 			lock.unlock();
 			aErrorHandler(ERR_NO_REQUEST_ID, "Too many pending requests, no free ID to assign to this one.");
 			return;
 		}
+		auto reqID = static_cast<quint8>(id);
 
-		// Find a free request ID to assign:
-		quint8 reqID = 255;
-		for (quint8 i = 0; i < 255; i++)
-		{
-			if (mPendingRequests.find(i) == mPendingRequests.end())
-			{
-				reqID = i;
-				break;
-			}
-		}
-
-		// Store the pending request:
+		// Store the pending request and schedule its timeout:
+		auto serial = mNextSerial++;
+		auto deadlineTick = mCurrentTick + static_cast<quint64>((aTimeoutMsec + TIMEOUT_TICK_MSEC - 1) / TIMEOUT_TICK_MSEC);
 		mPendingRequests[reqID] = std::make_unique<PendingRequest>(
 			reqID,
 			aSuccessHandler,
-			aErrorHandler
+			aErrorHandler,
+			serial,
+			deadlineTick
 		);
+		mTimeoutWheel[deadlineTick % NUM_TIMEOUT_SLOTS].emplace_back(reqID, serial);
 		lock.unlock();
 
 		// Serialize and send the request:
@@ -344,18 +593,109 @@ protected:
 
 
 
+	/** Allocates a free request ID, in a round-robin fashion.
+	Returns -1 if all the IDs are in use.
+	Expects mMtx to be held by the caller. */
+	int allocateRequestID()
+	{
+		if (mNumPendingRequests >= NUM_REQUEST_IDS)
+		{
+			return -1;
+		}
+
+		// Search the bitmap from mNextRequestID up, wrapping around back to the starting word:
+		auto word = mNextRequestID / 64;
+		auto bits = mFreeRequestIDs[word] & (~0ULL << (mNextRequestID % 64));
+		for (int i = 0; i <= NUM_FREE_ID_WORDS; ++i)
+		{
+			if (bits != 0)
+			{
+				auto id = word * 64 + static_cast<int>(qCountTrailingZeroBits(bits));
+				mFreeRequestIDs[word] &= ~(1ULL << (id % 64));
+				mNumPendingRequests += 1;
+				mNextRequestID = static_cast<quint8>(id + 1);
+				return id;
+			}
+			word = (word + 1) % NUM_FREE_ID_WORDS;
+			bits = mFreeRequestIDs[word];
+		}
+		assert(!"The free request ID bitmap is inconsistent with the pending request count");
+		return -1;
+	}
+
+
+
+
+
+	/** Removes the pending request with the specified ID and frees the ID.
+	Returns the removed request, or nullptr if there was no such request.
+	Expects mMtx to be held by the caller. */
+	std::unique_ptr<PendingRequest> releaseRequest(quint8 aRequestID)
+	{
+		auto req = std::move(mPendingRequests[aRequestID]);
+		if (req != nullptr)
+		{
+			mFreeRequestIDs[aRequestID / 64] |= (1ULL << (aRequestID % 64));
+			mNumPendingRequests -= 1;
+		}
+		return req;
+	}
+
+
+
+
+
 	/** Called when a ping's response is received, with the calculated roundtrip time. */
 	void pingReceived(qint64 aRoundtripMsec)
 	{
-		Q_UNUSED(aRoundtripMsec);
-
-		// TODO: Store and process the value
-		// mLogger.log("Ping received in %1 msec.", aRoundtripMsec);
+		mConnection.addRoundtrip(aRoundtripMsec);
 	}
 
 
 private slots:
 
+	/** Advances the timeout wheel by one tick, calls the error handler of the requests whose deadline has passed. */
+	void expireRequests()
+	{
+		std::vector<std::unique_ptr<PendingRequest>> expired;
+		{
+			QMutexLocker lock(&mMtx);
+			mCurrentTick += 1;
+			auto & slot = mTimeoutWheel[mCurrentTick % NUM_TIMEOUT_SLOTS];
+			size_t idx = 0;
+			while (idx < slot.size())
+			{
+				auto reqID = slot[idx].first;
+				const auto & req = mPendingRequests[reqID];
+				if ((req != nullptr) && (req->mSerial == slot[idx].second))
+				{
+					if (req->mDeadlineTick > mCurrentTick)
+					{
+						// The deadline is in one of the next rounds of the wheel
+						++idx;
+						continue;
+					}
+					expired.push_back(releaseRequest(reqID));
+				}
+				// Else the request has been answered meanwhile
+
+				// Remove the entry (the order within the slot doesn't matter):
+				slot[idx] = slot.back();
+				slot.pop_back();
+			}
+		}
+
+		for (auto & req: expired)
+		{
+			mConnection.logger().log("Request %1 has timed out.", req->mRequestID);
+			req->mErrorHandler(ERR_TIMEOUT, "The remote hasn't answered the request in time");
+		}
+	}
+
+
+
+
+
 	void sendPing()
 	{
 		static int numPings = 0;
@@ -380,6 +720,9 @@ protected:
 
 	/** The timer used for pinging. */
 	QTimer mTimer;
+
+	/** The timer driving the timeout wheel. */
+	QTimer mTimeoutTimer;
 };
 
 #include "Connection.moc"
@@ -394,7 +737,12 @@ protected:
 Connection::Channel::Channel(Connection & aConnection):
 	mConnection(aConnection),
 	mChannelID(0),
-	mIsOpen(false)
+	mIsOpen(false),
+	mPriority(prNormal),
+	mNumBytesQueued(0),
+	mSendBudget(DEFAULT_SEND_BUDGET),
+	mIsOverBudget(false),
+	mRemoteCredit(-1)
 {
 }
 
@@ -405,7 +753,38 @@ Connection::Channel::Channel(Connection & aConnection):
 void Connection::Channel::sendMessage(const QByteArray & aMessage)
 {
 	assert(mIsOpen);
-	mConnection.sendChannelMessage(mChannelID, aMessage);
+	mConnection.sendChannelMessage(*this, aMessage);
+}
+
+
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Connection::Stats:
+
+quint64 Connection::Stats::totalBytesIn() const
+{
+	quint64 res = 0;
+	for (const auto & ch: mChannels)
+	{
+		res += ch.second.mNumBytesIn;
+	}
+	return res;
+}
+
+
+
+
+
+quint64 Connection::Stats::totalBytesOut() const
+{
+	quint64 res = 0;
+	for (const auto & ch: mChannels)
+	{
+		res += ch.second.mNumBytesOut;
+	}
+	return res;
 }
 
 
@@ -430,19 +809,32 @@ Connection::Connection(
 	mTransportKind(aTransportKind),
 	mTransportName(aTransportName),
 	mState(csInitial),
+	mIsProcessingIncomingData(false),
 	mHasReceivedIdentification(false),
 	mRemoteVersion(0),
 	mHasSentStartTls(false),
+	mNumIncomingFragmentedBytes(0),
+	mNumPendingFrames(0),
+	mIsPumpScheduled(false),
+	mThroughputSliceBytes(0),
 	mLogger(aComponents.logger("Connection-" + aConnectionID))
 {
+	mStats.mLastRoundtrip = -1;
+	mStats.mSmoothedRoundtrip = -1;
+	mStats.mUptimeMsec = 0;
+	mStats.mLastRoundtripAge = -1;
+	mStats.mRecentThroughput = -1;
+	connect(&mStatsDumpTimer, &QTimer::timeout, this, &Connection::logStats);
+
 	connect(aIO, &QIODevice::readyRead,           this, &Connection::ioReadyRead);
 	connect(aIO, &QIODevice::aboutToClose,        this, &Connection::ioClosing);
 	connect(aIO, &QIODevice::readChannelFinished, this, &Connection::ioClosing);
+	connect(aIO, &QIODevice::bytesWritten,        this, &Connection::pumpOutgoing);
 
 	// Send the protocol identification:
 	mLogger.log("Sending protocol identification...");
 	QByteArray protocolIdent("Deskemes");
-	Utils::writeBE16(protocolIdent, 1);  // version
+	Utils::writeBE16(protocolIdent, PROTOCOL_VERSION);
 	sendCleartextMessage("dsms"_4cc, protocolIdent);
 
 	// If there's data already on the connection, process it:
@@ -476,6 +868,8 @@ ComponentCollection::ComponentKind Connection::enumeratorKindFromTransportKind(C
 
 void Connection::terminate()
 {
+	// Send whatever has been queued so far, it may explain the termination to the remote:
+	writePending();
 	mIO->close();
 }
 
@@ -563,7 +957,8 @@ void Connection::localPairingApproved()
 		(mState == csKnownPairing) ||
 		(mState == csRequestedPairing) ||
 		(mState == csDifferentKey) ||
-		(mState == csEncrypted)  // The device has already started encryption
+		(mState == csTlsHandshaking) ||  // The device has already started encryption
+		(mState == csEncrypted)          // The device has already started encryption
 	);
 	assert(mRemotePublicID.isPresent());
 	assert(mRemotePublicKeyData.isPresent());
@@ -582,7 +977,10 @@ void Connection::localPairingApproved()
 		pairing.value().mLocalPrivateKeyData
 	);
 
-	if (mState != csEncrypted)
+	// Any TLS sessions cached for the previous pairing must not be resumed anymore:
+	mComponents.get<TlsSessionCache>()->removeDevice(id);
+
+	if (!mHasSentStartTls)
 	{
 		sendCleartextMessage("stls"_4cc);
 	}
@@ -592,6 +990,27 @@ void Connection::localPairingApproved()
 
 
 
+bool Connection::closeChannel(ChannelPtr aChannel)
+{
+	if (mState != csEncrypted)
+	{
+		mLogger.log("Invalid protocol state, %1 instead of %2 (encrypted).", mState, csEncrypted);
+		return false;
+	}
+	if (!aChannel->isOpen() || (aChannel->channelID() == 0))
+	{
+		return false;
+	}
+	auto ch0 = channelZero();
+	assert(ch0 != nullptr);
+	ch0->closeChannel(aChannel);
+	return true;
+}
+
+
+
+
+
 bool Connection::openChannel(
 	ChannelPtr aChannel,
 	const QByteArray & aServiceName,
@@ -669,50 +1088,59 @@ void Connection::setState(Connection::State aNewState)
 
 
 
-void Connection::processIncomingData(const QByteArray & aData)
+void Connection::processIncomingData()
 {
-	switch (mState)
+	assert(!mIsProcessingIncomingData);
+	mIsProcessingIncomingData = true;
+
+	// Extract all complete messages, the state may change with each message (such as "stls"):
+	bool hasExtracted = true;
+	while (hasExtracted)
 	{
-		case csInitial:
-		case csBlacklisted:
-		case csDifferentKey:
-		case csKnownPairing:
-		case csUnknownPairing:
-		case csRequestedPairing:
+		switch (mState)
 		{
-			// Add the data to the internal buffer:
-			mIncomingData.append(aData);
-
-			// Extract all complete messages:
-			while (extractAndHandleCleartextMessage())
+			case csInitial:
+			case csBlacklisted:
+			case csDifferentKey:
+			case csKnownPairing:
+			case csUnknownPairing:
+			case csRequestedPairing:
 			{
-				// Empty loop body
+				hasExtracted = extractAndHandleCleartextMessage();
+				break;
 			}
-			break;
-		}
-
-		case csEncrypted:
-		{
-			// TODO: TLS
 
-			// Add the data to the internal buffer:
-			mIncomingData.append(aData);
+			case csTlsHandshaking:
+			{
+				// All the data is going to mTlsFilter now, there's nothing to extract until the handshake completes
+				hasExtracted = false;
+				break;
+			}
 
-			// Extract all complete messages:
-			while (extractAndHandleMuxMessage())
+			case csEncrypted:
 			{
-				// Empty loop body
+				// If using TLS, the data has already been decrypted by mTlsFilter
+				hasExtracted = extractAndHandleMuxMessage();
+				break;
 			}
-			break;
-		}
 
-		case csDisconnected:
-		{
-			// Probably some leftover data from the connection, don't know how to handle it, so drop it:
-			mLogger.logHex(aData, "Received data while disconnected, ignoring.");
-			break;
+			case csDisconnected:
+			{
+				// Probably some leftover data from the connection, don't know how to handle it, so drop it:
+				if (!mIncomingData.isEmpty())
+				{
+					mLogger.logHex(mIncomingData.view(0, mIncomingData.size()), "Received data while disconnected, ignoring.");
+					mIncomingData.clear();
+				}
+				hasExtracted = false;
+				break;
+			}
 		}
 	}
+
+	// Reclaim the space of all the processed messages at once; release the memory after a large burst:
+	mIncomingData.shrink(INCOMING_BUFFER_KEEP_CAPACITY);
+	mIsProcessingIncomingData = false;
 }
 
 
@@ -726,17 +1154,18 @@ bool Connection::extractAndHandleCleartextMessage()
 	{
 		return false;
 	}
-	auto bytes = reinterpret_cast<const quint8 *>(mIncomingData.constData());
+	auto bytes = mIncomingData.bytes();
 	quint16 msgLen = Utils::readBE16(&(bytes[4]));
 	if (mIncomingData.size() < msgLen + 6)
 	{
 		return false;
 	}
 
-	// Extract and handle the message:
+	// Extract and handle the message.
+	// The cleartext messages are few and may get stored (avatar, public key), so hand out a copy instead of a view:
 	auto msgType = Utils::readBE32(bytes);
-	auto msg = mIncomingData.mid(6, msgLen);
-	mIncomingData.remove(0, msgLen + 6);
+	auto msg = mIncomingData.copy(6, msgLen);
+	mIncomingData.consume(msgLen + 6);
 	handleCleartextMessage(msgType, msg);
 	return true;
 }
@@ -855,10 +1284,75 @@ void Connection::handleCleartextMessageStls()
 	{
 		sendCleartextMessage("stls"_4cc);
 	}
+	if (mRemoteVersion < PROTOCOL_VERSION_TLS)
+	{
+		// The version is exchanged in cleartext, so it may have been rewritten by an attacker to strip TLS.
+		// Refuse the fallback for devices known to support TLS, and when the user has disabled it altogether:
+		auto pairing = mComponents.get<DevicePairings>()->lookupDevice(mRemotePublicID.value());
+		if (pairing.isPresent() && pairing.value().mHasNegotiatedTls)
+		{
+			mLogger.log("ERROR: The remote reports protocol version %1 without TLS, but it has already negotiated TLS before. Possible downgrade attack, aborting connection.", mRemoteVersion);
+			terminate();
+			return;
+		}
+		if (!Settings::loadValue("Connection", "AllowCleartextFallback", true).toBool())
+		{
+			mLogger.log("ERROR: The remote reports protocol version %1 without TLS, and cleartext connections are disabled. Aborting connection.", mRemoteVersion);
+			terminate();
+			return;
+		}
+		mLogger.log("WARNING: Received a TLS request, but the remote uses protocol version %1 that has no TLS; the connection will NOT be encrypted.", mRemoteVersion);
+		startMuxedProtocol();
+		return;
+	}
 	mLogger.log("Received a TLS request, upgrading to TLS");
+	startTls();
+}
+
+
+
+
+
+void Connection::startTls()
+{
+	// The cleartext messages must all be sent before the TLS handshake starts:
+	writePending();
+
+	auto pairing = mComponents.get<DevicePairings>()->lookupDevice(mRemotePublicID.value());
+	if (!pairing.isPresent() || pairing.value().mLocalPrivateKeyData.isEmpty())
+	{
+		mLogger.log("ERROR: Cannot start TLS, there are no local keys for the remote, aborting connection");
+		terminate();
+		return;
+	}
+
+	mTlsFilter = std::make_unique<TlsFilter>(
+		pairing.value().mLocalPrivateKeyData,
+		mRemotePublicKeyData.value(),
+		mRemotePublicID.value(),
+		mComponents.get<TlsSessionCache>(),
+		mLogger
+	);
+	connect(mTlsFilter.get(), &TlsFilter::outgoingData,       this, &Connection::tlsOutgoingData);
+	connect(mTlsFilter.get(), &TlsFilter::handshakeCompleted, this, &Connection::tlsHandshakeCompleted);
+	connect(mTlsFilter.get(), &TlsFilter::failed,             this, &Connection::tlsFailed);
+	setState(csTlsHandshaking);
+	mTlsFilter->startHandshake();
+
+	// Any leftover data in mIncomingData is already the TLS handshake, hand it over to the filter:
+	if (!mIncomingData.isEmpty())
+	{
+		mTlsFilter->writeIncoming(mIncomingData.data(), mIncomingData.size());
+		mIncomingData.consume(mIncomingData.size());
+	}
+}
+
 
-	// TODO: Add an actual TLS filter
 
+
+
+void Connection::startMuxedProtocol()
+{
 	setState(csEncrypted);
 
 	// Set up the command channel:
@@ -873,10 +1367,16 @@ void Connection::handleCleartextMessageStls()
 		}
 	);
 
-	// Push the leftover data to the TLS filter:
-	QByteArray leftoverData;
-	std::swap(leftoverData, mIncomingData);
-	processIncomingData(leftoverData);
+	// Any leftover data in mIncomingData is already the muxed protocol, processIncomingData() will handle it
+	// after the current message handler returns.
+
+	// Start the statistics:
+	mUptimeTimer.start();
+	auto statsDumpInterval = Settings::loadValue("Connection", "StatsDumpIntervalSec", 0).toInt();
+	if (statsDumpInterval > 0)
+	{
+		mStatsDumpTimer.start(statsDumpInterval * 1000);
+	}
 
 	emit established(this);
 }
@@ -898,7 +1398,7 @@ void Connection::sendCleartextMessage(quint32 aMsgType, const QByteArray & aMsg)
 
 	QByteArray packet = Utils::writeBE32(aMsgType);
 	Utils::writeBE16Lstring(packet, aMsg);
-	mIO->write(packet);
+	queueWrite(packet);
 	if (aMsgType == "stls"_4cc)
 	{
 		mHasSentStartTls = true;
@@ -916,20 +1416,32 @@ bool Connection::extractAndHandleMuxMessage()
 		// Not enough data for the header
 		return false;
 	}
-	auto msgLen = static_cast<qint32>(Utils::readBE16(mIncomingData, 2));
+	auto header = mIncomingData.bytes();
+	auto msgLen = static_cast<int>(Utils::readBE16(header + 2));
 	if (mIncomingData.size() < msgLen + 4)
 	{
 		return false;
 	}
-	auto channelID = Utils::readBE16(mIncomingData, 0);
+	auto channelID = Utils::readBE16(header);
+
+	// Hand the channel a view into the buffer; consuming doesn't move the data, so the view stays valid:
+	auto msg = mIncomingData.view(4, msgLen);
+	mIncomingData.consume(4 + msgLen);
+	if (((channelID & FRAGMENT_FLAG) != 0) && (mRemoteVersion >= PROTOCOL_VERSION_FRAGMENTS))
+	{
+		auto fragmentChannelID = static_cast<quint16>(channelID & ~FRAGMENT_FLAG);
+		addFrameStats(fragmentChannelID, false, msgLen + 4);
+		handleMuxFragment(fragmentChannelID, msg);
+		return true;
+	}
+	addFrameStats(channelID, false, msgLen + 4);
 	auto channel = channelByID(channelID);
 	if (channel == nullptr)
 	{
 		mLogger.log("Message received for non-existent channel \"%1\".", channelID);
 		return true;
 	}
-	channel->processIncomingMessage(mIncomingData.mid(4, msgLen));
-	mIncomingData = mIncomingData.mid(4 + msgLen);
+	channel->processIncomingMessage(msg);
 	return true;
 }
 
@@ -937,9 +1449,81 @@ bool Connection::extractAndHandleMuxMessage()
 
 
 
-Connection::ChannelPtr Connection::channelByID(quint16 aChannelID)
+void Connection::handleMuxFragment(quint16 aChannelID, const QByteArray & aFragmentData)
 {
-	QMutexLocker lock(&mMtxChannels);
+	// Drop the fragments for unknown channels right away, don't store anything for them:
+	auto itr = mIncomingFragmentedMessages.find(aChannelID);
+	auto channel = channelByID(aChannelID);
+	if (channel == nullptr)
+	{
+		mLogger.log("Fragment received for non-existent channel \"%1\".", aChannelID);
+		if (itr != mIncomingFragmentedMessages.end())
+		{
+			// The channel has been closed during the reassembly:
+			mNumIncomingFragmentedBytes -= itr->second.mData.size();
+			mIncomingFragmentedMessages.erase(itr);
+		}
+		return;
+	}
+
+	int offset = 0;
+	if (itr == mIncomingFragmentedMessages.end())
+	{
+		// This is the first fragment, it starts with the total message size:
+		if (aFragmentData.size() < 4)
+		{
+			mLogger.log("ERROR: Received a first fragment without the message size, aborting connection.");
+			terminate();
+			return;
+		}
+		auto totalSize = Utils::readBE32(aFragmentData);
+		if (totalSize > MAX_FRAGMENTED_MESSAGE_SIZE)
+		{
+			mLogger.log("ERROR: Received a fragmented message too large (%1 bytes), aborting connection.", totalSize);
+			terminate();
+			return;
+		}
+		itr = mIncomingFragmentedMessages.emplace(aChannelID, IncomingFragmentedMessage{QByteArray(), static_cast<int>(totalSize)}).first;
+		offset = 4;
+	}
+
+	// Append the fragment data to the message, the buffer grows only as the data arrives:
+	auto & msg = itr->second;
+	auto numBytes = aFragmentData.size() - offset;
+	if (msg.mData.size() + numBytes > msg.mTotalSize)
+	{
+		mLogger.log("ERROR: Received more fragment data than the announced message size, aborting connection.");
+		terminate();
+		return;
+	}
+	mNumIncomingFragmentedBytes += numBytes;
+	if (mNumIncomingFragmentedBytes > MAX_FRAGMENTED_BYTES_IN_FLIGHT)
+	{
+		mLogger.log("ERROR: The fragmented messages being received exceed %1 bytes in total, aborting connection.", MAX_FRAGMENTED_BYTES_IN_FLIGHT);
+		terminate();
+		return;
+	}
+	msg.mData.append(aFragmentData.constData() + offset, numBytes);
+	if (msg.mData.size() < msg.mTotalSize)
+	{
+		// More fragments to come
+		return;
+	}
+
+	// The message is complete, pass it to the channel:
+	auto data = std::move(msg.mData);
+	mNumIncomingFragmentedBytes -= data.size();
+	mIncomingFragmentedMessages.erase(itr);
+	channel->processIncomingMessage(data);
+}
+
+
+
+
+
+Connection::ChannelPtr Connection::channelByID(quint16 aChannelID)
+{
+	QMutexLocker lock(&mMtxChannels);
 	auto itr = mChannels.find(aChannelID);
 	if (itr == mChannels.end())
 	{
@@ -961,6 +1545,24 @@ std::shared_ptr<ChannelZero> Connection::channelZero()
 
 
 
+void Connection::removeChannel(ChannelPtr aChannel)
+{
+	{
+		QMutexLocker lock(&mMtxChannels);
+		auto itr = mChannels.find(aChannel->channelID());
+		if ((itr != mChannels.end()) && (itr->second == aChannel))
+		{
+			mChannels.erase(itr);
+		}
+	}
+	aChannel->mIsOpen = false;
+	emit aChannel->closed(aChannel.get());
+}
+
+
+
+
+
 void Connection::addChannel(const quint16 aChannelID, Connection::ChannelPtr aChannel)
 {
 	QMutexLocker lock(&mMtxChannels);
@@ -972,16 +1574,388 @@ void Connection::addChannel(const quint16 aChannelID, Connection::ChannelPtr aCh
 
 
 
-void Connection::sendChannelMessage(const quint16 aChannelID, const QByteArray & aMessage)
+void Connection::sendChannelMessage(Channel & aChannel, const QByteArray & aMessage)
+{
+	auto channelID = aChannel.channelID();
+	if (aMessage.size() <= MAX_FRAME_DATA_SIZE)
+	{
+		// The message fits a single frame:
+		mLogger.logHex(aMessage, "Sending message to channel #%1", channelID);
+		QByteArray frame;
+		Utils::writeBE16(frame, channelID);
+		Utils::writeBE16Lstring(frame, aMessage);
+		std::vector<QByteArray> frames;
+		frames.push_back(std::move(frame));
+		queueOutgoingFrames(aChannel, std::move(frames));
+		schedulePumpOutgoing();
+		return;
+	}
+
+	if (mRemoteVersion < PROTOCOL_VERSION_FRAGMENTS)
+	{
+		mLogger.log("ERROR: Cannot send a %1-byte message to channel #%2, the remote doesn't support fragmented messages. Dropping the message.",
+			aMessage.size(), channelID
+		);
+		return;
+	}
+	if (static_cast<quint32>(aMessage.size()) > MAX_FRAGMENTED_MESSAGE_SIZE)
+	{
+		mLogger.log("ERROR: Cannot send a %1-byte message to channel #%2, the maximum is %3 bytes. Dropping the message.",
+			aMessage.size(), channelID, MAX_FRAGMENTED_MESSAGE_SIZE
+		);
+		return;
+	}
+	assert(channelID < FRAGMENT_FLAG);
+
+	// Split the message into fragments, each a separate frame, so that other channels can interleave.
+	// All the fragments are queued at once, so that another thread's message on the same channel doesn't get
+	// its fragments mixed into this one's:
+	mLogger.log("Sending a %1-byte message to channel #%2 in fragments.", aMessage.size(), channelID);
+	auto fragmentChannelID = static_cast<quint16>(channelID | FRAGMENT_FLAG);
+	std::vector<QByteArray> frames;
+	frames.reserve(static_cast<size_t>((aMessage.size() + 4) / FRAGMENT_DATA_SIZE + 1));
+	int offset = 0;
+	while (offset < aMessage.size())
+	{
+		QByteArray fragment;
+		if (offset == 0)
+		{
+			// The first fragment starts with the total message size:
+			Utils::writeBE32(fragment, static_cast<quint32>(aMessage.size()));
+		}
+		auto numBytes = std::min(aMessage.size() - offset, FRAGMENT_DATA_SIZE - fragment.size());
+		fragment.append(aMessage.constData() + offset, numBytes);
+		offset += numBytes;
+
+		QByteArray frame;
+		frame.reserve(fragment.size() + 4);
+		Utils::writeBE16(frame, fragmentChannelID);
+		Utils::writeBE16Lstring(frame, fragment);
+		frames.push_back(std::move(frame));
+	}
+	queueOutgoingFrames(aChannel, std::move(frames));
+	schedulePumpOutgoing();
+}
+
+
+
+
+
+void Connection::queueOutgoingFrames(Channel & aChannel, std::vector<QByteArray> && aFrames)
+{
+	auto channelID = aChannel.channelID();
+
+	// Account for the queued data:
+	qint64 numBytes = 0;
+	for (const auto & frame: aFrames)
+	{
+		numBytes += frame.size();
+	}
+	auto numBytesQueued = (aChannel.mNumBytesQueued += numBytes);
+	if (numBytesQueued >= aChannel.mSendBudget)
+	{
+		aChannel.mIsOverBudget = true;
+	}
+
+	// Queue the frame:
+	{
+		QMutexLocker lock(&mMtxOutgoing);
+		auto itr = mOutgoingQueues.find(channelID);
+		if (itr == mOutgoingQueues.end())
+		{
+			itr = mOutgoingQueues.emplace(channelID, OutgoingQueue{{}, 0, 0, aChannel.shared_from_this(), false}).first;
+			if (channelID != 0)
+			{
+				mOutgoingRoundRobin.push_back(channelID);
+			}
+		}
+		itr->second.mWeight = weightFromPriority(aChannel.priority());
+		for (auto & frame: aFrames)
+		{
+			itr->second.mFrames.push_back(std::move(frame));
+		}
+	}
+}
+
+
+
+
+
+QByteArray Connection::takeNextOutgoingFrame(ChannelPtr & aChannel)
+{
+	QMutexLocker lock(&mMtxOutgoing);
+
+	// ChannelZero is always served first (and is not subject to the flow control):
+	auto ch0 = mOutgoingQueues.find(0);
+	if (ch0 != mOutgoingQueues.end())
+	{
+		aChannel = ch0->second.mChannel.lock();
+		auto frame = std::move(ch0->second.mFrames.front());
+		ch0->second.mFrames.pop_front();
+		if (ch0->second.mFrames.empty())
+		{
+			mOutgoingQueues.erase(ch0);
+		}
+		return frame;
+	}
+
+	// Deficit Round Robin over the other channels:
+	while (!mOutgoingRoundRobin.empty())
+	{
+		auto channelID = mOutgoingRoundRobin.front();
+		auto itr = mOutgoingQueues.find(channelID);
+		assert(itr != mOutgoingQueues.end());
+		auto & queue = itr->second;
+		auto frameSize = queue.mFrames.front().size();
+		auto channel = queue.mChannel.lock();
+		auto dataSize = frameSize - 4;
+		if ((channel != nullptr) && (channel->mRemoteCredit >= 0) && (channel->mRemoteCredit < dataSize))
+		{
+			// The remote hasn't granted us enough credit for the frame, stall the channel until it does:
+			queue.mIsStalled = true;
+			mOutgoingRoundRobin.pop_front();
+			continue;
+		}
+		if (queue.mDeficit < frameSize)
+		{
+			// The channel has used up its share for this round, give it a new quantum and move on to the next one:
+			queue.mDeficit += DRR_QUANTUM * queue.mWeight;
+			mOutgoingRoundRobin.pop_front();
+			mOutgoingRoundRobin.push_back(channelID);
+			continue;
+		}
+		queue.mDeficit -= frameSize;
+		if ((channel != nullptr) && (channel->mRemoteCredit >= 0))
+		{
+			channel->mRemoteCredit -= dataSize;
+		}
+		aChannel = channel;
+		auto frame = std::move(queue.mFrames.front());
+		queue.mFrames.pop_front();
+		if (queue.mFrames.empty())
+		{
+			// An idle channel doesn't accumulate any deficit:
+			mOutgoingQueues.erase(itr);
+			mOutgoingRoundRobin.pop_front();
+		}
+		return frame;
+	}
+	return QByteArray();
+}
+
+
+
+
+
+Connection::CreditResult Connection::addRemoteCredit(quint16 aChannelID, quint32 aCredit)
 {
-	mLogger.logHex(aMessage, "Sending message to channel #%1", aChannelID);
-	QByteArray buf;
-	Utils::writeBE16(buf, aChannelID);
-	Utils::writeBE16Lstring(buf, aMessage);
+	auto channel = channelByID(aChannelID);
+	if (channel == nullptr)
+	{
+		return crNoSuchChannel;
+	}
+	{
+		QMutexLocker lock(&mMtxOutgoing);
+		if (channel->mRemoteCredit < 0)
+		{
+			// The first window update switches the channel from unlimited to credit-based sending.
+			// With less than a full frame of credit, a large frame would stall the channel forever:
+			if (aCredit < MIN_REMOTE_WINDOW)
+			{
+				return crWindowTooSmall;
+			}
+			channel->mRemoteCredit = 0;
+		}
+		channel->mRemoteCredit += aCredit;
+
+		// If the channel has been stalled, put it back into the scheduling:
+		auto itr = mOutgoingQueues.find(aChannelID);
+		if ((itr != mOutgoingQueues.end()) && itr->second.mIsStalled)
+		{
+			itr->second.mIsStalled = false;
+			mOutgoingRoundRobin.push_back(aChannelID);
+		}
+	}
+	schedulePumpOutgoing();
+	return crAdded;
+}
 
-	// TODO: TLS
 
-	mIO->write(buf);
+
+
+
+void Connection::addRoundtrip(qint64 aRoundtripMsec)
+{
+	QMutexLocker lock(&mMtxStats);
+	mStats.mRoundtrip.add(aRoundtripMsec);
+	mStats.mLastRoundtrip = aRoundtripMsec;
+	mLastRoundtripTimer.start();
+	if (mStats.mSmoothedRoundtrip < 0)
+	{
+		mStats.mSmoothedRoundtrip = aRoundtripMsec;
+	}
+	else
+	{
+		mStats.mSmoothedRoundtrip = (7 * mStats.mSmoothedRoundtrip + aRoundtripMsec) / 8;
+	}
+}
+
+
+
+
+
+void Connection::addFrameStats(quint16 aChannelID, bool aIsOutgoing, int aFrameSize)
+{
+	QMutexLocker lock(&mMtxStats);
+
+	// Fold the finished slice into the recent throughput:
+	if (!mThroughputSliceTimer.isValid())
+	{
+		mThroughputSliceTimer.start();
+	}
+	else if (mThroughputSliceTimer.elapsed() >= THROUGHPUT_SLICE_MSEC)
+	{
+		mStats.mRecentThroughput = foldThroughput(mStats.mRecentThroughput, mThroughputSliceBytes, mThroughputSliceTimer.restart());
+		mThroughputSliceBytes = 0;
+	}
+	mThroughputSliceBytes += static_cast<quint64>(aFrameSize);
+
+	auto & ch = mStats.mChannels[aChannelID];  // Value-initialized (zeroed) if not present yet
+	if (aIsOutgoing)
+	{
+		ch.mNumBytesOut += static_cast<quint64>(aFrameSize);
+		ch.mNumFramesOut += 1;
+	}
+	else
+	{
+		ch.mNumBytesIn += static_cast<quint64>(aFrameSize);
+		ch.mNumFramesIn += 1;
+	}
+}
+
+
+
+
+
+Connection::Stats Connection::stats() const
+{
+	Stats res;
+	{
+		QMutexLocker lock(&mMtxStats);
+		res = mStats;
+		res.mLastRoundtripAge = mLastRoundtripTimer.isValid() ? mLastRoundtripTimer.elapsed() : -1;
+
+		// Include the slice in progress once it is long enough (also decays the throughput of an idle connection):
+		auto sliceMsec = mThroughputSliceTimer.isValid() ? mThroughputSliceTimer.elapsed() : 0;
+		if (sliceMsec >= THROUGHPUT_SLICE_MSEC)
+		{
+			res.mRecentThroughput = foldThroughput(mStats.mRecentThroughput, mThroughputSliceBytes, sliceMsec);
+		}
+		res.mRecentThroughput = std::max<qint64>(res.mRecentThroughput, 0);
+	}
+	res.mUptimeMsec = mUptimeTimer.isValid() ? mUptimeTimer.elapsed() : 0;
+
+	// Fill in the queue depths:
+	QMutexLocker lock(&mMtxOutgoing);
+	for (const auto & queue: mOutgoingQueues)
+	{
+		auto & ch = res.mChannels[queue.first];
+		ch.mNumFramesQueued = static_cast<int>(queue.second.mFrames.size());
+		auto channel = queue.second.mChannel.lock();
+		if (channel != nullptr)
+		{
+			ch.mNumBytesQueued = channel->mNumBytesQueued;
+		}
+	}
+	return res;
+}
+
+
+
+
+
+void Connection::logStats()
+{
+	auto s = stats();
+	mLogger.log("Stats after %1 sec: RTT %2 (smoothed %3 ms); %4 bytes in, %5 bytes out; recent throughput %6 B/sec",
+		s.mUptimeMsec / 1000,
+		s.mRoundtrip.summary(" ms"),
+		s.mSmoothedRoundtrip,
+		s.totalBytesIn(),
+		s.totalBytesOut(),
+		s.mRecentThroughput
+	);
+	for (const auto & ch: s.mChannels)
+	{
+		mLogger.log("  Channel #%1: in %2 bytes / %3 frames, out %4 bytes / %5 frames, queued %6 bytes / %7 frames",
+			ch.first,
+			ch.second.mNumBytesIn, ch.second.mNumFramesIn,
+			ch.second.mNumBytesOut, ch.second.mNumFramesOut,
+			ch.second.mNumBytesQueued, ch.second.mNumFramesQueued
+		);
+	}
+	mLogger.log("  Writes: frames per write: %1; bytes per write: %2",
+		mWriteStats.mFramesPerWrite.summary(),
+		mWriteStats.mBytesPerWrite.summary(" B")
+	);
+}
+
+
+
+
+
+void Connection::queueWrite(const QByteArray & aData)
+{
+	mPendingWrite.append(aData);
+	mNumPendingFrames += 1;
+	if (mPendingWrite.size() >= WRITE_COALESCE_THRESHOLD)
+	{
+		writePending();
+	}
+	else
+	{
+		schedulePumpOutgoing();
+	}
+}
+
+
+
+
+
+void Connection::writePending()
+{
+	if (mPendingWrite.isEmpty())
+	{
+		return;
+	}
+	auto data = std::move(mPendingWrite);
+	mPendingWrite.clear();
+	mWriteStats.mFramesPerWrite.add(mNumPendingFrames);
+	mNumPendingFrames = 0;
+
+	if (mTlsFilter != nullptr)
+	{
+		// On encryption failure the filter has already reported it via failed(), which terminates the connection:
+		data = mTlsFilter->encrypt(data);
+		if (data.isEmpty())
+		{
+			return;
+		}
+	}
+	mWriteStats.mBytesPerWrite.add(data.size());
+	mIO->write(data);
+}
+
+
+
+
+
+void Connection::schedulePumpOutgoing()
+{
+	if (!mIsPumpScheduled.exchange(true))
+	{
+		QMetaObject::invokeMethod(this, "pumpOutgoing", Qt::QueuedConnection);
+	}
 }
 
 
@@ -990,13 +1964,45 @@ void Connection::sendChannelMessage(const quint16 aChannelID, const QByteArray &
 
 void Connection::ioReadyRead()
 {
+	if (mIsProcessingIncomingData)
+	{
+		// A message handler is running a nested event loop and is possibly holding a view into mIncomingData.
+		// Postpone the reading until the current processing finishes:
+		QMetaObject::invokeMethod(this, "ioReadyRead", Qt::QueuedConnection);
+		return;
+	}
+
+	if (mTlsFilter != nullptr)
+	{
+		// Push the raw data into the TLS layer; once handshaken, decrypt directly into the incoming buffer:
+		if (!mTlsFilter->readFrom(*mIO))
+		{
+			mLogger.log("ERROR: Reading from IO failed.");
+			ioClosing();
+			return;
+		}
+		if (!mTlsFilter->hasHandshaken())
+		{
+			// The handshake is progressing in the background, the data will be processed there
+			return;
+		}
+		if (!mTlsFilter->decryptInto(mIncomingData))
+		{
+			terminate();
+			return;
+		}
+		processIncomingData();
+		return;
+	}
+
+	// Read all the available data directly into the incoming buffer:
 	while (true)
 	{
-		char buf[4000];
-		auto numBytes = mIO->read(buf, sizeof(buf));
+		auto dest = mIncomingData.prepareWrite(READ_CHUNK_SIZE);
+		auto numBytes = mIO->read(dest, READ_CHUNK_SIZE);
 		if (numBytes == 0)
 		{
-			return;
+			break;
 		}
 		else if (numBytes < 0)
 		{
@@ -1004,8 +2010,11 @@ void Connection::ioReadyRead()
 			ioClosing();
 			return;
 		}
-		processIncomingData(QByteArray::fromRawData(buf, static_cast<int>(numBytes)));
+		mIncomingData.commitWrite(static_cast<int>(numBytes));
 	}
+
+	// Process the whole burst at once:
+	processIncomingData();
 }
 
 
@@ -1020,4 +2029,101 @@ void Connection::ioClosing()
 
 	// Clear all channels only after notifying "disconnected", in case client has some data in the channels
 	mChannels.clear();
+	mIncomingFragmentedMessages.clear();
+	mNumIncomingFragmentedBytes = 0;
+	mStatsDumpTimer.stop();
+	logStats();
+	mPendingWrite.clear();
+	mNumPendingFrames = 0;
+
+	// Drop all the data that hasn't been sent yet:
+	QMutexLocker lock(&mMtxOutgoing);
+	mOutgoingQueues.clear();
+	mOutgoingRoundRobin.clear();
+}
+
+
+
+
+
+void Connection::pumpOutgoing()
+{
+	// The IO may only be written from its own thread:
+	if (QThread::currentThread() != thread())
+	{
+		schedulePumpOutgoing();
+		return;
+	}
+	mIsPumpScheduled = false;
+	if (mState == csDisconnected)
+	{
+		return;
+	}
+
+	// Keep the IO's write buffer short, so that a new high-priority frame doesn't wait long behind bulk data:
+	while (mIO->bytesToWrite() + mPendingWrite.size() < MAX_IO_WRITE_BUFFER)
+	{
+		ChannelPtr channel;
+		auto frame = takeNextOutgoingFrame(channel);
+		if (frame.isEmpty())
+		{
+			break;
+		}
+		mPendingWrite.append(frame);
+		mNumPendingFrames += 1;
+		addFrameStats(static_cast<quint16>(Utils::readBE16(frame) & ~FRAGMENT_FLAG), true, frame.size());
+		if (mPendingWrite.size() >= WRITE_COALESCE_THRESHOLD)
+		{
+			writePending();
+		}
+
+		// Let the channel's producer continue once the queue drains to half of the budget:
+		if (channel != nullptr)
+		{
+			auto numBytesQueued = (channel->mNumBytesQueued -= frame.size());
+			if (channel->mIsOverBudget && (numBytesQueued <= channel->mSendBudget / 2))
+			{
+				channel->mIsOverBudget = false;
+				emit channel->writable(channel.get());
+			}
+		}
+	}
+	writePending();
+}
+
+
+
+
+
+void Connection::tlsHandshakeCompleted()
+{
+	assert(mState == csTlsHandshaking);
+
+	// Remember that the device supports TLS, so that a cleartext downgrade can be refused next time:
+	mComponents.get<DevicePairings>()->setHasNegotiatedTls(mRemotePublicID.value());
+
+	startMuxedProtocol();
+
+	// Process any data that has arrived after the handshake:
+	ioReadyRead();
+}
+
+
+
+
+
+void Connection::tlsFailed(const QString & aErrorMessage)
+{
+	mLogger.log("ERROR: The TLS layer has failed (%1), aborting connection.", aErrorMessage);
+	terminate();
+}
+
+
+
+
+
+void Connection::tlsOutgoingData(const QByteArray & aData)
+{
+	assert(mPendingWrite.isEmpty());  // No cleartext is sent after stls
+	mIO->write(aData);
 }
@@ -1,11 +1,20 @@
 #pragma once
 
 #include <memory>
+#include <deque>
+#include <map>
+#include <vector>
+#include <atomic>
 #include <QObject>
 #include <QIODevice>
 #include <QMutex>
+#include <QTimer>
+#include <QElapsedTimer>
 #include "../Optional.hpp"
 #include "../ComponentCollection.hpp"
+#include "../LatencyHistogram.hpp"
+#include "ReceiveBuffer.hpp"
+#include "TlsFilter.hpp"
 
 
 
@@ -22,6 +31,7 @@ class ChannelZero;
 A device can utilize multiple connections to the computer. The connections can use different transports
 (TCP, USB, Bluetooth), each transport provides a QIODevice interface for the actual IO.
 The Connection object handles the base protocol (unauthenticated - TLS handshake - TLS muxed).
+The TLS handshake runs in the background (see TlsFilter), so that it doesn't block the thread of the Connection.
 The Connection also provides the transport name and kind that is shown to the user (text + icon).
 Each connection is uniquely identified by its EnumeratorID. */
 class Connection:
@@ -31,6 +41,9 @@ class Connection:
 	using Super = QObject;
 	Q_OBJECT
 
+	// The command channel needs access to the flow control (window updates):
+	friend class ChannelZero;
+
 
 public:
 
@@ -59,11 +72,96 @@ public:
 		csRequestedPairing,  ///< The connection is waiting for pairing in the UI
 		csBlacklisted,       ///< The device's public ID is in the blacklist
 		csDifferentKey,      ///< The device's public key is different from the last time we paired (MITM?)
+		csTlsHandshaking,    ///< The TLS handshake is in progress (in the background)
 		csEncrypted,         ///< The connection is in the encrypted phase
 		csDisconnected,      ///< The connection has been disconnected (but is kept for housekeeping)
 	};
 
 
+	/** The result of applying a window update from the remote, see addRemoteCredit(). */
+	enum CreditResult
+	{
+		crAdded,           ///< The credit has been added to the channel
+		crNoSuchChannel,   ///< There's no such channel (it may have just been closed)
+		crWindowTooSmall,  ///< The initial credit is smaller than MIN_REMOTE_WINDOW, ignored
+	};
+
+
+	/** The minimum initial credit (window) the remote may grant to a channel: the largest frame's data, so that
+	any frame can be sent once the remote returns the credit for the data it has processed. */
+	static const quint32 MIN_REMOTE_WINDOW = 0xffff;
+
+
+	/** The statistics of the coalesced writes to the IO. */
+	struct WriteStats
+	{
+		/** The number of messages / mux frames in each write. */
+		LatencyHistogram mFramesPerWrite;
+
+		/** The number of bytes in each write (after encryption, if using TLS). */
+		LatencyHistogram mBytesPerWrite;
+	};
+
+
+	/** The traffic statistics of a single channel. */
+	struct ChannelStats
+	{
+		/** The amount of data received for the channel, in bytes (incl. the mux frame headers). */
+		quint64 mNumBytesIn;
+
+		/** The number of mux frames received for the channel. */
+		quint64 mNumFramesIn;
+
+		/** The amount of data sent on the channel, in bytes (incl. the mux frame headers). */
+		quint64 mNumBytesOut;
+
+		/** The number of mux frames sent on the channel. */
+		quint64 mNumFramesOut;
+
+		/** The number of frames currently queued for sending on the channel. */
+		int mNumFramesQueued;
+
+		/** The amount of data currently queued for sending on the channel, in bytes. */
+		qint64 mNumBytesQueued;
+	};
+
+
+	/** The latency and throughput statistics of the connection. */
+	struct Stats
+	{
+		/** The roundtrip times measured by the ChannelZero pings, in msec. */
+		LatencyHistogram mRoundtrip;
+
+		/** The most recent roundtrip time, in msec; -1 if none measured yet. */
+		qint64 mLastRoundtrip;
+
+		/** The smoothed roundtrip time (exponential moving average, as in TCP), in msec; -1 if none measured yet. */
+		qint64 mSmoothedRoundtrip;
+
+		/** The time since the most recent roundtrip was measured, in msec; -1 if none measured yet.
+		The pings are sent every second, so a large value means the link is degraded. */
+		qint64 mLastRoundtripAge;
+
+		/** The time since the muxed protocol has started, in msec. */
+		qint64 mUptimeMsec;
+
+		/** The recent throughput (both directions together), in bytes per second: an exponential moving average of
+		the per-slice rates with a time constant of a few seconds, so that it reflects the current state of the link
+		rather than the lifetime average. 0 until the first slice is measured. */
+		qint64 mRecentThroughput;
+
+		/** The per-channel statistics, by ChannelID.
+		Channels that have been closed are kept, so that the totals are preserved. */
+		std::map<quint16, ChannelStats> mChannels;
+
+		/** Returns the total amount of data received over all channels, in bytes. */
+		quint64 totalBytesIn() const;
+
+		/** Returns the total amount of data sent over all channels, in bytes. */
+		quint64 totalBytesOut() const;
+	};
+
+
 	/** Creates a new connection in the csInitial phase.
 	The ConnectionID is used as a unique identifier of the connection, it is assigned by whoever enumerated
 	the connection.
@@ -136,9 +234,26 @@ public:
 		const QByteArray & aServiceInitData = QByteArray()
 	);
 
+	/** Closes the specified channel, previously opened by openChannel().
+	The channel is removed from the connection (and its closed() signal emitted) once the device answers.
+	Returns false if not in csEncrypted or the channel is not open. */
+	bool closeChannel(ChannelPtr aChannel);
+
 	/** Returns the logger used for this connection. */
 	Logger & logger() { return mLogger; }
 
+	/** Returns the statistics of the coalesced writes to the IO.
+	To be used only from the connection's thread. */
+	const WriteStats & writeStats() const { return mWriteStats; }
+
+	/** Returns a snapshot of the connection's latency and throughput statistics.
+	Thread-safe. */
+	Stats stats() const;
+
+	/** Logs the current statistics into the connection's logger.
+	The RTT is logged as the histogram summary (average and percentiles up to p99), plus the smoothed value. */
+	void logStats();
+
 
 protected:
 
@@ -173,9 +288,15 @@ protected:
 	Optional<QByteArray> mRemotePublicKeyData;
 
 	/** Buffer for the unprocessed incoming data.
-	The data is stored here until a full message can be extracted; it is then removed from the buffer.
+	The data is stored here until a full message can be extracted; it is then consumed from the buffer.
+	The messages are parsed in-place, the consumed space is reclaimed once per each processIncomingData() call.
 	If the connection is in the TLS state, the data here is already decrypted. */
-	QByteArray mIncomingData;
+	ReceiveBuffer mIncomingData;
+
+	/** Set to true while processIncomingData() is extracting messages from mIncomingData.
+	Used to detect re-entrancy (a nested event loop in a message handler), during which mIncomingData
+	must not be modified because the handlers are working with views into it. */
+	bool mIsProcessingIncomingData;
 
 	/** True after the initial protocol identification has been received.
 	Used to detect messages sent without proper identification first. */
@@ -188,6 +309,66 @@ protected:
 	No more cleartext messages are allowed to be sent from us. */
 	bool mHasSentStartTls;
 
+	/** A large message being reassembled from its fragments. */
+	struct IncomingFragmentedMessage
+	{
+		/** The message data received so far; grows with each fragment, up to mTotalSize. */
+		QByteArray mData;
+
+		/** The total size of the message, as announced in its first fragment. */
+		int mTotalSize;
+	};
+
+
+	/** The fragmented messages being reassembled, by ChannelID.
+	Only accessed from the connection's thread (processIncomingData()). */
+	std::map<quint16, IncomingFragmentedMessage> mIncomingFragmentedMessages;
+
+	/** The total number of bytes in mIncomingFragmentedMessages, capped by MAX_FRAGMENTED_BYTES_IN_FLIGHT.
+	Only accessed from the connection's thread (processIncomingData()). */
+	int mNumIncomingFragmentedBytes;
+
+	/** The TLS layer between mIO and the muxed protocol.
+	Created when the StartTls is processed, if the remote supports TLS (protocol version 2+).
+	If nullptr in the csEncrypted state, the remote is an old version that uses the muxed protocol in cleartext. */
+	std::unique_ptr<TlsFilter> mTlsFilter;
+
+	/** The outgoing mux frames of a single channel, waiting to be written to mIO. */
+	struct OutgoingQueue
+	{
+		/** The serialized frames (header + data, not encrypted yet), in the order in which they are to be sent. */
+		std::deque<QByteArray> mFrames;
+
+		/** The scheduling weight of the channel, derived from its priority. */
+		int mWeight;
+
+		/** The deficit counter of the Deficit Round Robin scheduling, in bytes. */
+		int mDeficit;
+
+		/** The channel to which the frames belong, for the flow control accounting. */
+		std::weak_ptr<Channel> mChannel;
+
+		/** Set to true when the channel has run out of the remote's credit.
+		A stalled queue is not in mOutgoingRoundRobin until the remote grants more credit. */
+		bool mIsStalled;
+	};
+
+
+	/** The queues of the outgoing mux frames, by ChannelID. Only channels with frames waiting have a queue.
+	ChannelZero's frames are always sent first, the other channels are scheduled using Deficit Round Robin,
+	weighted by their priorities.
+	Protected against multithreaded access by mMtxOutgoing. */
+	std::map<quint16, OutgoingQueue> mOutgoingQueues;
+
+	/** The IDs of the channels (except ChannelZero and stalled ones) with frames waiting in mOutgoingQueues,
+	in the DRR service order.
+	Protected against multithreaded access by mMtxOutgoing. */
+	std::deque<quint16> mOutgoingRoundRobin;
+
+	/** The mutex protecting mOutgoingQueues, mOutgoingRoundRobin and the channels' remote credit against
+	multithreaded access. */
+	QMutex mMtxOutgoing;
+
 	/** Channels that have been opened on the csEncrypted connection.
 	Protected against multithreaded access by mMtxChannels. */
 	std::map<quint16, ChannelPtr> mChannels;
@@ -195,6 +376,47 @@ protected:
 	/** The mutex protecting mChannels against multithreaded access. */
 	QMutex mMtxChannels;
 
+	/** The data to be written to mIO in the next coalesced write.
+	Contains either cleartext messages, or mux frames not yet encrypted (the whole batch is encrypted at once).
+	Only accessed from the connection's thread. */
+	QByteArray mPendingWrite;
+
+	/** The number of messages / frames in mPendingWrite, for the statistics. */
+	int mNumPendingFrames;
+
+	/** Set to true when pumpOutgoing() has been queued for the next event loop iteration, so that it isn't
+	queued multiple times. */
+	std::atomic<bool> mIsPumpScheduled;
+
+	/** The statistics of the coalesced writes. */
+	WriteStats mWriteStats;
+
+	/** The latency and throughput statistics (the queue depths are filled in only when queried).
+	Protected against multithreaded access by mMtxStats. */
+	Stats mStats;
+
+	/** The mutex protecting mStats against multithreaded access. */
+	mutable QMutex mMtxStats;
+
+	/** Measures the time since the muxed protocol has started, for mStats' mUptimeMsec. */
+	QElapsedTimer mUptimeTimer;
+
+	/** Measures the time since the last roundtrip was measured, for mStats' mLastRoundtripAge.
+	Protected against multithreaded access by mMtxStats. */
+	QElapsedTimer mLastRoundtripTimer;
+
+	/** Measures the current slice of the recent throughput (mStats' mRecentThroughput).
+	Protected against multithreaded access by mMtxStats. */
+	QElapsedTimer mThroughputSliceTimer;
+
+	/** The number of bytes transferred (both directions) in the current slice of the recent throughput.
+	Protected against multithreaded access by mMtxStats. */
+	quint64 mThroughputSliceBytes;
+
+	/** The timer for the periodic dumps of the statistics into the log.
+	Only started if enabled in the Settings. */
+	QTimer mStatsDumpTimer;
+
 	/** The logger used for all messages produced by this class. */
 	Logger & mLogger;
 
@@ -209,9 +431,10 @@ protected:
 	Emits the stateChanged signal. */
 	void setState(State aNewState);
 
-	/** Processes the incoming data.
-	Based on the current protocol state, handles the data as cleartext or TLSMux. */
-	void processIncomingData(const QByteArray & aData);
+	/** Processes the data accumulated in mIncomingData.
+	Extracts all complete messages, handling each one as cleartext or TLSMux based on the current protocol
+	state (which may change between messages, such as after "stls"), then compacts the buffer. */
+	void processIncomingData();
 
 	/** Extracts a complete cleartext protocol message from mIncomingData, and acts on it.
 	Returns true if a complete message was extracted, false if there's no complete message. */
@@ -227,6 +450,14 @@ protected:
 	If the protocol has been violated (missing id / key), the connection terminates. */
 	void handleCleartextMessageStls();
 
+	/** Creates the TLS filter for the remote, starts its handshake and hands it the already received data.
+	If the local keys for the remote are not available, terminates the connection. */
+	void startTls();
+
+	/** Sets up the command channel and switches to the muxed protocol (csEncrypted).
+	Emits the established() signal. */
+	void startMuxedProtocol();
+
 	/** Sends the specified message over to the remote peer. */
 	void sendCleartextMessage(quint32 aMsgType, const QByteArray & aMsg = QByteArray());
 
@@ -234,6 +465,11 @@ protected:
 	Returns true if a complete message was extracted, false if there's no complete message. */
 	bool extractAndHandleMuxMessage();
 
+	/** Handles a single fragment frame of a large message for the specified channel.
+	Once the whole message is reassembled, passes it to the channel.
+	Terminates the connection on protocol violations. */
+	void handleMuxFragment(quint16 aChannelID, const QByteArray & aFragmentData);
+
 	/** Returns the channel identified by its ID, or nullptr if no such channel. */
 	ChannelPtr channelByID(quint16 aChannelID);
 
@@ -244,10 +480,56 @@ protected:
 	/** Adds the specified channel to our internal channel map. */
 	void addChannel(const quint16 aChannelID, ChannelPtr aChannel);
 
-	/** Sends the specified message through the connection to the remote channel specified.
-	Asserts that the connection is csEncrypted.
+	/** Removes the specified channel from our internal channel map, marks it as closed and emits its closed() signal.
+	Called by ChannelZero once the remote has answered the close request. */
+	void removeChannel(ChannelPtr aChannel);
+
+	/** Queues the specified message to be sent through the connection to the specified channel.
+	The message is sent when the scheduler decides it's the channel's turn (based on its priority) and the IO
+	write buffer has room.
+	Messages too large for a single mux frame are split into fragments (if the remote supports them),
+	so that the other channels' data can be sent between the fragments. Messages over
+	MAX_FRAGMENTED_MESSAGE_SIZE are dropped (and logged).
 	To be used from Channel::sendMessage() only. */
-	void sendChannelMessage(const quint16 aChannelID, const QByteArray & aMessage);
+	void sendChannelMessage(Channel & aChannel, const QByteArray & aMessage);
+
+	/** Puts the specified serialized mux frames into the channel's outgoing queue, and accounts for them
+	in the channel's flow control. The frames are queued under a single lock, so the fragments of a message
+	stay together even if other threads send on the same channel. */
+	void queueOutgoingFrames(Channel & aChannel, std::vector<QByteArray> && aFrames);
+
+	/** Returns the next frame to be written to mIO according to the channels' priorities and the remote's
+	credit, and removes it from its queue. Also returns the frame's channel in aChannel.
+	Returns an empty array if no frames can be sent now. */
+	QByteArray takeNextOutgoingFrame(ChannelPtr & aChannel);
+
+	/** Adds the specified credit (number of data bytes we may send) to the specified channel.
+	The first credit received for a channel switches it from unlimited sending to credit-based; it needs to be at
+	least MIN_REMOTE_WINDOW, otherwise the largest frames could never be sent. A smaller initial credit is rejected
+	and the channel stays unlimited.
+	Called by ChannelZero when the remote sends a window update. */
+	CreditResult addRemoteCredit(quint16 aChannelID, quint32 aCredit);
+
+	/** Adds the specified data (a cleartext message or a mux frame) to the pending coalesced write.
+	Writes the pending data right away if it has grown over the threshold, otherwise schedules the write
+	for the next event loop iteration. */
+	void queueWrite(const QByteArray & aData);
+
+	/** Records the specified ping roundtrip time, in msec, in the statistics.
+	Called by ChannelZero. */
+	void addRoundtrip(qint64 aRoundtripMsec);
+
+	/** Records an incoming (aIsOutgoing == false) or outgoing (aIsOutgoing == true) frame of the specified size
+	on the specified channel in the statistics. */
+	void addFrameStats(quint16 aChannelID, bool aIsOutgoing, int aFrameSize);
+
+	/** Writes all the pending data to mIO in a single write, encrypting it first if using TLS. */
+	void writePending();
+
+	/** Queues pumpOutgoing() to be called in the next event loop iteration, unless already queued.
+	This is what coalesces the messages sent in a single event loop iteration into a single write.
+	Thread-safe. */
+	void schedulePumpOutgoing();
 
 
 signals:
@@ -302,6 +584,20 @@ private slots:
 
 	/** The mIO is closing. */
 	void ioClosing();
+
+	/** Writes the queued outgoing frames to mIO, as long as its write buffer is not over the limit.
+	Consecutive frames are coalesced into a single write.
+	Called in the event loop iteration after new frames are queued and whenever mIO has written some data. */
+	void pumpOutgoing();
+
+	/** The TLS handshake has completed, start the muxed protocol. */
+	void tlsHandshakeCompleted();
+
+	/** The TLS layer has failed, terminate the connection. */
+	void tlsFailed(const QString & aErrorMessage);
+
+	/** The TLS layer has produced handshake data to be sent to the remote. */
+	void tlsOutgoingData(const QByteArray & aData);
 };
 
 using ConnectionPtr = std::shared_ptr<Connection>;
@@ -327,6 +623,24 @@ public:
 	// Allow the control channel full access to this object (for opening and closing purposes):
 	friend class ChannelZero;
 
+	// Allow the connection to do the flow control accounting:
+	friend class Connection;
+
+
+	/** The scheduling priority of the channel's outgoing data.
+	When multiple channels have data to send, each gets a share of the bandwidth based on its priority. */
+	enum Priority
+	{
+		prBulk,         ///< Background transfers (files, media), served with the lowest weight
+		prNormal,       ///< Regular channels
+		prInteractive,  ///< Channels whose latency is directly visible to the user
+		prControl,      ///< ChannelZero only; always sent before any other channel's data
+	};
+
+
+	/** The default budget of the outgoing data queued for a single channel, in bytes. */
+	static const qint64 DEFAULT_SEND_BUDGET = 256 * 1024;
+
 
 	/** Basic error codes */
 	enum
@@ -339,6 +653,8 @@ public:
 		ERR_NOT_YET = 6,
 		ERR_NO_REQUEST_ID = 7,   ///> Internal comm error: There is no free RequestID to send this request (Ch0)
 		ERR_DISCONNECTED = 8,    ///> Internal comm error: The connection has been disconnected
+		ERR_TIMEOUT = 9,         ///> Internal comm error: The remote hasn't answered the request in time (Ch0)
+		ERR_WINDOW_TOO_SMALL = 10,  ///> The initial window in a window update is smaller than a single frame
 	};
 
 
@@ -349,12 +665,35 @@ public:
 	Connection & connection() const { return mConnection; }
 	quint16 channelID() const { return mChannelID; }
 	bool isOpen() const { return mIsOpen; }
+	Priority priority() const { return mPriority; }
+
+	/** Sets the scheduling priority of the channel's outgoing data.
+	Affects the data queued after the call. */
+	void setPriority(Priority aPriority) { mPriority = aPriority; }
+
+	/** Returns true if the channel's outgoing data queued in the connection is under the channel's budget.
+	Producers of large amounts of data should check this before each sendMessage() and, when false,
+	wait for the writable() signal before sending more. sendMessage() still queues the data when over
+	the budget, but then the memory use is not bounded. */
+	bool canSend() const { return (mNumBytesQueued < mSendBudget); }
+
+	/** Returns the number of bytes of the channel's outgoing data queued in the connection. */
+	qint64 numBytesQueued() const { return mNumBytesQueued; }
+
+	/** Returns the budget of the channel's outgoing data queued in the connection, in bytes. */
+	qint64 sendBudget() const { return mSendBudget; }
+
+	/** Sets the budget of the channel's outgoing data queued in the connection, in bytes. */
+	void setSendBudget(qint64 aNumBytes) { mSendBudget = aNumBytes; }
 
 	/** Called by the parent connection when a new message arrives for the channel from the device.
-	Descendants use this to implement the receiving side of the protocol. */
+	Descendants use this to implement the receiving side of the protocol.
+	Note that aMessage is a non-owning view into the connection's incoming buffer, valid only for the
+	duration of this call; descendants that need to keep (parts of) the data need to make a deep copy. */
 	virtual void processIncomingMessage(const QByteArray & aMessage) = 0;
 
 	/** Sends the specified message through the connection to the device.
+	The message can be of any size; large messages are transparently fragmented by the connection.
 	Asserts that the connection has been actually opened (mIsOpen). */
 	void sendMessage(const QByteArray & aMessage);
 
@@ -371,6 +710,23 @@ protected:
 	Sending data on a non-open channel is a program logic error and will be caught in sendMessage(). */
 	bool mIsOpen;
 
+	/** The scheduling priority of the channel's outgoing data. */
+	Priority mPriority;
+
+	/** The number of bytes of the channel's outgoing data queued in the connection (incl. the mux headers). */
+	std::atomic<qint64> mNumBytesQueued;
+
+	/** The budget for mNumBytesQueued, see canSend(). */
+	std::atomic<qint64> mSendBudget;
+
+	/** Set to true when mNumBytesQueued goes over the budget; writable() is emitted when it drops to half. */
+	std::atomic<bool> mIsOverBudget;
+
+	/** The number of data bytes that the remote allows us to send on this channel,
+	or -1 for unlimited (until the remote sends its first window update for the channel).
+	Protected against multithreaded access by the connection's mMtxOutgoing. */
+	qint64 mRemoteCredit;
+
 
 signals:
 
@@ -382,4 +738,8 @@ signals:
 
 	/** The channel has failed to open on the device. */
 	void failed(Channel * aSelf, const quint16 aErrorCode, const QByteArray & aErrorMessage);
+
+	/** The channel's outgoing data queued in the connection has dropped to half of the budget,
+	after having been over the budget. The producer can continue sending. */
+	void writable(Channel * aSelf);
 };
@@ -63,6 +63,23 @@ ConnectionPtr ConnectionMgr::connectionFromID(const QByteArray & aConnectionID)
 
 
 
+std::map<QByteArray, Connection::Stats> ConnectionMgr::connectionStats() const
+{
+	std::map<QByteArray, Connection::Stats> res;
+	for (const auto & conn: connections())
+	{
+		if (conn->state() == Connection::csEncrypted)
+		{
+			res[conn->connectionID()] = conn->stats();
+		}
+	}
+	return res;
+}
+
+
+
+
+
 void ConnectionMgr::stop()
 {
 	mLogger.log("Terminating all connections...");
@@ -106,6 +123,7 @@ DetectedDevices::Device::Status ConnectionMgr::deviceStatusFromConnection(const
 		case Connection::csRequestedPairing: return DetectedDevices::Device::dsNeedPairing;
 		case Connection::csBlacklisted:      return DetectedDevices::Device::dsBlacklisted;
 		case Connection::csDifferentKey:     return DetectedDevices::Device::dsNeedPairing;
+		case Connection::csTlsHandshaking:   return DetectedDevices::Device::dsConnecting;
 		case Connection::csEncrypted:        return DetectedDevices::Device::dsOnline;
 		case Connection::csDisconnected:     return DetectedDevices::Device::dsOffline;
 	}
@@ -6,6 +6,7 @@
 
 #include <memory>
 #include <vector>
+#include <map>
 #include <QObject>
 #include <QMutex>
 #include "../ComponentCollection.hpp"
@@ -48,6 +49,10 @@ public:
 	Returns nullptr if there's no such connection. */
 	ConnectionPtr connectionFromID(const QByteArray & aConnectionID);
 
+	/** Returns a snapshot of the latency and throughput statistics of all the established connections,
+	by their ConnectionID. */
+	std::map<QByteArray, Connection::Stats> connectionStats() const;
+
 	/** Disconnects all connections. */
 	void stop();
 
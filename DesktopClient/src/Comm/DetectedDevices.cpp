@@ -2,6 +2,15 @@
 #include <cassert>
 #include <set>
 #include <QDebug>
+#include "FramebufferConverter.hpp"
+#include "../BackgroundTasks.hpp"
+
+
+
+
+
+/** The maximum size of the avatar thumbnails, in pixels (both width and height). */
+static const int AVATAR_MAX_SIZE = 128;
 
 
 
@@ -30,6 +39,7 @@ DetectedDevices::Device::Device(
 
 DetectedDevices::DetectedDevices(ComponentCollection & aComponents):
 	ComponentSuper(aComponents),
+	mLastAvatarSeq(0),
 	mLogger(aComponents.logger("DetectedDevices"))
 {
 
@@ -88,6 +98,7 @@ void DetectedDevices::delDevice(const QByteArray & aEnumeratorDeviceID)
 		}
 		auto dev = itr->second;
 		mDevices.erase(itr);
+		mAvatarUpdates.erase(aEnumeratorDeviceID);  // Any pending thumbnail job will be dropped as stale
 		lock.unlock();
 		emit deviceRemoved(dev);
 		return;
@@ -138,21 +149,7 @@ void DetectedDevices::setDeviceName(const QByteArray & aEnumeratorDeviceID, cons
 
 void DetectedDevices::setDeviceAvatar(const QByteArray & aEnumeratorDeviceID, const QImage & aAvatar)
 {
-	mLogger.log("Device id %1 is changing its avatar.", aEnumeratorDeviceID);
-	QMutexLocker lock(&mtxDevices);
-	for (auto & devEntry: mDevices)
-	{
-		if (devEntry.first.second != aEnumeratorDeviceID)
-		{
-			continue;
-		}
-		devEntry.second->setAvatar(aAvatar);
-		lock.unlock();
-		emit deviceAvatarChanged(devEntry.second);
-		return;
-	}
-
-	mLogger.log("Device %1 not found.", aEnumeratorDeviceID);
+	enqueueAvatarThumbnail(aEnumeratorDeviceID, [aAvatar]() { return aAvatar; });
 }
 
 
@@ -161,13 +158,7 @@ void DetectedDevices::setDeviceAvatar(const QByteArray & aEnumeratorDeviceID, co
 
 void DetectedDevices::setDeviceAvatar(const QByteArray & aEnumeratorDeviceID, const QByteArray & aAvatarImgData)
 {
-	auto avatar = QImage::fromData(aAvatarImgData);
-	if (avatar.isNull())
-	{
-		mLogger.log("Avatar data cannot be decoded into an image for device %1.", aEnumeratorDeviceID);
-		return;
-	}
-	setDeviceAvatar(aEnumeratorDeviceID, avatar);
+	enqueueAvatarThumbnail(aEnumeratorDeviceID, [aAvatarImgData]() { return QImage::fromData(aAvatarImgData); });
 }
 
 
@@ -234,3 +225,88 @@ std::map<QByteArray, DetectedDevices::DevicePtr> DetectedDevices::allEnumeratorD
 	}
 	return res;
 }
+
+
+
+
+
+bool DetectedDevices::hasPendingAvatar(const QByteArray & aEnumeratorDeviceID) const
+{
+	QMutexLocker lock(&mtxDevices);
+	auto itr = mAvatarUpdates.find(aEnumeratorDeviceID);
+	return ((itr != mAvatarUpdates.cend()) && itr->second.mIsPending);
+}
+
+
+
+
+
+void DetectedDevices::enqueueAvatarThumbnail(const QByteArray & aEnumeratorDeviceID, std::function<QImage()> aLoadAvatar)
+{
+	auto seq = beginAvatarUpdate(aEnumeratorDeviceID);
+	mLogger.log("Device id %1 is changing its avatar (update %2).", aEnumeratorDeviceID, seq);
+	BackgroundTasks::enqueue(tr("Avatar thumbnail for %1").arg(QString::fromUtf8(aEnumeratorDeviceID)),
+		[this, aEnumeratorDeviceID, seq, aLoadAvatar]()
+		{
+			auto avatar = aLoadAvatar();
+			if (avatar.isNull())
+			{
+				mLogger.log("Avatar data cannot be decoded into an image for device %1.", aEnumeratorDeviceID);
+				storeDeviceAvatar(aEnumeratorDeviceID, seq, QImage());
+				return;
+			}
+			storeDeviceAvatar(
+				aEnumeratorDeviceID,
+				seq,
+				FramebufferConverter::thumbnail(avatar, QSize(AVATAR_MAX_SIZE, AVATAR_MAX_SIZE))
+			);
+		}
+	);
+}
+
+
+
+
+
+quint64 DetectedDevices::beginAvatarUpdate(const QByteArray & aEnumeratorDeviceID)
+{
+	QMutexLocker lock(&mtxDevices);
+	mLastAvatarSeq += 1;
+	auto & updates = mAvatarUpdates[aEnumeratorDeviceID];
+	updates.mLatestSeq = mLastAvatarSeq;
+	updates.mIsPending = true;
+	return mLastAvatarSeq;
+}
+
+
+
+
+
+void DetectedDevices::storeDeviceAvatar(const QByteArray & aEnumeratorDeviceID, quint64 aSeq, const QImage & aThumbnail)
+{
+	QMutexLocker lock(&mtxDevices);
+	auto updItr = mAvatarUpdates.find(aEnumeratorDeviceID);
+	if ((updItr == mAvatarUpdates.end()) || (updItr->second.mLatestSeq != aSeq))
+	{
+		mLogger.log("Avatar update %1 for device %2 has been superseded, dropping it.", aSeq, aEnumeratorDeviceID);
+		return;
+	}
+	updItr->second.mIsPending = false;
+	if (aThumbnail.isNull())
+	{
+		return;
+	}
+	for (auto & devEntry: mDevices)
+	{
+		if (devEntry.first.second != aEnumeratorDeviceID)
+		{
+			continue;
+		}
+		devEntry.second->setAvatar(aThumbnail);
+		lock.unlock();
+		emit deviceAvatarChanged(devEntry.second);
+		return;
+	}
+
+	mLogger.log("Device %1 not found, dropping its avatar.", aEnumeratorDeviceID);
+}
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <functional>
+#include <map>
 #include <memory>
 #include <QAbstractTableModel>
 #include <QImage>
@@ -42,6 +44,7 @@ public:
 			dsOffline,       ///< The device is known but unavailable (ADB bootloader, ...)
 			dsNeedApp,       ///< The app is not installed on the device (ADB)
 			dsFailed,        ///< The device failed to connect properly, unknown reason (eg. ADB port-reversing failed)
+			dsConnecting,    ///< The device is paired and its connection is being set up (TLS handshake)
 		};
 
 		Device(ComponentCollection::ComponentKind aEnumeratorKind, const QByteArray & aEnumeratorDeviceID, Status aStatus);
@@ -113,10 +116,13 @@ public:
 	void setDeviceName(const QByteArray & aEnumeratorDeviceID, const QString & aName);
 
 	/** Updates the avatar for the specified device.
-	Ignored if such a device doesn't exist. */
+	The image (typically a full-resolution screenshot) is downscaled into a thumbnail in BackgroundTasks,
+	only the thumbnail is stored in the device, the full image is dropped.
+	Ignored if such a device doesn't exist (by the time the thumbnail is ready). */
 	void setDeviceAvatar(const QByteArray & aEnumeratorDeviceID, const QImage & aAvatar);
 
 	/** Updates the avatar for the specified device, based on the binary avatar data (JPG or PNG).
+	The data is decoded and downscaled into a thumbnail in BackgroundTasks.
 	Ignored if such a device doesn't exist, or if the avatar data cannot be decoded into an image. */
 	void setDeviceAvatar(const QByteArray & aEnumeratorDeviceID, const QByteArray & aAvatarImgData);
 
@@ -131,6 +137,10 @@ public:
 	/** Returns all of the devices currently tracked by the specified enumerator. */
 	std::map<QByteArray, DevicePtr> allEnumeratorDevices(ComponentCollection::ComponentKind aEnumeratorKind) const;
 
+	/** Returns true if the latest avatar update for the specified device is still being processed
+	(its thumbnail job hasn't finished yet). */
+	bool hasPendingAvatar(const QByteArray & aEnumeratorDeviceID) const;
+
 
 Q_SIGNALS:
 
@@ -152,14 +162,50 @@ Q_SIGNALS:
 
 protected:
 
+	/** The state of the avatar updates of a single device. */
+	struct AvatarUpdates
+	{
+		/** The sequence number of the latest avatar update; results of the older updates are stale. */
+		quint64 mLatestSeq;
+
+		/** True if the thumbnail job of the latest update hasn't finished yet. */
+		bool mIsPending;
+	};
+
+
 	/** The mutex protecting mDevices against multithreaded access. */
 	mutable QRecursiveMutex mtxDevices;
 
 	/** All the devices, in no particular order, protected by mMtxDevices. */
 	DevicePtrMap mDevices;
 
+	/** The avatar updates of each device, by its enumerator ID, protected by mMtxDevices.
+	The thumbnail jobs may finish out of order, only the result of the latest update is stored. */
+	std::map<QByteArray, AvatarUpdates> mAvatarUpdates;
+
+	/** The sequence number of the latest avatar update of any device, protected by mMtxDevices.
+	Shared by all devices and never reset, so that a job started before a device was removed cannot match
+	an update of the device after it is re-added. */
+	quint64 mLastAvatarSeq;
+
 	/** The logger used for all messages produced by this class. */
 	Logger & mLogger;
+
+
+	/** Starts a new avatar update for the specified device and enqueues its thumbnail job into BackgroundTasks.
+	The job calls aLoadAvatar to get the full-size avatar (decoding it, if needed; a null image if it cannot be
+	decoded), downscales it and passes the thumbnail to storeDeviceAvatar(). */
+	void enqueueAvatarThumbnail(const QByteArray & aEnumeratorDeviceID, std::function<QImage()> aLoadAvatar);
+
+	/** Starts a new avatar update for the specified device; returns its sequence number (see mLastAvatarSeq).
+	The update is pending until its result is passed to storeDeviceAvatar(). */
+	quint64 beginAvatarUpdate(const QByteArray & aEnumeratorDeviceID);
+
+	/** Stores the (already downscaled) avatar thumbnail in the specified device and emits deviceAvatarChanged().
+	aSeq is the sequence number returned by beginAvatarUpdate() for this update; the thumbnail is dropped if a newer
+	update has been started since. A null thumbnail (the avatar couldn't be decoded) only finishes the update.
+	Ignored if such a device doesn't exist. */
+	void storeDeviceAvatar(const QByteArray & aEnumeratorDeviceID, quint64 aSeq, const QImage & aThumbnail);
 };
 
 Q_DECLARE_METATYPE(DetectedDevices::DevicePtr);
@@ -0,0 +1,467 @@
+#include "FramebufferConverter.hpp"
+#include <cassert>
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__SSE2__)
+	#define FRAMEBUFFER_CONVERTER_X86
+	#include <emmintrin.h>
+	#include <immintrin.h>
+	#if defined(_MSC_VER)
+		#include <intrin.h>
+		#define TARGET_AVX2
+	#else
+		#define TARGET_AVX2 __attribute__((target("avx2")))
+	#endif
+#endif
+
+
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Scalar kernels:
+
+static void rgba8888ToRgb32Scalar(const uint8_t * aSrc, int aNumPixels, QRgb * aDst)
+{
+	for (int i = 0; i < aNumPixels; ++i)
+	{
+		aDst[i] = 0xff000000u | (static_cast<uint32_t>(aSrc[0]) << 16) | (static_cast<uint32_t>(aSrc[1]) << 8) | aSrc[2];
+		aSrc += 4;
+	}
+}
+
+
+
+
+
+static void bgra8888ToRgb32Scalar(const uint8_t * aSrc, int aNumPixels, QRgb * aDst)
+{
+	for (int i = 0; i < aNumPixels; ++i)
+	{
+		aDst[i] = 0xff000000u | (static_cast<uint32_t>(aSrc[2]) << 16) | (static_cast<uint32_t>(aSrc[1]) << 8) | aSrc[0];
+		aSrc += 4;
+	}
+}
+
+
+
+
+
+static void rgb565ToRgb32Scalar(const uint8_t * aSrc, int aNumPixels, QRgb * aDst)
+{
+	for (int i = 0; i < aNumPixels; ++i)
+	{
+		auto pixel = static_cast<uint32_t>(aSrc[0]) | (static_cast<uint32_t>(aSrc[1]) << 8);
+		auto r = pixel >> 11;
+		auto g = (pixel >> 5) & 0x3f;
+		auto b = pixel & 0x1f;
+		r = (r << 3) | (r >> 2);
+		g = (g << 2) | (g >> 4);
+		b = (b << 3) | (b >> 2);
+		aDst[i] = 0xff000000u | (r << 16) | (g << 8) | b;
+		aSrc += 2;
+	}
+}
+
+
+
+
+
+#ifdef FRAMEBUFFER_CONVERTER_X86
+
+////////////////////////////////////////////////////////////////////////////////
+// SSE2 kernels (SSE2 is always available on x86-64):
+
+static void rgba8888ToRgb32Sse2(const uint8_t * aSrc, int aNumPixels, QRgb * aDst)
+{
+	const auto alpha = _mm_set1_epi32(static_cast<int>(0xff000000u));
+	const auto maskRB = _mm_set1_epi32(0x00ff00ff);
+	const auto maskG = _mm_set1_epi32(0x0000ff00);
+	int i = 0;
+	for (; i + 4 <= aNumPixels; i += 4)
+	{
+		// Swap the R and B bytes by swapping the 16-bit halves of the R_B_ part, keep G, force alpha:
+		auto v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(aSrc + 4 * i));
+		auto rb = _mm_and_si128(v, maskRB);
+		rb = _mm_or_si128(_mm_slli_epi32(rb, 16), _mm_srli_epi32(rb, 16));
+		auto res = _mm_or_si128(_mm_or_si128(rb, _mm_and_si128(v, maskG)), alpha);
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(aDst + i), res);
+	}
+	rgba8888ToRgb32Scalar(aSrc + 4 * i, aNumPixels - i, aDst + i);
+}
+
+
+
+
+
+static void bgra8888ToRgb32Sse2(const uint8_t * aSrc, int aNumPixels, QRgb * aDst)
+{
+	const auto alpha = _mm_set1_epi32(static_cast<int>(0xff000000u));
+	int i = 0;
+	for (; i + 4 <= aNumPixels; i += 4)
+	{
+		// The memory layout is already the same as RGB32 on LE, only force the alpha:
+		auto v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(aSrc + 4 * i));
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(aDst + i), _mm_or_si128(v, alpha));
+	}
+	bgra8888ToRgb32Scalar(aSrc + 4 * i, aNumPixels - i, aDst + i);
+}
+
+
+
+
+
+static void rgb565ToRgb32Sse2(const uint8_t * aSrc, int aNumPixels, QRgb * aDst)
+{
+	const auto mask5 = _mm_set1_epi16(0x1f);
+	const auto mask6 = _mm_set1_epi16(0x3f);
+	const auto alpha = _mm_set1_epi16(static_cast<short>(0xff00));
+	int i = 0;
+	for (; i + 8 <= aNumPixels; i += 8)
+	{
+		// Expand the channels to 8 bits in 16-bit lanes:
+		auto p = _mm_loadu_si128(reinterpret_cast<const __m128i *>(aSrc + 2 * i));
+		auto r = _mm_srli_epi16(p, 11);
+		auto g = _mm_and_si128(_mm_srli_epi16(p, 5), mask6);
+		auto b = _mm_and_si128(p, mask5);
+		r = _mm_or_si128(_mm_slli_epi16(r, 3), _mm_srli_epi16(r, 2));
+		g = _mm_or_si128(_mm_slli_epi16(g, 2), _mm_srli_epi16(g, 4));
+		b = _mm_or_si128(_mm_slli_epi16(b, 3), _mm_srli_epi16(b, 2));
+
+		// Interleave the GB and AR 16-bit halves into 32-bit ARGB pixels:
+		auto gb = _mm_or_si128(_mm_slli_epi16(g, 8), b);
+		auto ar = _mm_or_si128(alpha, r);
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(aDst + i),     _mm_unpacklo_epi16(gb, ar));
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(aDst + i + 4), _mm_unpackhi_epi16(gb, ar));
+	}
+	rgb565ToRgb32Scalar(aSrc + 2 * i, aNumPixels - i, aDst + i);
+}
+
+
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+// AVX2 kernels (used only if the CPU supports AVX2):
+
+TARGET_AVX2 static void rgba8888ToRgb32Avx2(const uint8_t * aSrc, int aNumPixels, QRgb * aDst)
+{
+	const auto alpha = _mm256_set1_epi32(static_cast<int>(0xff000000u));
+	const auto shuffle = _mm256_setr_epi8(
+		2, 1, 0, 3,  6, 5, 4, 7,  10, 9, 8, 11,  14, 13, 12, 15,
+		2, 1, 0, 3,  6, 5, 4, 7,  10, 9, 8, 11,  14, 13, 12, 15
+	);
+	int i = 0;
+	for (; i + 8 <= aNumPixels; i += 8)
+	{
+		auto v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(aSrc + 4 * i));
+		auto res = _mm256_or_si256(_mm256_shuffle_epi8(v, shuffle), alpha);
+		_mm256_storeu_si256(reinterpret_cast<__m256i *>(aDst + i), res);
+	}
+	rgba8888ToRgb32Scalar(aSrc + 4 * i, aNumPixels - i, aDst + i);
+}
+
+
+
+
+
+TARGET_AVX2 static void bgra8888ToRgb32Avx2(const uint8_t * aSrc, int aNumPixels, QRgb * aDst)
+{
+	const auto alpha = _mm256_set1_epi32(static_cast<int>(0xff000000u));
+	int i = 0;
+	for (; i + 8 <= aNumPixels; i += 8)
+	{
+		auto v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(aSrc + 4 * i));
+		_mm256_storeu_si256(reinterpret_cast<__m256i *>(aDst + i), _mm256_or_si256(v, alpha));
+	}
+	bgra8888ToRgb32Scalar(aSrc + 4 * i, aNumPixels - i, aDst + i);
+}
+
+
+
+
+
+TARGET_AVX2 static void rgb565ToRgb32Avx2(const uint8_t * aSrc, int aNumPixels, QRgb * aDst)
+{
+	const auto mask5 = _mm256_set1_epi16(0x1f);
+	const auto mask6 = _mm256_set1_epi16(0x3f);
+	const auto alpha = _mm256_set1_epi16(static_cast<short>(0xff00));
+	int i = 0;
+	for (; i + 16 <= aNumPixels; i += 16)
+	{
+		// The unpacks below work within the 128-bit lanes; reorder the 64-bit quads (pixels 0-3, 8-11 | 4-7, 12-15)
+		// so that the results come out in order:
+		auto p = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(aSrc + 2 * i));
+		p = _mm256_permute4x64_epi64(p, _MM_SHUFFLE(3, 1, 2, 0));
+		auto r = _mm256_srli_epi16(p, 11);
+		auto g = _mm256_and_si256(_mm256_srli_epi16(p, 5), mask6);
+		auto b = _mm256_and_si256(p, mask5);
+		r = _mm256_or_si256(_mm256_slli_epi16(r, 3), _mm256_srli_epi16(r, 2));
+		g = _mm256_or_si256(_mm256_slli_epi16(g, 2), _mm256_srli_epi16(g, 4));
+		b = _mm256_or_si256(_mm256_slli_epi16(b, 3), _mm256_srli_epi16(b, 2));
+		auto gb = _mm256_or_si256(_mm256_slli_epi16(g, 8), b);
+		auto ar = _mm256_or_si256(alpha, r);
+		_mm256_storeu_si256(reinterpret_cast<__m256i *>(aDst + i),     _mm256_unpacklo_epi16(gb, ar));
+		_mm256_storeu_si256(reinterpret_cast<__m256i *>(aDst + i + 8), _mm256_unpackhi_epi16(gb, ar));
+	}
+	rgb565ToRgb32Scalar(aSrc + 2 * i, aNumPixels - i, aDst + i);
+}
+
+#endif  // FRAMEBUFFER_CONVERTER_X86
+
+
+
+
+
+/** Returns true if the CPU (and the OS) supports AVX2. */
+static bool cpuHasAvx2()
+{
+#if defined(FRAMEBUFFER_CONVERTER_X86) && defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 1);
+	auto hasOsxsave = ((info[2] & (1 << 27)) != 0);
+	if (!hasOsxsave || ((_xgetbv(0) & 6) != 6))
+	{
+		// The OS doesn't save the YMM registers
+		return false;
+	}
+	__cpuidex(info, 7, 0);
+	return ((info[1] & (1 << 5)) != 0);
+#elif defined(FRAMEBUFFER_CONVERTER_X86)
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+#else
+	return false;
+#endif
+}
+
+
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+// FramebufferConverter:
+
+FramebufferConverter::FramebufferConverter():
+	mLayout{32, {0, 8}, {8, 8}, {16, 8}, {24, 8}},
+	mKernel(kRgba8888),
+	mInstructionSet(bestInstructionSet())
+{
+}
+
+
+
+
+
+bool FramebufferConverter::setLayout(const Layout & aLayout)
+{
+	if ((aLayout.mBpp != 16) && (aLayout.mBpp != 24) && (aLayout.mBpp != 32))
+	{
+		return false;
+	}
+	mLayout = aLayout;
+	auto isChannel = [](const Channel & aChannel, uint32_t aOffset, uint32_t aLength)
+	{
+		return ((aChannel.mOffset == aOffset) && (aChannel.mLength == aLength));
+	};
+	mKernel = kGeneric;
+	if (aLayout.mBpp == 32)
+	{
+		if (isChannel(aLayout.mRed, 0, 8) && isChannel(aLayout.mGreen, 8, 8) && isChannel(aLayout.mBlue, 16, 8))
+		{
+			mKernel = kRgba8888;
+		}
+		else if (isChannel(aLayout.mRed, 16, 8) && isChannel(aLayout.mGreen, 8, 8) && isChannel(aLayout.mBlue, 0, 8))
+		{
+			mKernel = kBgra8888;
+		}
+	}
+	else if (aLayout.mBpp == 16)
+	{
+		if (isChannel(aLayout.mRed, 11, 5) && isChannel(aLayout.mGreen, 5, 6) && isChannel(aLayout.mBlue, 0, 5))
+		{
+			mKernel = kRgb565;
+		}
+	}
+	return true;
+}
+
+
+
+
+
+void FramebufferConverter::setInstructionSet(EInstructionSet aInstructionSet)
+{
+	mInstructionSet = std::min(aInstructionSet, bestInstructionSet());
+}
+
+
+
+
+
+void FramebufferConverter::convert(const char * aSrc, int aNumPixels, QRgb * aDst) const
+{
+	auto src = reinterpret_cast<const uint8_t *>(aSrc);
+	using KernelFn = void (*)(const uint8_t *, int, QRgb *);
+	KernelFn fn = nullptr;
+	switch (mKernel)
+	{
+		case kGeneric:
+		{
+			convertGeneric(aSrc, aNumPixels, aDst);
+			return;
+		}
+		case kRgba8888: fn = rgba8888ToRgb32Scalar; break;
+		case kBgra8888: fn = bgra8888ToRgb32Scalar; break;
+		case kRgb565:   fn = rgb565ToRgb32Scalar;   break;
+	}
+#ifdef FRAMEBUFFER_CONVERTER_X86
+	switch (mInstructionSet)
+	{
+		case siScalar: break;
+		case siSse2:
+		{
+			switch (mKernel)
+			{
+				case kGeneric:  break;
+				case kRgba8888: fn = rgba8888ToRgb32Sse2; break;
+				case kBgra8888: fn = bgra8888ToRgb32Sse2; break;
+				case kRgb565:   fn = rgb565ToRgb32Sse2;   break;
+			}
+			break;
+		}
+		case siAvx2:
+		{
+			switch (mKernel)
+			{
+				case kGeneric:  break;
+				case kRgba8888: fn = rgba8888ToRgb32Avx2; break;
+				case kBgra8888: fn = bgra8888ToRgb32Avx2; break;
+				case kRgb565:   fn = rgb565ToRgb32Avx2;   break;
+			}
+			break;
+		}
+	}
+#endif  // FRAMEBUFFER_CONVERTER_X86
+	assert(fn != nullptr);
+	fn(src, aNumPixels, aDst);
+}
+
+
+
+
+
+FramebufferConverter::EInstructionSet FramebufferConverter::bestInstructionSet()
+{
+#ifdef FRAMEBUFFER_CONVERTER_X86
+	static const auto best = cpuHasAvx2() ? siAvx2 : siSse2;
+	return best;
+#else
+	return siScalar;
+#endif
+}
+
+
+
+
+
+QImage FramebufferConverter::thumbnail(const QImage & aImage, const QSize & aMaxSize)
+{
+	if ((aImage.width() <= aMaxSize.width()) && (aImage.height() <= aMaxSize.height()))
+	{
+		return aImage;
+	}
+	auto img = aImage.convertToFormat(QImage::Format_RGB32);
+	while ((img.width() >= 2 * aMaxSize.width()) && (img.height() >= 2 * aMaxSize.height()))
+	{
+		img = halve(img, bestInstructionSet());
+	}
+	return img.scaled(aMaxSize, Qt::KeepAspectRatio, Qt::SmoothTransformation);
+}
+
+
+
+
+
+void FramebufferConverter::convertGeneric(const char * aSrc, int aNumPixels, QRgb * aDst) const
+{
+	auto src = reinterpret_cast<const uint8_t *>(aSrc);
+	auto bytesPerPixel = mLayout.mBpp / 8;
+	auto channel = [](uint32_t aPixel, const Channel & aChannel) -> int
+	{
+		if ((aChannel.mLength == 0) || (aChannel.mLength > 8) || (aChannel.mOffset + aChannel.mLength > 32))
+		{
+			return 0;
+		}
+		auto max = (1u << aChannel.mLength) - 1;
+		auto value = (aPixel >> aChannel.mOffset) & max;
+		return static_cast<int>((value * 255 + max / 2) / max);
+	};
+	for (int i = 0; i < aNumPixels; ++i)
+	{
+		uint32_t pixel = 0;
+		for (uint32_t b = 0; b < bytesPerPixel; ++b)
+		{
+			pixel |= static_cast<uint32_t>(src[b]) << (8 * b);
+		}
+		src += bytesPerPixel;
+		aDst[i] = qRgb(channel(pixel, mLayout.mRed), channel(pixel, mLayout.mGreen), channel(pixel, mLayout.mBlue));
+	}
+}
+
+
+
+
+
+QImage FramebufferConverter::halve(const QImage & aImage, EInstructionSet aInstructionSet)
+{
+	assert((aImage.format() == QImage::Format_RGB32) || (aImage.format() == QImage::Format_ARGB32));
+	auto width = aImage.width() / 2;
+	auto height = aImage.height() / 2;
+	QImage res(width, height, aImage.format());
+	for (int y = 0; y < height; ++y)
+	{
+		auto src0 = reinterpret_cast<const QRgb *>(aImage.constScanLine(2 * y));
+		auto src1 = reinterpret_cast<const QRgb *>(aImage.constScanLine(2 * y + 1));
+		auto dst = reinterpret_cast<QRgb *>(res.scanLine(y));
+		int x = 0;
+#ifdef FRAMEBUFFER_CONVERTER_X86
+		if (aInstructionSet != siScalar)
+		{
+			const auto zero = _mm_setzero_si128();
+			const auto two = _mm_set1_epi16(2);
+			for (; x + 4 <= width; x += 4)
+			{
+				// Sum the two rows in 16-bit lanes, then the even and odd pixels, the same as the scalar code:
+				auto a0 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src0 + 2 * x));
+				auto a1 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src0 + 2 * x + 4));
+				auto b0 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src1 + 2 * x));
+				auto b1 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src1 + 2 * x + 4));
+				auto s01 = _mm_add_epi16(_mm_unpacklo_epi8(a0, zero), _mm_unpacklo_epi8(b0, zero));  // Pixels 0, 1
+				auto s23 = _mm_add_epi16(_mm_unpackhi_epi8(a0, zero), _mm_unpackhi_epi8(b0, zero));  // Pixels 2, 3
+				auto s45 = _mm_add_epi16(_mm_unpacklo_epi8(a1, zero), _mm_unpacklo_epi8(b1, zero));  // Pixels 4, 5
+				auto s67 = _mm_add_epi16(_mm_unpackhi_epi8(a1, zero), _mm_unpackhi_epi8(b1, zero));  // Pixels 6, 7
+				auto q0 = _mm_add_epi16(_mm_unpacklo_epi64(s01, s23), _mm_unpackhi_epi64(s01, s23));
+				auto q1 = _mm_add_epi16(_mm_unpacklo_epi64(s45, s67), _mm_unpackhi_epi64(s45, s67));
+				q0 = _mm_srli_epi16(_mm_add_epi16(q0, two), 2);
+				q1 = _mm_srli_epi16(_mm_add_epi16(q1, two), 2);
+				_mm_storeu_si128(reinterpret_cast<__m128i *>(dst + x), _mm_packus_epi16(q0, q1));
+			}
+		}
+#else
+		Q_UNUSED(aInstructionSet);
+#endif  // FRAMEBUFFER_CONVERTER_X86
+		for (; x < width; ++x)
+		{
+			auto p00 = src0[2 * x], p01 = src0[2 * x + 1];
+			auto p10 = src1[2 * x], p11 = src1[2 * x + 1];
+			dst[x] = qRgba(
+				(qRed(p00)   + qRed(p01)   + qRed(p10)   + qRed(p11)   + 2) / 4,
+				(qGreen(p00) + qGreen(p01) + qGreen(p10) + qGreen(p11) + 2) / 4,
+				(qBlue(p00)  + qBlue(p01)  + qBlue(p10)  + qBlue(p11)  + 2) / 4,
+				(qAlpha(p00) + qAlpha(p01) + qAlpha(p10) + qAlpha(p11) + 2) / 4
+			);
+		}
+	}
+	return res;
+}
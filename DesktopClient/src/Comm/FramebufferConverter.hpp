@@ -0,0 +1,109 @@
+#pragma once
+
+#include <cstdint>
+#include <QImage>
+
+
+
+
+
+/** Converts the pixels of a device's framebuffer, as described by the ADB framebuffer header, into QImage's
+RGB32 pixels (the native format for painting, so the frames aren't converted again on each paint).
+The common layouts (RGBA8888, BGRA8888, RGB565) have dedicated kernels, vectorized with SSE2 and AVX2 on x86
+(picked at runtime by the CPU's capabilities), with a scalar fallback. Any other layout is handled by a generic
+scalar kernel that extracts each channel by its offset and length.
+Also provides the fast downscaling used for the device thumbnails. */
+class FramebufferConverter
+{
+public:
+
+	/** The position and size of a single color channel within a pixel, in bits. */
+	struct Channel
+	{
+		uint32_t mOffset;
+		uint32_t mLength;
+	};
+
+
+	/** The layout of the framebuffer pixels, as reported by the framebuffer header. */
+	struct Layout
+	{
+		uint32_t mBpp;
+		Channel mRed;
+		Channel mGreen;
+		Channel mBlue;
+		Channel mAlpha;
+	};
+
+
+	/** The kernel used for the conversion, picked by the layout. */
+	enum EKernel
+	{
+		kGeneric,   ///< Any layout, each channel extracted separately (slow)
+		kRgba8888,  ///< 32 bpp, bytes in memory: R, G, B, A (or X)
+		kBgra8888,  ///< 32 bpp, bytes in memory: B, G, R, A (or X)
+		kRgb565,    ///< 16 bpp LE, R in the top 5 bits, B in the bottom 5 bits
+	};
+
+
+	/** The instruction set used by the kernels. */
+	enum EInstructionSet
+	{
+		siScalar,
+		siSse2,
+		siAvx2,
+	};
+
+
+	/** Creates a new converter with the best instruction set supported by the CPU.
+	setLayout() needs to be called before converting. */
+	FramebufferConverter();
+
+	/** Sets the layout of the source pixels and picks the kernel for it.
+	Returns false if the layout is not supported (only 16, 24 and 32 bpp are). */
+	bool setLayout(const Layout & aLayout);
+
+	/** Returns the number of bytes of a single source pixel. */
+	int bytesPerPixel() const { return static_cast<int>(mLayout.mBpp / 8); }
+
+	/** Returns the kernel picked for the current layout. */
+	EKernel kernel() const { return mKernel; }
+
+	/** Returns the instruction set used by the kernels. */
+	EInstructionSet instructionSet() const { return mInstructionSet; }
+
+	/** Forces the specified instruction set, for comparing the kernels.
+	If the CPU doesn't support it, the best supported one is used instead. */
+	void setInstructionSet(EInstructionSet aInstructionSet);
+
+	/** Converts aNumPixels pixels at aSrc into RGB32 pixels at aDst. */
+	void convert(const char * aSrc, int aNumPixels, QRgb * aDst) const;
+
+	/** Returns the best instruction set supported by the current CPU. */
+	static EInstructionSet bestInstructionSet();
+
+	/** Returns a copy of the image scaled down to fit into aMaxSize, preserving the aspect ratio.
+	The bulk of the downscaling is done by repeated fast 2x2 box-filter halving, only the last (less than 2x) step
+	uses the (slow) smooth scaling of QImage. Images that already fit are returned as-is. */
+	static QImage thumbnail(const QImage & aImage, const QSize & aMaxSize);
+
+	/** Returns a copy of the (RGB32 / ARGB32) image with half the width and height, each pixel averaging a 2x2 block.
+	The result is the same for all the instruction sets (SSE2 is used for AVX2 as well). */
+	static QImage halve(const QImage & aImage, EInstructionSet aInstructionSet);
+
+
+protected:
+
+	/** The layout of the source pixels. */
+	Layout mLayout;
+
+	/** The kernel picked for mLayout. */
+	EKernel mKernel;
+
+	/** The instruction set used by the kernels. */
+	EInstructionSet mInstructionSet;
+
+
+	/** Converts the pixels using the generic kernel (any layout, scalar). */
+	void convertGeneric(const char * aSrc, int aNumPixels, QRgb * aDst) const;
+};
@@ -0,0 +1,165 @@
+#include "ReceiveBuffer.hpp"
+#include <cassert>
+#include <algorithm>
+#include <cstring>
+
+
+
+
+
+ReceiveBuffer::ReceiveBuffer():
+	mReadPos(0),
+	mWritePos(0)
+{
+}
+
+
+
+
+
+void ReceiveBuffer::append(const char * aData, int aSize)
+{
+	assert(aSize >= 0);
+	if (aSize == 0)
+	{
+		return;
+	}
+	auto dest = prepareWrite(aSize);
+	memcpy(dest, aData, static_cast<size_t>(aSize));
+	commitWrite(aSize);
+}
+
+
+
+
+
+char * ReceiveBuffer::prepareWrite(int aMaxSize)
+{
+	assert(aMaxSize >= 0);
+	if (mData.size() - mWritePos >= aMaxSize)
+	{
+		// There's enough space at the tail already:
+		return mData.data() + mWritePos;
+	}
+
+	// Try to make space by dropping the consumed data first, only grow if that's not enough:
+	compact();
+	if (mData.size() - mWritePos < aMaxSize)
+	{
+		mData.resize(mWritePos + aMaxSize);
+	}
+	return mData.data() + mWritePos;
+}
+
+
+
+
+
+void ReceiveBuffer::commitWrite(int aSize)
+{
+	assert(aSize >= 0);
+	assert(mWritePos + aSize <= mData.size());
+	mWritePos += aSize;
+}
+
+
+
+
+
+QByteArray ReceiveBuffer::view(int aOffset, int aLength) const
+{
+	assert(aOffset >= 0);
+	assert(aLength >= 0);
+	assert(aOffset + aLength <= size());
+	return QByteArray::fromRawData(data() + aOffset, aLength);
+}
+
+
+
+
+
+QByteArray ReceiveBuffer::copy(int aOffset, int aLength) const
+{
+	assert(aOffset >= 0);
+	assert(aLength >= 0);
+	assert(aOffset + aLength <= size());
+	return QByteArray(data() + aOffset, aLength);
+}
+
+
+
+
+
+void ReceiveBuffer::consume(int aNumBytes)
+{
+	assert(aNumBytes >= 0);
+	assert(aNumBytes <= size());
+	mReadPos += aNumBytes;
+}
+
+
+
+
+
+QByteArray ReceiveBuffer::takeAll()
+{
+	auto res = copy(0, size());
+	clear();
+	return res;
+}
+
+
+
+
+
+void ReceiveBuffer::clear()
+{
+	mReadPos = 0;
+	mWritePos = 0;
+}
+
+
+
+
+
+void ReceiveBuffer::compact()
+{
+	if (mReadPos == 0)
+	{
+		return;
+	}
+	auto numBytes = size();
+	if (numBytes > 0)
+	{
+		auto buf = mData.data();
+		memmove(buf, buf + mReadPos, static_cast<size_t>(numBytes));
+	}
+	mReadPos = 0;
+	mWritePos = numBytes;
+}
+
+
+
+
+
+void ReceiveBuffer::shrink(int aMinCapacity)
+{
+	assert(aMinCapacity >= 0);
+	auto numBytes = size();
+	if ((mData.size() <= aMinCapacity) || (numBytes * 4 > mData.size()))
+	{
+		compact();
+		return;
+	}
+
+	// Copy the unconsumed data into a new, smaller allocation; resizing in place wouldn't release the memory:
+	QByteArray data;
+	data.resize(std::max(numBytes, aMinCapacity));
+	if (numBytes > 0)
+	{
+		memcpy(data.data(), mData.constData() + mReadPos, static_cast<size_t>(numBytes));
+	}
+	std::swap(mData, data);
+	mReadPos = 0;
+	mWritePos = numBytes;
+}
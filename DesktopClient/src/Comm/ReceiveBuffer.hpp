@@ -0,0 +1,93 @@
+#pragma once
+
+#include <QByteArray>
+
+
+
+
+
+/** A buffer for the incoming stream data, which is parsed into messages in-place.
+New data is written at the tail (either copied in via append(), or read directly into the buffer using
+prepareWrite() + commitWrite()), and parsed messages are removed from the head by advancing a read cursor.
+The space taken by the consumed data is reclaimed only when compact() is called (typically once after
+processing an entire read burst), so that extracting many small messages costs no per-message copying.
+Parsers can get non-owning views of the data using view(); those are only valid until the next call to
+any of the modifying functions except consume(). */
+class ReceiveBuffer
+{
+public:
+
+	/** Creates a new empty buffer. */
+	ReceiveBuffer();
+
+	/** Returns the number of unconsumed bytes in the buffer. */
+	int size() const { return mWritePos - mReadPos; }
+
+	/** Returns the number of bytes allocated for the buffer (the unconsumed data, the consumed data not yet compacted
+	and the free space at the tail). */
+	int capacity() const { return mData.size(); }
+
+	/** Returns true if there are no unconsumed bytes in the buffer. */
+	bool isEmpty() const { return (mWritePos == mReadPos); }
+
+	/** Returns the pointer to the first unconsumed byte in the buffer. */
+	const char * data() const { return mData.constData() + mReadPos; }
+
+	/** Returns the pointer to the first unconsumed byte in the buffer, as unsigned bytes. */
+	const quint8 * bytes() const { return reinterpret_cast<const quint8 *>(data()); }
+
+	/** Appends a copy of the specified data at the tail of the buffer. */
+	void append(const char * aData, int aSize);
+
+	/** Appends a copy of the specified data at the tail of the buffer. */
+	void append(const QByteArray & aData) { append(aData.constData(), aData.size()); }
+
+	/** Returns a pointer to at least aMaxSize bytes of free space at the tail of the buffer,
+	so that the caller can read new data directly into the buffer.
+	The data written there becomes part of the buffer only after calling commitWrite().
+	May compact the buffer, invalidating any outstanding views. */
+	char * prepareWrite(int aMaxSize);
+
+	/** Marks aSize bytes, previously written into the space returned by prepareWrite(), as valid data. */
+	void commitWrite(int aSize);
+
+	/** Returns a non-owning view of aLength bytes starting aOffset bytes after the read cursor.
+	The view is valid only until the buffer is modified by anything other than consume(). */
+	QByteArray view(int aOffset, int aLength) const;
+
+	/** Returns a deep copy of aLength bytes starting aOffset bytes after the read cursor. */
+	QByteArray copy(int aOffset, int aLength) const;
+
+	/** Advances the read cursor by the specified number of bytes.
+	The consumed data stays in place until compact(), so views of it stay valid. */
+	void consume(int aNumBytes);
+
+	/** Returns a deep copy of all the unconsumed data and empties the buffer. */
+	QByteArray takeAll();
+
+	/** Removes all data from the buffer. */
+	void clear();
+
+	/** Reclaims the space taken by the consumed data, by moving the unconsumed data to the buffer front.
+	Invalidates all outstanding views. */
+	void compact();
+
+	/** Releases the memory of a buffer that has grown large but is now mostly empty (less than a quarter used),
+	so that a single large burst doesn't keep its peak allocation for the buffer's lifetime.
+	Reallocates to fit the unconsumed data, but keeps at least aMinCapacity bytes, so that the regular reads don't
+	need to grow the buffer again. Compacts the buffer, invalidating all outstanding views. */
+	void shrink(int aMinCapacity);
+
+
+protected:
+
+	/** The storage for the data.
+	Its size is the buffer's capacity, only the range [mReadPos, mWritePos) contains valid data. */
+	QByteArray mData;
+
+	/** The index into mData of the first unconsumed byte. */
+	int mReadPos;
+
+	/** The index into mData where the next incoming data will be written. */
+	int mWritePos;
+};
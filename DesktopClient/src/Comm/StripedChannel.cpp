@@ -0,0 +1,431 @@
+#include "StripedChannel.hpp"
+#include <cassert>
+#include <algorithm>
+#include <iterator>
+#include <QRandomGenerator>
+#include "../Utils.hpp"
+
+
+
+
+
+/** The flag in the chunk header marking the last chunk of a message. */
+static const quint8 FLAG_LAST_CHUNK = 0x01;
+
+/** The size of the chunk header (Seq + Flags). */
+static const int CHUNK_HEADER_SIZE = 5;
+
+/** The maximum size of the data in a single chunk, in bytes. */
+static const int CHUNK_SIZE = 16 * 1024;
+
+/** The maximum number of chunks waiting in the reorder buffer for a missing chunk.
+If there are more, the remote isn't following the protocol and the channel fails. */
+static const size_t MAX_REORDER_CHUNKS = 4096;
+
+
+
+
+
+/** Returns the throughput assumed for a connection of the specified transport until one is measured,
+in bytes per msec. */
+static qint64 defaultThroughput(Connection::TransportKind aTransportKind)
+{
+	switch (aTransportKind)
+	{
+		case Connection::tkUsb:       return 20000;
+		case Connection::tkTcp:       return 5000;
+		case Connection::tkBluetooth: return 100;
+	}
+	return 100;
+}
+
+
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+// StripedChannel::Leg:
+
+class StripedChannel::Leg:
+	public Connection::Channel
+{
+	using Super = Connection::Channel;
+
+
+public:
+
+	Leg(Connection & aConnection, StripedChannel & aParent):
+		Super(aConnection),
+		mParent(&aParent),
+		mWeight(1),
+		mCurrentWeight(0)
+	{
+		mPriority = prBulk;
+	}
+
+
+	/** The striped channel to which the leg belongs.
+	Reset to nullptr when the striped channel is destroyed while the leg is still in its connection. */
+	StripedChannel * mParent;
+
+	/** The weight of the leg for spreading the chunks (proportional to its connection's throughput). */
+	qint64 mWeight;
+
+	/** The current weight in the smooth weighted round-robin. */
+	qint64 mCurrentWeight;
+
+
+	// Connection::Channel override:
+	virtual void processIncomingMessage(const QByteArray & aMessage) override
+	{
+		if (mParent != nullptr)
+		{
+			mParent->processChunk(aMessage);
+		}
+	}
+};
+
+
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+// StripedChannel:
+
+StripedChannel::StripedChannel(const QByteArray & aServiceName, const QByteArray & aServiceInitData, Logger & aLogger):
+	mServiceName(aServiceName),
+	mServiceInitData(aServiceInitData),
+	mLogger(aLogger),
+	mIsOpen(false),
+	mHasFailed(false),
+	mIsOverBudget(false),
+	mNextSendSeq(0),
+	mNextReceiveSeq(0)
+{
+}
+
+
+
+
+
+StripedChannel::~StripedChannel()
+{
+	close();
+	for (auto & leg: mLegs)
+	{
+		leg->mParent = nullptr;
+	}
+}
+
+
+
+
+
+bool StripedChannel::open(const std::vector<ConnectionPtr> & aConnections)
+{
+	assert(mLegs.empty());
+
+	std::vector<ConnectionPtr> connections;
+	std::copy_if(aConnections.begin(), aConnections.end(), std::back_inserter(connections),
+		[](const ConnectionPtr & aConnection)
+		{
+			return (aConnection->state() == Connection::csEncrypted);
+		}
+	);
+	if (connections.empty())
+	{
+		mLogger.log("Cannot open striped channel for service \"%1\", there's no connection.", mServiceName);
+		return false;
+	}
+	mLogger.log("Opening striped channel for service \"%1\" over %2 connections.", mServiceName, connections.size());
+
+	// All the legs share a random group ID, so that the device can tell them apart from other striped channels:
+	auto groupID = QRandomGenerator::global()->generate();
+	auto numLegs = static_cast<quint16>(connections.size());
+	for (quint16 i = 0; i < numLegs; ++i)
+	{
+		auto & conn = connections[i];
+		auto leg = std::make_shared<Leg>(*conn, *this);
+		connect(leg.get(), &Connection::Channel::opened, this,
+			[this]()
+			{
+				legOpened();
+			}
+		);
+		connect(leg.get(), &Connection::Channel::failed, this,
+			[this](Connection::Channel * aChannel, const quint16 aErrorCode, const QByteArray & aErrorMessage)
+			{
+				Q_UNUSED(aChannel);
+				legFailed(QString("A leg has failed: %1: %2").arg(aErrorCode).arg(QString::fromUtf8(aErrorMessage)));
+			}
+		);
+		connect(leg.get(), &Connection::Channel::writable, this,
+			[this]()
+			{
+				legWritable();
+			}
+		);
+		connect(leg.get(), &Connection::Channel::closed, this,
+			[this]()
+			{
+				legFailed("A leg has been closed");
+			}
+		);
+		connect(conn.get(), &Connection::disconnected, this,
+			[this]()
+			{
+				legFailed("A leg's connection has been lost");
+			}
+		);
+		mLegs.push_back(leg);
+
+		QByteArray initData;
+		Utils::writeBE32(initData, groupID);
+		Utils::writeBE16(initData, numLegs);
+		Utils::writeBE16(initData, i);
+		Utils::writeBE16Lstring(initData, mServiceName);
+		Utils::writeBE16Lstring(initData, mServiceInitData);
+		if (!conn->openChannel(leg, "stripe", initData))
+		{
+			legFailed("Cannot open a leg");
+			return false;
+		}
+	}
+	return true;
+}
+
+
+
+
+
+void StripedChannel::sendMessage(const QByteArray & aMessage)
+{
+	assert(mIsOpen);
+	updateWeights();
+
+	// Split the message into chunks, even an empty message is sent as a single (empty) chunk:
+	int offset = 0;
+	do
+	{
+		auto numBytes = std::min(aMessage.size() - offset, CHUNK_SIZE);
+		auto isLast = (offset + numBytes >= aMessage.size());
+		QByteArray chunk;
+		chunk.reserve(CHUNK_HEADER_SIZE + numBytes);
+		Utils::writeBE32(chunk, mNextSendSeq);
+		chunk.push_back(static_cast<char>(isLast ? FLAG_LAST_CHUNK : 0));
+		chunk.append(aMessage.constData() + offset, numBytes);
+		mNextSendSeq += 1;
+		offset += numBytes;
+		chooseLeg().sendMessage(chunk);
+	} while (offset < aMessage.size());
+
+	if (!canSend())
+	{
+		mIsOverBudget = true;
+	}
+}
+
+
+
+
+
+bool StripedChannel::canSend() const
+{
+	return std::any_of(mLegs.begin(), mLegs.end(),
+		[](const std::shared_ptr<Leg> & aLeg)
+		{
+			return aLeg->canSend();
+		}
+	);
+}
+
+
+
+
+
+qint64 StripedChannel::numBytesQueued() const
+{
+	qint64 res = 0;
+	for (const auto & leg: mLegs)
+	{
+		res += leg->numBytesQueued();
+	}
+	return res;
+}
+
+
+
+
+
+void StripedChannel::close()
+{
+	// Closing the legs would report them as failed, suppress that:
+	mHasFailed = true;
+	mIsOpen = false;
+	for (auto & leg: mLegs)
+	{
+		if (leg->isOpen())
+		{
+			leg->connection().closeChannel(leg);
+		}
+	}
+}
+
+
+
+
+
+void StripedChannel::legOpened()
+{
+	if (mHasFailed)
+	{
+		return;
+	}
+	for (const auto & leg: mLegs)
+	{
+		if (!leg->isOpen())
+		{
+			// Still waiting for more legs
+			return;
+		}
+	}
+	mLogger.log("Striped channel for service \"%1\" is open.", mServiceName);
+	mIsOpen = true;
+	emit opened(this);
+}
+
+
+
+
+
+void StripedChannel::legFailed(const QString & aErrorMessage)
+{
+	if (mHasFailed)
+	{
+		return;
+	}
+	mLogger.log("Striped channel for service \"%1\" has failed: %2", mServiceName, aErrorMessage);
+	close();
+	emit failed(this, aErrorMessage);
+}
+
+
+
+
+
+void StripedChannel::legWritable()
+{
+	if (!mIsOverBudget || !mIsOpen)
+	{
+		return;
+	}
+	mIsOverBudget = false;
+	emit writable(this);
+}
+
+
+
+
+
+void StripedChannel::processChunk(const QByteArray & aChunk)
+{
+	if (aChunk.size() < CHUNK_HEADER_SIZE)
+	{
+		legFailed("Received a malformed chunk");
+		return;
+	}
+	auto seq = Utils::readBE32(aChunk);
+	if (static_cast<qint32>(seq - mNextReceiveSeq) < 0)
+	{
+		mLogger.log("Striped channel received a duplicate chunk %1, ignoring.", seq);
+		return;
+	}
+
+	if (seq != mNextReceiveSeq)
+	{
+		// Out of order, store (a deep copy, aChunk is valid only for the duration of this call) until the gap fills:
+		if (mReorderBuffer.size() >= MAX_REORDER_CHUNKS)
+		{
+			legFailed("Too many out-of-order chunks");
+			return;
+		}
+		mReorderBuffer[seq] = QByteArray(aChunk.constData() + 4, aChunk.size() - 4);  // Flags + Data
+		return;
+	}
+
+	// In order, process it and all the stored chunks that follow:
+	appendChunk(static_cast<quint8>(aChunk[4]), aChunk.constData() + CHUNK_HEADER_SIZE, aChunk.size() - CHUNK_HEADER_SIZE);
+	mNextReceiveSeq += 1;
+	auto itr = mReorderBuffer.find(mNextReceiveSeq);
+	while (itr != mReorderBuffer.end())
+	{
+		const auto & stored = itr->second;
+		appendChunk(static_cast<quint8>(stored[0]), stored.constData() + 1, stored.size() - 1);
+		mReorderBuffer.erase(itr);
+		mNextReceiveSeq += 1;
+		itr = mReorderBuffer.find(mNextReceiveSeq);
+	}
+}
+
+
+
+
+
+void StripedChannel::appendChunk(quint8 aFlags, const char * aData, int aSize)
+{
+	mIncomingMessage.append(aData, aSize);
+	if ((aFlags & FLAG_LAST_CHUNK) != 0)
+	{
+		auto msg = std::move(mIncomingMessage);
+		mIncomingMessage.clear();
+		emit messageReceived(this, msg);
+	}
+}
+
+
+
+
+
+void StripedChannel::updateWeights()
+{
+	for (auto & leg: mLegs)
+	{
+		// The recent throughput (bytes per msec), but at least the transport's default, so that an idle connection
+		// still gets its share of the chunks. The moving average, not the lifetime one, so that the chunks follow
+		// the current state of the links:
+		auto & conn = leg->connection();
+		auto measured = conn.stats().mRecentThroughput / 1000;
+		leg->mWeight = std::max(measured, defaultThroughput(conn.transportKind()));
+	}
+}
+
+
+
+
+
+StripedChannel::Leg & StripedChannel::chooseLeg()
+{
+	assert(!mLegs.empty());
+
+	// Smooth weighted round-robin: each leg accumulates its weight, the one with the highest accumulated weight
+	// is chosen and pays for it with the total weight. Prefer the legs that are within their send budget:
+	qint64 totalWeight = 0;
+	Leg * best = nullptr;
+	Leg * bestWritable = nullptr;
+	for (auto & leg: mLegs)
+	{
+		leg->mCurrentWeight += leg->mWeight;
+		totalWeight += leg->mWeight;
+		if ((best == nullptr) || (leg->mCurrentWeight > best->mCurrentWeight))
+		{
+			best = leg.get();
+		}
+		if (leg->canSend() && ((bestWritable == nullptr) || (leg->mCurrentWeight > bestWritable->mCurrentWeight)))
+		{
+			bestWritable = leg.get();
+		}
+	}
+	auto & chosen = (bestWritable != nullptr) ? *bestWritable : *best;
+	chosen.mCurrentWeight -= totalWeight;
+	return chosen;
+}
@@ -0,0 +1,148 @@
+#pragma once
+
+#include <memory>
+#include <map>
+#include <vector>
+#include <QObject>
+#include "Connection.hpp"
+
+
+
+
+
+/** A logical channel striped across multiple connections to a single device (such as USB and WiFi).
+A leg - a regular channel of the `stripe` service - is opened on each of the connections. The outgoing messages
+are split into sequence-numbered chunks that are spread across the legs in proportion to each connection's
+measured throughput; the chunks received from all the legs are put back in order by a reassembler.
+The chunks in flight on a leg are lost when the leg fails, so the whole striped channel fails if any leg fails.
+See DevDocs/Channel - Stripe.md for the protocol. */
+class StripedChannel:
+	public QObject,
+	public std::enable_shared_from_this<StripedChannel>
+{
+	using Super = QObject;
+
+	Q_OBJECT
+
+
+public:
+
+	/** Creates a new striped channel for the specified service.
+	Nothing is sent until open() is called. */
+	StripedChannel(const QByteArray & aServiceName, const QByteArray & aServiceInitData, Logger & aLogger);
+
+	virtual ~StripedChannel() override;
+
+	/** Opens a leg on each of the specified connections.
+	The opened() signal is emitted once all the legs are open.
+	Returns false if no leg could be requested (no connection in the csEncrypted state). */
+	bool open(const std::vector<ConnectionPtr> & aConnections);
+
+	/** Returns true if all the legs have been opened and none has failed yet. */
+	bool isOpen() const { return mIsOpen; }
+
+	/** Returns the number of legs of the channel. */
+	size_t numLegs() const { return mLegs.size(); }
+
+	/** Sends the specified message, of any size, to the device.
+	The message is split into chunks, sent over all the legs.
+	Asserts that the channel is open. */
+	void sendMessage(const QByteArray & aMessage);
+
+	/** Returns true if at least one of the legs is under its send budget (Connection::Channel::canSend()).
+	Producers of large amounts of data should check this before each sendMessage() and, when false,
+	wait for the writable() signal before sending more, the same as with a regular channel. */
+	bool canSend() const;
+
+	/** Returns the number of bytes of the outgoing data queued in the connections, summed over all the legs. */
+	qint64 numBytesQueued() const;
+
+	/** Closes all the legs. */
+	void close();
+
+
+protected:
+
+	/** A single leg of the striped channel, opened on one of the connections. */
+	class Leg;
+
+
+	/** The service to open over the striped channel. */
+	const QByteArray mServiceName;
+
+	/** The initialization data for the service. */
+	const QByteArray mServiceInitData;
+
+	/** The logger used for all messages produced by this class. */
+	Logger & mLogger;
+
+	/** The legs of the channel, one per connection. */
+	std::vector<std::shared_ptr<Leg>> mLegs;
+
+	/** Set to true once all the legs have been opened; reset when the channel fails or is closed. */
+	bool mIsOpen;
+
+	/** Set to true once the channel has failed; no more failed() signals are emitted afterwards. */
+	bool mHasFailed;
+
+	/** Set to true when sendMessage() leaves all the legs over their budget;
+	writable() is emitted when any of the legs becomes writable again. */
+	bool mIsOverBudget;
+
+	/** The sequence number to be assigned to the next outgoing chunk. */
+	quint32 mNextSendSeq;
+
+	/** The sequence number of the next incoming chunk to be reassembled. */
+	quint32 mNextReceiveSeq;
+
+	/** The incoming chunks that have arrived out of order, by their sequence number.
+	The values are the chunks' flags followed by their data. */
+	std::map<quint32, QByteArray> mReorderBuffer;
+
+	/** The incoming message being reassembled from the in-order chunks. */
+	QByteArray mIncomingMessage;
+
+
+	/** Called by a leg when it has been opened. Emits opened() once all the legs are open. */
+	void legOpened();
+
+	/** Called by a leg when it fails or gets closed.
+	Fails the entire striped channel. */
+	void legFailed(const QString & aErrorMessage);
+
+	/** Called by a leg when its queued outgoing data drops under its budget.
+	Emits writable() if the channel was over its budget. */
+	void legWritable();
+
+	/** Called by a leg when it receives a chunk. Puts the chunk into the reassembler. */
+	void processChunk(const QByteArray & aChunk);
+
+	/** Adds the (in-order) chunk with the specified flags and data to the message being reassembled.
+	Emits messageReceived() if the chunk completes the message. */
+	void appendChunk(quint8 aFlags, const char * aData, int aSize);
+
+	/** Recalculates the legs' weights for spreading the chunks, from their connections' measured throughput. */
+	void updateWeights();
+
+	/** Returns the leg on which the next chunk should be sent, using a smooth weighted round-robin.
+	Legs that are over their send budget are skipped, unless all of them are. */
+	Leg & chooseLeg();
+
+
+signals:
+
+	/** Emitted once all the legs have been opened and the channel is ready for sending. */
+	void opened(StripedChannel * aSelf);
+
+	/** Emitted when the channel fails to open, or when any of its legs fails. */
+	void failed(StripedChannel * aSelf, const QString & aErrorMessage);
+
+	/** Emitted when a complete message has been received and reassembled. */
+	void messageReceived(StripedChannel * aSelf, const QByteArray & aMessage);
+
+	/** Emitted when a leg becomes writable again after canSend() has returned false.
+	The producer can continue sending. */
+	void writable(StripedChannel * aSelf);
+};
+
+using StripedChannelPtr = std::shared_ptr<StripedChannel>;
@@ -0,0 +1,671 @@
+#include "TlsFilter.hpp"
+#include <cassert>
+#include <cstring>
+#include <climits>
+#include <algorithm>
+#include <QIODevice>
+#include <QMutex>
+#include "polarssl/ssl.h"
+#include "polarssl/entropy.h"
+#include "polarssl/ctr_drbg.h"
+#include "polarssl/pk.h"
+#include "polarssl/x509_crt.h"
+#include "polarssl/error.h"
+#include "../BackgroundTasks.hpp"
+#include "../Logger.hpp"
+#include "ReceiveBuffer.hpp"
+#include "TlsSessionCache.hpp"
+
+
+
+
+
+/** The subject and issuer name used for the local self-signed certificate. */
+static const char CERT_NAME[] = "CN=Deskemes Desktop Client";
+
+/** The personalization string for seeding the random generator. */
+static const char RNG_PERSONALIZATION[] = "Deskemes TLS";
+
+
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+// TlsFilter::State:
+
+class TlsFilter::State
+{
+public:
+
+	/** The mutex protecting mOwner, mIncoming, mOutgoing and the handshake status against multithreaded access.
+	The SSL context is not protected by the mutex, it is used exclusively by the running handshake step
+	(mIsHandshakeStepRunning) and, once the handshake completes, exclusively by the owner's thread. */
+	QMutex mMtx;
+
+	/** The filter that owns this state, to be notified of the handshake steps.
+	Set to nullptr when the filter is destroyed, the background tasks then stop as soon as possible. */
+	TlsFilter * mOwner;
+
+	/** The logger used for all messages produced by this class. */
+	Logger & mLogger;
+
+	/** The local private key, used for the certificate, in DER format. */
+	const QByteArray mLocalPrivateKeyData;
+
+	/** The only remote public key that is accepted in the remote's certificate, in DER format. */
+	const QByteArray mRemotePublicKeyData;
+
+	/** The public ID of the remote, used as the key for the session cache. */
+	const QByteArray mRemotePublicID;
+
+	/** The cache of the sessions, or nullptr if not caching. */
+	std::shared_ptr<TlsSessionCache> mSessionCache;
+
+	/** The raw data received from the remote, not yet processed by the SSL context. */
+	ReceiveBuffer mIncoming;
+
+	/** The raw data produced by the SSL context, to be sent to the remote. */
+	QByteArray mOutgoing;
+
+	/** True while a handshake step is scheduled or running in the background. */
+	bool mIsHandshakeStepRunning;
+
+	/** Set to true by the background task when the handshake completes successfully. */
+	bool mHasHandshaken;
+
+	/** The PolarSSL error code of the handshake failure, or 0 if no failure. */
+	int mErrorCode;
+
+	/** Set to true once mSsl has been initialized (and thus needs freeing). */
+	bool mIsSslInitialized;
+
+	/** Set to true by the handshake if the remote has resumed a cached session. */
+	bool mIsResumedSession;
+
+	entropy_context mEntropy;
+	ctr_drbg_context mCtrDrbg;
+	pk_context mOwnKey;
+	x509_crt mOwnCert;
+	ssl_context mSsl;
+
+
+	State(
+		const QByteArray & aLocalPrivateKeyData,
+		const QByteArray & aRemotePublicKeyData,
+		const QByteArray & aRemotePublicID,
+		std::shared_ptr<TlsSessionCache> aSessionCache,
+		Logger & aLogger,
+		TlsFilter * aOwner
+	):
+		mOwner(aOwner),
+		mLogger(aLogger),
+		mLocalPrivateKeyData(aLocalPrivateKeyData),
+		mRemotePublicKeyData(aRemotePublicKeyData),
+		mRemotePublicID(aRemotePublicID),
+		mSessionCache(aSessionCache),
+		mIsHandshakeStepRunning(false),
+		mHasHandshaken(false),
+		mErrorCode(0),
+		mIsSslInitialized(false),
+		mIsResumedSession(false)
+	{
+		memset(&mCtrDrbg, 0, sizeof(mCtrDrbg));
+		memset(&mSsl, 0, sizeof(mSsl));
+		entropy_init(&mEntropy);
+		pk_init(&mOwnKey);
+		x509_crt_init(&mOwnCert);
+	}
+
+
+	~State()
+	{
+		if (mIsSslInitialized)
+		{
+			ssl_free(&mSsl);
+		}
+		x509_crt_free(&mOwnCert);
+		pk_free(&mOwnKey);
+		ctr_drbg_free(&mCtrDrbg);
+		entropy_free(&mEntropy);
+	}
+
+
+	/** Sets up the RNG, the local key and certificate, and the SSL context.
+	Returns 0 on success, PolarSSL error code on failure.
+	Runs in the background, the certificate signing is expensive. */
+	int initialize()
+	{
+		auto res = ctr_drbg_init(
+			&mCtrDrbg, entropy_func, &mEntropy,
+			reinterpret_cast<const unsigned char *>(RNG_PERSONALIZATION), sizeof(RNG_PERSONALIZATION) - 1
+		);
+		if (res != 0)
+		{
+			mLogger.log("ERROR: TLS: Cannot seed the random generator: %1", errorString(res));
+			return res;
+		}
+		res = pk_parse_key(
+			&mOwnKey,
+			reinterpret_cast<const unsigned char *>(mLocalPrivateKeyData.constData()),
+			static_cast<size_t>(mLocalPrivateKeyData.size()),
+			nullptr, 0
+		);
+		if (res != 0)
+		{
+			mLogger.log("ERROR: TLS: Cannot parse the local private key: %1", errorString(res));
+			return res;
+		}
+		QByteArray certData;
+		res = createSelfSignedCert(certData);
+		if (res != 0)
+		{
+			mLogger.log("ERROR: TLS: Cannot create the local certificate: %1", errorString(res));
+			return res;
+		}
+		res = x509_crt_parse_der(
+			&mOwnCert,
+			reinterpret_cast<const unsigned char *>(certData.constData()),
+			static_cast<size_t>(certData.size())
+		);
+		if (res != 0)
+		{
+			mLogger.log("ERROR: TLS: Cannot parse the local certificate: %1", errorString(res));
+			return res;
+		}
+
+		res = ssl_init(&mSsl);
+		if (res != 0)
+		{
+			mLogger.log("ERROR: TLS: Cannot initialize the SSL context: %1", errorString(res));
+			return res;
+		}
+		mIsSslInitialized = true;
+		ssl_set_endpoint(&mSsl, SSL_IS_SERVER);
+		ssl_set_authmode(&mSsl, SSL_VERIFY_REQUIRED);
+		ssl_set_min_version(&mSsl, SSL_MAJOR_VERSION_3, SSL_MINOR_VERSION_3);  // TLS 1.2
+		ssl_set_renegotiation(&mSsl, SSL_RENEGOTIATION_DISABLED);
+		ssl_set_rng(&mSsl, ctr_drbg_random, &mCtrDrbg);
+		ssl_set_bio(&mSsl, bioRecv, this, bioSend, this);
+
+		// The remote is authenticated by its public key in verifyRemoteCert(), rather than by a CA.
+		// PolarSSL requires a CA chain to be set for the verification to be performed, so use our own cert:
+		ssl_set_ca_chain(&mSsl, &mOwnCert, nullptr, nullptr);
+		ssl_set_verify(&mSsl, verifyRemoteCert, this);
+		if (mSessionCache != nullptr)
+		{
+			ssl_set_session_cache(&mSsl, getCachedSession, this, setCachedSession, this);
+		}
+		res = ssl_set_own_cert(&mSsl, &mOwnCert, &mOwnKey);
+		if (res != 0)
+		{
+			mLogger.log("ERROR: TLS: Cannot set the local certificate: %1", errorString(res));
+			return res;
+		}
+		return 0;
+	}
+
+
+	/** Creates a self-signed certificate for mOwnKey, stores it into aCertData in the DER format.
+	Returns 0 on success, PolarSSL error code on failure. */
+	int createSelfSignedCert(QByteArray & aCertData)
+	{
+		x509write_cert crt;
+		x509write_crt_init(&crt);
+		mpi serial;
+		mpi_init(&serial);
+
+		x509write_crt_set_md_alg(&crt, POLARSSL_MD_SHA256);
+		x509write_crt_set_subject_key(&crt, &mOwnKey);
+		x509write_crt_set_issuer_key(&crt, &mOwnKey);
+		auto res = mpi_lset(&serial, 1);
+		if (res == 0)
+		{
+			res = x509write_crt_set_serial(&crt, &serial);
+		}
+		if (res == 0)
+		{
+			res = x509write_crt_set_subject_name(&crt, CERT_NAME);
+		}
+		if (res == 0)
+		{
+			res = x509write_crt_set_issuer_name(&crt, CERT_NAME);
+		}
+		if (res == 0)
+		{
+			res = x509write_crt_set_validity(&crt, "20000101000000", "20991231235959");
+		}
+		if (res == 0)
+		{
+			// The certificate is written at the end of the buffer, the return value is its length:
+			unsigned char buf[8192];
+			res = x509write_crt_der(&crt, buf, sizeof(buf), ctr_drbg_random, &mCtrDrbg);
+			if (res > 0)
+			{
+				aCertData = QByteArray(reinterpret_cast<const char *>(buf) + sizeof(buf) - res, res);
+				res = 0;
+			}
+		}
+
+		mpi_free(&serial);
+		x509write_crt_free(&crt);
+		return res;
+	}
+
+
+	/** Runs the handshake as far as the data received so far allows.
+	Executed in a BackgroundTasks executor; aSelf keeps the state alive even if the owner is destroyed meanwhile. */
+	static void runHandshakeStep(std::shared_ptr<State> aSelf)
+	{
+		int res = 0;
+		if (!aSelf->mIsSslInitialized)
+		{
+			res = aSelf->initialize();
+		}
+		while (res == 0)
+		{
+			res = ssl_handshake(&aSelf->mSsl);
+			if ((res != POLARSSL_ERR_NET_WANT_READ) && (res != POLARSSL_ERR_NET_WANT_WRITE))
+			{
+				// The handshake has either completed or failed:
+				break;
+			}
+			QMutexLocker lock(&aSelf->mMtx);
+			if (aSelf->mIncoming.isEmpty() || (aSelf->mOwner == nullptr))
+			{
+				// Waiting for more data from the remote; the owner schedules another step when it arrives:
+				aSelf->mIsHandshakeStepRunning = false;
+				aSelf->notifyOwner();
+				return;
+			}
+
+			// More data has arrived while this step was running, continue right away
+			res = 0;
+		}
+
+		QMutexLocker lock(&aSelf->mMtx);
+		aSelf->mIsHandshakeStepRunning = false;
+		if (res == 0)
+		{
+			aSelf->mHasHandshaken = true;
+		}
+		else
+		{
+			aSelf->mErrorCode = res;
+		}
+		aSelf->notifyOwner();
+	}
+
+
+	/** Lets the owner know (in its own thread) that a handshake step has finished.
+	Expects mMtx to be held by the caller. */
+	void notifyOwner()
+	{
+		if (mOwner != nullptr)
+		{
+			QMetaObject::invokeMethod(mOwner, "handshakeStepFinished", Qt::QueuedConnection);
+		}
+	}
+
+
+	/** The PolarSSL callback for looking up a session that the remote wants to resume.
+	Fills in the master secret and returns 0 if found in the cache, returns 1 if not found. */
+	static int getCachedSession(void * aContext, ssl_session * aSession)
+	{
+		auto self = static_cast<State *>(aContext);
+		auto session = self->mSessionCache->lookup(
+			self->mRemotePublicID,
+			QByteArray(reinterpret_cast<const char *>(aSession->id), static_cast<int>(aSession->length)),
+			aSession->ciphersuite,
+			aSession->compression
+		);
+		if (!session.isPresent())
+		{
+			return 1;
+		}
+		const auto & masterSecret = session.value().mMasterSecret;
+		if (masterSecret.size() != sizeof(aSession->master))
+		{
+			return 1;
+		}
+		memcpy(aSession->master, masterSecret.constData(), sizeof(aSession->master));
+		aSession->verify_result = 0;  // The remote's certificate has been verified when the session was created
+		self->mIsResumedSession = true;
+		return 0;
+	}
+
+
+	/** The PolarSSL callback for storing a newly established session. */
+	static int setCachedSession(void * aContext, const ssl_session * aSession)
+	{
+		auto self = static_cast<State *>(aContext);
+		self->mSessionCache->store(TlsSessionCache::Session
+		{
+			self->mRemotePublicID,
+			QByteArray(reinterpret_cast<const char *>(aSession->id), static_cast<int>(aSession->length)),
+			aSession->ciphersuite,
+			aSession->compression,
+			QByteArray(reinterpret_cast<const char *>(aSession->master), sizeof(aSession->master)),
+			QDateTime::currentDateTimeUtc(),
+		});
+		return 0;
+	}
+
+
+	/** The PolarSSL callback for reading the raw data from the remote. */
+	static int bioRecv(void * aContext, unsigned char * aBuffer, size_t aSize)
+	{
+		auto self = static_cast<State *>(aContext);
+		QMutexLocker lock(&self->mMtx);
+		auto numBytes = std::min(self->mIncoming.size(), static_cast<int>(std::min<size_t>(aSize, INT_MAX)));
+		if (numBytes == 0)
+		{
+			return POLARSSL_ERR_NET_WANT_READ;
+		}
+		memcpy(aBuffer, self->mIncoming.data(), static_cast<size_t>(numBytes));
+		self->mIncoming.consume(numBytes);
+		return numBytes;
+	}
+
+
+	/** The PolarSSL callback for sending the raw data to the remote. */
+	static int bioSend(void * aContext, const unsigned char * aData, size_t aSize)
+	{
+		auto self = static_cast<State *>(aContext);
+		auto numBytes = static_cast<int>(std::min<size_t>(aSize, INT_MAX));
+		QMutexLocker lock(&self->mMtx);
+		self->mOutgoing.append(reinterpret_cast<const char *>(aData), numBytes);
+		return numBytes;
+	}
+
+
+	/** The PolarSSL callback for verifying the remote's certificate chain.
+	The remote's certificate is self-signed, it is trusted only if it carries the public key from the pairing. */
+	static int verifyRemoteCert(void * aContext, x509_crt * aCert, int aDepth, int * aFlags)
+	{
+		auto self = static_cast<State *>(aContext);
+		if (aDepth != 0)
+		{
+			// Only the remote's own certificate matters, there are no intermediate CAs
+			return 0;
+		}
+		unsigned char buf[4096];
+		auto len = pk_write_pubkey_der(&aCert->pk, buf, sizeof(buf));
+		if (len <= 0)
+		{
+			self->mLogger.log("ERROR: TLS: Cannot serialize the remote certificate's public key: %1", errorString(len));
+			*aFlags |= BADCERT_NOT_TRUSTED;
+			return 0;
+		}
+
+		// pk_write_pubkey_der() writes the data at the end of the buffer:
+		auto pubKey = QByteArray::fromRawData(reinterpret_cast<const char *>(buf) + sizeof(buf) - len, len);
+		if (pubKey != self->mRemotePublicKeyData)
+		{
+			self->mLogger.log("ERROR: TLS: The remote certificate's public key doesn't match the paired key.");
+			*aFlags |= BADCERT_NOT_TRUSTED;
+			return 0;
+		}
+
+		// The key matches, ignore the CA-based verification result (self-signed, validity dates etc.):
+		*aFlags = 0;
+		return 0;
+	}
+};
+
+
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+// TlsFilter:
+
+TlsFilter::TlsFilter(
+	const QByteArray & aLocalPrivateKeyData,
+	const QByteArray & aRemotePublicKeyData,
+	const QByteArray & aRemotePublicID,
+	std::shared_ptr<TlsSessionCache> aSessionCache,
+	Logger & aLogger,
+	QObject * aParent
+):
+	Super(aParent),
+	mState(std::make_shared<State>(
+		aLocalPrivateKeyData, aRemotePublicKeyData, aRemotePublicID, aSessionCache, aLogger, this
+	)),
+	mLogger(aLogger),
+	mHasHandshaken(false),
+	mIsResumedSession(false),
+	mHasFailed(false)
+{
+}
+
+
+
+
+
+TlsFilter::~TlsFilter()
+{
+	// Detach from the state, any running handshake step will stop and free the state once done:
+	QMutexLocker lock(&mState->mMtx);
+	mState->mOwner = nullptr;
+}
+
+
+
+
+
+void TlsFilter::startHandshake()
+{
+	mLogger.log("TLS: Starting the handshake");
+	mHandshakeTimer.start();
+	QMutexLocker lock(&mState->mMtx);
+	scheduleHandshakeStep();
+}
+
+
+
+
+
+bool TlsFilter::readFrom(QIODevice & aIO)
+{
+	static const int READ_CHUNK_SIZE = 64 * 1024;
+	QMutexLocker lock(&mState->mMtx);
+	auto & incoming = mState->mIncoming;
+	while (true)
+	{
+		auto dest = incoming.prepareWrite(READ_CHUNK_SIZE);
+		auto numBytes = aIO.read(dest, READ_CHUNK_SIZE);
+		if (numBytes == 0)
+		{
+			break;
+		}
+		else if (numBytes < 0)
+		{
+			return false;
+		}
+		incoming.commitWrite(static_cast<int>(numBytes));
+	}
+	if (!mState->mHasHandshaken && !incoming.isEmpty())
+	{
+		scheduleHandshakeStep();
+	}
+	return true;
+}
+
+
+
+
+
+void TlsFilter::writeIncoming(const char * aData, int aSize)
+{
+	if (aSize <= 0)
+	{
+		return;
+	}
+	QMutexLocker lock(&mState->mMtx);
+	mState->mIncoming.append(aData, aSize);
+	if (!mState->mHasHandshaken)
+	{
+		scheduleHandshakeStep();
+	}
+}
+
+
+
+
+
+bool TlsFilter::decryptInto(ReceiveBuffer & aDest)
+{
+	assert(mHasHandshaken);
+	if (mHasFailed)
+	{
+		return false;
+	}
+	while (true)
+	{
+		auto dest = aDest.prepareWrite(SSL_MAX_CONTENT_LEN);
+		auto res = ssl_read(&mState->mSsl, reinterpret_cast<unsigned char *>(dest), SSL_MAX_CONTENT_LEN);
+		if (res > 0)
+		{
+			aDest.commitWrite(res);
+			continue;
+		}
+		if ((res == POLARSSL_ERR_NET_WANT_READ) || (res == POLARSSL_ERR_NET_WANT_WRITE))
+		{
+			// No more complete records
+			return true;
+		}
+		if ((res == 0) || (res == POLARSSL_ERR_SSL_PEER_CLOSE_NOTIFY))
+		{
+			mLogger.log("TLS: The remote has closed the session.");
+			return false;
+		}
+		reportFailure(tr("Cannot decrypt the incoming data: %1").arg(errorString(res)));
+		return false;
+	}
+}
+
+
+
+
+
+QByteArray TlsFilter::encrypt(const QByteArray & aPlainData)
+{
+	assert(mHasHandshaken);
+	if (mHasFailed)
+	{
+		return QByteArray();
+	}
+	auto data = reinterpret_cast<const unsigned char *>(aPlainData.constData());
+	auto numLeft = static_cast<size_t>(aPlainData.size());
+	while (numLeft > 0)
+	{
+		// ssl_write() may write less than requested, if the data doesn't fit into a single record:
+		auto res = ssl_write(&mState->mSsl, data, numLeft);
+		if (res < 0)
+		{
+			reportFailure(tr("Cannot encrypt the outgoing data: %1").arg(errorString(res)));
+			return QByteArray();
+		}
+		data += res;
+		numLeft -= static_cast<size_t>(res);
+	}
+
+	// The encrypted data has been put into mOutgoing by bioSend():
+	QMutexLocker lock(&mState->mMtx);
+	QByteArray res;
+	std::swap(res, mState->mOutgoing);
+	return res;
+}
+
+
+
+
+
+QString TlsFilter::errorString(int aErrorCode)
+{
+	char buf[200];
+	polarssl_strerror(aErrorCode, buf, sizeof(buf));
+	return QString("-0x%1 (%2)").arg(-aErrorCode, 4, 16, QChar('0')).arg(QString::fromUtf8(buf));
+}
+
+
+
+
+
+void TlsFilter::scheduleHandshakeStep()
+{
+	if (mState->mIsHandshakeStepRunning || (mState->mErrorCode != 0))
+	{
+		// The running step picks up the new data itself; or there's no point in continuing
+		return;
+	}
+	mState->mIsHandshakeStepRunning = true;
+	auto state = mState;
+	BackgroundTasks::enqueue(tr("TLS handshake"),
+		[state]()
+		{
+			State::runHandshakeStep(state);
+		},
+		true,  // Prioritize, the remote is waiting for us
+		[state]()
+		{
+			QMutexLocker lock(&state->mMtx);
+			state->mIsHandshakeStepRunning = false;
+		}
+	);
+}
+
+
+
+
+
+void TlsFilter::reportFailure(const QString & aErrorMessage)
+{
+	if (mHasFailed)
+	{
+		return;
+	}
+	mHasFailed = true;
+	mLogger.log("ERROR: TLS: %1", aErrorMessage);
+	emit failed(aErrorMessage);
+}
+
+
+
+
+
+void TlsFilter::handshakeStepFinished()
+{
+	// Take the results of the step:
+	QMutexLocker lock(&mState->mMtx);
+	QByteArray outgoing;
+	std::swap(outgoing, mState->mOutgoing);
+	auto errorCode = mState->mErrorCode;
+	auto hasHandshaken = mState->mHasHandshaken;
+	auto isResumedSession = mState->mIsResumedSession;
+	lock.unlock();
+
+	if (!outgoing.isEmpty() && !mHasFailed)
+	{
+		emit outgoingData(outgoing);
+	}
+	if (errorCode != 0)
+	{
+		reportFailure(tr("The handshake has failed: %1").arg(errorString(errorCode)));
+		return;
+	}
+	if (hasHandshaken && !mHasHandshaken)
+	{
+		mHasHandshaken = true;
+		mIsResumedSession = isResumedSession;
+		auto duration = mHandshakeTimer.elapsed();
+		mLogger.log("TLS: The %1 handshake has completed in %2 msec, using %3.",
+			isResumedSession ? "resumed" : "full", duration, QString::fromUtf8(ssl_get_ciphersuite(&mState->mSsl))
+		);
+		if (mState->mSessionCache != nullptr)
+		{
+			mState->mSessionCache->addHandshakeStats(isResumedSession, duration);
+		}
+		emit handshakeCompleted();
+	}
+}
@@ -0,0 +1,147 @@
+#pragma once
+
+#include <memory>
+#include <QObject>
+#include <QByteArray>
+#include <QElapsedTimer>
+
+
+
+
+
+// fwd:
+class QIODevice;
+class Logger;
+class ReceiveBuffer;
+class TlsSessionCache;
+
+
+
+
+
+/** Implements the TLS layer between the raw IO of a Connection and its muxed protocol.
+The Connection pushes the raw data received from the remote into the filter, and the filter produces
+the data to be sent to the remote via the outgoingData() signal (during the handshake) or the return value
+of encrypt() (after the handshake).
+The local side always acts as the TLS server, authenticating itself with a self-signed certificate made
+from the local private key of the pairing, and requiring the remote to present a certificate with the
+public key that was exchanged during the pairing.
+The handshake involves expensive RSA operations with the 4096-bit pairing keys, so it is executed in
+the BackgroundTasks' executors; multiple connections can handshake in parallel without blocking
+the thread in which the Connections live (the GUI thread).
+Once the handshake completes, the filter is used solely from the owner's thread.
+If a TlsSessionCache is provided, the sessions are cached and a reconnecting remote can resume its session
+with an abbreviated handshake. */
+class TlsFilter:
+	public QObject
+{
+	using Super = QObject;
+
+	Q_OBJECT
+
+
+public:
+
+	/** Creates a new filter that will use the specified local private key for its certificate and will
+	accept only the specified remote public key in the remote's certificate.
+	Both keys are in the DER format, as stored in DevicePairings.
+	The sessions are cached in aSessionCache (may be nullptr for no caching) under aRemotePublicID.
+	Nothing happens until startHandshake() is called. */
+	TlsFilter(
+		const QByteArray & aLocalPrivateKeyData,
+		const QByteArray & aRemotePublicKeyData,
+		const QByteArray & aRemotePublicID,
+		std::shared_ptr<TlsSessionCache> aSessionCache,
+		Logger & aLogger,
+		QObject * aParent = nullptr
+	);
+
+	virtual ~TlsFilter() override;
+
+	/** Starts the handshake in the background.
+	The self-signed certificate is created right away, then the handshake waits for the remote's data. */
+	void startHandshake();
+
+	/** Returns true if the handshake has completed successfully and the filter is ready for data. */
+	bool hasHandshaken() const { return mHasHandshaken; }
+
+	/** Returns true if the handshake has resumed a cached session.
+	Only valid after the handshake has completed. */
+	bool isResumedSession() const { return mIsResumedSession; }
+
+	/** Reads all the data available in aIO and pushes it into the filter, as if by writeIncoming().
+	Returns false if reading from the IO fails. */
+	bool readFrom(QIODevice & aIO);
+
+	/** Pushes the specified raw data received from the remote into the filter.
+	While handshaking, schedules the next handshake step in the background, if needed. */
+	void writeIncoming(const char * aData, int aSize);
+
+	/** Decrypts all the complete TLS records received so far directly into aDest.
+	Returns false if the remote has closed the TLS session or on an error (after emitting failed()).
+	Asserts that the handshake has completed. */
+	bool decryptInto(ReceiveBuffer & aDest);
+
+	/** Encrypts the specified data, returns the data to be sent to the remote.
+	Returns an empty array on failure (after emitting failed()).
+	Asserts that the handshake has completed. */
+	QByteArray encrypt(const QByteArray & aPlainData);
+
+	/** Returns the user-visible description of the specified PolarSSL error code. */
+	static QString errorString(int aErrorCode);
+
+
+protected:
+
+	/** The TLS context and the buffers shared between the filter and the background handshake tasks.
+	Held by a shared pointer so that it outlives the filter while a handshake step is still running. */
+	class State;
+
+
+	/** The context shared with the background handshake tasks. */
+	std::shared_ptr<State> mState;
+
+	/** The logger used for all messages produced by this class. */
+	Logger & mLogger;
+
+	/** Set to true once the owner has been notified of the handshake completion. */
+	bool mHasHandshaken;
+
+	/** Set to true if the completed handshake has resumed a cached session. */
+	bool mIsResumedSession;
+
+	/** Set to true once the owner has been notified of a failure.
+	No more notifications are sent afterwards. */
+	bool mHasFailed;
+
+	/** Measures the duration of the handshake, for the log and the session cache statistics. */
+	QElapsedTimer mHandshakeTimer;
+
+
+	/** Schedules the next handshake step in the background, unless one is already running.
+	Called with mState's mutex held. */
+	void scheduleHandshakeStep();
+
+	/** Reports the specified error via the failed() signal, unless a failure has already been reported. */
+	void reportFailure(const QString & aErrorMessage);
+
+
+signals:
+
+	/** Emitted when the handshake has produced data to be sent to the remote. */
+	void outgoingData(const QByteArray & aData);
+
+	/** Emitted once the handshake has completed successfully.
+	The remote's data that has arrived after the handshake can be extracted using decryptInto(). */
+	void handshakeCompleted();
+
+	/** Emitted when the TLS session fails (handshake failure, remote certificate mismatch, protocol error). */
+	void failed(const QString & aErrorMessage);
+
+
+private slots:
+
+	/** Invoked (queued) by the background task after each handshake step.
+	Sends the outgoing data and reports the handshake result. */
+	void handshakeStepFinished();
+};
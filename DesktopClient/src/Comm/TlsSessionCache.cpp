@@ -0,0 +1,433 @@
+#include "TlsSessionCache.hpp"
+#include <cassert>
+#include <cstring>
+#include <vector>
+#include <QSqlError>
+#include <QFile>
+#include <QRandomGenerator>
+#include "polarssl/gcm.h"
+#include "../DB/Database.hpp"
+#include "../InstallConfiguration.hpp"
+#include "../Settings.hpp"
+#include "../Utils.hpp"
+
+
+
+
+
+/** The sizes of the individual parts of the encrypted master secret, in bytes. */
+static const int STORAGE_KEY_SIZE = 32;
+static const int STORAGE_IV_SIZE = 12;
+static const int STORAGE_TAG_SIZE = 16;
+
+const char * TlsSessionCache::KEY_FILE_NAME = "TlsSessionCache.key";
+
+
+
+
+
+TlsSessionCache::TlsSessionCache(ComponentCollection & aComponents):
+	ComponentSuper(aComponents),
+	mLogger(aComponents.logger("TlsSessionCache")),
+	mMaxSessions(64),
+	mLifetimeSec(12 * 60 * 60),
+	mShouldPersist(false)
+{
+	mStats.mNumHits = 0;
+	mStats.mNumMisses = 0;
+	requireForStart(ComponentCollection::ckInstallConfiguration);
+	requireForStart(ComponentCollection::ckDatabase);
+}
+
+
+
+
+
+void TlsSessionCache::start()
+{
+	mMaxSessions   = Settings::loadValue("TlsSessionCache", "MaxSessions", mMaxSessions).toInt();
+	mLifetimeSec   = Settings::loadValue("TlsSessionCache", "LifetimeSec", mLifetimeSec).toLongLong();
+	mShouldPersist = Settings::loadValue("TlsSessionCache", "Persist",     mShouldPersist).toBool();
+	mLogger.log("Starting, max %1 sessions, lifetime %2 sec, persisting: %3", mMaxSessions, mLifetimeSec, mShouldPersist);
+
+	auto db = mComponents.get<Database>();
+	auto conn = db->connection();
+	if (!mShouldPersist)
+	{
+		// Don't keep any previously persisted sessions around:
+		auto query = conn.query("DELETE FROM TlsSessions");
+		query.exec();
+		return;
+	}
+	if (!loadOrCreateStorageKey())
+	{
+		// A new key, the stored sessions cannot be decrypted anymore:
+		auto query = conn.query("DELETE FROM TlsSessions");
+		query.exec();
+		return;
+	}
+
+	// Drop the expired sessions:
+	auto oldest = QDateTime::currentDateTimeUtc().addSecs(-mLifetimeSec);
+	{
+		auto query = conn.query("DELETE FROM TlsSessions WHERE CreatedAt < ?");
+		query.addBindValue(oldest.toSecsSinceEpoch());
+		if (!query.exec())
+		{
+			mLogger.log("ERROR: Cannot exec expiry statement: %1.", query.lastError());
+		}
+	}
+
+	// Load the rest, the oldest first, so that the newest end up in the front:
+	auto query = conn.query("SELECT * FROM TlsSessions ORDER BY CreatedAt");
+	if (!query.exec())
+	{
+		mLogger.log("ERROR: Cannot exec load statement: %1.", query.lastError());
+		return;
+	}
+	QMutexLocker lock(&mMtx);
+	std::vector<Session> undecryptable;
+	while (query.next())
+	{
+		Session session
+		{
+			query.value("DeviceID").toByteArray(),
+			query.value("SessionID").toByteArray(),
+			query.value("CipherSuite").toInt(),
+			query.value("Compression").toInt(),
+			QByteArray(),
+			QDateTime::fromSecsSinceEpoch(query.value("CreatedAt").toLongLong(), Qt::UTC),
+		};
+		if (!decryptMasterSecret(session, query.value("MasterSecret").toByteArray()))
+		{
+			undecryptable.push_back(std::move(session));
+			continue;
+		}
+		mSessions.push_front(std::move(session));
+	}
+	mLogger.log("Loaded %1 sessions from the DB, dropping %2 sessions that cannot be decrypted.",
+		mSessions.size(), undecryptable.size()
+	);
+	for (const auto & session: undecryptable)
+	{
+		dbRemoveSession(session.mDevicePublicID, session.mSessionID);
+	}
+	trim();
+}
+
+
+
+
+
+Optional<TlsSessionCache::Session> TlsSessionCache::lookup(
+	const QByteArray & aDevicePublicID,
+	const QByteArray & aSessionID,
+	int aCipherSuite,
+	int aCompression
+)
+{
+	QMutexLocker lock(&mMtx);
+	trim();
+	for (auto itr = mSessions.begin(), end = mSessions.end(); itr != end; ++itr)
+	{
+		if ((itr->mSessionID != aSessionID) || (itr->mDevicePublicID != aDevicePublicID))
+		{
+			continue;
+		}
+		if ((itr->mCipherSuite != aCipherSuite) || (itr->mCompression != aCompression))
+		{
+			mLogger.log("Session for device %1 found, but with different parameters.", Utils::toHex(aDevicePublicID));
+			return {};
+		}
+
+		// Move to the front (most recently used):
+		mSessions.splice(mSessions.begin(), mSessions, itr);
+		return mSessions.front();
+	}
+	return {};
+}
+
+
+
+
+
+void TlsSessionCache::store(const Session & aSession)
+{
+	QMutexLocker lock(&mMtx);
+
+	// If there are too many sessions for the device already, remove the oldest ones:
+	int numDeviceSessions = 0;
+	for (auto itr = mSessions.begin(); itr != mSessions.end();)
+	{
+		if (itr->mDevicePublicID != aSession.mDevicePublicID)
+		{
+			++itr;
+			continue;
+		}
+		if ((itr->mSessionID == aSession.mSessionID) || (numDeviceSessions + 1 >= MAX_SESSIONS_PER_DEVICE))
+		{
+			itr = removeSession(itr);
+			continue;
+		}
+		numDeviceSessions += 1;
+		++itr;
+	}
+
+	mSessions.push_front(aSession);
+	if (mShouldPersist)
+	{
+		QMetaObject::invokeMethod(this, [this, aSession]() { dbStoreSession(aSession); }, Qt::QueuedConnection);
+	}
+	trim();
+}
+
+
+
+
+
+void TlsSessionCache::removeDevice(const QByteArray & aDevicePublicID)
+{
+	QMutexLocker lock(&mMtx);
+	mSessions.remove_if(
+		[&aDevicePublicID](const Session & aSession)
+		{
+			return (aSession.mDevicePublicID == aDevicePublicID);
+		}
+	);
+	if (mShouldPersist)
+	{
+		QMetaObject::invokeMethod(this, [this, aDevicePublicID]() { dbRemoveSession(aDevicePublicID, QByteArray()); }, Qt::QueuedConnection);
+	}
+}
+
+
+
+
+
+void TlsSessionCache::addHandshakeStats(bool aIsResumed, qint64 aDurationMsec)
+{
+	QMutexLocker lock(&mMtx);
+	if (aIsResumed)
+	{
+		mStats.mNumHits += 1;
+		mStats.mResumedHandshakeLatency.add(aDurationMsec);
+	}
+	else
+	{
+		mStats.mNumMisses += 1;
+		mStats.mFullHandshakeLatency.add(aDurationMsec);
+	}
+	mLogger.log("Handshake stats: %1 hits, %2 misses; full handshakes: %3; resumed handshakes: %4",
+		mStats.mNumHits, mStats.mNumMisses,
+		mStats.mFullHandshakeLatency.summary("ms"),
+		mStats.mResumedHandshakeLatency.summary("ms")
+	);
+}
+
+
+
+
+
+TlsSessionCache::Stats TlsSessionCache::stats() const
+{
+	QMutexLocker lock(&mMtx);
+	return mStats;
+}
+
+
+
+
+
+void TlsSessionCache::trim()
+{
+	// Remove the expired sessions:
+	auto oldest = QDateTime::currentDateTimeUtc().addSecs(-mLifetimeSec);
+	for (auto itr = mSessions.begin(); itr != mSessions.end();)
+	{
+		if (itr->mCreatedAt < oldest)
+		{
+			itr = removeSession(itr);
+		}
+		else
+		{
+			++itr;
+		}
+	}
+
+	// Evict the least recently used sessions over capacity:
+	while (static_cast<int>(mSessions.size()) > mMaxSessions)
+	{
+		removeSession(std::prev(mSessions.end()));
+	}
+}
+
+
+
+
+
+std::list<TlsSessionCache::Session>::iterator TlsSessionCache::removeSession(std::list<Session>::iterator aItr)
+{
+	if (mShouldPersist)
+	{
+		auto deviceID = aItr->mDevicePublicID;
+		auto sessionID = aItr->mSessionID;
+		QMetaObject::invokeMethod(this, [this, deviceID, sessionID]() { dbRemoveSession(deviceID, sessionID); }, Qt::QueuedConnection);
+	}
+	return mSessions.erase(aItr);
+}
+
+
+
+
+
+bool TlsSessionCache::loadOrCreateStorageKey()
+{
+	auto fileName = mComponents.get<InstallConfiguration>()->dataLocation(KEY_FILE_NAME);
+	QFile f(fileName);
+	if (f.open(QIODevice::ReadOnly))
+	{
+		mStorageKey = f.readAll();
+		if (mStorageKey.size() == STORAGE_KEY_SIZE)
+		{
+			return true;
+		}
+		mLogger.log("The storage key in %1 is invalid, generating a new one.", fileName);
+		f.close();
+	}
+
+	// Generate a new key and save it, readable only by the current user:
+	quint32 key[STORAGE_KEY_SIZE / sizeof(quint32)];
+	QRandomGenerator::system()->fillRange(key);
+	mStorageKey = QByteArray(reinterpret_cast<const char *>(key), STORAGE_KEY_SIZE);
+	if (
+		!f.open(QIODevice::WriteOnly | QIODevice::Truncate) ||
+		!f.setPermissions(QFile::ReadOwner | QFile::WriteOwner) ||
+		(f.write(mStorageKey) != STORAGE_KEY_SIZE)
+	)
+	{
+		mLogger.log("ERROR: Cannot save the storage key to %1: %2", fileName, f.errorString());
+	}
+	return false;
+}
+
+
+
+
+
+QByteArray TlsSessionCache::encryptMasterSecret(const Session & aSession) const
+{
+	assert(mStorageKey.size() == STORAGE_KEY_SIZE);
+
+	// Random IV, the device and session IDs as the additional authenticated data:
+	quint32 iv[STORAGE_IV_SIZE / sizeof(quint32)];
+	QRandomGenerator::system()->fillRange(iv);
+	auto aad = aSession.mDevicePublicID + aSession.mSessionID;
+	QByteArray res(STORAGE_IV_SIZE + aSession.mMasterSecret.size() + STORAGE_TAG_SIZE, 0);
+	auto out = reinterpret_cast<unsigned char *>(res.data());
+	memcpy(out, iv, STORAGE_IV_SIZE);
+
+	gcm_context gcm;
+	gcm_init(&gcm, POLARSSL_CIPHER_ID_AES, reinterpret_cast<const unsigned char *>(mStorageKey.constData()), STORAGE_KEY_SIZE * 8);
+	auto ret = gcm_crypt_and_tag(
+		&gcm, GCM_ENCRYPT, static_cast<size_t>(aSession.mMasterSecret.size()),
+		out, STORAGE_IV_SIZE,
+		reinterpret_cast<const unsigned char *>(aad.constData()), static_cast<size_t>(aad.size()),
+		reinterpret_cast<const unsigned char *>(aSession.mMasterSecret.constData()),
+		out + STORAGE_IV_SIZE,
+		STORAGE_TAG_SIZE, out + STORAGE_IV_SIZE + aSession.mMasterSecret.size()
+	);
+	gcm_free(&gcm);
+	if (ret != 0)
+	{
+		mLogger.log("ERROR: Cannot encrypt the master secret: %1", ret);
+		return QByteArray();
+	}
+	return res;
+}
+
+
+
+
+
+bool TlsSessionCache::decryptMasterSecret(Session & aSession, const QByteArray & aEncrypted) const
+{
+	assert(mStorageKey.size() == STORAGE_KEY_SIZE);
+
+	auto secretSize = aEncrypted.size() - STORAGE_IV_SIZE - STORAGE_TAG_SIZE;
+	if (secretSize <= 0)
+	{
+		return false;
+	}
+	auto in = reinterpret_cast<const unsigned char *>(aEncrypted.constData());
+	auto aad = aSession.mDevicePublicID + aSession.mSessionID;
+	QByteArray secret(secretSize, 0);
+	gcm_context gcm;
+	gcm_init(&gcm, POLARSSL_CIPHER_ID_AES, reinterpret_cast<const unsigned char *>(mStorageKey.constData()), STORAGE_KEY_SIZE * 8);
+	auto ret = gcm_auth_decrypt(
+		&gcm, static_cast<size_t>(secretSize),
+		in, STORAGE_IV_SIZE,
+		reinterpret_cast<const unsigned char *>(aad.constData()), static_cast<size_t>(aad.size()),
+		in + STORAGE_IV_SIZE + secretSize, STORAGE_TAG_SIZE,
+		in + STORAGE_IV_SIZE,
+		reinterpret_cast<unsigned char *>(secret.data())
+	);
+	gcm_free(&gcm);
+	if (ret != 0)
+	{
+		return false;
+	}
+	aSession.mMasterSecret = secret;
+	return true;
+}
+
+
+
+
+
+void TlsSessionCache::dbStoreSession(const Session & aSession)
+{
+	auto encryptedSecret = encryptMasterSecret(aSession);
+	if (encryptedSecret.isEmpty())
+	{
+		return;
+	}
+	auto db = mComponents.get<Database>();
+	auto conn = db->connection();
+	auto query = conn.query(
+		"INSERT INTO TlsSessions "
+		"(DeviceID, SessionID, CipherSuite, Compression, MasterSecret, CreatedAt) "
+		"VALUES (?, ?, ?, ?, ?, ?)"
+	);
+	query.addBindValue(aSession.mDevicePublicID);
+	query.addBindValue(aSession.mSessionID);
+	query.addBindValue(aSession.mCipherSuite);
+	query.addBindValue(aSession.mCompression);
+	query.addBindValue(encryptedSecret);
+	query.addBindValue(aSession.mCreatedAt.toSecsSinceEpoch());
+	if (!query.exec())
+	{
+		mLogger.log("ERROR: Cannot store the session to the DB: %1.", query.lastError());
+	}
+}
+
+
+
+
+
+void TlsSessionCache::dbRemoveSession(const QByteArray & aDevicePublicID, const QByteArray & aSessionID)
+{
+	auto db = mComponents.get<Database>();
+	auto conn = db->connection();
+	auto query = aSessionID.isEmpty() ?
+		conn.query("DELETE FROM TlsSessions WHERE DeviceID = ?") :
+		conn.query("DELETE FROM TlsSessions WHERE DeviceID = ? AND SessionID = ?");
+	query.addBindValue(aDevicePublicID);
+	if (!aSessionID.isEmpty())
+	{
+		query.addBindValue(aSessionID);
+	}
+	if (!query.exec())
+	{
+		mLogger.log("ERROR: Cannot remove the session from the DB: %1.", query.lastError());
+	}
+}
@@ -0,0 +1,172 @@
+#pragma once
+
+#include <list>
+#include <QObject>
+#include <QMutex>
+#include <QDateTime>
+#include "../Optional.hpp"
+#include "../ComponentCollection.hpp"
+#include "../LatencyHistogram.hpp"
+
+
+
+
+
+/** Caches the TLS sessions of the connections, so that a reconnecting device can resume its session
+with an abbreviated handshake instead of the full one with the expensive RSA operations.
+The sessions are keyed by the device's public ID (as used by DevicePairings) in addition to the TLS
+session ID, so that a session can only ever be resumed by the device that has established it.
+The cache is bounded (LRU) and its entries expire; optionally (off by default, see mShouldPersist), the sessions
+are persisted in the DB so that they survive an app restart.
+Also keeps the statistics of the handshakes (cache hits / misses and the handshake latencies).
+All the public functions are thread-safe, they are called from the background TLS handshakes. */
+class TlsSessionCache:
+	public QObject,
+	public ComponentCollection::Component<ComponentCollection::ckTlsSessionCache>
+{
+	using Super = QObject;
+	using ComponentSuper = ComponentCollection::Component<ComponentCollection::ckTlsSessionCache>;
+
+	Q_OBJECT
+
+
+public:
+
+	/** The data of a single cached session. */
+	struct Session
+	{
+		/** The public ID of the device that has established the session. */
+		QByteArray mDevicePublicID;
+
+		/** The TLS session ID. */
+		QByteArray mSessionID;
+
+		/** The TLS ciphersuite negotiated for the session. */
+		int mCipherSuite;
+
+		/** The TLS compression negotiated for the session. */
+		int mCompression;
+
+		/** The TLS master secret of the session. */
+		QByteArray mMasterSecret;
+
+		/** When the session was established, used for the expiry. */
+		QDateTime mCreatedAt;
+	};
+
+
+	/** The handshake statistics. */
+	struct Stats
+	{
+		/** The number of handshakes that have resumed a cached session. */
+		quint64 mNumHits;
+
+		/** The number of handshakes that have had to do the full handshake. */
+		quint64 mNumMisses;
+
+		/** The durations of the full handshakes, in msec. */
+		LatencyHistogram mFullHandshakeLatency;
+
+		/** The durations of the resumed handshakes, in msec. */
+		LatencyHistogram mResumedHandshakeLatency;
+	};
+
+
+	explicit TlsSessionCache(ComponentCollection & aComponents);
+
+	/** Loads the settings and, if persisting, the unexpired sessions from the DB. */
+	virtual void start() override;
+
+	/** Returns the session with the specified ID established by the specified device, if it is still valid
+	and matches the specified ciphersuite and compression.
+	Marks the session as the most recently used. */
+	Optional<Session> lookup(
+		const QByteArray & aDevicePublicID,
+		const QByteArray & aSessionID,
+		int aCipherSuite,
+		int aCompression
+	);
+
+	/** Stores the specified session in the cache, evicting the least recently used ones over capacity. */
+	void store(const Session & aSession);
+
+	/** Removes all sessions of the specified device.
+	Used when the device's pairing changes, so that the old sessions cannot be resumed anymore. */
+	void removeDevice(const QByteArray & aDevicePublicID);
+
+	/** Records the result of a single handshake in the statistics. */
+	void addHandshakeStats(bool aIsResumed, qint64 aDurationMsec);
+
+	/** Returns a snapshot of the current statistics. */
+	Stats stats() const;
+
+
+protected:
+
+	/** The maximum number of sessions kept per single device.
+	A device normally has at most one session per transport (WiFi, USB, ...). */
+	static const int MAX_SESSIONS_PER_DEVICE = 4;
+
+	/** The name of the file (in the data folder) that holds mStorageKey. */
+	static const char * KEY_FILE_NAME;
+
+
+	/** The logger used for all messages produced by this class. */
+	Logger & mLogger;
+
+	/** The mutex protecting all the member variables against multithreaded access. */
+	mutable QMutex mMtx;
+
+	/** The cached sessions, the most recently used first. */
+	std::list<Session> mSessions;
+
+	/** The maximum number of sessions kept in the cache. */
+	int mMaxSessions;
+
+	/** The time after which the cached sessions expire, in seconds. */
+	qint64 mLifetimeSec;
+
+	/** If true, the sessions are persisted in the DB.
+	Loaded from the "TlsSessionCache/Persist" setting, off by default: the master secret is all that is needed
+	to decrypt a recorded session, so anyone who can read the stored sessions can decrypt the device traffic
+	captured during their lifetime. The secrets are therefore stored encrypted, with a key kept in a separate
+	file (see mStorageKey), but the protection is only as good as the access control on the data folder. */
+	bool mShouldPersist;
+
+	/** The AES-256 key used for encrypting the master secrets stored in the DB.
+	Kept in the KEY_FILE_NAME file in the data folder, never in the DB itself. Empty if not persisting. */
+	QByteArray mStorageKey;
+
+	/** The handshake statistics. */
+	Stats mStats;
+
+
+	/** Removes the expired sessions and evicts the least recently used ones over capacity.
+	Expects mMtx to be held by the caller. */
+	void trim();
+
+	/** Removes the specified session from the cache, and from the DB if persisting.
+	Expects mMtx to be held by the caller. Returns the iterator to the next session. */
+	std::list<Session>::iterator removeSession(std::list<Session>::iterator aItr);
+
+	/** Loads mStorageKey from its file, generating (and saving) a new one if there is none.
+	Returns true if the key was loaded, false if a new one was generated, in which case the caller should drop
+	the sessions already stored in the DB, as they cannot be decrypted. */
+	bool loadOrCreateStorageKey();
+
+	/** Returns the master secret of the session encrypted using mStorageKey (AES-256-GCM), bound to the device
+	and session IDs; the result is the IV, the ciphertext and the tag, concatenated. */
+	QByteArray encryptMasterSecret(const Session & aSession) const;
+
+	/** Decrypts the master secret stored for the session by encryptMasterSecret() into aSession.mMasterSecret.
+	Returns false if it cannot be decrypted (wrong key, modified or plaintext data). */
+	bool decryptMasterSecret(Session & aSession, const QByteArray & aEncrypted) const;
+
+	/** Stores the session in the DB.
+	Executed in the cache's thread (the DB is not accessed from the TLS background tasks). */
+	void dbStoreSession(const Session & aSession);
+
+	/** Removes the specified session (or all sessions of the device, if aSessionID is empty) from the DB.
+	Executed in the cache's thread (the DB is not accessed from the TLS background tasks). */
+	void dbRemoveSession(const QByteArray & aDevicePublicID, const QByteArray & aSessionID);
+};
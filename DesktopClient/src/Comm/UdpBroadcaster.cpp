@@ -1,23 +1,72 @@
 #include "UdpBroadcaster.hpp"
 #include <cassert>
+#include <algorithm>
+#include <iterator>
+#include <set>
 #include <QNetworkInterface>
 #include <QUdpSocket>
 #include "../Utils.hpp"
 #include "../InstallConfiguration.hpp"
+#include "../Logger.hpp"
+#include "../Settings.hpp"
+#include "../DeviceMgr.hpp"
+#include "../DB/DevicePairings.hpp"
 #include "TcpListener.hpp"
 
 
 
 
 
+/** The interval between the beacons while discovering new devices. */
+static const int BEACON_DISCOVERY_INTERVAL_MSEC = 250;
+
+/** The shortest interval between the regular beacons, used while some paired devices are not connected. */
+static const int BEACON_MIN_INTERVAL_MSEC = 1000;
+
+/** The longest interval between the regular beacons (the keepalive), reached while all paired devices are connected. */
+static const int BEACON_MAX_INTERVAL_MSEC = 30000;
+
+/** The interval in which the network interfaces are re-read, to pick up the network changes. */
+static const int INTERFACE_REFRESH_INTERVAL_MSEC = 10000;
+
+/** The IPv4 multicast group to which the beacons are sent in the multicast mode (organization-local scope). */
+static const char MULTICAST_GROUP_IPV4[] = "239.255.48.16";
+
+/** The IPv6 multicast group to which the beacons are sent in the multicast mode (link-local scope). */
+static const char MULTICAST_GROUP_IPV6[] = "ff02::4816";
+
+
+
+
+
 UdpBroadcaster::UdpBroadcaster(ComponentCollection & aComponents, QObject * aParent):
 	Super(aParent),
 	ComponentSuper(aComponents),
+	mLogger(aComponents.logger("UdpBroadcaster")),
+	mNeedsInterfaceRefresh(true),
+	mIsMulticastEnabled(Settings::loadValue("UdpBroadcaster", "Multicast", false).toBool()),
 	mPrimaryPort(0),
 	mAltPort(0),
-	mIsDiscovery(false)
+	mIsDiscovery(false),
+	mBeaconIntervalMsec(BEACON_MIN_INTERVAL_MSEC),
+	mAreAllPairedDevicesOnline(false)
 {
+	requireForStart(ComponentCollection::ckTcpListener);
+	requireForStart(ComponentCollection::ckDevices);
+	requireForStart(ComponentCollection::ckDevicePairings);
+
+	mTimer.setSingleShot(true);
 	connect(&mTimer, &QTimer::timeout, this, &UdpBroadcaster::broadcastBeacon);
+	connect(&mInterfaceRefreshTimer, &QTimer::timeout, this, &UdpBroadcaster::refreshInterfaces);
+}
+
+
+
+
+
+void UdpBroadcaster::start()
+{
+	start(DEFAULT_BROADCASTER_PORT, ALTERNATE_BROADCASTER_PORT);
 }
 
 
@@ -30,7 +79,16 @@ void UdpBroadcaster::start(quint16 aPrimaryPort, quint16 aAltPort)
 	assert(aPrimaryPort != 0);
 	mPrimaryPort = aPrimaryPort;
 	mAltPort = aAltPort;
-	mTimer.start(1000);
+
+	// Slow down the beacons once all the paired devices are connected:
+	auto devMgr = mComponents.get<DeviceMgr>();
+	connect(devMgr.get(), &DeviceMgr::deviceAdded,   this, &UdpBroadcaster::updatePairedDevicesOnline);
+	connect(devMgr.get(), &DeviceMgr::deviceRemoved, this, &UdpBroadcaster::updatePairedDevicesOnline);
+	updatePairedDevicesOnline();
+
+	mInterfaceRefreshTimer.start(INTERFACE_REFRESH_INTERVAL_MSEC);
+	refreshInterfaces();
+	mTimer.start(0);
 }
 
 
@@ -40,6 +98,12 @@ void UdpBroadcaster::start(quint16 aPrimaryPort, quint16 aAltPort)
 void UdpBroadcaster::startDiscovery()
 {
 	mIsDiscovery = true;
+
+	// Start the burst right away:
+	if (mPrimaryPort != 0)
+	{
+		mTimer.start(0);
+	}
 }
 
 
@@ -73,21 +137,219 @@ QByteArray UdpBroadcaster::createBeacon(bool aIsDiscovery)
 
 
 
+std::vector<UdpBroadcaster::BeaconSocket> UdpBroadcaster::socketsForInterface(const QNetworkInterface & aInterface, bool & aHasChanged)
+{
+	std::vector<BeaconSocket> res;
+	auto flags = aInterface.flags();
+	if (
+		!flags.testFlag(QNetworkInterface::IsUp) ||
+		!flags.testFlag(QNetworkInterface::IsRunning) ||
+		flags.testFlag(QNetworkInterface::IsLoopBack)
+	)
+	{
+		return res;
+	}
+	auto canMulticast = mIsMulticastEnabled && flags.testFlag(QNetworkInterface::CanMulticast);
+	for (const auto & entry: aInterface.addressEntries())
+	{
+		// Decide where to send the beacons from this address:
+		auto address = entry.ip();
+		std::vector<QHostAddress> targets;
+		if (address.protocol() == QAbstractSocket::IPv4Protocol)
+		{
+			if (flags.testFlag(QNetworkInterface::CanBroadcast) && !entry.broadcast().isNull())
+			{
+				targets.push_back(entry.broadcast());
+			}
+			else
+			{
+				// No known broadcast address (point-to-point links, some VPN and Wi-Fi drivers); fall back to
+				// the limited broadcast, as the beacons always used to be sent:
+				targets.push_back(QHostAddress(QHostAddress::Broadcast));
+			}
+			if (canMulticast)
+			{
+				targets.push_back(QHostAddress(QString::fromUtf8(MULTICAST_GROUP_IPV4)));
+			}
+		}
+		else if ((address.protocol() == QAbstractSocket::IPv6Protocol) && address.isLinkLocal() && canMulticast)
+		{
+			QHostAddress group(QString::fromUtf8(MULTICAST_GROUP_IPV6));
+			group.setScopeId(address.scopeId());
+			targets.push_back(group);
+		}
+		if (targets.empty())
+		{
+			continue;
+		}
+
+		// Reuse the existing socket, if there's one for this address:
+		auto itr = std::find_if(mSockets.begin(), mSockets.end(),
+			[&address, &targets](const BeaconSocket & aSocket)
+			{
+				return ((aSocket.mSocket != nullptr) && (aSocket.mAddress == address) && (aSocket.mTargets == targets));
+			}
+		);
+		if (itr != mSockets.end())
+		{
+			res.push_back(std::move(*itr));
+			continue;
+		}
+		auto socket = std::make_unique<QUdpSocket>();
+		if (!socket->bind(address))
+		{
+			mLogger.log("Cannot bind to %1 for sending the beacons: %2", address, socket->errorString());
+			continue;
+		}
+		if (canMulticast)
+		{
+			socket->setMulticastInterface(aInterface);
+		}
+		if (targets.front() == QHostAddress(QHostAddress::Broadcast))
+		{
+			mLogger.log("Interface %1 reports no broadcast address for %2, using the limited broadcast.",
+				aInterface.humanReadableName(), address
+			);
+		}
+		mLogger.log("Sending the beacons from %1 to %2.", address, targets);
+		res.push_back({std::move(socket), address, std::move(targets)});
+		aHasChanged = true;
+	}
+	return res;
+}
+
+
+
+
+
+void UdpBroadcaster::refreshInterfaces()
+{
+	std::vector<BeaconSocket> sockets;
+	auto hasChanged = false;
+	for (const auto & iface: QNetworkInterface::allInterfaces())
+	{
+		auto ifaceSockets = socketsForInterface(iface, hasChanged);
+		std::move(ifaceSockets.begin(), ifaceSockets.end(), std::back_inserter(sockets));
+	}
+
+	// Any socket not reused means an address has gone away:
+	for (const auto & socket: mSockets)
+	{
+		if (socket.mSocket != nullptr)
+		{
+			hasChanged = true;
+			break;
+		}
+	}
+	std::swap(mSockets, sockets);
+	mNeedsInterfaceRefresh = false;
+
+	// Let the devices on the changed network know about us quickly:
+	if (hasChanged)
+	{
+		mLogger.log("The network interfaces have changed, %1 beacon sockets.", mSockets.size());
+		resetBeaconRate();
+	}
+}
+
+
+
+
+
+void UdpBroadcaster::updatePairedDevicesOnline()
+{
+	std::set<QByteArray> onlineIDs;
+	for (const auto & dev: mComponents.get<DeviceMgr>()->devices())
+	{
+		onlineIDs.insert(dev->deviceID());
+	}
+	auto areAllOnline = true;
+	for (const auto & id: mComponents.get<DevicePairings>()->pairedDeviceIDs())
+	{
+		if (onlineIDs.find(id) == onlineIDs.end())
+		{
+			areAllOnline = false;
+			break;
+		}
+	}
+	if (areAllOnline == mAreAllPairedDevicesOnline)
+	{
+		return;
+	}
+	mAreAllPairedDevicesOnline = areAllOnline;
+	if (!areAllOnline)
+	{
+		// A device has disconnected, help it reconnect:
+		resetBeaconRate();
+	}
+}
+
+
+
+
+
+void UdpBroadcaster::scheduleNextBeacon()
+{
+	if (mIsDiscovery)
+	{
+		mTimer.start(BEACON_DISCOVERY_INTERVAL_MSEC);
+		return;
+	}
+	if (mAreAllPairedDevicesOnline)
+	{
+		mBeaconIntervalMsec = std::min(mBeaconIntervalMsec * 2, BEACON_MAX_INTERVAL_MSEC);
+	}
+	else
+	{
+		mBeaconIntervalMsec = BEACON_MIN_INTERVAL_MSEC;
+	}
+	mTimer.start(mBeaconIntervalMsec);
+}
+
+
+
+
+
+void UdpBroadcaster::resetBeaconRate()
+{
+	mBeaconIntervalMsec = BEACON_MIN_INTERVAL_MSEC;
+	if (mPrimaryPort != 0)
+	{
+		mTimer.start(0);
+	}
+}
+
+
+
+
+
 void UdpBroadcaster::broadcastBeacon()
 {
 	static const auto beaconRegular = createBeacon(false);
 	static const auto beaconDiscovery = createBeacon(true);
 	const auto & beacon = mIsDiscovery ? beaconDiscovery : beaconRegular;
 
-	// Broadcast the beacon on all interfaces / addresses:
-	for (const auto & addr: QNetworkInterface::allAddresses())
+	if (mNeedsInterfaceRefresh)
+	{
+		refreshInterfaces();
+	}
+
+	// Send the beacon on all interfaces:
+	for (const auto & socket: mSockets)
 	{
-		QUdpSocket socket;
-		socket.bind(addr);
-		socket.writeDatagram(beacon, QHostAddress::Broadcast, mPrimaryPort);
-		if (mAltPort > 0)
+		for (const auto & target: socket.mTargets)
 		{
-			socket.writeDatagram(beacon, QHostAddress::Broadcast, mAltPort);
+			auto res = socket.mSocket->writeDatagram(beacon, target, mPrimaryPort);
+			if (mAltPort > 0)
+			{
+				res = std::min(res, socket.mSocket->writeDatagram(beacon, target, mAltPort));
+			}
+			if (res < 0)
+			{
+				// The interface has probably gone down, re-read the interfaces before the next beacon:
+				mNeedsInterfaceRefresh = true;
+			}
 		}
 	}
+	scheduleNextBeacon();
 }
@@ -1,6 +1,8 @@
 #pragma once
 
 #include <atomic>
+#include <memory>
+#include <vector>
 #include <QThread>
 #include <QUdpSocket>
 #include <QTimer>
@@ -10,9 +12,26 @@
 
 
 
+// fwd:
+class QNetworkInterface;
+
+
+
+
+
 /** Broadcasts the UDP beacons so that devices on the local network know about this Deskemes instance.
 Normally broadcasts a non-discovery beacon; after startDiscovery() is called it broadcasts discovery beacons
-until endDiscovery() is called. */
+until endDiscovery() is called.
+The beacons are sent to the broadcast address of each IPv4 interface, through a socket bound to the interface's
+address; the interfaces that report no broadcast address get the limited broadcast (255.255.255.255) instead.
+Optionally (the "UdpBroadcaster/Multicast" setting) they are also sent to the IPv4 and IPv6 multicast groups, for
+networks that filter out broadcasts; the phone app joins these groups (UdpListenerThread), older app versions
+receive only the broadcasts. The sockets are kept between the beacons; the interface list is re-read periodically,
+or after sending through one of the sockets fails.
+The beacon rate adapts: discovery sends the beacons in quick succession; otherwise the beacons go out once per
+second while some of the paired devices are not connected, and once all of them are, the interval decays
+exponentially to a slow keepalive. Any network change, a device disconnecting, or a discovery start resets
+the rate. */
 class UdpBroadcaster:
 	public QObject,
 	public ComponentCollection::Component<ComponentCollection::ckUdpBroadcaster>
@@ -35,12 +54,12 @@ public:
 
 	virtual ~UdpBroadcaster() override {}
 
+	/** Starts broadcasting the beacon on the default ports. */
+	virtual void start() override;
+
 	/** Starts broadcasting the beacon on the two specified UDP ports.
 	If aAltPort is zero, only the aPrimaryPort is used. */
-	void start(
-		quint16 aPrimaryPort = DEFAULT_BROADCASTER_PORT,
-		quint16 aAltPort = ALTERNATE_BROADCASTER_PORT
-	);
+	void start(quint16 aPrimaryPort, quint16 aAltPort);
 
 	/** Turns the Discovery flag on. */
 	void startDiscovery();
@@ -51,9 +70,39 @@ public:
 
 protected:
 
-	/** The timer used for periodicity. */
+	/** A socket bound to a single interface address, used to send the beacons on that interface. */
+	struct BeaconSocket
+	{
+		/** The socket, bound to mAddress. */
+		std::unique_ptr<QUdpSocket> mSocket;
+
+		/** The interface address to which the socket is bound. */
+		QHostAddress mAddress;
+
+		/** The addresses to which the beacons are sent: the interface network's broadcast address,
+		and / or the multicast group. */
+		std::vector<QHostAddress> mTargets;
+	};
+
+
+	/** The logger used for all messages produced by this class. */
+	Logger & mLogger;
+
+	/** The timer for sending the next beacon; single-shot, re-armed after each beacon with the current interval. */
 	QTimer mTimer;
 
+	/** The timer for re-reading the network interfaces. */
+	QTimer mInterfaceRefreshTimer;
+
+	/** The sockets used for sending the beacons, one per interface address. */
+	std::vector<BeaconSocket> mSockets;
+
+	/** Set when sending through a socket fails, so that the interfaces are re-read before the next beacon. */
+	bool mNeedsInterfaceRefresh;
+
+	/** If true, the beacons are sent to the multicast groups as well as to the broadcast addresses. */
+	bool mIsMulticastEnabled;
+
 	/** The primary port on which the broadcasts should be made. 0 if not started. */
 	quint16 mPrimaryPort;
 
@@ -64,15 +113,41 @@ protected:
 	Manipulated by startDiscovery() and endDiscovery(). */
 	bool mIsDiscovery;
 
+	/** The current interval between the regular (non-discovery) beacons. */
+	int mBeaconIntervalMsec;
+
+	/** True if all the paired devices are connected (present in DeviceMgr).
+	Updated whenever a device is added to / removed from DeviceMgr. */
+	bool mAreAllPairedDevicesOnline;
+
 
 	/** Returns the data that should be sent as the beacon.
 	The aIsDiscovery flag is sent in the beacon; discovery indicates that the user is actively searching for new
 	devices via Deskemes' Add new device wizard. */
 	QByteArray createBeacon(bool aIsDiscovery);
 
+	/** Returns the sockets that should be used for the specified interface, reusing the matching ones from mSockets.
+	aHasChanged is set to true if any new socket was created. */
+	std::vector<BeaconSocket> socketsForInterface(const QNetworkInterface & aInterface, bool & aHasChanged);
+
+	/** Schedules the next beacon, updating the interval by the current mode. */
+	void scheduleNextBeacon();
+
+	/** Resets the regular beacon interval to the shortest one and sends a beacon right away. */
+	void resetBeaconRate();
+
 
 protected slots:
 
-	/** Broadcasts a single beacon through mSocket. */
+	/** Broadcasts a single beacon through all the sockets in mSockets, then schedules the next one. */
 	void broadcastBeacon();
+
+	/** Re-reads the network interfaces and updates mSockets to match them.
+	Sockets for the addresses that are still present are kept, the rest are closed, and new ones are bound
+	for the new addresses. If the set of the addresses changes, the beacon rate is reset. */
+	void refreshInterfaces();
+
+	/** Re-checks whether all the paired devices are connected (mAreAllPairedDevicesOnline).
+	If a device has disconnected, the beacon rate is reset, so that it can reconnect quickly. */
+	void updatePairedDevicesOnline();
 };
@@ -1,10 +1,58 @@
 #include "UsbDeviceEnumerator.hpp"
+#include <cassert>
+#include <algorithm>
 #include <QHostAddress>
 #include <QNetworkInterface>
 #include <QProcess>
+#include <QRandomGenerator>
 #include "AdbCommunicator.hpp"
+#include "AdbConnectionPool.hpp"
 #include "DetectedDevices.hpp"
 #include "TcpListener.hpp"
+#include "../Settings.hpp"
+
+
+
+
+
+/** The shortest interval between the watchdog device list polls.
+Used while the tracking is down and while there are devices waiting for the user (unauthorized / need app). */
+static const int WATCHDOG_MIN_INTERVAL_MSEC = 1000;
+
+/** The longest interval between the watchdog device list polls, reached while the tracking works reliably. */
+static const int WATCHDOG_MAX_INTERVAL_MSEC = 30000;
+
+/** The delay before the first attempt to reconnect the device tracking after it has been lost. */
+static const int TRACKER_MIN_RECONNECT_DELAY_MSEC = 500;
+
+/** The longest delay between the attempts to reconnect the device tracking. */
+static const int TRACKER_MAX_RECONNECT_DELAY_MSEC = 30000;
+
+/** The exit code of the app start shell command signalling that the app is not installed on the device. */
+static const int EXIT_CODE_APP_NOT_INSTALLED = 100;
+
+/** The exit code of the app start shell command signalling that the cached APK path is no longer valid
+(the app has been updated or uninstalled since). */
+static const int EXIT_CODE_APP_CACHE_STALE = 101;
+
+/** The number of seconds for which the results of a device's onboarding are reused (see UsbDeviceEnumerator::mAppCache). */
+static const qint64 APP_CACHE_VALIDITY_SEC = 60 * 60;
+
+/** The prefix of the package manager's "pm path" output lines. */
+static const char PM_PATH_PREFIX[] = "package:";
+
+/** The marker preceding the exit code that is echoed by the app start shell command when run through ShellV1
+(which has no other way of reporting the exit code). */
+static const char SHELL_V1_EXIT_MARKER[] = "DESKEMES_EXIT_CODE:";
+
+/** The number of attempts at onboarding a device before it is set as dsFailed. */
+static const int ONBOARDING_MAX_ATTEMPTS = 4;
+
+/** The base delay before retrying a failed onboarding, doubled with each failure (and jittered). */
+static const int ONBOARDING_RETRY_MIN_DELAY_MSEC = 1000;
+
+/** The longest (base) delay before retrying a failed onboarding. */
+static const int ONBOARDING_RETRY_MAX_DELAY_MSEC = 16000;
 
 
 
@@ -12,8 +60,18 @@
 
 UsbDeviceEnumerator::UsbDeviceEnumerator(ComponentCollection & aComponents):
 	ComponentSuper(aComponents),
+	mMaxConcurrentOnboardings(static_cast<size_t>(std::max(Settings::loadValue("UsbDeviceEnumerator", "MaxConcurrentOnboardings", 4).toInt(), 1))),
+	mNextOnboardingID(0),
+	mNumBatchOnboardings(0),
+	mNumBatchOnline(0),
+	mBatchLastOnlineMsec(-1),
 	mIsAdbAvailable(false),
-	mLogger(aComponents.logger("UsbDeviceEnumerator"))
+	mLogger(aComponents.logger("UsbDeviceEnumerator")),
+	mAdbPool(nullptr),
+	mAdbTracker(nullptr),
+	mWatchdogTimer(nullptr),
+	mIsTracking(false),
+	mTrackerReconnectDelayMsec(TRACKER_MIN_RECONNECT_DELAY_MSEC)
 {
 	requireForStart(ComponentCollection::ckTcpListener);
 	requireForStart(ComponentCollection::ckDetectedDevices);
@@ -58,32 +116,150 @@ void UsbDeviceEnumerator::run()
 		mIsAdbAvailable = false;
 	}
 
-	// Set up the device tracking:
-	auto & devListLogger = mComponents.logger("UsbDeviceEnumerator-DevList");
-	auto adbDevList = std::make_unique<AdbCommunicator>(devListLogger);
-	adbDevList->moveToThread(this);
-	connect(adbDevList.get(), &AdbCommunicator::connected,        adbDevList.get(), &AdbCommunicator::trackDevices);
-	connect(adbDevList.get(), &AdbCommunicator::updateDeviceList, this,             &UsbDeviceEnumerator::updateDeviceList);
-	adbDevList->start();
-
-	// Also set up periodic device queries:
-	QTimer timer;
-	connect(&timer, &QTimer::timeout, this, [=, &devListLogger]()
+	// All the operations except for the tracking go through the pool:
+	auto adbPool = std::make_unique<AdbConnectionPool>(
+		mComponents.logger("UsbDeviceEnumerator-AdbPool"),
+		[this](const QByteArray & aDeviceID) -> Logger &
 		{
-			auto adbDevLister = new AdbCommunicator(devListLogger);
-			adbDevLister->moveToThread(this);
-			connect(adbDevLister, &AdbCommunicator::updateDeviceList, this,         &UsbDeviceEnumerator::updateDeviceList);
-			connect(adbDevLister, &AdbCommunicator::connected,        adbDevLister, [=](){adbDevLister->listDevices();});
-			connect(adbDevLister, &AdbCommunicator::disconnected,     adbDevLister, &QObject::deleteLater);
-			adbDevLister->start();
+			return loggerForDevice(aDeviceID);
 		}
 	);
-	timer.start(1000);
+	mAdbPool = adbPool.get();
+
+	// The device tracking is the main source of the device list; the periodic polling is only a watchdog,
+	// polling less often the longer the tracking proves reliable:
+	QTimer watchdogTimer;
+	mWatchdogTimer = &watchdogTimer;
+	connect(&watchdogTimer, &QTimer::timeout, this, &UsbDeviceEnumerator::watchdogPoll);
+	watchdogTimer.start(WATCHDOG_MIN_INTERVAL_MSEC);
+	startTracking();
 
 	exec();
 
-	timer.stop();
-	adbDevList.reset();
+	watchdogTimer.stop();
+	mWatchdogTimer = nullptr;
+	auto tracker = mAdbTracker;
+	mAdbTracker = nullptr;  // Any signals emitted while deleting are ignored
+	delete tracker;
+
+	// Deleting the pool deletes its communicators, whose last signals would still reach the onboarding handlers
+	// and the screen mirrors sharing the pool; drop the onboardings and disconnect the communicators first:
+	mOnboardings.clear();
+	mOnboardingQueue.clear();
+	for (auto comm: adbPool->findChildren<AdbCommunicator *>())
+	{
+		comm->disconnect();
+	}
+	mAdbPool = nullptr;
+	adbPool.reset();
+}
+
+
+
+
+
+void UsbDeviceEnumerator::startTracking()
+{
+	auto tracker = new AdbCommunicator(mComponents.logger("UsbDeviceEnumerator-DevList"));
+	mAdbTracker = tracker;
+	connect(tracker, &AdbCommunicator::connected, tracker, &AdbCommunicator::trackDevices);
+	connect(tracker, &AdbCommunicator::updateDeviceList, this,
+		[this](const AdbCommunicator::DeviceList & aDeviceList)
+		{
+			if (!mIsTracking)
+			{
+				mLogger.log("Device tracking is up.");
+				mIsTracking = true;
+				mTrackerReconnectDelayMsec = TRACKER_MIN_RECONNECT_DELAY_MSEC;
+			}
+			updateDeviceList(aDeviceList);
+		}
+	);
+	auto onLost = [this, tracker]()
+	{
+		if (mAdbTracker != tracker)
+		{
+			// Already handled (both error() and disconnected() may be emitted)
+			return;
+		}
+		mAdbTracker = nullptr;
+		tracker->deleteLater();
+		mIsTracking = false;
+		mLogger.log("Device tracking lost, reconnecting in %1 msec.", mTrackerReconnectDelayMsec);
+		QTimer::singleShot(mTrackerReconnectDelayMsec, this, &UsbDeviceEnumerator::startTracking);
+		mTrackerReconnectDelayMsec = std::min(mTrackerReconnectDelayMsec * 2, TRACKER_MAX_RECONNECT_DELAY_MSEC);
+
+		// Rely on the watchdog until the tracking is back up:
+		mWatchdogTimer->start(WATCHDOG_MIN_INTERVAL_MSEC);
+	};
+	connect(tracker, &AdbCommunicator::error,        this, onLost);
+	connect(tracker, &AdbCommunicator::disconnected, this, onLost);
+	tracker->start();
+}
+
+
+
+
+
+void UsbDeviceEnumerator::watchdogPoll()
+{
+	if (mAdbPool->numQueued(QByteArray()) > 0)
+	{
+		// The previous poll is still waiting for its turn
+		return;
+	}
+	mAdbPool->enqueue(QByteArray(), "listDevices",
+		[this](AdbCommunicator & aComm)
+		{
+			connect(&aComm, &AdbCommunicator::updateDeviceList, this, &UsbDeviceEnumerator::watchdogDeviceList);
+			aComm.listDevices();
+		},
+		nullptr
+	);
+}
+
+
+
+
+
+void UsbDeviceEnumerator::watchdogDeviceList(const AdbCommunicator::DeviceList & aDeviceList)
+{
+	auto interval = mWatchdogTimer->interval();
+	auto isSame = (aDeviceList == mLastDeviceList);
+	if (!mIsTracking)
+	{
+		interval = WATCHDOG_MIN_INTERVAL_MSEC;
+	}
+	else if (isSame)
+	{
+		// The tracking has been right all along, back off:
+		interval = std::min(interval * 2, WATCHDOG_MAX_INTERVAL_MSEC);
+	}
+	else
+	{
+		mLogger.log("The device tracking has missed a change in the device list, polling more often.");
+		interval = WATCHDOG_MIN_INTERVAL_MSEC;
+	}
+	auto onlineIDs = aDeviceList.idsWithStatus(AdbDeviceList::adsOnline);
+	if (!isSame)
+	{
+		updateDeviceList(aDeviceList);
+	}
+	else
+	{
+		checkOnlineDevices(onlineIDs);
+	}
+
+	// Devices waiting for the user (ADB authorization, app install) are likely to change soon; some ADB versions
+	// don't report the unauthorized -> online transition through the tracking:
+	if ((aDeviceList.mNumUnauthorized > 0) || hasDeviceNeedingApp(onlineIDs))
+	{
+		interval = WATCHDOG_MIN_INTERVAL_MSEC;
+	}
+	if (interval != mWatchdogTimer->interval())
+	{
+		mWatchdogTimer->start(interval);
+	}
 }
 
 
@@ -106,21 +282,24 @@ void UsbDeviceEnumerator::requestDeviceScreenshot(const QByteArray & aDeviceID)
 void UsbDeviceEnumerator::invRequestDeviceScreenshot(const QByteArray & aDeviceID)
 {
 	mLogger.log("Requesting screenshot from device %1", aDeviceID);
-	auto adbScreenshotter = new AdbCommunicator(loggerForDevice(aDeviceID));
-	adbScreenshotter->moveToThread(this);
 	auto devID = aDeviceID;
-	connect(adbScreenshotter, &AdbCommunicator::connected,          adbScreenshotter, [=](){adbScreenshotter->assignDevice(devID);});
-	connect(adbScreenshotter, &AdbCommunicator::deviceAssigned,     adbScreenshotter, [=](){adbScreenshotter->takeScreenshot();});
-	connect(adbScreenshotter, &AdbCommunicator::screenshotReceived, this,             &UsbDeviceEnumerator::updateDeviceLastScreenshot);
-	connect(adbScreenshotter, &AdbCommunicator::disconnected,       adbScreenshotter, &QObject::deleteLater);
-	connect(adbScreenshotter, &AdbCommunicator::error, this,
-		[=](const QString & aErrorText)
+	mDevicesRequestedScreenshot.insert(devID);
+	auto onError = [=](const QString & aErrorText)
+	{
+		mLogger.log("Device %1  has failed to produce screenshot: %2.", devID, aErrorText);
+		mDevicesFailedScreenshot.insert(devID);
+		mDevicesRequestedScreenshot.erase(devID);
+	};
+	mAdbPool->enqueueDeviceCommand(devID, "screenshot",
+		[=](AdbCommunicator & aComm)
 		{
-			mLogger.log("Device %1  has failed to produce screenshot: %2.", devID, aErrorText);
-			mDevicesFailedScreenshot.insert(devID);
-		}
+			auto comm = &aComm;
+			connect(comm, &AdbCommunicator::screenshotReceived, this, &UsbDeviceEnumerator::updateDeviceLastScreenshot);
+			connect(comm, &AdbCommunicator::error,              this, onError);
+			comm->takeScreenshot();
+		},
+		onError
 	);
-	adbScreenshotter->start();
 }
 
 
@@ -129,100 +308,620 @@ void UsbDeviceEnumerator::invRequestDeviceScreenshot(const QByteArray & aDeviceI
 
 void UsbDeviceEnumerator::tryStartApp(const QByteArray & aDeviceID)
 {
-	// If detection is already running on the device, bail out:
-	auto itr = mDetectionStatus.find(aDeviceID);
-	if (itr != mDetectionStatus.cend())
+	// If the onboarding is already running on the device, bail out:
+	if (mOnboardings.find(aDeviceID) != mOnboardings.cend())
 	{
 		return;
 	}
 
-	mLogger.log("Attempting to start the app on device %1.", aDeviceID);
-	mDetectionStatus[aDeviceID];
+	mLogger.log("Queueing the app start on device %1.", aDeviceID);
+	startOnboardingBatch();
+	mNumBatchOnboardings += 1;
+	auto & onboarding = mOnboardings[aDeviceID];
+	onboarding.mID = mNextOnboardingID++;
+	onboarding.mState = osQueued;
+	onboarding.mNumFailures = 0;
+	mOnboardingQueue.push_back(aDeviceID);
+	startQueuedOnboardings();
+}
+
 
-	auto shellCmd = QString::fromUtf8("pm list packages cz.xoft.deskemes");
-	auto devID = aDeviceID;
-	auto appQuery = new AdbCommunicator(loggerForDevice(aDeviceID));
-	appQuery->moveToThread(this);
-	connect(appQuery, &AdbCommunicator::connected,         this, [=](){appQuery->assignDevice(devID);});
-	connect(appQuery, &AdbCommunicator::deviceAssigned,    this, [=](){appQuery->shellExecuteV1(shellCmd.toUtf8());});
-	connect(appQuery, &AdbCommunicator::shellIncomingData, this,
-		[this](const QByteArray & aDeviceID, const QByteArray & aShellOutOrErr)
+
+
+
+void UsbDeviceEnumerator::cancelOnboarding(const QByteArray & aDeviceID)
+{
+	// The operations already in the pool will find their onboarding gone and ignore their results:
+	if (mOnboardings.erase(aDeviceID) > 0)
+	{
+		if (mAdbPool != nullptr)
 		{
-			mDetectionStatus[aDeviceID].mAppPackageQueryOutput.append(aShellOutOrErr);
+			mAdbPool->endTransportSession(aDeviceID);
 		}
-	);
-	connect(appQuery, &AdbCommunicator::error, this,
-		[this, devID](const QString & aErrorText)
+		mLogger.log("Cancelled the app start on device %1.", aDeviceID);
+		startQueuedOnboardings();
+		checkOnboardingBatchEnd();
+	}
+}
+
+
+
+
+
+UsbDeviceEnumerator::Onboarding * UsbDeviceEnumerator::findOnboarding(const QByteArray & aDeviceID, quint64 aOnboardingID)
+{
+	auto itr = mOnboardings.find(aDeviceID);
+	if ((itr == mOnboardings.end()) || (itr->second.mID != aOnboardingID))
+	{
+		return nullptr;
+	}
+	return &itr->second;
+}
+
+
+
+
+
+size_t UsbDeviceEnumerator::numActiveOnboardings() const
+{
+	size_t res = 0;
+	for (const auto & onboarding: mOnboardings)
+	{
+		switch (onboarding.second.mState)
 		{
-			mLogger.log("Error while checking on %1 for app: %2.", devID, aErrorText);
-			auto itr = mDetectionStatus.find(devID);
-			if (itr != mDetectionStatus.end())
+			case osQueued:
+			case osWaitingForRetry:
+			{
+				break;
+			}
+			case osCheckingReverse:
+			case osReversingPort:
+			case osQueryingFeatures:
+			case osStartingApp:
+			case osStartingAppShellV1:
 			{
-				mDetectionStatus.erase(itr);
+				res += 1;
+				break;
 			}
 		}
-	);
-	connect(appQuery, &AdbCommunicator::disconnected, this,
-		[this, devID, appQuery]()
+	}
+	return res;
+}
+
+
+
+
+
+void UsbDeviceEnumerator::startQueuedOnboardings()
+{
+	auto numActive = numActiveOnboardings();
+	while ((numActive < mMaxConcurrentOnboardings) && !mOnboardingQueue.empty())
+	{
+		auto devID = mOnboardingQueue.front();
+		mOnboardingQueue.pop_front();
+		auto itr = mOnboardings.find(devID);
+		if ((itr == mOnboardings.end()) || (itr->second.mState != osQueued))
+		{
+			// Cancelled in the meantime
+			continue;
+		}
+		numActive += 1;
+		advanceOnboarding(devID, itr->second.mID);
+	}
+}
+
+
+
+
+
+void UsbDeviceEnumerator::advanceOnboarding(const QByteArray & aDeviceID, quint64 aOnboardingID)
+{
+	auto onboarding = findOnboarding(aDeviceID, aOnboardingID);
+	if (onboarding == nullptr)
+	{
+		return;
+	}
+	switch (onboarding->mState)
+	{
+		case osQueued:
 		{
-			appQuery->deleteLater();
-			auto itr = mDetectionStatus.find(devID);
-			bool hasApp = false;
-			if (itr != mDetectionStatus.end())
+			// The app needs the port reversing in place before it is started, set it up first,
+			// unless the one from the last onboarding is still there.
+			// The steps follow one another, keep a connection switched to the device ready for each next one:
+			mLogger.log("Attempting to start the app on device %1.", aDeviceID);
+			mAdbPool->beginTransportSession(aDeviceID);
+			auto cacheEntry = validAppCacheEntry(aDeviceID);
+			if ((cacheEntry != nullptr) && (cacheEntry->mReversedPort == mTcpListenerPort))
 			{
-				hasApp = itr->second.mAppPackageQueryOutput.contains("cz.xoft.deskemes");
+				onboarding->mState = osCheckingReverse;
+				checkPortReverse(aDeviceID, aOnboardingID);
 			}
-			if (hasApp)
+			else
 			{
-				setupPortReversingAndConnect(devID);
+				onboarding->mState = osReversingPort;
+				setupPortReversing(aDeviceID, aOnboardingID);
 			}
-			else
+			return;
+		}
+		case osCheckingReverse:
+		case osReversingPort:
+		case osQueryingFeatures:
+		{
+			// The port reversing is in place (and the ShellV2 support is known), start the app:
+			startAppStartCommand(aDeviceID, aOnboardingID);
+			return;
+		}
+		case osStartingApp:
+		case osStartingAppShellV1:
+		case osWaitingForRetry:
+		{
+			// The app start is finished by appStartFinished(), the retry restarts from osQueued
+			mLogger.log("ERROR: Cannot advance the onboarding of device %1 from state %2.", aDeviceID, static_cast<int>(onboarding->mState));
+			assert(!"Invalid onboarding state transition");
+			return;
+		}
+	}
+}
+
+
+
+
+
+void UsbDeviceEnumerator::onboardingFailed(const QByteArray & aDeviceID, quint64 aOnboardingID, const QString & aErrorText)
+{
+	auto onboarding = findOnboarding(aDeviceID, aOnboardingID);
+	if ((onboarding == nullptr) || (onboarding->mState == osWaitingForRetry))
+	{
+		// Cancelled, or already handled (both error() and disconnected() may be reported)
+		return;
+	}
+	onboarding->mNumFailures += 1;
+	if (onboarding->mNumFailures >= ONBOARDING_MAX_ATTEMPTS)
+	{
+		mLogger.log("Starting the app on device %1 failed: %2; giving up after %3 attempts.", aDeviceID, aErrorText, onboarding->mNumFailures);
+		finishOnboarding(aDeviceID, DetectedDevices::Device::dsFailed);
+		return;
+	}
+
+	// Retry after an exponential backoff; the jitter keeps the devices on a hub from retrying all at once:
+	auto delay = std::min(ONBOARDING_RETRY_MIN_DELAY_MSEC << (onboarding->mNumFailures - 1), ONBOARDING_RETRY_MAX_DELAY_MSEC);
+	delay = delay / 2 + QRandomGenerator::global()->bounded(delay);
+	mLogger.log("Starting the app on device %1 failed: %2; retrying in %3 msec.", aDeviceID, aErrorText, delay);
+	onboarding->mState = osWaitingForRetry;
+	if (mAdbPool == nullptr)
+	{
+		// Shutting down
+		return;
+	}
+	mAdbPool->endTransportSession(aDeviceID);
+	auto devID = aDeviceID;
+	QTimer::singleShot(delay, this,
+		[this, devID, aOnboardingID]()
+		{
+			auto onb = findOnboarding(devID, aOnboardingID);
+			if ((onb == nullptr) || (onb->mState != osWaitingForRetry))
 			{
-				mLogger.log("Device %1 doesn't have the app installed.", devID);
-				auto dd = mComponents.get<DetectedDevices>();
-				dd->setDeviceStatus(mKind, devID, DetectedDevices::Device::dsNeedApp);
-				mDetectionStatus.erase(itr);
+				return;
 			}
+			onb->mState = osQueued;
+			mOnboardingQueue.push_back(devID);
+			startQueuedOnboardings();
 		}
 	);
+	startQueuedOnboardings();
+}
+
+
+
 
-	appQuery->start();
+
+void UsbDeviceEnumerator::finishOnboarding(const QByteArray & aDeviceID, DetectedDevices::Device::Status aStatus)
+{
+	mOnboardings.erase(aDeviceID);
+	if (mAdbPool != nullptr)
+	{
+		mAdbPool->endTransportSession(aDeviceID);
+	}
+	mComponents.get<DetectedDevices>()->setDeviceStatus(mKind, aDeviceID, aStatus);
+	if (aStatus == DetectedDevices::Device::dsOnline)
+	{
+		mNumBatchOnline += 1;
+		mBatchLastOnlineMsec = mOnboardingBatchTimer.elapsed();
+	}
+
+	// The device is now known to DetectedDevices, give it its avatar right away:
+	if ((aStatus != DetectedDevices::Device::dsFailed) && (mAdbPool != nullptr))
+	{
+		requestMissingScreenshot(aDeviceID);
+	}
+	startQueuedOnboardings();
+	checkOnboardingBatchEnd();
 }
 
 
 
 
 
-void UsbDeviceEnumerator::setupPortReversingAndConnect(const QByteArray & aDeviceID)
+void UsbDeviceEnumerator::startOnboardingBatch()
+{
+	if (mOnboardingBatchTimer.isValid())
+	{
+		return;
+	}
+	mOnboardingBatchTimer.start();
+	mNumBatchOnboardings = 0;
+	mNumBatchOnline = 0;
+	mBatchLastOnlineMsec = -1;
+}
+
+
+
+
+
+void UsbDeviceEnumerator::checkOnboardingBatchEnd()
+{
+	// The devices waiting for the user to authorize them still belong to the batch:
+	if (!mOnboardings.empty() || (mLastDeviceList.mNumUnauthorized > 0) || !mOnboardingBatchTimer.isValid())
+	{
+		return;
+	}
+	mLogger.log("Onboarding batch finished in %1 msec: %2 of %3 devices online, the last one %4 msec after the first device was detected (MaxConcurrentOnboardings %5).",
+		mOnboardingBatchTimer.elapsed(), mNumBatchOnline, mNumBatchOnboardings, mBatchLastOnlineMsec, mMaxConcurrentOnboardings
+	);
+	mOnboardingBatchTimer.invalidate();
+}
+
+
+
+
+
+const UsbDeviceEnumerator::AppCacheEntry * UsbDeviceEnumerator::validAppCacheEntry(const QByteArray & aDeviceID) const
+{
+	auto itr = mAppCache.find(aDeviceID);
+	if (itr == mAppCache.cend())
+	{
+		return nullptr;
+	}
+	if (itr->second.mTimestamp.secsTo(QDateTime::currentDateTimeUtc()) > APP_CACHE_VALIDITY_SEC)
+	{
+		return nullptr;
+	}
+	return &itr->second;
+}
+
+
+
+
+
+void UsbDeviceEnumerator::checkPortReverse(const QByteArray & aDeviceID, quint64 aOnboardingID)
+{
+	mLogger.log("Checking the port-reversing on device %1.", aDeviceID);
+	auto devID = aDeviceID;
+	auto reverseAgain = [=]()
+	{
+		auto onboarding = findOnboarding(devID, aOnboardingID);
+		if ((onboarding == nullptr) || (onboarding->mState != osCheckingReverse))
+		{
+			return;
+		}
+		onboarding->mState = osReversingPort;
+		setupPortReversing(devID, aOnboardingID);
+	};
+	auto onError = [=](const QString & aErrorText)
+	{
+		// Not fatal, the reversing will simply be set up again:
+		mLogger.log("Listing the port-reversing on device %1 failed: %2", devID, aErrorText);
+		reverseAgain();
+	};
+	mAdbPool->enqueueDeviceCommand(devID, "listPortReverses",
+		[=](AdbCommunicator & aComm)
+		{
+			auto comm = &aComm;
+			connect(comm, &AdbCommunicator::portReversesListed, this,
+				[=](const QByteArray & aListDeviceID, const std::vector<AdbCommunicator::PortReverse> & aReverses)
+				{
+					auto port = "tcp:" + QByteArray::number(mTcpListenerPort);
+					for (const auto & reverse: aReverses)
+					{
+						if ((reverse.mDeviceSide == port) && (reverse.mLocalSide == port))
+						{
+							mLogger.log("The port-reversing on device %1 is still in place.", aListDeviceID);
+							advanceOnboarding(aListDeviceID, aOnboardingID);
+							return;
+						}
+					}
+					reverseAgain();
+				}
+			);
+			connect(comm, &AdbCommunicator::error, this, onError);
+			comm->listPortReverses();
+		},
+		onError
+	);
+}
+
+
+
+
+
+void UsbDeviceEnumerator::setupPortReversing(const QByteArray & aDeviceID, quint64 aOnboardingID)
 {
 	mLogger.log("Requesting port-reversing on device %1.", aDeviceID);
-	auto adbReverser = new AdbCommunicator(loggerForDevice(aDeviceID));
-	adbReverser->moveToThread(this);
 	auto devID = aDeviceID;
-	connect(adbReverser, &AdbCommunicator::connected,                this,        [=](){adbReverser->assignDevice(devID);});
-	connect(adbReverser, &AdbCommunicator::deviceAssigned,           this,        [=](){adbReverser->portReverse(mTcpListenerPort, mTcpListenerPort);});
-	connect(adbReverser, &AdbCommunicator::portReversingEstablished, this,        &UsbDeviceEnumerator::startConnectionToApp);
-	connect(adbReverser, &AdbCommunicator::disconnected,             adbReverser, &QObject::deleteLater);
-	connect(adbReverser, &AdbCommunicator::error,                    this,
-		[=](QString aErrorText)
+	auto onError = [=](const QString & aErrorText)
+	{
+		onboardingFailed(devID, aOnboardingID, tr("Port reversing setup failed: %1").arg(aErrorText));
+	};
+	mAdbPool->enqueueDeviceCommand(devID, "portReverse",
+		[=](AdbCommunicator & aComm)
+		{
+			auto comm = &aComm;
+			connect(comm, &AdbCommunicator::portReversingEstablished, this, [=](){advanceOnboarding(devID, aOnboardingID);});
+			connect(comm, &AdbCommunicator::error,                    this, onError);
+			comm->portReverse(mTcpListenerPort, mTcpListenerPort);
+		},
+		onError
+	);
+}
+
+
+
+
+
+void UsbDeviceEnumerator::startAppStartCommand(const QByteArray & aDeviceID, quint64 aOnboardingID)
+{
+	auto onboarding = findOnboarding(aDeviceID, aOnboardingID);
+	if (onboarding == nullptr)
+	{
+		return;
+	}
+	onboarding->mShellStdOut.clear();
+	onboarding->mShellStdErr.clear();
+	auto itr = mDeviceHasShellV2.find(aDeviceID);
+	if (itr == mDeviceHasShellV2.cend())
+	{
+		onboarding->mState = osQueryingFeatures;
+		queryDeviceFeatures(aDeviceID, aOnboardingID);
+	}
+	else if (itr->second)
+	{
+		onboarding->mState = osStartingApp;
+		startConnectionToApp(aDeviceID, aOnboardingID);
+	}
+	else
+	{
+		onboarding->mState = osStartingAppShellV1;
+		startConnectionToAppShellV1(aDeviceID, aOnboardingID);
+	}
+}
+
+
+
+
+
+void UsbDeviceEnumerator::queryDeviceFeatures(const QByteArray & aDeviceID, quint64 aOnboardingID)
+{
+	auto devID = aDeviceID;
+	auto onError = [=](const QString & aErrorText)
+	{
+		// Old ADB servers don't know the features query; try ShellV2, it falls back to ShellV1 if refused:
+		auto onboarding = findOnboarding(devID, aOnboardingID);
+		if ((onboarding == nullptr) || (onboarding->mState != osQueryingFeatures))
 		{
-			mLogger.log("Port reversing setup on device %1 failed: %2", devID, aErrorText);
-			mComponents.get<DetectedDevices>()->setDeviceStatus(mKind, devID, DetectedDevices::Device::dsFailed);
+			return;
 		}
+		mLogger.log("Cannot query the features of device %1 (%2), trying ShellV2.", devID, aErrorText);
+		onboarding->mState = osStartingApp;
+		startConnectionToApp(devID, aOnboardingID);
+	};
+	mAdbPool->enqueue(devID, "features",
+		[=](AdbCommunicator & aComm)
+		{
+			auto comm = &aComm;
+			connect(comm, &AdbCommunicator::featuresReceived, this,
+				[=](const QByteArray & aFeaturesDeviceID, const QList<QByteArray> & aFeatures)
+				{
+					comm->disconnect(this);
+					auto onboarding = findOnboarding(aFeaturesDeviceID, aOnboardingID);
+					if ((onboarding == nullptr) || (onboarding->mState != osQueryingFeatures))
+					{
+						return;
+					}
+					mDeviceHasShellV2[aFeaturesDeviceID] = aFeatures.contains("shell_v2");
+					advanceOnboarding(aFeaturesDeviceID, aOnboardingID);
+				}
+			);
+			connect(comm, &AdbCommunicator::error, this,
+				[=](const QString & aErrorText)
+				{
+					comm->disconnect(this);
+					onError(aErrorText);
+				}
+			);
+			comm->queryFeatures(devID);
+		},
+		onError
 	);
-	adbReverser->start();
 }
 
 
 
 
 
-void UsbDeviceEnumerator::startConnectionToApp(const QByteArray & aDeviceID)
+void UsbDeviceEnumerator::startConnectionToApp(const QByteArray & aDeviceID, quint64 aOnboardingID)
 {
 	mLogger.log("Attempting to start the connection from the app on device %1.", aDeviceID);
+	auto cacheEntry = validAppCacheEntry(aDeviceID);
+	auto shellCmd = appStartShellCommand((cacheEntry == nullptr) ? QByteArray() : cacheEntry->mApkPath);
+	auto devID = aDeviceID;
+	auto onError = [=](const QString & aErrorText)
+	{
+		onboardingFailed(devID, aOnboardingID, tr("Error while starting connection by intent: %1").arg(aErrorText));
+	};
+	mAdbPool->enqueueDeviceCommand(devID, "startApp",
+		[=](AdbCommunicator & aComm)
+		{
+			auto comm = &aComm;
+			connect(comm, &AdbCommunicator::shellStdOut, this,
+				[=](const QByteArray & aShellDeviceID, const QByteArray & aData)
+				{
+					if (auto onboarding = findOnboarding(aShellDeviceID, aOnboardingID))
+					{
+						onboarding->mShellStdOut.append(aData);
+					}
+				}
+			);
+			connect(comm, &AdbCommunicator::shellStdErr, this,
+				[=](const QByteArray & aShellDeviceID, const QByteArray & aData)
+				{
+					if (auto onboarding = findOnboarding(aShellDeviceID, aOnboardingID))
+					{
+						onboarding->mShellStdErr.append(aData);
+					}
+				}
+			);
+			connect(comm, &AdbCommunicator::shellFinished, this,
+				[=](const QByteArray & aShellDeviceID, int aExitCode)
+				{
+					// The onboarding may go on with another command, the upcoming disconnection is not a failure:
+					comm->disconnect(this);
+					appStartFinished(aShellDeviceID, aOnboardingID, aExitCode);
+				}
+			);
+			connect(comm, &AdbCommunicator::disconnected, this,
+				[=]()
+				{
+					// If the command has finished, the onboarding is no longer in this state and this is ignored:
+					auto onboarding = findOnboarding(devID, aOnboardingID);
+					if ((onboarding != nullptr) && (onboarding->mState == osStartingApp))
+					{
+						onboardingFailed(devID, aOnboardingID, tr("The connection was closed before the app start command finished."));
+					}
+				}
+			);
+			connect(comm, &AdbCommunicator::shellV2Refused, this,
+				[=](const QByteArray & aShellDeviceID, const QString & aErrorText)
+				{
+					// The features said ShellV2 (or couldn't be queried), yet the device doesn't know the service;
+					// retry with ShellV1 (and use it until the device disconnects).
+					// Disconnect first, the error() signal that follows is not an onboarding failure:
+					Q_UNUSED(aShellDeviceID);
+					comm->disconnect(this);
+					auto onboarding = findOnboarding(devID, aOnboardingID);
+					if (onboarding == nullptr)
+					{
+						return;
+					}
+					mLogger.log("ShellV2 failed on device %1 (%2), falling back to ShellV1.", devID, aErrorText);
+					mDeviceHasShellV2[devID] = false;
+					onboarding->mState = osStartingAppShellV1;
+					onboarding->mShellStdOut.clear();
+					onboarding->mShellStdErr.clear();
+					startConnectionToAppShellV1(devID, aOnboardingID);
+				}
+			);
+			connect(comm, &AdbCommunicator::error, this,
+				[=](const QString & aErrorText)
+				{
+					comm->disconnect(this);
+					onError(aErrorText);
+				}
+			);
+			comm->shellExecuteV2(shellCmd);
+		},
+		onError
+	);
+}
+
+
+
+
+
+void UsbDeviceEnumerator::startConnectionToAppShellV1(const QByteArray & aDeviceID, quint64 aOnboardingID)
+{
+	mLogger.log("Attempting to start the connection from the app on device %1 (ShellV1).", aDeviceID);
 
-	// Build the shell commandline with all our IPs that are not loopback:
-	auto shellCmd = QString::fromUtf8("am startservice -n cz.xoft.deskemes/.InitiateConnectionService --ei LocalPort %1 --ei Port %1 --es Addresses \"").arg(mTcpListenerPort);
+	// Run the command in a subshell, so that its exit code can be echoed even if it exits:
+	auto cacheEntry = validAppCacheEntry(aDeviceID);
+	auto cmd = appStartShellCommand((cacheEntry == nullptr) ? QByteArray() : cacheEntry->mApkPath);
+	auto shellCmd = "(" + cmd + "); echo " + SHELL_V1_EXIT_MARKER + "$?";
+	auto devID = aDeviceID;
+	auto onError = [=](const QString & aErrorText)
+	{
+		onboardingFailed(devID, aOnboardingID, tr("Error while starting connection by intent: %1").arg(aErrorText));
+	};
+	mAdbPool->enqueueDeviceCommand(devID, "startAppV1",
+		[=](AdbCommunicator & aComm)
+		{
+			auto comm = &aComm;
+			connect(comm, &AdbCommunicator::shellIncomingData, this,
+				[=](const QByteArray & aShellDeviceID, const QByteArray & aShellOutOrErr)
+				{
+					if (auto onboarding = findOnboarding(aShellDeviceID, aOnboardingID))
+					{
+						onboarding->mShellStdOut.append(aShellOutOrErr);
+					}
+				}
+			);
+			connect(comm, &AdbCommunicator::disconnected, this,
+				[=]()
+				{
+					auto onboarding = findOnboarding(devID, aOnboardingID);
+					if ((onboarding == nullptr) || (onboarding->mState != osStartingAppShellV1))
+					{
+						// Cancelled, or already handled as an error
+						return;
+					}
+
+					// Split the echoed exit code off the output:
+					auto & output = onboarding->mShellStdOut;
+					auto idx = output.lastIndexOf(SHELL_V1_EXIT_MARKER);
+					auto exitCode = -1;
+					if (idx >= 0)
+					{
+						bool isOK;
+						exitCode = output.mid(idx + static_cast<int>(sizeof(SHELL_V1_EXIT_MARKER)) - 1).trimmed().toInt(&isOK);
+						if (!isOK)
+						{
+							exitCode = -1;
+						}
+						output.truncate(idx);
+					}
+					appStartFinished(devID, aOnboardingID, exitCode);
+				}
+			);
+			connect(comm, &AdbCommunicator::error, this, onError);
+			comm->shellExecuteV1(shellCmd);
+		},
+		onError
+	);
+}
+
+
+
+
+
+QByteArray UsbDeviceEnumerator::appStartShellCommand(const QByteArray & aCachedApkPath) const
+{
+	// Check that the app is installed (using only shell builtins, so that it works on all Android versions):
+	QByteArray cmd;
+	if (aCachedApkPath.isEmpty())
+	{
+		// Ask the package manager, print out the APK path for the cache:
+		cmd = "p=\"$(pm path cz.xoft.deskemes)\"; case \"$p\" in package:*) echo \"$p\";; *) exit ";
+		cmd.append(QByteArray::number(EXIT_CODE_APP_NOT_INSTALLED));
+		cmd.append(";; esac; ");
+	}
+	else
+	{
+		// The APK path is only cached if it contains no quotes (see appStartFinished()):
+		cmd = "[ -f '" + aCachedApkPath + "' ] || exit ";
+		cmd.append(QByteArray::number(EXIT_CODE_APP_CACHE_STALE));
+		cmd.append("; ");
+	}
+
+	// Start the service, with all our IPs that are not loopback:
+	auto startCmd = QString::fromUtf8("am startservice -n cz.xoft.deskemes/.InitiateConnectionService --ei LocalPort %1 --ei Port %1 --es Addresses \"").arg(mTcpListenerPort);
 	for (const auto & address: QNetworkInterface::allAddresses())
 	{
 		if (
@@ -235,117 +934,194 @@ void UsbDeviceEnumerator::startConnectionToApp(const QByteArray & aDeviceID)
 		{
 			auto addrCopy = address;
 			addrCopy.setScopeId(QString());
-			shellCmd += QString::fromUtf8(" %1").arg(addrCopy.toString());
+			startCmd += QString::fromUtf8(" %1").arg(addrCopy.toString());
 		}
 	}
-	shellCmd += "\"";
-
-	auto devID = aDeviceID;
-	auto appStarter = new AdbCommunicator(loggerForDevice(devID));
-	appStarter->moveToThread(this);
-	connect(appStarter, &AdbCommunicator::connected,      this, [=](){appStarter->assignDevice(devID);});
-	connect(appStarter, &AdbCommunicator::deviceAssigned, this, [=](){appStarter->shellExecuteV1(shellCmd.toUtf8());});
-	connect(appStarter, &AdbCommunicator::disconnected,   appStarter, &QObject::deleteLater);
-	connect(appStarter, &AdbCommunicator::shellIncomingData, this,
-		[=](const QByteArray & aDeviceID, const QByteArray & aShellOutOrErr)
-		{
-			mDetectionStatus[aDeviceID].mStartServiceOutput.append(aShellOutOrErr);
-		}
-	);
-	connect(appStarter, &AdbCommunicator::disconnected, this,
-		[=]()
-		{
-			appStarter->deleteLater();
-			auto shellOutput = std::move(mDetectionStatus[devID].mStartServiceOutput);
-			mDetectionStatus.erase(aDeviceID);
-			if (shellOutput.isEmpty())
-			{
-				// There was no error message, assume the service was started
-				// The device should connect via regular TCP now
-				// TODO: What if the device still needs pairing?
-				mComponents.get<DetectedDevices>()->setDeviceStatus(mKind, devID, DetectedDevices::Device::dsOnline);
-			}
-			else
-			{
-				mComponents.get<DetectedDevices>()->setDeviceStatus(mKind, devID, DetectedDevices::Device::dsFailed);
-			}
-		}
-	);
-	connect(appStarter, &AdbCommunicator::error, this,
-		[=](const QString & aErrorText)
-		{
-			mLogger.log("Error while starting connection to %1 by intent: %2", devID, aErrorText);
-			mComponents.get<DetectedDevices>()->setDeviceStatus(mKind, devID, DetectedDevices::Device::dsFailed);
-		}
-	);
-	appStarter->start();
+	startCmd += "\"";
+	cmd.append(startCmd.toUtf8());
+	return cmd;
 }
 
 
 
 
 
-Logger & UsbDeviceEnumerator::loggerForDevice(const QString & aDeviceID)
+void UsbDeviceEnumerator::appStartFinished(const QByteArray & aDeviceID, quint64 aOnboardingID, int aExitCode)
 {
-	return mComponents.logger("UsbDeviceEnumerator-" + aDeviceID);
+	auto onboarding = findOnboarding(aDeviceID, aOnboardingID);
+	if (onboarding == nullptr)
+	{
+		// Cancelled in the meantime
+		return;
+	}
+	const auto & stdOut = onboarding->mShellStdOut;
+	const auto & stdErr = onboarding->mShellStdErr;
+
+	if (aExitCode == EXIT_CODE_APP_NOT_INSTALLED)
+	{
+		mLogger.log("Device %1 doesn't have the app installed.", aDeviceID);
+		mAppCache.erase(aDeviceID);
+		finishOnboarding(aDeviceID, DetectedDevices::Device::dsNeedApp);
+		return;
+	}
+	if (aExitCode == EXIT_CODE_APP_CACHE_STALE)
+	{
+		// The app has been updated or uninstalled since the last onboarding, ask the package manager:
+		mLogger.log("The cached app info for device %1 is stale, re-checking the app.", aDeviceID);
+		mAppCache.erase(aDeviceID);
+		startAppStartCommand(aDeviceID, aOnboardingID);
+		return;
+	}
+
+	// "am" reports some of its failures only in the output, not in the exit code:
+	if ((aExitCode == 0) && stdErr.trimmed().isEmpty() && !stdOut.contains("Error"))
+	{
+		// The service was started, the device should connect via regular TCP now
+		// TODO: What if the device still needs pairing?
+		mLogger.log("The app on device %1 has been started.", aDeviceID);
+		updateAppCache(aDeviceID, stdOut);
+		finishOnboarding(aDeviceID, DetectedDevices::Device::dsOnline);
+	}
+	else
+	{
+		onboardingFailed(aDeviceID, aOnboardingID,
+			tr("exit code %1:\n%2\n%3").arg(aExitCode).arg(QString::fromUtf8(stdOut), QString::fromUtf8(stdErr))
+		);
+	}
 }
 
 
 
 
 
-void UsbDeviceEnumerator::updateDeviceList(
-	const QList<QByteArray> & aOnlineIDs,
-	const QList<QByteArray> & aUnauthIDs,
-	const QList<QByteArray> & aOtherIDs
-)
+void UsbDeviceEnumerator::updateAppCache(const QByteArray & aDeviceID, const QByteArray & aAppStartStdOut)
 {
-	auto dd = mComponents.get<DetectedDevices>();
-	auto devEntries = dd->allEnumeratorDevices(mKind);
+	auto & entry = mAppCache[aDeviceID];
+	entry.mReversedPort = mTcpListenerPort;
+	entry.mTimestamp = QDateTime::currentDateTimeUtc();
 
-	// Set devices no longer tracked as offline:
-	for (const auto & devEntry: devEntries)
+	// The output starts with the "pm path" lines if the package manager was asked; keep the cached path otherwise.
+	// Split APKs report a line for each split, the base APK is the first one:
+	if (!aAppStartStdOut.startsWith(PM_PATH_PREFIX))
 	{
-		const auto & id = devEntry.second->enumeratorDeviceID();
-		if (
-			!aOnlineIDs.contains(id) &&
-			!aUnauthIDs.contains(id) &&
-			!aOtherIDs.contains(id)
-		)
-		{
-			dd->setDeviceStatus(mKind, id, DetectedDevices::Device::dsOffline);
-		}
+		return;
 	}
-
-	// Set all unauth devices as dsUnauthorized:
-	for (const auto & id: aUnauthIDs)
+	auto lineEnd = aAppStartStdOut.indexOf('\n');
+	auto path = aAppStartStdOut.mid(
+		static_cast<int>(sizeof(PM_PATH_PREFIX)) - 1,
+		(lineEnd < 0) ? -1 : lineEnd - static_cast<int>(sizeof(PM_PATH_PREFIX)) + 1
+	).trimmed();
+	if (path.contains('\''))
 	{
-		dd->setDeviceStatus(mKind, id, DetectedDevices::Device::dsUnauthorized);
+		// Not safe to put into the shell command, don't cache
+		path.clear();
 	}
+	entry.mApkPath = path;
+}
+
+
 
-	// Set all other devices as dsOffline; forget about screenshot failures:
-	for (const auto & id: aOtherIDs)
+
+
+Logger & UsbDeviceEnumerator::loggerForDevice(const QByteArray & aDeviceID)
+{
+	return mComponents.logger("UsbDeviceEnumerator-" + QString::fromUtf8(aDeviceID));
+}
+
+
+
+
+
+void UsbDeviceEnumerator::updateDeviceList(const AdbCommunicator::DeviceList & aDeviceList)
+{
+	// Both the tracking and the watchdog report the full list; nothing to do if it hasn't changed:
+	if (aDeviceList == mLastDeviceList)
 	{
-		dd->setDeviceStatus(mKind, id, DetectedDevices::Device::dsOffline);
-		mDevicesFailedScreenshot.erase(id);
+		return;
 	}
 
-	// Request a screenshot for all online devices that haven't failed to screenshot before:
-	for (const auto & id: aOnlineIDs)
+	// Push only the differences into DetectedDevices:
+	auto dd = mComponents.get<DetectedDevices>();
+	std::vector<QByteArray> newOnlineIDs;
+	for (const auto & change: AdbDeviceList::diff(mLastDeviceList, aDeviceList))
 	{
-		if (mDevicesFailedScreenshot.find(id) != mDevicesFailedScreenshot.cend())
+		const auto & id = change.mDeviceID;
+		if (change.mIsRemoved)
 		{
+			cancelOnboarding(id);
+			dd->setDeviceStatus(mKind, id, DetectedDevices::Device::dsOffline);
+			mDevicesRequestedScreenshot.erase(id);
+			mDeviceHasShellV2.erase(id);
 			continue;
 		}
-		auto devItr = devEntries.find(id);
-		if (devItr != devEntries.cend())
+
+		// The device is new, or its status has changed. The onboarding batch is timed from the new device's detection,
+		// even if it needs authorizing first:
+		if (
+			(change.mNewStatus != AdbDeviceList::adsOther) &&
+			(mLastDeviceList.mDevices.find(id) == mLastDeviceList.mDevices.cend())
+		)
 		{
-			if (devItr->second->avatar().isNull())
+			startOnboardingBatch();
+		}
+		switch (change.mNewStatus)
+		{
+			case AdbDeviceList::adsOnline:
+			{
+				newOnlineIDs.push_back(id);
+				break;
+			}
+			case AdbDeviceList::adsUnauthorized:
+			{
+				cancelOnboarding(id);
+				dd->setDeviceStatus(mKind, id, DetectedDevices::Device::dsUnauthorized);
+				break;
+			}
+			case AdbDeviceList::adsOther:
 			{
-				requestDeviceScreenshot(id);
+				// Forget about screenshot failures, the device may behave differently once it comes online again:
+				cancelOnboarding(id);
+				dd->setDeviceStatus(mKind, id, DetectedDevices::Device::dsOffline);
+				mDevicesFailedScreenshot.erase(id);
+				mDevicesRequestedScreenshot.erase(id);
+				mDeviceHasShellV2.erase(id);
+				break;
 			}
 		}
 	}
+	mLastDeviceList = aDeviceList;
+
+	// A device that has just come online (new, or authorized in the meantime) needs its app checked.
+	// A device that is known already (such as a newly authorized one) gets its avatar right away,
+	// a new one once its onboarding finishes (finishOnboarding()):
+	for (const auto & id: newOnlineIDs)
+	{
+		tryStartApp(id);
+		requestMissingScreenshot(id);
+	}
+
+	// The batch may have been waiting only for a device that has now gone away:
+	checkOnboardingBatchEnd();
+}
+
+
+
+
+
+void UsbDeviceEnumerator::checkOnlineDevices(const std::vector<QByteArray> & aOnlineIDs)
+{
+	auto dd = mComponents.get<DetectedDevices>();
+	auto devEntries = dd->allEnumeratorDevices(mKind);
+
+	// The screenshots are requested as soon as the devices appear; here, only retry the missing ones,
+	// for the devices that are idle:
+	for (const auto & id: aOnlineIDs)
+	{
+		if (mAdbPool->numQueued(id) == 0)
+		{
+			requestMissingScreenshot(id);
+		}
+	}
 
 	// New online devs need to check the app presence to determine their status:
 	for (const auto & id: aOnlineIDs)
@@ -371,7 +1147,49 @@ void UsbDeviceEnumerator::updateDeviceList(
 
 
 
+void UsbDeviceEnumerator::requestMissingScreenshot(const QByteArray & aDeviceID)
+{
+	if (
+		(mDevicesFailedScreenshot.find(aDeviceID) != mDevicesFailedScreenshot.cend()) ||
+		(mDevicesRequestedScreenshot.find(aDeviceID) != mDevicesRequestedScreenshot.cend())
+	)
+	{
+		return;
+	}
+	auto dd = mComponents.get<DetectedDevices>();
+	auto devEntries = dd->allEnumeratorDevices(mKind);
+	auto devItr = devEntries.find(aDeviceID);
+	if ((devItr == devEntries.cend()) || !devItr->second->avatar().isNull() || dd->hasPendingAvatar(aDeviceID))
+	{
+		return;
+	}
+	requestDeviceScreenshot(aDeviceID);
+}
+
+
+
+
+
+bool UsbDeviceEnumerator::hasDeviceNeedingApp(const std::vector<QByteArray> & aOnlineIDs)
+{
+	auto devEntries = mComponents.get<DetectedDevices>()->allEnumeratorDevices(mKind);
+	for (const auto & id: aOnlineIDs)
+	{
+		auto devItr = devEntries.find(id);
+		if ((devItr != devEntries.cend()) && (devItr->second->status() == DetectedDevices::Device::dsNeedApp))
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+
+
+
+
 void UsbDeviceEnumerator::updateDeviceLastScreenshot(const QByteArray & aDeviceID, const QImage & aScreenshot)
 {
+	mDevicesRequestedScreenshot.erase(aDeviceID);
 	mComponents.get<DetectedDevices>()->setDeviceAvatar(aDeviceID, aScreenshot);
 }
@@ -1,14 +1,19 @@
 #pragma once
 
 #include <atomic>
+#include <deque>
 #include <map>
 #include <set>
+#include <vector>
 
 #include <QThread>
 #include <QTimer>
 #include <QImage>
+#include <QDateTime>
+#include <QElapsedTimer>
 #include <QMutex>
 #include "../ComponentCollection.hpp"
+#include "AdbCommunicator.hpp"
 #include "DetectedDevices.hpp"
 
 
@@ -16,7 +21,7 @@
 
 
 // fwd:
-class AdbCommunicator;
+class AdbConnectionPool;
 
 
 
@@ -27,7 +32,10 @@ If ADB is not available, it doesn't report any devices.
 The devices are reported into a DetectedDevices instance that is used to thread-sync the changes and
 provide a UI model for the devices.
 Basically a thread for the enumerating and container for the various ADB connections; the heavy lifting
-is done in AdbCommunicator. */
+is done in AdbCommunicator. All the per-device ADB operations go through an AdbConnectionPool, which
+serializes them per device and hands them communicators already connected and switched to the device.
+Each device's onboarding runs in a transport session of the pool, so that its consecutive steps don't wait for
+the connection setup. */
 class UsbDeviceEnumerator:
 	public QThread,
 	public ComponentCollection::Component<ComponentCollection::ckUsbDeviceEnumerator>
@@ -53,35 +61,120 @@ public:
 	Initialized upon thread start, never updated (need to restart app to re-detect). */
 	bool isAdbAvailable() const { return mIsAdbAvailable; }
 
+	/** Returns the pool of the ADB connections, so that other ADB users (the screen mirroring) can share it.
+	To be called only from this object's thread; nullptr while the thread isn't running. */
+	AdbConnectionPool * adbPool() const { return mAdbPool; }
+
 
 protected:
 
-	/** Temporary data needed while detection is in progress on a device. */
-	struct DetectionStatus
+	/** The individual states of the onboarding of a single device (starting the app on it through ADB). */
+	enum EOnboardingState
+	{
+		osQueued,              ///< Waiting for a free onboarding slot (see mMaxConcurrentOnboardings)
+		osCheckingReverse,     ///< Checking whether the port reversing from the last onboarding is still in place (see mAppCache)
+		osReversingPort,       ///< Setting up the port reversing to our TCP listener
+		osQueryingFeatures,    ///< Asking the ADB server whether the device supports ShellV2 (see mDeviceHasShellV2)
+		osStartingApp,         ///< Running appStartShellCommand() through ShellV2
+		osStartingAppShellV1,  ///< Running appStartShellCommand() through ShellV1 (device without ShellV2)
+		osWaitingForRetry,     ///< A step has failed, waiting for the backoff delay before starting over
+	};
+
+
+	/** Temporary data needed while the onboarding is in progress on a device. */
+	struct Onboarding
+	{
+		/** The unique ID of this onboarding, so that the results of operations belonging to an onboarding
+		that has since been cancelled (device disconnected) are not applied to a new onboarding of the same device. */
+		quint64 mID;
+
+		/** The current state of the onboarding. */
+		EOnboardingState mState;
+
+		/** The number of times the onboarding has failed so far (and been retried). */
+		int mNumFailures;
+
+		/** The stdout of the app start shell command (see appStartShellCommand()).
+		Contains the stderr as well, if the device doesn't support ShellV2. */
+		QByteArray mShellStdOut;
+
+		/** The stderr of the app start shell command (see appStartShellCommand()). */
+		QByteArray mShellStdErr;
+	};
+
+
+	/** The results of the last successful onboarding of a device, so that a device that reappears (cable replug,
+	ADB server restart) can skip the slow parts of the onboarding. */
+	struct AppCacheEntry
 	{
-		/** Shell output of the package query ("pm list packages cz.xoft.deskemes").
-		Used to detect whether the app is present, in tryStartApp(). */
-		QByteArray mAppPackageQueryOutput;
+		/** The path of the app's APK on the device, as reported by the package manager.
+		Changes with each install or update of the app, so it serves as the installed app's version.
+		Empty if not known. */
+		QByteArray mApkPath;
+
+		/** The TCP port that has been port-reversed on the device. */
+		quint16 mReversedPort;
 
-		/** Shell output of the service start command ("am startservice ...").
-		Used to detect whether the service was started successfully. */
-		QByteArray mStartServiceOutput;
+		/** When the entry was stored. Entries older than APP_CACHE_VALIDITY_SEC are not used. */
+		QDateTime mTimestamp;
 	};
 
 
 	/** The TCP port to which the traffic from the devices is redirected using ADB port-forwaring. */
 	quint16 mTcpListenerPort;
 
-	/** The temporary data needed for each device while detection is in progress on it.
-	Map of DeviceID -> Status.
+	/** The onboardings in progress (including the queued and waiting ones).
+	Map of DeviceID -> Onboarding.
 	To be accessed only from this object's thread. */
-	std::map<QByteArray, DetectionStatus> mDetectionStatus;
+	std::map<QByteArray, Onboarding> mOnboardings;
+
+	/** The devices whose onboarding is waiting for a free slot, in the order in which they will be started.
+	May contain devices whose onboarding has been cancelled in the meantime, those are skipped.
+	To be accessed only from this object's thread. */
+	std::deque<QByteArray> mOnboardingQueue;
+
+	/** The maximum number of onboardings running at the same time.
+	Keeps a hub full of devices from starting all their ADB operations at once, so that each device gets
+	through its onboarding quickly instead of all of them progressing slowly. */
+	size_t mMaxConcurrentOnboardings;
+
+	/** The ID to be assigned to the next onboarding. */
+	quint64 mNextOnboardingID;
+
+	/** Measures the current onboarding batch: started when a new device is detected (or an onboarding is queued)
+	while there's no batch, the batch ends when there are no onboardings and no devices waiting for authorization.
+	The time until the last device came online is logged, to compare the mMaxConcurrentOnboardings values. */
+	QElapsedTimer mOnboardingBatchTimer;
+
+	/** The number of onboardings queued in the current batch. */
+	int mNumBatchOnboardings;
+
+	/** The number of devices that have come online in the current batch. */
+	int mNumBatchOnline;
+
+	/** The time since the start of the current batch when its last device came online, -1 if none has yet. */
+	qint64 mBatchLastOnlineMsec;
+
+	/** The results of the last successful onboarding of each device.
+	Map of DeviceID -> AppCacheEntry. Kept when the device disconnects, that's when the entries are useful.
+	To be accessed only from this object's thread. */
+	std::map<QByteArray, AppCacheEntry> mAppCache;
 
 	/** Tracks the devices for which the screenshot command has failed (so that no further screenshots will be requested for them).
 	Map of DeviceID -> bool (true = failed).
 	To be accessed only from this object's thread. */
 	std::set<QByteArray> mDevicesFailedScreenshot;
 
+	/** The devices whose screenshot has been requested and not yet received (nor failed).
+	To be accessed only from this object's thread. */
+	std::set<QByteArray> mDevicesRequestedScreenshot;
+
+	/** Whether each device supports ShellV2, as reported by its features (ShellV1 is used for those that don't).
+	Map of DeviceID -> bool. A device without an entry gets its features queried before the app start.
+	Forgotten when the device disconnects or goes offline, the device may have been upgraded in the meantime.
+	To be accessed only from this object's thread. */
+	std::map<QByteArray, bool> mDeviceHasShellV2;
+
 	/** Indicates whether ADB executable can be started.
 	Initialized upon thread start, never updated (need to restart app to re-detect). */
 	bool mIsAdbAvailable;
@@ -89,32 +182,150 @@ protected:
 	/** The logger used for all messages produced by this class. */
 	Logger & mLogger;
 
+	/** The pool of the ADB connections used for all the operations except for the device tracking.
+	Lives in this object's thread for the duration of run(), nullptr outside of it. */
+	AdbConnectionPool * mAdbPool;
+
+	/** The communicator tracking the device list ("host:track-devices"), the main source of the device list.
+	nullptr while the tracking is being reconnected. */
+	AdbCommunicator * mAdbTracker;
+
+	/** The timer for the watchdog polls of the device list, catching the changes that the tracking misses.
+	Its interval adapts to how reliable the tracking has been. Valid for the duration of run(), nullptr outside of it. */
+	QTimer * mWatchdogTimer;
+
+	/** True while the tracking is connected and has delivered a device list. */
+	bool mIsTracking;
+
+	/** The delay before the next attempt to reconnect the tracking, doubled on each failure. */
+	int mTrackerReconnectDelayMsec;
+
+	/** The device list as last processed by updateDeviceList(). */
+	AdbCommunicator::DeviceList mLastDeviceList;
+
 
 	// QThread overrides:
 	virtual void run() override;
 
+	/** Creates a new tracking communicator and starts tracking the devices.
+	If the tracking is lost, it is restarted after a delay (with exponential backoff). */
+	void startTracking();
+
+	/** Queues a watchdog poll of the device list, unless one is already queued. */
+	void watchdogPoll();
+
+	/** Processes the device list received by the watchdog poll.
+	Adapts the watchdog interval: backs off while the list matches the tracking, polls often while the tracking
+	is down, has missed a change, or while some devices are waiting for the user. */
+	void watchdogDeviceList(const AdbCommunicator::DeviceList & aDeviceList);
+
+	/** Requests the missing screenshots and (re-)checks the app for the online devices that need it. */
+	void checkOnlineDevices(const std::vector<QByteArray> & aOnlineIDs);
+
+	/** Requests the screenshot for the device's avatar, if it has none yet, none is being requested or processed,
+	and the device hasn't failed to produce one before.
+	The device needs to be known to DetectedDevices already, otherwise the avatar would have nowhere to go. */
+	void requestMissingScreenshot(const QByteArray & aDeviceID);
+
+	/** Returns true if any of the specified devices is known to need the app installed. */
+	bool hasDeviceNeedingApp(const std::vector<QByteArray> & aOnlineIDs);
+
 	/** Requests a new screenshot from the specified device.
 	Guaranteed to be called from this object's thread. */
 	Q_INVOKABLE void invRequestDeviceScreenshot(const QByteArray & aDeviceID);
 
-	/** Asynchronously tries to start the app and connect to it.
-	First checks if the app is installed ("pm list packages"); if not, sets the device as dsNeedApp and finishes.
-	Then it sets up the port reversing through ADB.
-	Then it tries to start the app and make it connect both via USB and TCP. If all succeeds, sets the device as dsOnline. */
+	/** Queues the onboarding of the specified device: tries to start the app and make it connect to us.
+	Does nothing if the device is already being onboarded.
+	The onboarding is a state machine (see EOnboardingState) driven by advanceOnboarding(); at most
+	mMaxConcurrentOnboardings devices are onboarded at the same time, the rest wait in mOnboardingQueue.
+	First the port reversing is set up, then, in a single shell command, the app presence is checked and the app
+	is started, making it connect both via USB and TCP. The device ends up as dsNeedApp, dsOnline or dsFailed.
+	If the device has been onboarded recently (mAppCache), the port reversing is only re-done if it is no longer
+	in place, and the app presence is checked by the APK's path instead of the (slow) package manager. */
 	void tryStartApp(const QByteArray & aDeviceID);
 
-	/** Tries to set up port-reversing on the device, then calls startConnectionByIntent(). */
-	void setupPortReversingAndConnect(const QByteArray & aDeviceID);
+	/** Cancels the onboarding of the specified device, if any (the device has disconnected). */
+	void cancelOnboarding(const QByteArray & aDeviceID);
+
+	/** Returns the onboarding of the specified device, if it is the one with the specified ID.
+	Returns nullptr if the onboarding has been finished or cancelled in the meantime. */
+	Onboarding * findOnboarding(const QByteArray & aDeviceID, quint64 aOnboardingID);
+
+	/** Returns the number of onboardings that are currently running ADB operations. */
+	size_t numActiveOnboardings() const;
+
+	/** Starts the queued onboardings, as long as there are free slots. */
+	void startQueuedOnboardings();
+
+	/** Moves the onboarding of the specified device to its next state and starts the state's ADB operation.
+	Called when the onboarding starts and whenever a step succeeds. */
+	void advanceOnboarding(const QByteArray & aDeviceID, quint64 aOnboardingID);
+
+	/** Called when a step of the onboarding fails.
+	Schedules a retry of the whole onboarding after a jittered exponential backoff, or, once the retries are
+	exhausted, sets the device as dsFailed. */
+	void onboardingFailed(const QByteArray & aDeviceID, quint64 aOnboardingID, const QString & aErrorText);
+
+	/** Finishes the onboarding of the specified device, setting the device to the specified status,
+	and starts the next queued onboarding. */
+	void finishOnboarding(const QByteArray & aDeviceID, DetectedDevices::Device::Status aStatus);
+
+	/** Starts a new onboarding batch, unless one is already running. */
+	void startOnboardingBatch();
+
+	/** Logs the results of the current onboarding batch, if it has just ended (no onboardings left and no devices
+	waiting for authorization). */
+	void checkOnboardingBatchEnd();
+
+	/** Returns the device's entry in mAppCache, if present and not older than APP_CACHE_VALIDITY_SEC.
+	Returns nullptr otherwise. */
+	const AppCacheEntry * validAppCacheEntry(const QByteArray & aDeviceID) const;
+
+	/** Checks whether the port reversing from the last onboarding is still in place on the device (state osCheckingReverse).
+	If it is, continues with the app start, otherwise sets up the port reversing again. */
+	void checkPortReverse(const QByteArray & aDeviceID, quint64 aOnboardingID);
+
+	/** Sets up the port-reversing on the device (state osReversingPort). */
+	void setupPortReversing(const QByteArray & aDeviceID, quint64 aOnboardingID);
+
+	/** Starts the app start shell command on the device, using ShellV2 or, for devices without it, ShellV1.
+	If the device's ShellV2 support isn't known yet (mDeviceHasShellV2), queries its features first. */
+	void startAppStartCommand(const QByteArray & aDeviceID, quint64 aOnboardingID);
+
+	/** Asks the ADB server for the device's features, stores its ShellV2 support (state osQueryingFeatures). */
+	void queryDeviceFeatures(const QByteArray & aDeviceID, quint64 aOnboardingID);
 
-	/** Tries to start up the on-device app and make it connect both through USB and TCP.
+	/** Tries to start up the on-device app and make it connect both through USB and TCP (state osStartingApp).
 	USB connection is attempted by invoking the LocalConnectService using an intent.
 	TCP connection is attempted by invoking the InitiateConnectionService intent for all our IPs.
 	This will "ping" the app to connect to the local port, previously port-reversed through ADB to local computer.
-	Updates the device state in DetectedDeviecs based on the result (dsNeedApp / dsOnline) */
-	void startConnectionToApp(const QByteArray & aDeviceID);
+	Runs appStartShellCommand() through ShellV2, to get separate stdout / stderr and the real exit code; falls back
+	to startConnectionToAppShellV1() if the device turns out not to know the ShellV2 service after all.
+	The result is processed in appStartFinished(). */
+	void startConnectionToApp(const QByteArray & aDeviceID, quint64 aOnboardingID);
+
+	/** Same as startConnectionToApp(), but uses ShellV1, for devices that don't support ShellV2 (state osStartingAppShellV1).
+	The exit code is echoed by the shell after the command and parsed from the output. */
+	void startConnectionToAppShellV1(const QByteArray & aDeviceID, quint64 aOnboardingID);
+
+	/** Returns the shell command that checks that the app is installed and then starts the app's
+	InitiateConnectionService with all our IPs.
+	If aCachedApkPath is empty, the package manager is asked for the app's APK, which is printed out (for mAppCache);
+	the command exits with EXIT_CODE_APP_NOT_INSTALLED if there's none. Otherwise the command only checks that the
+	APK still exists (much faster than running the package manager), exiting with EXIT_CODE_APP_CACHE_STALE if not. */
+	QByteArray appStartShellCommand(const QByteArray & aCachedApkPath) const;
+
+	/** Processes the result of the app start shell command executed on the specified device.
+	Finishes the onboarding as dsNeedApp or dsOnline, or fails it (to be retried) based on the exit code and output. */
+	void appStartFinished(const QByteArray & aDeviceID, quint64 aOnboardingID, int aExitCode);
+
+	/** Stores the results of the successful onboarding of the specified device into mAppCache.
+	aAppStartStdOut is the stdout of the app start shell command, containing the APK path if the package manager
+	was asked for it. */
+	void updateAppCache(const QByteArray & aDeviceID, const QByteArray & aAppStartStdOut);
 
 	/** Returns the logger to use for a specific device's AdbCommunicator. */
-	Logger & loggerForDevice(const QString & aDeviceID);
+	Logger & loggerForDevice(const QByteArray & aDeviceID);
 
 
 public Q_SLOTS:
@@ -126,15 +337,12 @@ public Q_SLOTS:
 
 protected Q_SLOTS:
 
-	/** Updates the internal list of devices based on the given IDs.
-	Called from the run::adbDevList when the device list changes. */
-	void updateDeviceList(
-		const QList<QByteArray> & aOnlineIDs,
-		const QList<QByteArray> & aUnauthIDs,
-		const QList<QByteArray> & aOtherIDs
-	);
+	/** Updates the devices in DetectedDevices based on the differences between the given device list and the last one.
+	Called by the tracking when the device list changes, and by the watchdog when the tracking has missed a change.
+	Does nothing if the list is the same as the last processed one. */
+	void updateDeviceList(const AdbCommunicator::DeviceList & aDeviceList);
 
-	/** Updates the last screenshot stored in mDevices[] for the specified device.
-	If the device is not in mDevices[], ignored. */
+	/** Hands the screenshot over to DetectedDevices as the device's avatar.
+	DetectedDevices keeps only a downscaled thumbnail of it, the full screenshot is dropped. */
 	void updateDeviceLastScreenshot(const QByteArray & aDeviceID, const QImage & aScreenshot);
 };
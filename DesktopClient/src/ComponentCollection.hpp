@@ -43,6 +43,7 @@ public:
 		ckDetectedDevices,            ///< All the devices that have been detected by the enumerators
 		ckUsbDeviceEnumerator,        ///< The background thread that monitors the connected USB devices
 		ckBluetoothDeviceEnumerator,  ///< The background thread that monitors the available Bluetooth devices
+		ckTlsSessionCache,            ///< The cache of TLS sessions for resuming the connections' handshakes
 	};
 
 
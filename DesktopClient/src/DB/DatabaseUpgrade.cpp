@@ -141,6 +141,31 @@ static const std::vector<VersionScript> g_VersionScripts =
 	VersionScript({
 		"ALTER TABLE DevicePairings ADD COLUMN FriendlyName",
 	}),  // Version 2 to Version 3
+
+	// Version 4 to Version 5:
+	// Added TlsSessions
+	VersionScript({
+		"CREATE TABLE TlsSessions ("
+			"DeviceID     BLOB,"
+			"SessionID    BLOB,"
+			"CipherSuite  INTEGER,"
+			"Compression  INTEGER,"
+			"MasterSecret BLOB,"
+			"CreatedAt    INTEGER"
+		")",
+	}),  // Version 4 to Version 5
+
+	// Version 5 to Version 6:
+	// Added HasNegotiatedTls to DevicePairings
+	VersionScript({
+		"ALTER TABLE DevicePairings ADD COLUMN HasNegotiatedTls INTEGER DEFAULT 0",
+	}),  // Version 5 to Version 6
+
+	// Version 6 to Version 7:
+	// TlsSessions' MasterSecret is now encrypted, drop the sessions stored in plaintext
+	VersionScript({
+		"DELETE FROM TlsSessions",
+	}),  // Version 6 to Version 7
 };
 
 
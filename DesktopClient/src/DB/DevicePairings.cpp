@@ -40,6 +40,7 @@ void DevicePairings::start()
 		"DeviceID",
 		"DevicePublicKeyData",
 		"LocalPublicKeyData",
+		"HasNegotiatedTls",
 	};
 	for (const auto & fieldName: fieldNames)
 	{
@@ -80,6 +81,7 @@ Optional<DevicePairings::Pairing> DevicePairings::lookupDevice(const QByteArray
 		query.value("DevicePublicKeyData").toByteArray(),
 		query.value("LocalPublicKeyData").toByteArray(),
 		query.value("LocalPrivateKeyData").toByteArray(),
+		query.value("HasNegotiatedTls").toBool(),
 	};
 }
 
@@ -87,6 +89,29 @@ Optional<DevicePairings::Pairing> DevicePairings::lookupDevice(const QByteArray
 
 
 
+std::vector<QByteArray> DevicePairings::pairedDeviceIDs()
+{
+	std::vector<QByteArray> res;
+	auto db = mComponents.get<Database>();
+	auto conn = db->connection();
+	auto query = conn.query("SELECT DeviceID FROM DevicePairings");
+	if (!query.exec())
+	{
+		mLogger.log("ERROR: Cannot exec list statement: %1.", query.lastError());
+		assert(!"DB error");
+		return res;
+	}
+	while (query.next())
+	{
+		res.push_back(query.value(0).toByteArray());
+	}
+	return res;
+}
+
+
+
+
+
 void DevicePairings::pairDevice(
 	const QString & aFriendlyName,
 	const QByteArray & aDevicePublicID,
@@ -129,6 +154,28 @@ void DevicePairings::pairDevice(
 
 
 
+void DevicePairings::setHasNegotiatedTls(const QByteArray & aDevicePublicID)
+{
+	auto db = mComponents.get<Database>();
+	auto conn = db->connection();
+	auto query = conn.query("UPDATE DevicePairings SET HasNegotiatedTls = 1 WHERE DeviceID = ? AND HasNegotiatedTls IS NOT 1");
+	query.addBindValue(aDevicePublicID);
+	if (!query.exec())
+	{
+		mLogger.log("ERROR: Cannot exec TLS-negotiated statement: %1.", query.lastError());
+		assert(!"DB error");
+		return;
+	}
+	if (query.numRowsAffected() > 0)
+	{
+		mLogger.log("Device %1 has negotiated TLS, cleartext connections will no longer be accepted.", aDevicePublicID);
+	}
+}
+
+
+
+
+
 void DevicePairings::createLocalKeyPair(const QByteArray & aDevicePublicID, const QString & aFriendlyName)
 {
 	auto oldPairing = lookupDevice(aDevicePublicID);
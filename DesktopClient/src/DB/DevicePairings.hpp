@@ -4,6 +4,7 @@
 
 
 
+#include <vector>
 #include <QObject>
 #include "../Optional.hpp"
 #include "../ComponentCollection.hpp"
@@ -46,6 +47,10 @@ public:
 
 		/** The local private key that we've used to pair with the device. */
 		QByteArray mLocalPrivateKeyData;
+
+		/** True if a connection to the device has completed a TLS handshake with this pairing's keys.
+		Such a device must not be allowed to fall back to the cleartext protocol. */
+		bool mHasNegotiatedTls;
 	};
 
 
@@ -58,6 +63,9 @@ public:
 	/** Looks up the specified device, and returns its pairing data, if available. */
 	Optional<Pairing> lookupDevice(const QByteArray & aDevicePublicID);
 
+	/** Returns the Public IDs of all the paired devices. */
+	std::vector<QByteArray> pairedDeviceIDs();
+
 	/** Adds / modifies a pairing for the specified device. */
 	void pairDevice(
 		const QString & aFriendlyName,
@@ -67,6 +75,10 @@ public:
 		const QByteArray & aLocalPrivateKeyData
 	);
 
+	/** Marks the pairing of the specified device as having negotiated TLS (Pairing::mHasNegotiatedTls).
+	Ignored if the device is not paired. */
+	void setHasNegotiatedTls(const QByteArray & aDevicePublicID);
+
 	/** Generates a new keypair for the specified device and stores it in the DB.
 	Silently ignored if a keypair for the device already exists. */
 	void createLocalKeyPair(const QByteArray & aDevicePublicID, const QString & aFriendlyName);
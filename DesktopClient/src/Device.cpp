@@ -1,5 +1,6 @@
 #include "Device.hpp"
 #include <cassert>
+#include <algorithm>
 #include "Comm/Channels/InfoChannel.hpp"
 #include "MultiLogger.hpp"
 
@@ -7,6 +8,74 @@
 
 
 
+/** The time without a ping response after which a connection is considered degraded, in msec.
+The pings are sent every second. */
+static const qint64 STALE_ROUNDTRIP_MSEC = 3000;
+
+/** A long-lived channel is migrated to a better connection only if its current connection's roundtrip is
+at least this many times the better one's. */
+static const qint64 MIGRATION_HYSTERESIS = 2;
+
+
+
+
+
+/** Returns the roundtrip assumed for a connection of the specified transport until one is measured, in msec. */
+static qint64 defaultRoundtrip(Connection::TransportKind aTransportKind)
+{
+	switch (aTransportKind)
+	{
+		case Connection::tkUsb:       return 5;
+		case Connection::tkTcp:       return 50;
+		case Connection::tkBluetooth: return 200;
+	}
+	return 1000;
+}
+
+
+
+
+
+/** Returns the effective roundtrip of a connection with the specified stats, in msec.
+This is the smoothed measured roundtrip, or the time since the last ping response if that is longer
+(the link is degraded, possibly dropped). */
+static qint64 effectiveRoundtrip(const Connection::Stats & aStats, Connection::TransportKind aTransportKind)
+{
+	auto roundtrip = (aStats.mSmoothedRoundtrip >= 0) ? aStats.mSmoothedRoundtrip : defaultRoundtrip(aTransportKind);
+	auto age = (aStats.mLastRoundtripAge >= 0) ? aStats.mLastRoundtripAge : aStats.mUptimeMsec;
+	if (age > STALE_ROUNDTRIP_MSEC)
+	{
+		roundtrip = std::max(roundtrip, age);
+	}
+	return roundtrip;
+}
+
+
+
+
+
+/** Returns the effective roundtrip of the connection, in msec. */
+static qint64 effectiveRoundtrip(const Connection & aConnection)
+{
+	return effectiveRoundtrip(aConnection.stats(), aConnection.transportKind());
+}
+
+
+
+
+
+/** Returns the recent throughput of a connection with the specified stats, in bytes per second.
+The moving average rather than the lifetime average, so that a connection that has slowed down (or sped up)
+is ranked by its current state. */
+static qint64 throughput(const Connection::Stats & aStats)
+{
+	return aStats.mRecentThroughput;
+}
+
+
+
+
+
 Device::Device(ComponentCollection & aComponents, const QByteArray & aDeviceID):
 	mDeviceID(aDeviceID),
 	mLogger(createLogger(aComponents, aDeviceID))
@@ -48,7 +117,59 @@ const QString & Device::friendlyName() const
 		static const QString empty;
 		return empty;
 	}
-	return mConnections[0]->friendlyName().value();
+	auto conn = bestConnection();
+	if (conn == nullptr)
+	{
+		conn = mConnections[0];
+	}
+	return conn->friendlyName().value();
+}
+
+
+
+
+
+ConnectionPtr Device::bestConnection() const
+{
+	// Pick the lowest roundtrip; if the roundtrips are similar (within 25 %), the higher throughput:
+	ConnectionPtr best;
+	qint64 bestRoundtrip = 0;
+	qint64 bestThroughput = 0;
+	for (const auto & conn: mConnections)
+	{
+		if (conn->state() != Connection::csEncrypted)
+		{
+			continue;
+		}
+		auto stats = conn->stats();
+		auto roundtrip = effectiveRoundtrip(stats, conn->transportKind());
+		auto thr = throughput(stats);
+		if (
+			(best == nullptr) ||
+			(roundtrip * 4 < bestRoundtrip * 3) ||
+			((roundtrip * 3 <= bestRoundtrip * 4) && (thr > bestThroughput))
+		)
+		{
+			best = conn;
+			bestRoundtrip = roundtrip;
+			bestThroughput = thr;
+		}
+	}
+	return best;
+}
+
+
+
+
+
+StripedChannelPtr Device::openStripedChannel(const QByteArray & aServiceName, const QByteArray & aServiceInitData)
+{
+	auto res = std::make_shared<StripedChannel>(aServiceName, aServiceInitData, mLogger);
+	if (!res->open(mConnections))
+	{
+		return nullptr;
+	}
+	return res;
 }
 
 
@@ -57,26 +178,39 @@ const QString & Device::friendlyName() const
 
 void Device::openInfoChannel()
 {
-	mLogger.log("Opening an info channel...");
-	if (mConnections.empty())
+	auto conn = bestConnection();
+	if (conn == nullptr)
 	{
 		mLogger.log("WARNING: Cannot open InfoChannel, there's no connection");
 		return;
 	}
-
-	auto conn = mConnections[0];
-	mInfoChannel = std::make_shared<InfoChannel>(*conn);
-	connect(mInfoChannel.get(), &InfoChannel::receivedImei,           this, &Device::receivedIdentification);
-	connect(mInfoChannel.get(), &InfoChannel::receivedImsi,           this, &Device::receivedIdentification);
-	connect(mInfoChannel.get(), &InfoChannel::receivedCarrierName,    this, &Device::receivedIdentification);
-	connect(mInfoChannel.get(), &InfoChannel::receivedBattery,        this, &Device::batteryUpdated);
-	connect(mInfoChannel.get(), &InfoChannel::receivedSignalStrength, this, &Device::signalStrengthUpdated);
-	connect(mInfoChannel.get(), &InfoChannel::opened, this,
+	mLogger.log("Opening an info channel on connection %1...", conn->connectionID());
+
+	auto infoChannel = std::make_shared<InfoChannel>(*conn);
+	connect(infoChannel.get(), &InfoChannel::receivedImei,           this, &Device::receivedIdentification);
+	connect(infoChannel.get(), &InfoChannel::receivedImsi,           this, &Device::receivedIdentification);
+	connect(infoChannel.get(), &InfoChannel::receivedCarrierName,    this, &Device::receivedIdentification);
+	connect(infoChannel.get(), &InfoChannel::receivedBattery,        this, &Device::batteryUpdated);
+	connect(infoChannel.get(), &InfoChannel::receivedSignalStrength, this, &Device::signalStrengthUpdated);
+	connect(infoChannel.get(), &InfoChannel::opened, this,
 		[this](Connection::Channel * aChannel)
 		{
+			if (aChannel == mPendingInfoChannel.get())
+			{
+				// Migrating to a better connection; switch over to the new channel and close the old one:
+				auto oldChannel = std::move(mInfoChannel);
+				mInfoChannel = std::move(mPendingInfoChannel);
+				mPendingInfoChannel.reset();
+				if ((oldChannel != nullptr) && oldChannel->isOpen())
+				{
+					oldChannel->connection().closeChannel(oldChannel);
+				}
+				mLogger.log("The info channel has been migrated to connection %1.", mInfoChannel->connection().connectionID());
+			}
 			if (aChannel != mInfoChannel.get())
 			{
-				// Someone replaced the info channel in the meantime
+				// Someone replaced the info channel in the meantime, this one is not needed anymore:
+				aChannel->connection().closeChannel(aChannel->shared_from_this());
 				return;
 			}
 			mInfoChannel->queryIdentification();
@@ -84,24 +218,60 @@ void Device::openInfoChannel()
 			mInfoChannel->queryBattery();
 		}
 	);
-	connect(mInfoChannel.get(), &InfoChannel::failed, this,
+	connect(infoChannel.get(), &InfoChannel::failed, this,
 		[this](Connection::Channel * aChannel, const quint16 aErrorCode, const QByteArray & aErrorMsg)
 		{
-			Q_UNUSED(aChannel);
-			mInfoChannel.reset();
+			if (aChannel == mPendingInfoChannel.get())
+			{
+				mPendingInfoChannel.reset();
+			}
+			else if (aChannel == mInfoChannel.get())
+			{
+				mInfoChannel.reset();
+			}
 			qWarning() << "Failed to open the info channel: " << aErrorCode << ": " << aErrorMsg;
 		}
 	);
-	connect(conn.get(), &Connection::disconnected, this,
-		[this]()
-		{
-			mInfoChannel.reset();
-		}
-	);
-	if (!conn->openChannel(mInfoChannel, "info"))
+
+	auto & dest = (mInfoChannel == nullptr) ? mInfoChannel : mPendingInfoChannel;
+	dest = infoChannel;
+	if (!conn->openChannel(infoChannel, "info"))
 	{
 		mLogger.log("WARNING: Failed to open the InfoChannel.");
+		dest.reset();
+	}
+}
+
+
+
+
+
+void Device::checkInfoChannelConnection()
+{
+	if ((mInfoChannel == nullptr) || (mPendingInfoChannel != nullptr))
+	{
+		// Nothing to migrate, or already migrating
+		return;
+	}
+	auto best = bestConnection();
+	auto & current = mInfoChannel->connection();
+	if ((best == nullptr) || (best.get() == &current))
+	{
+		return;
 	}
+
+	// Migrate only if the current connection is considerably worse, so that the channel doesn't flap
+	// between two similar connections:
+	auto currentRoundtrip = effectiveRoundtrip(current);
+	auto bestRoundtrip = effectiveRoundtrip(*best);
+	if (currentRoundtrip < bestRoundtrip * MIGRATION_HYSTERESIS)
+	{
+		return;
+	}
+	mLogger.log("Connection %1 (roundtrip %2 ms) is better than connection %3 (roundtrip %4 ms), migrating the info channel.",
+		best->connectionID(), bestRoundtrip, current.connectionID(), currentRoundtrip
+	);
+	openInfoChannel();
 }
 
 
@@ -125,6 +295,7 @@ void Device::queryStatusInfo()
 		openInfoChannel();
 		return;
 	}
+	checkInfoChannelConnection();
 	if (!mInfoChannel->isOpen())
 	{
 		// Either the channel is waiting for open confirmation, or its connection has been closed.
@@ -164,6 +335,27 @@ void Device::connDisconnected(Connection * aConnection)
 		mConnections.end()
 	);
 
+	// Drop the info channels that were using the connection:
+	if ((mPendingInfoChannel != nullptr) && (&mPendingInfoChannel->connection() == aConnection))
+	{
+		mPendingInfoChannel.reset();
+	}
+	if ((mInfoChannel != nullptr) && (&mInfoChannel->connection() == aConnection))
+	{
+		mInfoChannel.reset();
+		if (mPendingInfoChannel != nullptr)
+		{
+			// The migration is already underway, the pending channel will take over once opened
+			mInfoChannel = std::move(mPendingInfoChannel);
+			mPendingInfoChannel.reset();
+		}
+		else if (!mConnections.empty())
+		{
+			// Reopen right away on another connection, instead of waiting for the next status query:
+			openInfoChannel();
+		}
+	}
+
 	// If this was the last connection, go offline:
 	if (mConnections.empty())
 	{
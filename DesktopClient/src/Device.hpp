@@ -4,6 +4,7 @@
 #include <QObject>
 #include <QTimer>
 #include "Comm/Connection.hpp"
+#include "Comm/StripedChannel.hpp"
 
 
 
@@ -43,6 +44,18 @@ public:
 	Returns an empty string if there are no connections. */
 	const QString & friendlyName() const;
 
+	/** Returns the connection that is currently the best for communicating with the device, based on
+	the measured roundtrip times and throughput of the connections.
+	New channels should be opened on this connection.
+	Returns nullptr if there's no established connection. */
+	ConnectionPtr bestConnection() const;
+
+	/** Opens a channel for the specified service striped across all the connections to the device,
+	for bulk transfers that can use multiple links at once (such as USB and WiFi).
+	The channel is usable once its opened() signal is emitted.
+	Returns nullptr if there's no established connection. */
+	StripedChannelPtr openStripedChannel(const QByteArray & aServiceName, const QByteArray & aServiceInitData = QByteArray());
+
 
 protected:
 
@@ -55,6 +68,10 @@ protected:
 	/** The channel currently used for querying information from the device. */
 	std::shared_ptr<InfoChannel> mInfoChannel;
 
+	/** The channel being opened on a better connection, to replace mInfoChannel once open.
+	The switch-over is make-before-break, mInfoChannel is used until this channel is opened. */
+	std::shared_ptr<InfoChannel> mPendingInfoChannel;
+
 	/** The timer used for querying status information from the device periodically. */
 	QTimer mInfoQueryTimer;
 
@@ -62,9 +79,14 @@ protected:
 	Logger & mLogger;
 
 
-	/** Opens an InfoChannel on one of the connections, sets it to mInfoChannel. */
+	/** Opens an InfoChannel on the best connection.
+	Sets it to mInfoChannel if there's none yet, or to mPendingInfoChannel if migrating. */
 	void openInfoChannel();
 
+	/** Checks whether mInfoChannel's connection is still good enough compared to the best connection.
+	If not, starts migrating the info channel to the best connection. */
+	void checkInfoChannelConnection();
+
 	/** Returns a logger appropriate for a device using the specified connection. */
 	static Logger & createLogger(ComponentCollection & aComponents, const QString & aDeviceID);
 
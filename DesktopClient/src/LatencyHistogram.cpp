@@ -0,0 +1,152 @@
+#include "LatencyHistogram.hpp"
+#include <cassert>
+#include <limits>
+#include <algorithm>
+
+
+
+
+
+LatencyHistogram::LatencyHistogram()
+{
+	clear();
+}
+
+
+
+
+
+void LatencyHistogram::add(qint64 aValue)
+{
+	if (aValue < 0)
+	{
+		aValue = 0;
+	}
+	mBuckets[static_cast<size_t>(bucketIndex(aValue))] += 1;
+	mCount += 1;
+	mSum += static_cast<double>(aValue);
+	if (aValue < mMin)
+	{
+		mMin = aValue;
+	}
+	if (aValue > mMax)
+	{
+		mMax = aValue;
+	}
+}
+
+
+
+
+
+void LatencyHistogram::clear()
+{
+	mBuckets.fill(0);
+	mCount = 0;
+	mSum = 0;
+	mMin = std::numeric_limits<qint64>::max();
+	mMax = 0;
+}
+
+
+
+
+
+double LatencyHistogram::mean() const
+{
+	if (mCount == 0)
+	{
+		return 0;
+	}
+	return mSum / static_cast<double>(mCount);
+}
+
+
+
+
+
+qint64 LatencyHistogram::percentile(double aPercentile) const
+{
+	if (mCount == 0)
+	{
+		return 0;
+	}
+	auto threshold = static_cast<quint64>(aPercentile / 100 * static_cast<double>(mCount));
+	if (threshold >= mCount)
+	{
+		return mMax;
+	}
+	quint64 cumulative = 0;
+	for (int i = 0; i < NUM_BUCKETS; ++i)
+	{
+		cumulative += mBuckets[static_cast<size_t>(i)];
+		if (cumulative > threshold)
+		{
+			if (i + 1 >= NUM_BUCKETS)
+			{
+				return mMax;
+			}
+			return std::min(bucketLowerBound(i + 1) - 1, mMax);
+		}
+	}
+	return mMax;
+}
+
+
+
+
+
+QString LatencyHistogram::summary(const QString & aUnit) const
+{
+	return QString("n=%1, avg=%2%9, min=%3%9, p50=%4%9, p90=%5%9, p95=%6%9, p99=%7%9, max=%8%9")
+		.arg(mCount)
+		.arg(mean(), 0, 'f', 1)
+		.arg(min())
+		.arg(percentile(50))
+		.arg(percentile(90))
+		.arg(percentile(95))
+		.arg(percentile(99))
+		.arg(mMax)
+		.arg(aUnit);
+}
+
+
+
+
+
+int LatencyHistogram::bucketIndex(qint64 aValue)
+{
+	assert(aValue >= 0);
+	auto value = static_cast<quint64>(aValue);
+	if (value < NUM_SUB_BUCKETS)
+	{
+		// The smallest values each have their own bucket:
+		return static_cast<int>(value);
+	}
+
+	// Find the power-of-two range, then the linear sub-bucket within it:
+	int exponent = 63;
+	while ((value & (1ULL << exponent)) == 0)
+	{
+		exponent -= 1;
+	}
+	auto subBucket = static_cast<int>((value >> (exponent - SUB_BUCKET_BITS)) & (NUM_SUB_BUCKETS - 1));
+	return (exponent - SUB_BUCKET_BITS + 1) * NUM_SUB_BUCKETS + subBucket;
+}
+
+
+
+
+
+qint64 LatencyHistogram::bucketLowerBound(int aBucketIndex)
+{
+	assert(aBucketIndex >= 0);
+	assert(aBucketIndex < NUM_BUCKETS);
+	if (aBucketIndex < NUM_SUB_BUCKETS)
+	{
+		return aBucketIndex;
+	}
+	auto exponent = aBucketIndex / NUM_SUB_BUCKETS + SUB_BUCKET_BITS - 1;
+	auto subBucket = static_cast<quint64>(aBucketIndex % NUM_SUB_BUCKETS);
+	return static_cast<qint64>((NUM_SUB_BUCKETS + subBucket) << (exponent - SUB_BUCKET_BITS));
+}
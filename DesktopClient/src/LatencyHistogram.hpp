@@ -0,0 +1,82 @@
+#pragma once
+
+#include <array>
+#include <QString>
+
+
+
+
+
+/** A histogram of (latency) values, with log-linear buckets.
+Each power-of-two range of values is split into 4 equally wide buckets, so the relative resolution
+is 25 % across the entire value range, with constant memory and O(1) insertion.
+The values are unit-less; the owner decides whether they are msec, usec etc.
+The class is not thread-safe, owners need to provide their own locking. */
+class LatencyHistogram
+{
+public:
+
+	/** Creates a new empty histogram. */
+	LatencyHistogram();
+
+	/** Adds the specified value to the histogram.
+	Negative values are counted as zero. */
+	void add(qint64 aValue);
+
+	/** Removes all values from the histogram. */
+	void clear();
+
+	/** Returns the number of values added. */
+	quint64 count() const { return mCount; }
+
+	/** Returns the smallest value added, or 0 if empty. */
+	qint64 min() const { return (mCount > 0) ? mMin : 0; }
+
+	/** Returns the largest value added, or 0 if empty. */
+	qint64 max() const { return mMax; }
+
+	/** Returns the average of the values added, or 0 if empty. */
+	double mean() const;
+
+	/** Returns the (approximate) value at the specified percentile (0 - 100).
+	The returned value is the upper bound of the bucket containing the percentile, clamped to max(). */
+	qint64 percentile(double aPercentile) const;
+
+	/** Returns a single-line user-readable summary of the histogram, such as "n=10, avg=4.2, min=1, p50=5, ...",
+	with the p50, p90, p95 and p99 percentiles.
+	The aUnit is appended to each value. */
+	QString summary(const QString & aUnit = QString()) const;
+
+
+protected:
+
+	/** The number of linear sub-buckets in each power-of-two range, as a power of two. */
+	static const int SUB_BUCKET_BITS = 2;
+	static const int NUM_SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+
+	/** The total number of buckets needed to cover the entire non-negative qint64 range. */
+	static const int NUM_BUCKETS = (63 - SUB_BUCKET_BITS + 1) * NUM_SUB_BUCKETS;
+
+
+	/** The number of values in each bucket. */
+	std::array<quint64, NUM_BUCKETS> mBuckets;
+
+	/** The total number of values added. */
+	quint64 mCount;
+
+	/** The sum of all values added, for mean(). */
+	double mSum;
+
+	/** The smallest value added. */
+	qint64 mMin;
+
+	/** The largest value added. */
+	qint64 mMax;
+
+
+	/** Returns the index of the bucket for the specified value. */
+	static int bucketIndex(qint64 aValue);
+
+	/** Returns the lowest value belonging to the specified bucket. */
+	static qint64 bucketLowerBound(int aBucketIndex);
+};
@@ -139,6 +139,7 @@ QVariant DetectedDevicesModel::data(const QModelIndex & aIndex, int aRole) const
 						case DetectedDevices::Device::dsBlacklisted:  return tr("Blacklisted");
 						case DetectedDevices::Device::dsNeedApp:      return tr("App not installed");
 						case DetectedDevices::Device::dsFailed:       return tr("Connection failed");
+						case DetectedDevices::Device::dsConnecting:   return tr("Connecting");
 					}
 					return {};
 				}
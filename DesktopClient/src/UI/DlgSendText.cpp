@@ -69,7 +69,12 @@ void DlgSendText::sendAndClose()
 		qWarning() << "Cannot send, unknown source device";
 		return;
 	}
-	auto conn = dev->connections()[0];
+	auto conn = dev->bestConnection();
+	if (conn == nullptr)
+	{
+		qWarning() << "Cannot send, the device has no connection";
+		return;
+	}
 	auto sendChannel = std::make_shared<ChannelSmsSend>(*conn);
 	auto to = mUI->cbTo->currentText();
 	auto text = mUI->teText->toPlainText();
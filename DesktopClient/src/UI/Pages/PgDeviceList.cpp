@@ -82,6 +82,7 @@ int PgDeviceList::nextId() const
 		case DetectedDevices::Device::dsOffline:      return NewDeviceWizard::pgFailed;
 		case DetectedDevices::Device::dsNeedApp:      return NewDeviceWizard::pgNeedApp;
 		case DetectedDevices::Device::dsFailed:       return NewDeviceWizard::pgFailed;
+		case DetectedDevices::Device::dsConnecting:   return NewDeviceWizard::pgSucceeded;
 	}
 	#ifdef _MSC_VER
 		assert(!"Unknown device status");
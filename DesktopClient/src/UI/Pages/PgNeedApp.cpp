@@ -68,6 +68,7 @@ bool PgNeedApp::isComplete() const
 		case DetectedDevices::Device::dsOnline:       return true;
 		case DetectedDevices::Device::dsUnauthorized: return true;
 		case DetectedDevices::Device::dsFailed:       return true;
+		case DetectedDevices::Device::dsConnecting:   return false;
 	}
 	#ifdef _MSC_VER
 		assert(!"Unknown device status");
@@ -92,6 +93,7 @@ int PgNeedApp::nextId() const
 		case DetectedDevices::Device::dsOnline:       return NewDeviceWizard::pgSucceeded;
 		case DetectedDevices::Device::dsUnauthorized: return NewDeviceWizard::pgNeedAuth;
 		case DetectedDevices::Device::dsFailed:       return NewDeviceWizard::pgFailed;
+		case DetectedDevices::Device::dsConnecting:   return NewDeviceWizard::pgSucceeded;
 	}
 	#ifdef _MSC_VER
 		assert(!"Unknown device status");
@@ -114,12 +116,14 @@ void PgNeedApp::checkDeviceStatus()
 
 void PgNeedApp::tryInstallApp()
 {
-	auto appInst = new AdbAppInstaller;
+	auto appInst = new AdbAppInstaller(mComponents.logger("AdbAppInstaller"));
 	connect(appInst, &AdbAppInstaller::installed,     this, &PgNeedApp::onAppInstalled);
 	connect(appInst, &AdbAppInstaller::errorOccurred, this, &PgNeedApp::onAppInstallFailed);
+	connect(appInst, &AdbAppInstaller::progress,      this, &PgNeedApp::onAppInstallProgress);
 	appInst->autoDeleteSelf();
 	appInst->installAppFromFile(mParent.device()->enumeratorDeviceID(), "deskemes.apk");
 	mUI->btnPushOverUsb->hide();
+	mUI->pbAppInstall->setRange(0, 0);
 	mUI->pbAppInstall->show();
 	mUI->lblAppInstallResult->hide();
 }
@@ -162,3 +166,18 @@ void PgNeedApp::onAppInstallFailed(QString aErrorDesc)
 	mUI->lblAppInstallResult->show();
 	mUI->pbAppInstall->hide();
 }
+
+
+
+
+
+void PgNeedApp::onAppInstallProgress(qint64 aNumBytesUploaded, qint64 aTotalBytes)
+{
+	if ((aTotalBytes <= 0) || (aNumBytesUploaded >= aTotalBytes))
+	{
+		mUI->pbAppInstall->setRange(0, 0);
+		return;
+	}
+	mUI->pbAppInstall->setRange(0, 1000);
+	mUI->pbAppInstall->setValue(static_cast<int>(aNumBytesUploaded * 1000 / aTotalBytes));
+}
@@ -59,6 +59,10 @@ protected Q_SLOTS:
 	/** App install failed with the specified error, hide the progressbar, show the error message. */
 	void onAppInstallFailed(QString aErrorDesc);
 
+	/** The APK upload progressed, update the progressbar.
+	Once the upload is complete, the progressbar shows the busy indicator while the app is being installed. */
+	void onAppInstallProgress(qint64 aNumBytesUploaded, qint64 aTotalBytes);
+
 
 private:
 
@@ -64,6 +64,7 @@ int PgNeedAuth::nextId() const
 		case DetectedDevices::Device::dsOnline:       return NewDeviceWizard::pgSucceeded;
 		case DetectedDevices::Device::dsUnauthorized: return NewDeviceWizard::pgNeedAuth;
 		case DetectedDevices::Device::dsFailed:       return NewDeviceWizard::pgFailed;
+		case DetectedDevices::Device::dsConnecting:   return NewDeviceWizard::pgSucceeded;
 	}
 	#ifdef _MSC_VER
 		assert(!"Unknown device status");
@@ -65,6 +65,7 @@ void PgPairingInProgress::connStateChanged(Connection * aConnection)
 		}
 		case Connection::csRequestedPairing:
 		case Connection::csKnownPairing:
+		case Connection::csTlsHandshaking:
 		{
 			// Still waiting
 			mNextPage = -1;
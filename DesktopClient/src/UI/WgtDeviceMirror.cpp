@@ -0,0 +1,85 @@
+#include "WgtDeviceMirror.hpp"
+#include <QPainter>
+#include "../Comm/AdbScreenMirror.hpp"
+#include "../Comm/UsbDeviceEnumerator.hpp"
+#include "../ComponentCollection.hpp"
+#include "../Settings.hpp"
+
+
+
+
+
+WgtDeviceMirror::WgtDeviceMirror(ComponentCollection & aComponents, const QByteArray & aDeviceID, QWidget * aParent):
+	Super(aParent, Qt::Window),
+	mDeviceID(aDeviceID),
+	mMirror(new AdbScreenMirror(
+		*aComponents.get<UsbDeviceEnumerator>(),
+		aDeviceID,
+		aComponents.logger("AdbScreenMirror-" + QString::fromUtf8(aDeviceID))
+	))
+{
+	setAttribute(Qt::WA_DeleteOnClose);
+	setAttribute(Qt::WA_OpaquePaintEvent);
+	setWindowTitle(tr("Mirror: %1").arg(QString::fromUtf8(mDeviceID)));
+	resize(360, 720);
+	Settings::loadWindowPos("WgtDeviceMirror", *this);
+
+	connect(mMirror, &AdbScreenMirror::frameReceived, this, &WgtDeviceMirror::onFrame);
+	connect(mMirror, &AdbScreenMirror::failed,        this, &WgtDeviceMirror::onFailed);
+	mMirror->start(Settings::loadValue("WgtDeviceMirror", "MaxFps", 15).toInt());
+}
+
+
+
+
+
+WgtDeviceMirror::~WgtDeviceMirror()
+{
+	Settings::saveWindowPos("WgtDeviceMirror", *this);
+
+	// The mirror lives in the enumerator's thread, it is deleted there after it stops:
+	mMirror->disconnect(this);
+	mMirror->stop();
+	mMirror->deleteLater();
+}
+
+
+
+
+
+void WgtDeviceMirror::paintEvent(QPaintEvent * aEvent)
+{
+	Q_UNUSED(aEvent);
+	QPainter painter(this);
+	painter.fillRect(rect(), Qt::black);
+	if (mFrame.isNull())
+	{
+		return;
+	}
+
+	// Draw directly from the frame, scaled by the painter (no intermediate scaled copy):
+	auto target = mFrame.size().scaled(size(), Qt::KeepAspectRatio);
+	QRect targetRect(QPoint((width() - target.width()) / 2, (height() - target.height()) / 2), target);
+	painter.setRenderHint(QPainter::SmoothPixmapTransform, true);
+	painter.drawImage(targetRect, mFrame);
+}
+
+
+
+
+
+void WgtDeviceMirror::onFrame(const QImage & aFrame, double aFps)
+{
+	mFrame = aFrame;
+	setWindowTitle(tr("Mirror: %1 (%2 fps)").arg(QString::fromUtf8(mDeviceID)).arg(aFps, 0, 'f', 1));
+	update();
+}
+
+
+
+
+
+void WgtDeviceMirror::onFailed(const QString & aErrorText)
+{
+	setWindowTitle(tr("Mirror: %1 (failed: %2)").arg(QString::fromUtf8(mDeviceID), aErrorText));
+}
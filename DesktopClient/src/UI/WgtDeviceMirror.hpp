@@ -0,0 +1,61 @@
+#pragma once
+
+#include <QWidget>
+#include <QImage>
+
+
+
+
+
+// fwd:
+class AdbScreenMirror;
+class ComponentCollection;
+
+
+
+
+
+/** A top-level window that shows the live screen of a device connected over USB (ADB).
+The frames are provided by an AdbScreenMirror and drawn scaled to fit, preserving the aspect ratio.
+The window deletes itself when closed. */
+class WgtDeviceMirror:
+	public QWidget
+{
+	using Super = QWidget;
+
+	Q_OBJECT
+	Q_DISABLE_COPY(WgtDeviceMirror)
+
+
+public:
+
+	/** Creates the window and starts mirroring the device with the specified ADB serial. */
+	WgtDeviceMirror(ComponentCollection & aComponents, const QByteArray & aDeviceID, QWidget * aParent = nullptr);
+
+	virtual ~WgtDeviceMirror() override;
+
+
+private:
+
+	/** The ADB serial of the mirrored device. */
+	const QByteArray mDeviceID;
+
+	/** The source of the frames. Lives in the UsbDeviceEnumerator's thread, deleted using deleteLater(). */
+	AdbScreenMirror * mMirror;
+
+	/** The last received frame. Replaced (not copied into) with each new frame, so that the mirror can reuse the buffer. */
+	QImage mFrame;
+
+
+	// QWidget overrides:
+	virtual void paintEvent(QPaintEvent * aEvent) override;
+
+
+private slots:
+
+	/** Stores the new frame, schedules a repaint and updates the window title with the frame rate. */
+	void onFrame(const QImage & aFrame, double aFps);
+
+	/** Shows the error in the window title. */
+	void onFailed(const QString & aErrorText);
+};
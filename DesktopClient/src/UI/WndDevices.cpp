@@ -1,12 +1,16 @@
 #include "WndDevices.hpp"
 #include <cassert>
 #include <QLabel>
+#include <QInputDialog>
+#include <QMessageBox>
 #include "ui_WndDevices.h"
 #include "../Settings.hpp"
 #include "../DeviceMgr.hpp"
+#include "../Comm/DetectedDevices.hpp"
 #include "WgtDevice.hpp"
 #include "NewDeviceWizard.hpp"
 #include "DlgSendText.hpp"
+#include "WgtDeviceMirror.hpp"
 
 
 
@@ -24,6 +28,7 @@ WndDevices::WndDevices(ComponentCollection & aComponents, QWidget * aParent):
 	connect(mgr.get(),              &DeviceMgr::deviceAdded,   this, &WndDevices::onDeviceAdded);
 	connect(mgr.get(),              &DeviceMgr::deviceRemoved, this, &WndDevices::onDeviceRemoved);
 	connect(mUI->actDeviceNew,      &QAction::triggered,       this, &WndDevices::addNewDevice);
+	connect(mUI->actDeviceMirror,   &QAction::triggered,       this, &WndDevices::mirrorUsbDevice);
 	connect(mUI->actMessageSendNew, &QAction::triggered,       this, &WndDevices::sendNewMessage);
 	connect(mUI->actExit,           &QAction::triggered,       this, &WndDevices::close);
 
@@ -105,3 +110,55 @@ void WndDevices::sendNewMessage()
 	DlgSendText dlg(mComponents, this);
 	dlg.exec();
 }
+
+
+
+
+
+void WndDevices::mirrorUsbDevice()
+{
+	// Collect the USB devices that can be mirrored:
+	QStringList deviceIDs;
+	auto devices = mComponents.get<DetectedDevices>()->allEnumeratorDevices(ComponentCollection::ckUsbDeviceEnumerator);
+	for (const auto & dev: devices)
+	{
+		switch (dev.second->status())
+		{
+			case DetectedDevices::Device::dsUnauthorized:
+			case DetectedDevices::Device::dsOffline:
+			{
+				continue;
+			}
+			case DetectedDevices::Device::dsOnline:
+			case DetectedDevices::Device::dsNoPubKey:
+			case DetectedDevices::Device::dsNeedPairing:
+			case DetectedDevices::Device::dsBlacklisted:
+			case DetectedDevices::Device::dsNeedApp:
+			case DetectedDevices::Device::dsFailed:
+			case DetectedDevices::Device::dsConnecting:
+			{
+				break;
+			}
+		}
+		deviceIDs.append(QString::fromUtf8(dev.first));
+	}
+	if (deviceIDs.isEmpty())
+	{
+		QMessageBox::information(this, tr("Mirror USB device"), tr("There is no device connected over USB."));
+		return;
+	}
+
+	// Let the user choose, if there's more than one:
+	auto deviceID = deviceIDs.first();
+	if (deviceIDs.size() > 1)
+	{
+		bool isOK = false;
+		deviceID = QInputDialog::getItem(this, tr("Mirror USB device"), tr("Device:"), deviceIDs, 0, false, &isOK);
+		if (!isOK)
+		{
+			return;
+		}
+	}
+	auto wnd = new WgtDeviceMirror(mComponents, deviceID.toUtf8(), this);
+	wnd->show();
+}
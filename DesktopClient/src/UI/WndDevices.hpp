@@ -79,6 +79,10 @@ private slots:
 	Called when the user selects New device from the menu. */
 	void addNewDevice();
 
+	/** Opens a window mirroring the screen of a USB-connected device, letting the user choose the device first if needed.
+	Called when the user selects Mirror USB device from the menu. */
+	void mirrorUsbDevice();
+
 	/** Opens the Send message dialog, letting the user send a new text message.
 	Called when the user selects Send new message from the menu. */
 	void sendNewMessage();
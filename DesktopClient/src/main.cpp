@@ -21,6 +21,7 @@
 #include "Comm/ConnectionMgr.hpp"
 #include "Comm/DetectedDevices.hpp"
 #include "Comm/TcpListener.hpp"
+#include "Comm/TlsSessionCache.hpp"
 #include "Comm/UdpBroadcaster.hpp"
 #include "Comm/UsbDeviceEnumerator.hpp"
 
@@ -124,6 +125,7 @@ int main(int argc, char *argv[])
 		auto blacklist       = cc.addNew<DeviceBlacklist>();
 		auto usbEnumerator   = cc.addNew<UsbDeviceEnumerator>();
 		auto detectedDevices = cc.addNew<DetectedDevices>();
+		auto tlsSessionCache = cc.addNew<TlsSessionCache>();
 		auto & logger = multiLogger->mainLogger();
 
 		// Start the components:
@@ -0,0 +1,295 @@
+// AdbDeviceListTest.cpp
+
+// Tests the parsing and diffing of the ADB device list and benchmarks both on 500 synthetic devices, against
+// the previous parsing (split into three QLists) and offline check (QList::contains() per known device).
+
+#include <cstdio>
+#include <algorithm>
+#include <QByteArray>
+#include <QList>
+#include <QElapsedTimer>
+#include "Comm/AdbDeviceList.hpp"
+#include "Logger.hpp"
+#include "TestHelpers.hpp"
+
+
+
+
+
+/** The number of synthetic devices used in the benchmarks. */
+static const int NUM_DEVICES = 500;
+
+
+
+
+
+/** Returns the synthetic ID of the device with the specified index, in the form of an emulator / USB serial. */
+static QByteArray deviceID(int aIndex)
+{
+	return QByteArray("SYNTH") + QByteArray::number(1000000 + aIndex * 7919);
+}
+
+
+
+
+
+/** Returns the device list message, as sent by ADB, for aNumDevices devices.
+Every aUnauthorizedEvery-th device is reported as unauthorized, the one with index aOfflineIndex as offline,
+all the others as online. */
+static QByteArray createMessage(int aNumDevices, int aUnauthorizedEvery, int aOfflineIndex)
+{
+	QByteArray res;
+	for (int i = 0; i < aNumDevices; ++i)
+	{
+		res.append(deviceID(i));
+		if (i == aOfflineIndex)
+		{
+			res.append("\toffline\n");
+		}
+		else if ((aUnauthorizedEvery > 0) && (i % aUnauthorizedEvery == 0))
+		{
+			res.append("\tunauthorized\n");
+		}
+		else
+		{
+			res.append("\tdevice\n");
+		}
+	}
+	return res;
+}
+
+
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Behavior tests:
+
+static void testParse(Logger & aLogger)
+{
+	auto list = AdbDeviceList::parse(
+		"0123456789\tdevice\n"
+		"emulator-5554\tunauthorized\n"
+		"emulator-5556\tauthorizing\n"
+		"ABCDEFGHIJ\toffline\n"
+		"no-tab-in-this-line\n"
+		"short\tdevice\n"
+		"\n"
+		"KLMNOPQRST\tbootloader",  // The last line doesn't need to be terminated
+		aLogger
+	);
+	CHECK(list.mDevices.size() == 5);
+	CHECK(list.mNumUnauthorized == 2);
+	CHECK(list.mDevices.at("0123456789") == AdbDeviceList::adsOnline);
+	CHECK(list.mDevices.at("emulator-5554") == AdbDeviceList::adsUnauthorized);
+	CHECK(list.mDevices.at("emulator-5556") == AdbDeviceList::adsUnauthorized);
+	CHECK(list.mDevices.at("ABCDEFGHIJ") == AdbDeviceList::adsOther);
+	CHECK(list.mDevices.at("KLMNOPQRST") == AdbDeviceList::adsOther);
+	CHECK(list.mDevices.count("short") == 0);
+	CHECK(list.idsWithStatus(AdbDeviceList::adsOnline) == std::vector<QByteArray>{"0123456789"});
+
+	// The parsed IDs must stay valid after the message is gone:
+	AdbDeviceList copy;
+	{
+		QByteArray msg("0123456789\tdevice\n");
+		copy = AdbDeviceList::parse(msg, aLogger);
+	}
+	CHECK(copy.mDevices.count("0123456789") == 1);
+
+	CHECK(AdbDeviceList::parse(QByteArray(), aLogger).mDevices.empty());
+}
+
+
+
+
+
+static void testDiff(Logger & aLogger)
+{
+	auto full = AdbDeviceList::parse(createMessage(NUM_DEVICES, 10, -1), aLogger);
+	CHECK(static_cast<int>(full.mDevices.size()) == NUM_DEVICES);
+	CHECK(full.mNumUnauthorized == NUM_DEVICES / 10);
+
+	// No change:
+	CHECK(AdbDeviceList::diff(full, full).empty());
+
+	// A single status change:
+	auto oneOffline = AdbDeviceList::parse(createMessage(NUM_DEVICES, 10, 123), aLogger);
+	CHECK(oneOffline != full);
+	auto changes = AdbDeviceList::diff(full, oneOffline);
+	CHECK(changes.size() == 1);
+	CHECK(!changes.empty() && (changes[0].mDeviceID == deviceID(123)));
+	CHECK(!changes.empty() && !changes[0].mIsRemoved && (changes[0].mNewStatus == AdbDeviceList::adsOther));
+
+	// A device added at the end (unauthorized, NUM_DEVICES is a multiple of 10), and then removed again:
+	auto oneMore = AdbDeviceList::parse(createMessage(NUM_DEVICES + 1, 10, -1), aLogger);
+	changes = AdbDeviceList::diff(full, oneMore);
+	CHECK(changes.size() == 1);
+	CHECK(!changes.empty() && (changes[0].mDeviceID == deviceID(NUM_DEVICES)) && !changes[0].mIsRemoved);
+	CHECK(!changes.empty() && (changes[0].mNewStatus == AdbDeviceList::adsUnauthorized));
+	changes = AdbDeviceList::diff(oneMore, full);
+	CHECK(changes.size() == 1);
+	CHECK(!changes.empty() && (changes[0].mDeviceID == deviceID(NUM_DEVICES)) && changes[0].mIsRemoved);
+
+	// All devices new, all devices removed:
+	AdbDeviceList empty;
+	changes = AdbDeviceList::diff(empty, full);
+	CHECK(static_cast<int>(changes.size()) == NUM_DEVICES);
+	CHECK(std::none_of(changes.begin(), changes.end(), [](const AdbDeviceList::Change & aChange) { return aChange.mIsRemoved; }));
+	changes = AdbDeviceList::diff(full, empty);
+	CHECK(static_cast<int>(changes.size()) == NUM_DEVICES);
+	CHECK(std::all_of(changes.begin(), changes.end(), [](const AdbDeviceList::Change & aChange) { return aChange.mIsRemoved; }));
+
+	// The changes are reported in the order of the IDs:
+	CHECK(std::is_sorted(changes.begin(), changes.end(),
+		[](const AdbDeviceList::Change & aChange1, const AdbDeviceList::Change & aChange2)
+		{
+			return (aChange1.mDeviceID < aChange2.mDeviceID);
+		}
+	));
+}
+
+
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Benchmarks:
+
+/** The device list as parsed by the previous implementation: three lists of the IDs. */
+struct ReferenceDeviceList
+{
+	QList<QByteArray> mOnline;
+	QList<QByteArray> mUnauthorized;
+	QList<QByteArray> mOther;
+};
+
+
+
+
+
+/** Parses the device list the way the previous implementation did. */
+static ReferenceDeviceList referenceParse(const QByteArray & aMessage)
+{
+	ReferenceDeviceList res;
+	for (const auto & line: aMessage.split('\n'))
+	{
+		if (line.isEmpty())
+		{
+			continue;
+		}
+		auto split = line.split('\t');
+		if ((split.size() < 2) || (split[0].size() < 8))
+		{
+			continue;
+		}
+		if (split[1] == "device")
+		{
+			res.mOnline.append(split[0]);
+		}
+		else if ((split[1] == "authorizing") || (split[1] == "unauthorized"))
+		{
+			res.mUnauthorized.append(split[0]);
+		}
+		else
+		{
+			res.mOther.append(split[0]);
+		}
+	}
+	return res;
+}
+
+
+
+
+
+/** Returns the number of the known devices that are no longer listed in aNew, checked the way the previous
+implementation did (QList::contains() on all three lists, for each known device). */
+static int referenceNumRemoved(const std::vector<QByteArray> & aKnownIDs, const ReferenceDeviceList & aNew)
+{
+	int res = 0;
+	for (const auto & id: aKnownIDs)
+	{
+		if (!aNew.mOnline.contains(id) && !aNew.mUnauthorized.contains(id) && !aNew.mOther.contains(id))
+		{
+			res += 1;
+		}
+	}
+	return res;
+}
+
+
+
+
+
+/** Measures a single device list update with NUM_DEVICES devices, the way the watchdog and the tracker deliver it:
+parse the whole list, then find the differences against the previous one (in which one device has a different
+status). Prints the time per update for both the current and the previous implementation. */
+static void benchmarkUpdate(Logger & aLogger)
+{
+	static const int NUM_ITERATIONS = 2000;
+	auto prevMessage = createMessage(NUM_DEVICES, 10, -1);
+	auto message = createMessage(NUM_DEVICES, 10, 123);
+	auto prevList = AdbDeviceList::parse(prevMessage, aLogger);
+	std::vector<QByteArray> knownIDs;
+	for (const auto & dev: prevList.mDevices)
+	{
+		knownIDs.push_back(dev.first);
+	}
+
+	// The parsing alone:
+	QElapsedTimer timer;
+	timer.start();
+	size_t numParsed = 0;
+	for (int i = 0; i < NUM_ITERATIONS; ++i)
+	{
+		numParsed += AdbDeviceList::parse(message, aLogger).mDevices.size();
+	}
+	auto parseNsec = timer.nsecsElapsed();
+	CHECK(numParsed == static_cast<size_t>(NUM_ITERATIONS) * NUM_DEVICES);
+
+	// The parsing and the diff:
+	timer.start();
+	size_t numChanges = 0;
+	for (int i = 0; i < NUM_ITERATIONS; ++i)
+	{
+		numChanges += AdbDeviceList::diff(prevList, AdbDeviceList::parse(message, aLogger)).size();
+	}
+	auto updateNsec = timer.nsecsElapsed();
+	CHECK(numChanges == static_cast<size_t>(NUM_ITERATIONS));
+
+	// The previous implementation, parsing and the offline check:
+	timer.start();
+	int numRefRemoved = 0;
+	size_t numRefParsed = 0;
+	for (int i = 0; i < NUM_ITERATIONS; ++i)
+	{
+		auto ref = referenceParse(message);
+		numRefParsed += static_cast<size_t>(ref.mOnline.size() + ref.mUnauthorized.size() + ref.mOther.size());
+		numRefRemoved += referenceNumRemoved(knownIDs, ref);
+	}
+	auto refNsec = timer.nsecsElapsed();
+	CHECK(numRefParsed == static_cast<size_t>(NUM_ITERATIONS) * NUM_DEVICES);
+	CHECK(numRefRemoved == 0);
+
+	printf("%d devices: parse %8.1f usec, parse + diff %8.1f usec; previous split + contains() %8.1f usec per update\n",
+		NUM_DEVICES,
+		parseNsec / 1000.0 / NUM_ITERATIONS,
+		updateNsec / 1000.0 / NUM_ITERATIONS,
+		refNsec / 1000.0 / NUM_ITERATIONS
+	);
+}
+
+
+
+
+
+int main()
+{
+	Logger logger("AdbDeviceListTest.log");
+	testParse(logger);
+	testDiff(logger);
+
+	benchmarkUpdate(logger);
+
+	return reportChecks();
+}
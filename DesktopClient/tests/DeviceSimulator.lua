@@ -46,6 +46,19 @@ end
 
 
 
+--- Reads the four bytes from aData starting at the specified index (1-based) and returns
+-- the number represented by them (big-endian uint32)
+local function readBE32(aData, aStartIdx)
+	assert(type(aData) == "string")
+
+	aStartIdx = aStartIdx or 1
+	return readBE16(aData, aStartIdx) * 65536 + readBE16(aData, aStartIdx + 2)
+end
+
+
+
+
+
 --- Converts the specified number to its big-endian uint16 representation and returns it as a two-byte string
 local function writeBE16(aNumber)
 	assert(type(aNumber) == "number")
@@ -351,11 +364,98 @@ end
 
 
 
+-------------------------------------------------------------------------------------------------------------
+-- ChannelStripe class:
+
+-- Implements a leg of a striped channel as a sink: the chunks from all the legs of a group are reassembled and
+-- counted, the throughput is printed periodically. Used for benchmarking the striping against a single link.
+-- Multiple simulated devices in the same process (e.g. connected over different interfaces) share the groups.
+local ChannelStripe = Channel:new()
+
+--- A map of GroupID -> group state, shared by all the legs
+local gStripeGroups = {}
+
+--- The amount of reassembled data after which the throughput is printed
+local STRIPE_REPORT_BYTES = 4 * 1024 * 1024
+
+
+
+
+
+function ChannelStripe:init(aInitData)
+	assert(type(self) == "table")
+
+	if (#(aInitData or "") < 8) then
+		return nil, "Init data too short"
+	end
+	local groupID = readBE32(aInitData, 1)
+	local numLegs = readBE16(aInitData, 5)
+	local legIndex = readBE16(aInitData, 7)
+	local svcName = readBE16LString(aInitData, 9)
+	local group = gStripeGroups[groupID]
+	if not(group) then
+		group =
+		{
+			mNumLegs = numLegs,
+			mNumLegsOpen = 0,
+			mNextSeq = 0,
+			mReorder = {},
+			mNumBytes = 0,
+			mNumMessages = 0,
+			mStartTime = socket.gettime(),
+		}
+		gStripeGroups[groupID] = group
+	end
+	group.mNumLegsOpen = group.mNumLegsOpen + 1
+	self.mGroup = group
+	print("Opened stripe leg " .. legIndex .. " of " .. numLegs .. " for service \"" .. tostring(svcName) .. "\"")
+	return true
+end
+
+
+
+
+
+function ChannelStripe:handleMessage(aMsg)
+	assert(type(self) == "table")
+
+	if (#aMsg < 5) then
+		error("Stripe chunk too short")
+	end
+	local group = self.mGroup
+	group.mReorder[readBE32(aMsg, 1)] = aMsg
+
+	-- Process all the chunks that are in order:
+	while (group.mReorder[group.mNextSeq]) do
+		local chunk = group.mReorder[group.mNextSeq]
+		group.mReorder[group.mNextSeq] = nil
+		group.mNextSeq = (group.mNextSeq + 1) % 4294967296
+		group.mNumBytes = group.mNumBytes + #chunk - 5
+		if (string.byte(chunk, 5) % 2 == 1) then
+			group.mNumMessages = group.mNumMessages + 1
+		end
+		if (group.mNumBytes >= STRIPE_REPORT_BYTES) then
+			local elapsed = socket.gettime() - group.mStartTime
+			print(string.format("Stripe: %d KiB in %d messages over %d legs in %.3f sec: %.1f KiB/sec",
+				group.mNumBytes / 1024, group.mNumMessages, group.mNumLegsOpen, elapsed, group.mNumBytes / 1024 / elapsed
+			))
+			group.mNumBytes = 0
+			group.mNumMessages = 0
+			group.mStartTime = socket.gettime()
+		end
+	end
+end
+
+
+
+
+
 -------------------------------------------------------------------------------------------------------------
 --- A map of "serviceName" -> ChannelClass for all known services / channels:
 local gChannelClasses =
 {
 	["info"] = ChannelInfo,
+	["stripe"] = ChannelStripe,
 }
 
 
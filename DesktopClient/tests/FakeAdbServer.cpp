@@ -0,0 +1,848 @@
+#include "FakeAdbServer.hpp"
+#include <cassert>
+#include <algorithm>
+#include <QTcpSocket>
+#include <QTimer>
+#include <QDateTime>
+#include <QRegularExpression>
+#include <QStringList>
+
+
+
+
+
+/** The packet IDs of the ShellV2 protocol. */
+static const char SHELL_ID_STDOUT = 1;
+static const char SHELL_ID_STDERR = 2;
+static const char SHELL_ID_EXIT = 3;
+
+/** The maximum size of a single DATA packet in the sync protocol. */
+static const int SYNC_DATA_CHUNK_SIZE = 64 * 1024;
+
+/** The exit code of the desktop client's app start command that signals that the app is not installed. */
+static const int EXIT_CODE_APP_NOT_INSTALLED = 100;
+
+/** The exit code of the desktop client's app start command that signals that its cached APK path is no longer valid. */
+static const int EXIT_CODE_APP_CACHE_STALE = 101;
+
+/** The file mode reported for all the files pushed to the devices (regular file, rw-r--r--). */
+static const quint32 SYNC_FILE_MODE = 0100644;
+
+
+
+
+
+/** Returns the little-endian uint32 representation of the specified number. */
+static QByteArray writeLE32(quint32 aValue)
+{
+	QByteArray res(4, 0);
+	for (int i = 0; i < 4; ++i)
+	{
+		res[i] = static_cast<char>((aValue >> (8 * i)) & 0xff);
+	}
+	return res;
+}
+
+
+
+
+
+/** Reads the little-endian uint32 from aData starting at the specified index. */
+static quint32 readLE32(const QByteArray & aData, int aIndex)
+{
+	quint32 res = 0;
+	for (int i = 3; i >= 0; --i)
+	{
+		res = (res << 8) | static_cast<quint8>(aData[aIndex + i]);
+	}
+	return res;
+}
+
+
+
+
+
+/** Returns the specified data prefixed with its length as hex4. */
+static QByteArray hex4(const QByteArray & aData)
+{
+	assert(aData.size() < 65536);
+	return QByteArray::number(aData.size(), 16).rightJustified(4, '0') + aData;
+}
+
+
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+// FakeAdbServer::Device:
+
+QByteArray FakeAdbServer::Device::apkPath() const
+{
+	return QByteArray("/data/app/cz.xoft.deskemes-") + QByteArray::number(mNumInstalls) + "/base.apk";
+}
+
+
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+// FakeAdbServer:
+
+FakeAdbServer::FakeAdbServer(const Config & aConfig, QObject * aParent):
+	Super(aParent),
+	mConfig(aConfig),
+	mNumAppStarted(0)
+{
+	for (int i = 1; i <= mConfig.mNumDevices; ++i)
+	{
+		auto dev = std::make_unique<Device>();
+		dev->mSerial = QByteArray("FAKE") + QByteArray::number(i).rightJustified(8, '0');
+		dev->mStatus = (i <= mConfig.mNumUnauthorized) ? "unauthorized" : "device";
+		dev->mHasApp = (i <= mConfig.mNumDevices - mConfig.mNumNoApp);
+		dev->mHasShellV2 = (i > mConfig.mNumNoShellV2);
+		dev->mScreenColor = qRgba((i * 53) % 256, (i * 101) % 256, (i * 151) % 256, 255);
+		mDevices.push_back(std::move(dev));
+	}
+	connect(&mServer, &QTcpServer::newConnection, this, &FakeAdbServer::acceptClients);
+}
+
+
+
+
+
+FakeAdbServer::~FakeAdbServer()
+{
+	for (auto & client: mClients)
+	{
+		client.first->disconnect(this);
+		client.first->abort();
+	}
+}
+
+
+
+
+
+bool FakeAdbServer::start()
+{
+	if (!mServer.listen(QHostAddress::LocalHost, mConfig.mPort))
+	{
+		return false;
+	}
+	for (size_t i = 0; i < mDevices.size(); ++i)
+	{
+		auto dev = mDevices[i].get();
+		if (mConfig.mArrivalIntervalMsec > 0)
+		{
+			QTimer::singleShot(static_cast<int>(i) * mConfig.mArrivalIntervalMsec, this, [this, dev]() { deviceArrive(*dev); });
+		}
+		else
+		{
+			deviceArrive(*dev);
+		}
+	}
+	return true;
+}
+
+
+
+
+
+std::vector<QByteArray> FakeAdbServer::serials() const
+{
+	std::vector<QByteArray> res;
+	for (const auto & dev: mDevices)
+	{
+		res.push_back(dev->mSerial);
+	}
+	return res;
+}
+
+
+
+
+
+bool FakeAdbServer::hasApp(const QByteArray & aSerial) const
+{
+	for (const auto & dev: mDevices)
+	{
+		if (dev->mSerial == aSerial)
+		{
+			return dev->mHasApp;
+		}
+	}
+	return false;
+}
+
+
+
+
+
+bool FakeAdbServer::isAppStarted(const QByteArray & aSerial) const
+{
+	for (const auto & dev: mDevices)
+	{
+		if (dev->mSerial == aSerial)
+		{
+			return dev->mIsAppStarted;
+		}
+	}
+	return false;
+}
+
+
+
+
+
+int FakeAdbServer::numDevicesWithApp() const
+{
+	return static_cast<int>(std::count_if(mDevices.cbegin(), mDevices.cend(),
+		[](const std::unique_ptr<Device> & aDevice)
+		{
+			return aDevice->mHasApp;
+		}
+	));
+}
+
+
+
+
+
+int FakeAdbServer::numRequests(const QByteArray & aService) const
+{
+	auto itr = mRequestCounts.find(aService);
+	return (itr == mRequestCounts.cend()) ? 0 : itr->second;
+}
+
+
+
+
+
+QString FakeAdbServer::requestCountsSummary() const
+{
+	QStringList parts;
+	for (const auto & count: mRequestCounts)
+	{
+		parts.append(QString::fromUtf8("%1: %2").arg(QString::fromUtf8(count.first)).arg(count.second));
+	}
+	return parts.join(", ");
+}
+
+
+
+
+
+qint64 FakeAdbServer::msecSinceFirstArrival() const
+{
+	return mFirstArrivalTimer.isValid() ? mFirstArrivalTimer.elapsed() : -1;
+}
+
+
+
+
+
+void FakeAdbServer::acceptClients()
+{
+	while (auto sock = mServer.nextPendingConnection())
+	{
+		sock->setSocketOption(QAbstractSocket::LowDelayOption, 1);
+		auto client = std::make_unique<Client>();
+		client->mSocket = sock;
+		auto clientPtr = client.get();
+		mClients[sock] = std::move(client);
+		connect(sock, &QTcpSocket::readyRead, this, [this, clientPtr]() { clientReadyRead(*clientPtr); });
+
+		// The socket may get disconnected while its data is being processed, remove the client only afterwards:
+		connect(sock, &QTcpSocket::disconnected, this,
+			[this, sock]()
+			{
+				mClients.erase(sock);
+				sock->deleteLater();
+			},
+			Qt::QueuedConnection
+		);
+	}
+}
+
+
+
+
+
+void FakeAdbServer::clientReadyRead(Client & aClient)
+{
+	aClient.mIncomingData.append(aClient.mSocket->readAll());
+	while (true)
+	{
+		switch (aClient.mMode)
+		{
+			case cmRequests:
+			{
+				if (!extractProcessRequest(aClient))
+				{
+					return;
+				}
+				break;
+			}
+			case cmSync:
+			{
+				if (!extractProcessSyncPacket(aClient))
+				{
+					return;
+				}
+				break;
+			}
+			case cmIgnore:
+			{
+				aClient.mIncomingData.clear();
+				return;
+			}
+		}
+	}
+}
+
+
+
+
+
+void FakeAdbServer::deviceArrive(Device & aDevice)
+{
+	aDevice.mIsPresent = true;
+	if (!mFirstArrivalTimer.isValid())
+	{
+		mFirstArrivalTimer.start();
+	}
+	emit deviceChanged(aDevice.mSerial, aDevice.mStatus);
+	notifyTrackers();
+	if (aDevice.mStatus == "unauthorized")
+	{
+		auto dev = &aDevice;
+		QTimer::singleShot(mConfig.mAuthorizeAfterMsec, this,
+			[this, dev]()
+			{
+				dev->mStatus = "device";
+				emit deviceChanged(dev->mSerial, dev->mStatus);
+				notifyTrackers();
+			}
+		);
+	}
+}
+
+
+
+
+
+FakeAdbServer::Device * FakeAdbServer::presentDevice(const QByteArray & aSerial)
+{
+	for (auto & dev: mDevices)
+	{
+		if (dev->mIsPresent && (dev->mSerial == aSerial))
+		{
+			return dev.get();
+		}
+	}
+	return nullptr;
+}
+
+
+
+
+
+QByteArray FakeAdbServer::deviceList() const
+{
+	// The serials are all the same length, the arrival order is also the sorted order:
+	QByteArray res;
+	for (const auto & dev: mDevices)
+	{
+		if (dev->mIsPresent)
+		{
+			res.append(dev->mSerial + "\t" + dev->mStatus + "\n");
+		}
+	}
+	return res;
+}
+
+
+
+
+
+void FakeAdbServer::notifyTrackers()
+{
+	auto list = hex4(deviceList());
+	for (auto & client: mClients)
+	{
+		if (client.second->mIsTracking)
+		{
+			send(*client.second, list);
+		}
+	}
+}
+
+
+
+
+
+void FakeAdbServer::send(Client & aClient, const QByteArray & aData, bool aShouldClose)
+{
+	auto sock = aClient.mSocket;
+	auto sendNow = [sock, aData, aShouldClose]()
+	{
+		sock->write(aData);
+		if (aShouldClose)
+		{
+			sock->disconnectFromHost();
+		}
+	};
+	if (mConfig.mLatencyMsec <= 0)
+	{
+		sendNow();
+		return;
+	}
+
+	// The timers with the same interval fire in the order in which they were started, so the data stays in order:
+	QTimer::singleShot(mConfig.mLatencyMsec, sock, sendNow);
+}
+
+
+
+
+
+void FakeAdbServer::fail(Client & aClient, const QByteArray & aMessage)
+{
+	aClient.mMode = cmIgnore;
+	send(aClient, "FAIL" + hex4(aMessage), true);
+}
+
+
+
+
+
+bool FakeAdbServer::extractProcessRequest(Client & aClient)
+{
+	if (aClient.mIncomingData.size() < 4)
+	{
+		return false;
+	}
+	bool isOK;
+	auto len = aClient.mIncomingData.left(4).toInt(&isOK, 16);
+	if (!isOK)
+	{
+		fail(aClient, "malformed request");
+		return false;
+	}
+	if (aClient.mIncomingData.size() < 4 + len)
+	{
+		return false;
+	}
+	auto request = aClient.mIncomingData.mid(4, len);
+	aClient.mIncomingData.remove(0, 4 + len);
+	if (aClient.mDevice != nullptr)
+	{
+		processDeviceRequest(aClient, request);
+	}
+	else
+	{
+		processHostRequest(aClient, request);
+	}
+	return true;
+}
+
+
+
+
+
+void FakeAdbServer::processHostRequest(Client & aClient, const QByteArray & aRequest)
+{
+	// Count the requests by the first two components ("host:transport", "host-serial:<serial>" is counted as "host-serial"):
+	auto parts = aRequest.split(':');
+	countRequest(parts[0].startsWith("host-serial") ? parts[0] : (parts[0] + ":" + parts.value(1)));
+
+	static const QRegularExpression reFeatures("^host-serial:([^:]+):features$");
+	auto featuresMatch = reFeatures.match(QString::fromUtf8(aRequest));
+	if (aRequest == "host:version")
+	{
+		send(aClient, "OKAY" + hex4(QByteArray::number(41, 16).rightJustified(4, '0')), true);
+	}
+	else if ((aRequest == "host:devices") || (aRequest == "host:devices-l"))
+	{
+		send(aClient, "OKAY" + hex4(deviceList()), true);
+	}
+	else if (aRequest == "host:track-devices")
+	{
+		send(aClient, "OKAY" + hex4(deviceList()));
+		aClient.mIsTracking = true;
+	}
+	else if (aRequest.startsWith("host:transport:"))
+	{
+		auto dev = presentDevice(aRequest.mid(15));
+		if (dev == nullptr)
+		{
+			fail(aClient, "device '" + aRequest.mid(15) + "' not found");
+		}
+		else if (dev->mStatus != "device")
+		{
+			fail(aClient, "device unauthorized.");
+		}
+		else
+		{
+			aClient.mDevice = dev;
+			send(aClient, "OKAY");
+		}
+	}
+	else if (featuresMatch.hasMatch())
+	{
+		auto dev = presentDevice(featuresMatch.captured(1).toUtf8());
+		if (dev == nullptr)
+		{
+			fail(aClient, "device not found");
+		}
+		else
+		{
+			send(aClient, "OKAY" + hex4(dev->mHasShellV2 ? "shell_v2,cmd,stat_v2" : ""), true);
+		}
+	}
+	else
+	{
+		fail(aClient, "unknown host service");
+	}
+}
+
+
+
+
+
+void FakeAdbServer::processDeviceRequest(Client & aClient, const QByteArray & aRequest)
+{
+	// Count the requests by the service name, without the arguments:
+	auto colonIdx = aRequest.indexOf(':');
+	countRequest((colonIdx < 0) ? aRequest : aRequest.left(colonIdx));
+
+	auto & dev = *aClient.mDevice;
+	if (aRequest == "framebuffer:")
+	{
+		// The client sends a nudge byte after the header, ignore it:
+		aClient.mMode = cmIgnore;
+		send(aClient, "OKAY" + framebuffer(dev), true);
+	}
+	else if (aRequest.startsWith("shell:"))
+	{
+		auto res = executeShell(dev, aRequest.mid(6));
+		send(aClient, "OKAY" + res.mStdOut + res.mStdErr, true);
+	}
+	else if (aRequest.startsWith("shell,v2,") || aRequest.startsWith("shell,v2:"))
+	{
+		if (!dev.mHasShellV2)
+		{
+			// Old adbd doesn't know the service:
+			fail(aClient, "closed");
+			return;
+		}
+
+		// The client closes its stdin, ignore it:
+		aClient.mMode = cmIgnore;
+		auto res = executeShell(dev, aRequest.mid(aRequest.indexOf(':') + 1));
+		QByteArray resp("OKAY");
+		if (!res.mStdOut.isEmpty())
+		{
+			resp.append(SHELL_ID_STDOUT).append(writeLE32(static_cast<quint32>(res.mStdOut.size()))).append(res.mStdOut);
+		}
+		if (!res.mStdErr.isEmpty())
+		{
+			resp.append(SHELL_ID_STDERR).append(writeLE32(static_cast<quint32>(res.mStdErr.size()))).append(res.mStdErr);
+		}
+		resp.append(SHELL_ID_EXIT).append(writeLE32(1)).append(static_cast<char>(res.mExitCode & 0xff));
+		send(aClient, resp, true);
+	}
+	else if (aRequest.startsWith("reverse:forward:"))
+	{
+		auto rule = aRequest.mid(16).replace(';', ' ');
+		auto deviceSide = rule.left(rule.indexOf(' '));
+		dev.mReverseRules.erase(
+			std::remove_if(dev.mReverseRules.begin(), dev.mReverseRules.end(),
+				[&deviceSide](const QByteArray & aRule)
+				{
+					return (aRule.left(aRule.indexOf(' ')) == deviceSide);
+				}
+			),
+			dev.mReverseRules.end()
+		);
+		dev.mReverseRules.push_back(rule);
+
+		// One OKAY for opening the service, another one for the result:
+		send(aClient, "OKAYOKAY", true);
+	}
+	else if (aRequest == "reverse:list-forward")
+	{
+		QByteArray lines;
+		for (const auto & rule: dev.mReverseRules)
+		{
+			lines.append(dev.mSerial + " " + rule + "\n");
+		}
+		send(aClient, "OKAYOKAY" + hex4(lines), true);
+	}
+	else if (aRequest == "sync:")
+	{
+		aClient.mMode = cmSync;
+		send(aClient, "OKAY");
+	}
+	else
+	{
+		fail(aClient, "unknown service " + aRequest);
+	}
+}
+
+
+
+
+
+bool FakeAdbServer::extractProcessSyncPacket(Client & aClient)
+{
+	auto & data = aClient.mIncomingData;
+	if (data.size() < 8)
+	{
+		return false;
+	}
+	auto id = data.left(4);
+	auto len = readLE32(data, 4);
+	auto & dev = *aClient.mDevice;
+
+	// The packets without any payload:
+	if (id == "DONE")
+	{
+		data.remove(0, 8);
+		if (!aClient.mIsSyncSending)
+		{
+			fail(aClient, "DONE without SEND");
+			return false;
+		}
+		dev.mFiles[aClient.mSyncSendPath] = aClient.mSyncSendData;
+		aClient.mIsSyncSending = false;
+		aClient.mSyncSendPath.clear();
+		aClient.mSyncSendData.clear();
+		send(aClient, "OKAY" + writeLE32(0));
+		return true;
+	}
+	else if (id == "QUIT")
+	{
+		data.clear();
+		aClient.mMode = cmIgnore;
+		aClient.mSocket->disconnectFromHost();
+		return false;
+	}
+
+	// The packets with a payload:
+	if (static_cast<quint32>(data.size()) < 8 + len)
+	{
+		return false;
+	}
+	auto payload = data.mid(8, static_cast<int>(len));
+	data.remove(0, 8 + static_cast<int>(len));
+	countRequest("sync:" + id);
+	if (id == "SEND")
+	{
+		auto commaIdx = payload.lastIndexOf(',');
+		aClient.mSyncSendPath = (commaIdx < 0) ? payload : payload.left(commaIdx);
+		aClient.mSyncSendData.clear();
+		aClient.mIsSyncSending = true;
+	}
+	else if (id == "DATA")
+	{
+		if (!aClient.mIsSyncSending)
+		{
+			fail(aClient, "DATA without SEND");
+			return false;
+		}
+		aClient.mSyncSendData.append(payload);
+	}
+	else if (id == "RECV")
+	{
+		auto itr = dev.mFiles.find(payload);
+		if (itr == dev.mFiles.end())
+		{
+			QByteArray msg("No such file or directory");
+			send(aClient, "FAIL" + writeLE32(static_cast<quint32>(msg.size())) + msg);
+		}
+		else
+		{
+			const auto & contents = itr->second;
+			for (int i = 0; i < contents.size(); i += SYNC_DATA_CHUNK_SIZE)
+			{
+				auto chunk = contents.mid(i, SYNC_DATA_CHUNK_SIZE);
+				send(aClient, "DATA" + writeLE32(static_cast<quint32>(chunk.size())) + chunk);
+			}
+			send(aClient, "DONE" + writeLE32(0));
+		}
+	}
+	else if (id == "STAT")
+	{
+		auto itr = dev.mFiles.find(payload);
+		if (itr == dev.mFiles.end())
+		{
+			send(aClient, "STAT" + writeLE32(0) + writeLE32(0) + writeLE32(0));
+		}
+		else
+		{
+			auto now = static_cast<quint32>(QDateTime::currentSecsSinceEpoch());
+			send(aClient, "STAT" + writeLE32(SYNC_FILE_MODE) + writeLE32(static_cast<quint32>(itr->second.size())) + writeLE32(now));
+		}
+	}
+	else if (id == "LIST")
+	{
+		auto prefix = payload;
+		while (prefix.endsWith('/'))
+		{
+			prefix.chop(1);
+		}
+		prefix.append('/');
+		auto now = static_cast<quint32>(QDateTime::currentSecsSinceEpoch());
+		for (const auto & file: dev.mFiles)
+		{
+			if (!file.first.startsWith(prefix))
+			{
+				continue;
+			}
+			auto name = file.first.mid(prefix.size());
+			send(aClient,
+				"DENT" + writeLE32(SYNC_FILE_MODE) + writeLE32(static_cast<quint32>(file.second.size())) + writeLE32(now) +
+				writeLE32(static_cast<quint32>(name.size())) + name
+			);
+		}
+		send(aClient, "DONE" + writeLE32(0) + writeLE32(0) + writeLE32(0) + writeLE32(0));
+	}
+	else
+	{
+		fail(aClient, "unknown sync request " + id);
+		return false;
+	}
+	return true;
+}
+
+
+
+
+
+FakeAdbServer::ShellResult FakeAdbServer::executeShell(Device & aDevice, const QByteArray & aCommand)
+{
+	static const QRegularExpression reCachedApkPath("\\[ -f '([^']*)' \\] \\|\\| exit");
+	static const QRegularExpression reInstallPath("pm install -r '([^']*)'");
+	static const QRegularExpression reExitMarker("; echo ([\\w:]+)\\$\\?$");
+
+	auto command = QString::fromUtf8(aCommand);
+	auto cachedApkMatch = reCachedApkPath.match(command);
+	auto cachedApkPath = cachedApkMatch.captured(1).toUtf8();
+	auto isAppStart = aCommand.contains("am startservice");
+	auto asksPackageManager = aCommand.contains("pm path cz.xoft.deskemes");
+	ShellResult res{QByteArray(), QByteArray(), 0};
+	if (isAppStart && asksPackageManager && !aDevice.mHasApp)
+	{
+		// The desktop client's app start command, the package manager reports no app:
+		res.mExitCode = EXIT_CODE_APP_NOT_INSTALLED;
+	}
+	else if (isAppStart && cachedApkMatch.hasMatch() && (cachedApkPath != aDevice.apkPath()))
+	{
+		// The desktop client's app start command, with a stale cached APK path:
+		res.mExitCode = EXIT_CODE_APP_CACHE_STALE;
+	}
+	else if (isAppStart && (cachedApkMatch.hasMatch() || asksPackageManager))
+	{
+		// The desktop client's app start command, the app is present:
+		res.mStdOut = "Starting service: Intent { cmp=cz.xoft.deskemes/.InitiateConnectionService (has extras) }\n";
+		if (!cachedApkMatch.hasMatch())
+		{
+			res.mStdOut.prepend("package:" + aDevice.apkPath() + "\n");
+		}
+		else
+		{
+			countRequest("appStartCached");
+		}
+		if (!aDevice.mIsAppStarted)
+		{
+			aDevice.mIsAppStarted = true;
+			mNumAppStarted += 1;
+			emit appStarted(aDevice.mSerial, mNumAppStarted);
+			if (mNumAppStarted == numDevicesWithApp())
+			{
+				emit allAppsStarted(msecSinceFirstArrival());
+			}
+		}
+	}
+	else if (aCommand.contains("pm list packages"))
+	{
+		res.mStdOut = aDevice.mHasApp ? "package:cz.xoft.deskemes\n" : "";
+	}
+	else if (aCommand.contains("pm install"))
+	{
+		auto path = reInstallPath.match(command).captured(1).toUtf8();
+		if (!path.isEmpty() && (aDevice.mFiles.find(path) != aDevice.mFiles.end()))
+		{
+			aDevice.mHasApp = true;
+			aDevice.mNumInstalls += 1;
+			res.mStdOut = "Success\n";
+		}
+		else
+		{
+			res.mStdErr = "Failure [INSTALL_FAILED_INVALID_URI]\n";
+			res.mExitCode = 1;
+		}
+	}
+	else if (aCommand.contains("am start"))
+	{
+		res.mStdOut = "Starting: Intent { act=android.intent.action.VIEW }\n";
+	}
+	else
+	{
+		res.mStdErr = "/system/bin/sh: " + aCommand + ": not found\n";
+		res.mExitCode = 127;
+	}
+
+	// Simulate the trailing "echo <marker>$?" that reports the exit code through ShellV1:
+	auto markerMatch = reExitMarker.match(command);
+	if (markerMatch.hasMatch())
+	{
+		res.mStdOut.append(markerMatch.captured(1).toUtf8() + QByteArray::number(res.mExitCode) + "\n");
+		res.mExitCode = 0;
+	}
+	return res;
+}
+
+
+
+
+
+QByteArray FakeAdbServer::framebuffer(const Device & aDevice) const
+{
+	auto width = static_cast<quint32>(mConfig.mScreenSize.width());
+	auto height = static_cast<quint32>(mConfig.mScreenSize.height());
+	auto size = width * height * 4;
+	QByteArray res;
+	res.reserve(static_cast<int>(52 + size));
+	res.append(writeLE32(1));  // version
+	res.append(writeLE32(32));  // bpp
+	res.append(writeLE32(size));
+	res.append(writeLE32(width));
+	res.append(writeLE32(height));
+	res.append(writeLE32(0)).append(writeLE32(8));  // red offset, length
+	res.append(writeLE32(16)).append(writeLE32(8));  // blue offset, length
+	res.append(writeLE32(8)).append(writeLE32(8));  // green offset, length
+	res.append(writeLE32(24)).append(writeLE32(8));  // alpha offset, length
+	const char pixel[] =
+	{
+		static_cast<char>(qRed(aDevice.mScreenColor)),
+		static_cast<char>(qGreen(aDevice.mScreenColor)),
+		static_cast<char>(qBlue(aDevice.mScreenColor)),
+		static_cast<char>(qAlpha(aDevice.mScreenColor)),
+	};
+	for (quint32 i = 0; i < width * height; ++i)
+	{
+		res.append(pixel, 4);
+	}
+	return res;
+}
+
+
+
+
+
+void FakeAdbServer::countRequest(const QByteArray & aService)
+{
+	mRequestCounts[aService] += 1;
+}
@@ -0,0 +1,269 @@
+#pragma once
+
+#include <map>
+#include <memory>
+#include <vector>
+#include <QObject>
+#include <QTcpServer>
+#include <QElapsedTimer>
+#include <QSize>
+#include <QRgb>
+
+
+
+
+
+// fwd:
+class QTcpSocket;
+
+
+
+
+
+/** Emulates a local ADB server with a number of simulated devices, so that the ADB-related code of the desktop client
+(AdbCommunicator, UsbDeviceEnumerator, AdbAppInstaller) can be tested and benchmarked without any real devices.
+Speaks the hex4 host protocol (host:devices, host:track-devices, host:transport:, host-serial:<serial>:features) and,
+per device, the framebuffer:, shell: (V1 and V2), reverse:forward:, reverse:list-forward and sync: services.
+The simulated devices recognize the desktop client's app start command (and report whether the app is installed),
+"pm list packages", "pm install" and "am start". */
+class FakeAdbServer:
+	public QObject
+{
+	using Super = QObject;
+
+	Q_OBJECT
+
+
+public:
+
+	/** The configuration of the simulated devices and the server's behavior. */
+	struct Config
+	{
+		/** The TCP port on which to listen for the ADB clients; 0 = any free port. */
+		quint16 mPort = 0;
+
+		/** The number of the simulated devices. */
+		int mNumDevices = 3;
+
+		/** The delay, in msec, before each response is sent out. */
+		int mLatencyMsec = 0;
+
+		/** The number of devices (from the end of the list) that don't have the app installed. */
+		int mNumNoApp = 0;
+
+		/** The number of devices (from the start of the list) that don't support the ShellV2 protocol (before Android 7). */
+		int mNumNoShellV2 = 0;
+
+		/** The number of devices (from the start of the list) that start in the "unauthorized" state. */
+		int mNumUnauthorized = 0;
+
+		/** The time, in msec, after which the unauthorized devices become authorized. */
+		int mAuthorizeAfterMsec = 5000;
+
+		/** The time, in msec, between the individual devices appearing; 0 = all devices are present from the start. */
+		int mArrivalIntervalMsec = 0;
+
+		/** The size of the simulated screens, in pixels. */
+		QSize mScreenSize = QSize(120, 240);
+	};
+
+
+	explicit FakeAdbServer(const Config & aConfig, QObject * aParent = nullptr);
+
+	virtual ~FakeAdbServer() override;
+
+	/** Starts listening on the configured port and makes the devices appear (either at once, or over time).
+	Returns false if the server cannot listen. */
+	bool start();
+
+	/** Returns the port on which the server is listening. */
+	quint16 port() const { return mServer.serverPort(); }
+
+	/** Returns the serials of all the simulated devices (including those that haven't appeared yet). */
+	std::vector<QByteArray> serials() const;
+
+	/** Returns true if the device with the specified serial has the app installed. */
+	bool hasApp(const QByteArray & aSerial) const;
+
+	/** Returns true if the app has been started on the device with the specified serial. */
+	bool isAppStarted(const QByteArray & aSerial) const;
+
+	/** Returns the number of devices that have the app installed. */
+	int numDevicesWithApp() const;
+
+	/** Returns the number of devices that have had the app started. */
+	int numAppStarted() const { return mNumAppStarted; }
+
+	/** Returns the number of requests received for the specified service (such as "host:transport", "shell,v2"). */
+	int numRequests(const QByteArray & aService) const;
+
+	/** Returns the request counts of all services, formatted as a single line of text. */
+	QString requestCountsSummary() const;
+
+	/** Returns the time, in msec, since the first device has appeared; -1 if no device has appeared yet. */
+	qint64 msecSinceFirstArrival() const;
+
+
+signals:
+
+	/** Emitted when a device appears, or its status changes. */
+	void deviceChanged(const QByteArray & aSerial, const QByteArray & aStatus);
+
+	/** Emitted when the app is started on a device for the first time. */
+	void appStarted(const QByteArray & aSerial, int aNumAppStarted);
+
+	/** Emitted once the app has been started on all the devices that have it.
+	aMsecSinceFirstArrival is the time since the first device has appeared. */
+	void allAppsStarted(qint64 aMsecSinceFirstArrival);
+
+
+protected:
+
+	/** A single simulated device. */
+	struct Device
+	{
+		/** The ADB serial of the device. */
+		QByteArray mSerial;
+
+		/** The status reported in the device list ("device", "unauthorized"). */
+		QByteArray mStatus;
+
+		/** True if the device is present (it has appeared). */
+		bool mIsPresent = false;
+
+		/** True if the app is installed on the device. */
+		bool mHasApp = true;
+
+		/** The number of times the app has been installed, used to generate a new APK path for each install. */
+		int mNumInstalls = 1;
+
+		/** True if the device supports the ShellV2 protocol. */
+		bool mHasShellV2 = true;
+
+		/** True once the app has been started on the device (by the app start command). */
+		bool mIsAppStarted = false;
+
+		/** The color of the device's simulated screen. */
+		QRgb mScreenColor = 0;
+
+		/** The files pushed to the device through the sync protocol, map of remote path -> contents. */
+		std::map<QByteArray, QByteArray> mFiles;
+
+		/** The port-reversing rules ("tcp:X tcp:Y") set up on the device. */
+		std::vector<QByteArray> mReverseRules;
+
+		/** Returns the path of the app's APK, as reported by "pm path"; changes with each install. */
+		QByteArray apkPath() const;
+	};
+
+	/** The result of a simulated shell command. */
+	struct ShellResult
+	{
+		QByteArray mStdOut;
+		QByteArray mStdErr;
+		int mExitCode;
+	};
+
+	/** The way the incoming data of a client connection is processed; changes as the connection switches services. */
+	enum ClientMode
+	{
+		cmRequests,  ///< Hex4-lengthed requests, to the host or (after host:transport:) to the device
+		cmSync,      ///< The sync protocol packets
+		cmIgnore,    ///< All incoming data is ignored (the framebuffer nudge byte, the ShellV2 stdin packets)
+	};
+
+	/** A single connection from an ADB client. */
+	struct Client
+	{
+		/** The socket of the connection, owned by the server. */
+		QTcpSocket * mSocket;
+
+		/** The incoming data, buffered until a complete request / packet is present. */
+		QByteArray mIncomingData;
+
+		/** The way the incoming data is processed. */
+		ClientMode mMode = cmRequests;
+
+		/** The device to which the connection has been switched (host:transport:), nullptr while talking to the host. */
+		Device * mDevice = nullptr;
+
+		/** True if the client is tracking the devices (host:track-devices). */
+		bool mIsTracking = false;
+
+		/** The path of the file being received through the sync SEND request, and the data received so far. */
+		QByteArray mSyncSendPath;
+		QByteArray mSyncSendData;
+		bool mIsSyncSending = false;
+	};
+
+
+	/** The configuration of the devices and the server's behavior. */
+	Config mConfig;
+
+	/** The TCP server accepting the client connections. */
+	QTcpServer mServer;
+
+	/** All the simulated devices, in the order of their arrival. */
+	std::vector<std::unique_ptr<Device>> mDevices;
+
+	/** All the connected clients, map of socket -> client. */
+	std::map<QTcpSocket *, std::unique_ptr<Client>> mClients;
+
+	/** Measures the time since the first device has appeared. Invalid until then. */
+	QElapsedTimer mFirstArrivalTimer;
+
+	/** The number of devices that have had the app started. */
+	int mNumAppStarted;
+
+	/** The number of requests for each service, map of service name -> count. */
+	std::map<QByteArray, int> mRequestCounts;
+
+
+	/** Accepts the new client connections. */
+	void acceptClients();
+
+	/** Reads the data from the specified client's socket and processes everything that is complete. */
+	void clientReadyRead(Client & aClient);
+
+	/** Makes the specified device present and notifies the trackers; schedules its authorization, if unauthorized. */
+	void deviceArrive(Device & aDevice);
+
+	/** Returns the device with the specified serial, if it is present; nullptr otherwise. */
+	Device * presentDevice(const QByteArray & aSerial);
+
+	/** Returns the device list, in the format used by host:devices and host:track-devices. */
+	QByteArray deviceList() const;
+
+	/** Sends the current device list to all the tracking clients. */
+	void notifyTrackers();
+
+	/** Queues the data to be sent to the client, once the configured latency passes.
+	If aShouldClose is true, the connection is closed after the data has been sent. */
+	void send(Client & aClient, const QByteArray & aData, bool aShouldClose = false);
+
+	/** Sends a FAIL response with the specified message and closes the connection. */
+	void fail(Client & aClient, const QByteArray & aMessage);
+
+	/** Extracts a single hex4-lengthed request from the client's incoming data and processes it.
+	Returns true if a request was processed, false if more data is needed. */
+	bool extractProcessRequest(Client & aClient);
+
+	/** Processes a single request to the host (the ADB server itself). */
+	void processHostRequest(Client & aClient, const QByteArray & aRequest);
+
+	/** Processes a single request to the device to which the client has been switched. */
+	void processDeviceRequest(Client & aClient, const QByteArray & aRequest);
+
+	/** Extracts a single sync protocol packet from the client's incoming data and processes it.
+	Returns true if a packet was processed, false if more data is needed. */
+	bool extractProcessSyncPacket(Client & aClient);
+
+	/** Simulates running the specified shell command on the device. */
+	ShellResult executeShell(Device & aDevice, const QByteArray & aCommand);
+
+	/** Returns the framebuffer:-service response for the device (header version 1, RGBA8888, and the pixels). */
+	QByteArray framebuffer(const Device & aDevice) const;
+
+	/** Counts a single request of the specified service. */
+	void countRequest(const QByteArray & aService);
+};
@@ -0,0 +1,126 @@
+// FakeAdbServerMain.cpp
+
+// The standalone fake ADB server, for running the desktop client against simulated devices by hand and for
+// benchmarking the onboarding of many devices.
+//
+// Usage:
+//   FakeAdbServer [--port=5037] [--devices=3] [--latency=0] [--noapp=0] [--nov2=0] [--unauthorized=0]
+//     [--authorize-after=5] [--arrival-interval=0] [--screen=120x240] [--timeout=0]
+// Then run the desktop client with the ANDROID_ADB_SERVER_PORT environment variable set to the same port (or use the
+// default ADB port, 5037, with no real ADB server running).
+// For scripted runs, --timeout makes the server exit as soon as the app is started on all the devices that have it
+// (exit code 0), or after the specified number of seconds (exit code 1).
+
+#include <cstdio>
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QTimer>
+#include "FakeAdbServer.hpp"
+
+
+
+
+
+int main(int argc, char * argv[])
+{
+	QCoreApplication app(argc, argv);
+
+	QCommandLineParser parser;
+	parser.setApplicationDescription("Emulates a local ADB server with a number of simulated devices.");
+	parser.addHelpOption();
+	parser.addOptions({
+		{"port",             "The TCP port on which to listen for the ADB clients.", "port", "5037"},
+		{"devices",          "The number of the simulated devices.", "num", "3"},
+		{"latency",          "The delay, in milliseconds, before each response is sent out.", "msec", "0"},
+		{"noapp",            "The number of devices (from the end of the list) that don't have the app installed.", "num", "0"},
+		{"nov2",             "The number of devices (from the start of the list) that don't support ShellV2.", "num", "0"},
+		{"unauthorized",     "The number of devices (from the start of the list) that start unauthorized.", "num", "0"},
+		{"authorize-after",  "The number of seconds after which the unauthorized devices become authorized.", "sec", "5"},
+		{"arrival-interval", "The number of seconds between the devices appearing; 0 = all present from the start.", "sec", "0"},
+		{"screen",           "The size of the simulated screens, in pixels.", "WxH", "120x240"},
+		{"timeout",          "Exit once the app is started on all devices, or with an error after this many seconds; 0 = run until killed.", "sec", "0"},
+	});
+	parser.process(app);
+
+	FakeAdbServer::Config config;
+	config.mPort = static_cast<quint16>(parser.value("port").toUInt());
+	config.mNumDevices = parser.value("devices").toInt();
+	config.mLatencyMsec = parser.value("latency").toInt();
+	config.mNumNoApp = parser.value("noapp").toInt();
+	config.mNumNoShellV2 = parser.value("nov2").toInt();
+	config.mNumUnauthorized = parser.value("unauthorized").toInt();
+	config.mAuthorizeAfterMsec = static_cast<int>(parser.value("authorize-after").toDouble() * 1000);
+	config.mArrivalIntervalMsec = static_cast<int>(parser.value("arrival-interval").toDouble() * 1000);
+	auto screen = parser.value("screen").split('x');
+	if (screen.size() == 2)
+	{
+		config.mScreenSize = QSize(screen[0].toInt(), screen[1].toInt());
+	}
+	auto timeoutSec = parser.value("timeout").toInt();
+
+	FakeAdbServer server(config);
+	QObject::connect(&server, &FakeAdbServer::deviceChanged,
+		[](const QByteArray & aSerial, const QByteArray & aStatus)
+		{
+			printf("Device %s: %s\n", aSerial.constData(), aStatus.constData());
+		}
+	);
+	QObject::connect(&server, &FakeAdbServer::appStarted,
+		[](const QByteArray & aSerial, int aNumAppStarted)
+		{
+			printf("App started on device %s (%d started)\n", aSerial.constData(), aNumAppStarted);
+		}
+	);
+	QObject::connect(&server, &FakeAdbServer::allAppsStarted,
+		[&server, timeoutSec](qint64 aMsecSinceFirstArrival)
+		{
+			printf("**** App started on all %d devices, %.3f seconds after the first device appeared\n",
+				server.numDevicesWithApp(), aMsecSinceFirstArrival / 1000.0
+			);
+			printf("Requests: %s\n", server.requestCountsSummary().toUtf8().constData());
+			if (timeoutSec > 0)
+			{
+				QCoreApplication::exit(0);
+			}
+		}
+	);
+	if (!server.start())
+	{
+		printf("Cannot listen on port %d.\n", config.mPort);
+		return 2;
+	}
+	printf("Fake ADB server listening on port %d: %d devices (%d without the app, %d without ShellV2, %d unauthorized), latency %d msec\n",
+		server.port(), config.mNumDevices, config.mNumNoApp, config.mNumNoShellV2, config.mNumUnauthorized, config.mLatencyMsec
+	);
+	fflush(stdout);
+
+	// Give up after the timeout:
+	if (timeoutSec > 0)
+	{
+		QTimer::singleShot(timeoutSec * 1000, &app,
+			[&server, timeoutSec]()
+			{
+				printf("**** Timeout: app started on only %d of %d devices after %d seconds\n",
+					server.numAppStarted(), server.numDevicesWithApp(), timeoutSec
+				);
+				printf("Requests: %s\n", server.requestCountsSummary().toUtf8().constData());
+				QCoreApplication::exit(1);
+			}
+		);
+	}
+
+	// Periodically print the stats:
+	QTimer statsTimer;
+	QObject::connect(&statsTimer, &QTimer::timeout,
+		[&server]()
+		{
+			printf("App started on %d of %d devices; requests: %s\n",
+				server.numAppStarted(), server.numDevicesWithApp(), server.requestCountsSummary().toUtf8().constData()
+			);
+			fflush(stdout);
+		}
+	);
+	statsTimer.start(5000);
+
+	return app.exec();
+}
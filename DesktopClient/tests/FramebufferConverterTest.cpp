@@ -0,0 +1,206 @@
+// FramebufferConverterTest.cpp
+
+// Runs the FramebufferConverter kernels with each instruction set (scalar, SSE2, AVX2, selected through
+// setInstructionSet()) on random 1080x2400 frames, checks that the vectorized results are bit-equal to the scalar
+// ones (the pixel conversions as well as halve()), and reports the throughput of each.
+
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <vector>
+#include <QElapsedTimer>
+#include <QImage>
+#include "Comm/FramebufferConverter.hpp"
+#include "TestHelpers.hpp"
+
+
+
+
+
+/** The dimensions of the test frames, a common phone screen. */
+static const int FRAME_WIDTH = 1080;
+static const int FRAME_HEIGHT = 2400;
+
+/** The number of times each kernel is run when measuring its throughput. */
+static const int NUM_ITERATIONS = 20;
+
+
+
+
+
+/** Returns aNumBytes of pseudo-random data, the same on every run. */
+static std::vector<char> randomData(size_t aNumBytes)
+{
+	std::vector<char> res(aNumBytes);
+	uint32_t rnd = 0x12345678;
+	for (auto & b: res)
+	{
+		rnd = rnd * 1103515245 + 12345;
+		b = static_cast<char>(rnd >> 16);
+	}
+	return res;
+}
+
+
+
+
+
+/** Returns the name of the instruction set, for the output. */
+static const char * instructionSetName(FramebufferConverter::EInstructionSet aInstructionSet)
+{
+	switch (aInstructionSet)
+	{
+		case FramebufferConverter::siScalar: return "scalar";
+		case FramebufferConverter::siSse2:   return "SSE2";
+		case FramebufferConverter::siAvx2:   return "AVX2";
+	}
+	return "unknown";
+}
+
+
+
+
+
+/** The instruction sets, in the order in which they are compared; the first one is the reference. */
+static const FramebufferConverter::EInstructionSet INSTRUCTION_SETS[] =
+{
+	FramebufferConverter::siScalar,
+	FramebufferConverter::siSse2,
+	FramebufferConverter::siAvx2,
+};
+
+
+
+
+
+/** Converts a random frame in the specified layout with each instruction set, checks the results against the scalar
+kernel and prints the throughput. Also checks pixel counts that leave a scalar tail after the vectorized part. */
+static void testConvert(const char * aName, const FramebufferConverter::Layout & aLayout)
+{
+	FramebufferConverter conv;
+	CHECK(conv.setLayout(aLayout));
+	auto numPixels = FRAME_WIDTH * FRAME_HEIGHT;
+	auto src = randomData(static_cast<size_t>(numPixels * conv.bytesPerPixel()));
+	std::vector<QRgb> reference(static_cast<size_t>(numPixels));
+	for (auto instructionSet: INSTRUCTION_SETS)
+	{
+		conv.setInstructionSet(instructionSet);
+		if (conv.instructionSet() != instructionSet)
+		{
+			printf("%-9s %-6s: not supported by this CPU, skipped\n", aName, instructionSetName(instructionSet));
+			continue;
+		}
+		std::vector<QRgb> dst(static_cast<size_t>(numPixels));
+		QElapsedTimer timer;
+		timer.start();
+		for (int i = 0; i < NUM_ITERATIONS; ++i)
+		{
+			conv.convert(src.data(), numPixels, dst.data());
+		}
+		auto elapsedNsec = std::max<qint64>(timer.nsecsElapsed(), 1);
+		if (instructionSet == FramebufferConverter::siScalar)
+		{
+			reference = dst;
+		}
+		else
+		{
+			CHECK(dst == reference);
+
+			// Odd pixel counts, so that the scalar tail is used, too:
+			for (int n: {1, 7, 15, 17, 1001})
+			{
+				std::vector<QRgb> tail(static_cast<size_t>(n));
+				conv.convert(src.data(), n, tail.data());
+				CHECK(std::equal(tail.begin(), tail.end(), reference.begin()));
+			}
+		}
+		printf("%-9s %-6s: %8.1f Mpix/sec, %7.1f frames/sec\n",
+			aName, instructionSetName(instructionSet),
+			1e3 * numPixels * NUM_ITERATIONS / elapsedNsec,
+			1e9 * NUM_ITERATIONS / elapsedNsec
+		);
+	}
+}
+
+
+
+
+
+/** Halves a random ARGB32 frame with each instruction set, checks the results against the scalar code and prints
+the throughput. The odd width checks the scalar tail at the end of each row. */
+static void testHalve(int aWidth, int aHeight)
+{
+	QImage img(aWidth, aHeight, QImage::Format_ARGB32);
+	for (int y = 0; y < aHeight; ++y)
+	{
+		auto row = randomData(static_cast<size_t>(aWidth) * 4 + static_cast<size_t>(y));
+		memcpy(img.scanLine(y), row.data() + y, static_cast<size_t>(aWidth) * 4);
+	}
+	FramebufferConverter conv;
+	QImage reference;
+	for (auto instructionSet: INSTRUCTION_SETS)
+	{
+		conv.setInstructionSet(instructionSet);
+		if (conv.instructionSet() != instructionSet)
+		{
+			printf("halve %4dx%-4d %-6s: not supported by this CPU, skipped\n", aWidth, aHeight, instructionSetName(instructionSet));
+			continue;
+		}
+		QImage res;
+		QElapsedTimer timer;
+		timer.start();
+		for (int i = 0; i < NUM_ITERATIONS; ++i)
+		{
+			res = FramebufferConverter::halve(img, conv.instructionSet());
+		}
+		auto elapsedNsec = std::max<qint64>(timer.nsecsElapsed(), 1);
+		CHECK(res.width() == aWidth / 2);
+		CHECK(res.height() == aHeight / 2);
+		if (instructionSet == FramebufferConverter::siScalar)
+		{
+			reference = res;
+
+			// Check the scalar code against the definition on a few pixels:
+			for (int y: {0, aHeight / 4, aHeight / 2 - 1})
+			{
+				for (int x: {0, aWidth / 4, aWidth / 2 - 1})
+				{
+					auto p00 = img.pixel(2 * x, 2 * y),     p01 = img.pixel(2 * x + 1, 2 * y);
+					auto p10 = img.pixel(2 * x, 2 * y + 1), p11 = img.pixel(2 * x + 1, 2 * y + 1);
+					auto red = (qRed(p00) + qRed(p01) + qRed(p10) + qRed(p11) + 2) / 4;
+					auto alpha = (qAlpha(p00) + qAlpha(p01) + qAlpha(p10) + qAlpha(p11) + 2) / 4;
+					CHECK(qRed(res.pixel(x, y)) == red);
+					CHECK(qAlpha(res.pixel(x, y)) == alpha);
+				}
+			}
+		}
+		else
+		{
+			CHECK(res == reference);
+		}
+		printf("halve %4dx%-4d %-6s: %8.1f Mpix/sec (source), %7.1f frames/sec\n",
+			aWidth, aHeight, instructionSetName(instructionSet),
+			1e3 * aWidth * aHeight * NUM_ITERATIONS / elapsedNsec,
+			1e9 * NUM_ITERATIONS / elapsedNsec
+		);
+	}
+}
+
+
+
+
+
+int main()
+{
+	printf("Best instruction set on this CPU: %s\n", instructionSetName(FramebufferConverter::bestInstructionSet()));
+
+	testConvert("RGBA8888", {32, {0, 8},  {8, 8}, {16, 8}, {24, 8}});
+	testConvert("BGRA8888", {32, {16, 8}, {8, 8}, {0, 8},  {24, 8}});
+	testConvert("RGB565",   {16, {11, 5}, {5, 6}, {0, 5},  {0, 0}});
+	testConvert("RGB888",   {24, {0, 8},  {8, 8}, {16, 8}, {0, 0}});  // The generic kernel, the same for all
+
+	testHalve(FRAME_WIDTH, FRAME_HEIGHT);
+	testHalve(FRAME_WIDTH - 1, FRAME_HEIGHT - 1);
+
+	return reportChecks();
+}
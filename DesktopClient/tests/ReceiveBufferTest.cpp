@@ -0,0 +1,354 @@
+// ReceiveBufferTest.cpp
+
+// Tests the ReceiveBuffer behavior (consume / compact / prepareWrite and the views across them) and benchmarks
+// the mux frame extraction on bursts of 1k, 10k and 100k frames, against the previous copy-per-frame QByteArray
+// parsing.
+
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <QByteArray>
+#include <QElapsedTimer>
+#include "Comm/ReceiveBuffer.hpp"
+#include "Utils.hpp"
+#include "TestHelpers.hpp"
+
+
+
+
+
+/** Returns a burst of aNumFrames mux frames (BE16 channel ID, BE16 length, payload) with 8 - 71 byte payloads. */
+static QByteArray createBurst(int aNumFrames)
+{
+	QByteArray res;
+	quint32 rnd = 0x12345678;
+	for (int i = 0; i < aNumFrames; ++i)
+	{
+		rnd = rnd * 1103515245 + 12345;
+		auto payloadLen = static_cast<quint16>(8 + (rnd >> 16) % 64);
+		res.append('\0');
+		res.append(static_cast<char>(1 + i % 4));
+		res.append(static_cast<char>(payloadLen >> 8));
+		res.append(static_cast<char>(payloadLen & 0xff));
+		res.append(QByteArray(payloadLen, static_cast<char>(i)));
+	}
+	return res;
+}
+
+
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Behavior tests:
+
+static void testConsumeKeepsViews()
+{
+	ReceiveBuffer buf;
+	buf.append(QByteArray("hello world"));
+	CHECK(buf.size() == 11);
+	auto hello = buf.view(0, 5);
+	buf.consume(6);
+	CHECK(buf.size() == 5);
+	CHECK(hello == "hello");
+	CHECK(buf.view(0, 5) == "world");
+	CHECK(QByteArray(buf.data(), buf.size()) == "world");
+
+	// Consuming everything leaves the buffer empty, but the views still point to the data:
+	buf.consume(5);
+	CHECK(buf.isEmpty());
+	CHECK(hello == "hello");
+}
+
+
+
+
+
+static void testCompact()
+{
+	ReceiveBuffer buf;
+	buf.append(QByteArray("0123456789"));
+	buf.consume(4);
+	auto copy = buf.copy(0, 3);
+	buf.compact();
+	CHECK(buf.size() == 6);
+	CHECK(buf.view(0, 6) == "456789");
+	CHECK(copy == "456");
+
+	// Compacting again is a no-op:
+	auto before = buf.data();
+	buf.compact();
+	CHECK(buf.data() == before);
+	CHECK(buf.view(0, 6) == "456789");
+
+	// Compacting an all-consumed buffer resets it to the start:
+	buf.consume(6);
+	buf.compact();
+	CHECK(buf.isEmpty());
+	buf.append(QByteArray("ab"));
+	CHECK(buf.view(0, 2) == "ab");
+}
+
+
+
+
+
+static void testPrepareWrite()
+{
+	ReceiveBuffer buf;
+	auto dest = buf.prepareWrite(16);
+	memcpy(dest, "abcdefgh", 8);
+	buf.commitWrite(8);
+	CHECK(buf.size() == 8);
+	CHECK(buf.view(0, 8) == "abcdefgh");
+
+	// There's space left at the tail, so the next write goes right after the data, without moving it:
+	auto front = buf.data();
+	dest = buf.prepareWrite(8);
+	CHECK(dest == front + 8);
+	CHECK(buf.data() == front);
+	memcpy(dest, "ijkl", 4);
+	buf.commitWrite(4);
+	CHECK(buf.view(0, 12) == "abcdefghijkl");
+
+	// Not enough space at the tail, but enough when the consumed data is dropped: compacts instead of growing:
+	buf.consume(10);
+	dest = buf.prepareWrite(12);
+	CHECK(buf.data() == front);
+	CHECK(buf.view(0, 2) == "kl");
+	CHECK(dest == front + 2);
+	memcpy(dest, "mn", 2);
+	buf.commitWrite(2);
+	CHECK(buf.view(0, 4) == "klmn");
+
+	// Committing less than prepared only adds the committed part:
+	dest = buf.prepareWrite(100);
+	memcpy(dest, "op", 2);
+	buf.commitWrite(2);
+	CHECK(buf.size() == 6);
+	CHECK(buf.view(0, 6) == "klmnop");
+	buf.append(QByteArray("qr"));
+	CHECK(buf.view(0, 8) == "klmnopqr");
+}
+
+
+
+
+
+static void testTakeAllAndClear()
+{
+	ReceiveBuffer buf;
+	buf.append(QByteArray("abcdef"));
+	buf.consume(2);
+	auto all = buf.takeAll();
+	CHECK(all == "cdef");
+	CHECK(buf.isEmpty());
+	buf.append(QByteArray("xyz"));
+	CHECK(all == "cdef");
+	CHECK(buf.view(0, 3) == "xyz");
+	buf.clear();
+	CHECK(buf.isEmpty());
+	CHECK(buf.size() == 0);
+}
+
+
+
+
+
+static void testShrink()
+{
+	// A buffer that's mostly full is only compacted:
+	ReceiveBuffer buf;
+	buf.append(QByteArray(1000, 'a'));
+	buf.append(QByteArray("bcd"));
+	buf.consume(500);
+	buf.shrink(16);
+	CHECK(buf.capacity() == 1003);
+	CHECK(buf.size() == 503);
+	CHECK(buf.view(500, 3) == "bcd");
+
+	// A large buffer that's mostly empty is reallocated to fit the data, keeping the minimum capacity:
+	buf.consume(490);
+	buf.shrink(16);
+	CHECK(buf.capacity() == 16);
+	CHECK(buf.size() == 13);
+	CHECK(buf.view(10, 3) == "bcd");
+
+	// A buffer that isn't larger than the minimum capacity is kept:
+	buf.consume(13);
+	buf.shrink(16);
+	CHECK(buf.capacity() == 16);
+	CHECK(buf.isEmpty());
+	buf.append(QByteArray("xyz"));
+	CHECK(buf.view(0, 3) == "xyz");
+
+	// An empty buffer after a large burst shrinks to the minimum capacity:
+	buf.append(QByteArray(100000, 'z'));
+	buf.consume(buf.size());
+	buf.shrink(64);
+	CHECK(buf.capacity() == 64);
+	CHECK(buf.isEmpty());
+}
+
+
+
+
+
+/** Feeds a burst in odd-sized chunks (as the socket would deliver it) and checks that all frames come out intact. */
+static void testChunkedFrames()
+{
+	static const int NUM_FRAMES = 1000;
+	auto burst = createBurst(NUM_FRAMES);
+	ReceiveBuffer buf;
+	int numFrames = 0;
+	int pos = 0;
+	bool isIntact = true;
+	while (pos < burst.size())
+	{
+		auto chunkLen = std::min(burst.size() - pos, 1 + (pos % 997));
+		memcpy(buf.prepareWrite(chunkLen), burst.constData() + pos, static_cast<size_t>(chunkLen));
+		buf.commitWrite(chunkLen);
+		pos += chunkLen;
+		while (buf.size() >= 4)
+		{
+			auto msgLen = static_cast<int>(Utils::readBE16(buf.bytes() + 2));
+			if (buf.size() < msgLen + 4)
+			{
+				break;
+			}
+			auto msg = buf.view(4, msgLen);
+			if (msg != QByteArray(msgLen, static_cast<char>(numFrames)))
+			{
+				isIntact = false;
+			}
+			buf.consume(4 + msgLen);
+			numFrames += 1;
+		}
+		buf.compact();
+	}
+	CHECK(isIntact);
+	CHECK(numFrames == NUM_FRAMES);
+	CHECK(buf.isEmpty());
+}
+
+
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Benchmarks:
+
+/** Extracts all the frames from aBurst the way Connection::processIncomingData() does: read into the buffer tail,
+extract views while consuming, compact once per burst. Returns the number of extracted frames. */
+static int extractWithReceiveBuffer(ReceiveBuffer & aBuffer, const QByteArray & aBurst, quint32 & aChecksum)
+{
+	memcpy(aBuffer.prepareWrite(aBurst.size()), aBurst.constData(), static_cast<size_t>(aBurst.size()));
+	aBuffer.commitWrite(aBurst.size());
+	int numFrames = 0;
+	while (aBuffer.size() >= 4)
+	{
+		auto header = aBuffer.bytes();
+		auto msgLen = static_cast<int>(Utils::readBE16(header + 2));
+		if (aBuffer.size() < msgLen + 4)
+		{
+			break;
+		}
+		auto msg = aBuffer.view(4, msgLen);
+		aBuffer.consume(4 + msgLen);
+		aChecksum += static_cast<quint8>(msg.at(0)) + Utils::readBE16(header);
+		numFrames += 1;
+	}
+	aBuffer.compact();
+	return numFrames;
+}
+
+
+
+
+
+/** Extracts all the frames from aBurst the way the previous QByteArray-based parser did: a copy of each frame,
+and a copy of the remaining data after each frame. Returns the number of extracted frames. */
+static int extractWithQByteArray(QByteArray & aBuffer, const QByteArray & aBurst, quint32 & aChecksum)
+{
+	aBuffer.append(aBurst);
+	int numFrames = 0;
+	while (aBuffer.size() >= 4)
+	{
+		auto msgLen = static_cast<int>(Utils::readBE16(reinterpret_cast<const quint8 *>(aBuffer.constData()) + 2));
+		if (aBuffer.size() < msgLen + 4)
+		{
+			break;
+		}
+		auto channelID = Utils::readBE16(reinterpret_cast<const quint8 *>(aBuffer.constData()));
+		auto msg = aBuffer.mid(4, msgLen);
+		aBuffer = aBuffer.mid(4 + msgLen);
+		aChecksum += static_cast<quint8>(msg.at(0)) + channelID;
+		numFrames += 1;
+	}
+	return numFrames;
+}
+
+
+
+
+
+/** Runs the extraction of aNumFramesPerBurst-frame bursts repeatedly, until at least aMinTotalFrames frames are
+processed, and prints the resulting rate. */
+static void benchmarkBurst(int aNumFramesPerBurst, int aMinTotalFrames, bool aShouldRunReference)
+{
+	auto burst = createBurst(aNumFramesPerBurst);
+	auto numBursts = std::max(1, aMinTotalFrames / aNumFramesPerBurst);
+
+	quint32 checksum = 0;
+	ReceiveBuffer buf;
+	QElapsedTimer timer;
+	timer.start();
+	qint64 numFrames = 0;
+	for (int i = 0; i < numBursts; ++i)
+	{
+		numFrames += extractWithReceiveBuffer(buf, burst, checksum);
+	}
+	auto elapsedNsec = std::max<qint64>(timer.nsecsElapsed(), 1);
+	CHECK(numFrames == static_cast<qint64>(numBursts) * aNumFramesPerBurst);
+	printf("%6d frames / burst: ReceiveBuffer %10.0f frames/sec", aNumFramesPerBurst, 1e9 * numFrames / elapsedNsec);
+
+	if (!aShouldRunReference)
+	{
+		printf(", QByteArray copy-per-frame skipped (quadratic in the burst size)\n");
+		return;
+	}
+	// The reference is much slower, run fewer bursts; the checksums are compared per burst:
+	auto numRefBursts = std::max(1, numBursts / 100);
+	quint32 refChecksum = 0;
+	QByteArray refBuf;
+	timer.start();
+	qint64 numRefFrames = 0;
+	for (int i = 0; i < numRefBursts; ++i)
+	{
+		numRefFrames += extractWithQByteArray(refBuf, burst, refChecksum);
+	}
+	auto refElapsedNsec = std::max<qint64>(timer.nsecsElapsed(), 1);
+	CHECK(numRefFrames == static_cast<qint64>(numRefBursts) * aNumFramesPerBurst);
+	CHECK(refChecksum * static_cast<quint32>(numBursts) == checksum * static_cast<quint32>(numRefBursts));
+	printf(", QByteArray copy-per-frame %10.0f frames/sec\n", 1e9 * numRefFrames / refElapsedNsec);
+}
+
+
+
+
+
+int main()
+{
+	testConsumeKeepsViews();
+	testCompact();
+	testPrepareWrite();
+	testTakeAllAndClear();
+	testShrink();
+	testChunkedFrames();
+
+	benchmarkBurst(1000,   1000000, true);
+	benchmarkBurst(10000,  1000000, true);
+	benchmarkBurst(100000, 1000000, false);
+
+	return reportChecks();
+}
@@ -0,0 +1,169 @@
+#include "StripeBenchmark.hpp"
+#include <cstdio>
+#include <algorithm>
+#include <QTimer>
+#include "Device.hpp"
+#include "Logger.hpp"
+
+
+
+
+
+/** The service to which the benchmark data is sent. */
+static const char SERVICE_NAME[] = "stripe-benchmark";
+
+/** The size of a single message sent through the striped channel. */
+static const int MESSAGE_SIZE = 64 * 1024;
+
+/** The interval for checking whether the legs have sent out all their queued data, at the end of a run, in msec. */
+static const int DRAIN_CHECK_INTERVAL_MSEC = 5;
+
+
+
+
+
+StripeBenchmark::StripeBenchmark(Device & aDevice, qint64 aNumBytes, Logger & aLogger):
+	mDevice(aDevice),
+	mNumBytes(aNumBytes),
+	mLogger(aLogger),
+	mIsAllConnectionsRun(false),
+	mNumBytesSent(0),
+	mSingleThroughput(0)
+{
+}
+
+
+
+
+
+void StripeBenchmark::start()
+{
+	auto conn = mDevice.bestConnection();
+	if (conn == nullptr)
+	{
+		mLogger.log("Stripe benchmark: there's no connection, aborting.");
+		emit finished(this, false);
+		return;
+	}
+	mIsAllConnectionsRun = false;
+	auto channel = std::make_shared<StripedChannel>(SERVICE_NAME, QByteArray(), mLogger);
+	if (!channel->open({conn}))
+	{
+		mLogger.log("Stripe benchmark: cannot open the channel, aborting.");
+		emit finished(this, false);
+		return;
+	}
+	startRun(std::move(channel));
+}
+
+
+
+
+
+void StripeBenchmark::startAllConnectionsRun()
+{
+	mIsAllConnectionsRun = true;
+	auto channel = mDevice.openStripedChannel(SERVICE_NAME);
+	if (channel == nullptr)
+	{
+		mLogger.log("Stripe benchmark: cannot open the channel over all the connections, aborting.");
+		emit finished(this, false);
+		return;
+	}
+	startRun(std::move(channel));
+}
+
+
+
+
+
+void StripeBenchmark::startRun(StripedChannelPtr && aChannel)
+{
+	mNumBytesSent = 0;
+	mChannel = std::move(aChannel);
+	connect(mChannel.get(), &StripedChannel::opened, this,
+		[this]()
+		{
+			mTimer.start();
+			sendMore();
+		}
+	);
+	connect(mChannel.get(), &StripedChannel::writable, this, &StripeBenchmark::sendMore);
+	connect(mChannel.get(), &StripedChannel::failed, this,
+		[this](StripedChannel * aChannel, const QString & aErrorMessage)
+		{
+			Q_UNUSED(aChannel);
+			mLogger.log("Stripe benchmark: the channel has failed (%1), aborting.", aErrorMessage);
+			emit finished(this, false);
+		}
+	);
+}
+
+
+
+
+
+void StripeBenchmark::sendMore()
+{
+	if (!mChannel->isOpen() || (mNumBytesSent >= mNumBytes))
+	{
+		return;
+	}
+	QByteArray msg(MESSAGE_SIZE, 'x');
+	while ((mNumBytesSent < mNumBytes) && mChannel->canSend())
+	{
+		mChannel->sendMessage(msg);
+		mNumBytesSent += msg.size();
+	}
+	if (mNumBytesSent >= mNumBytes)
+	{
+		finishRun();
+	}
+}
+
+
+
+
+
+void StripeBenchmark::finishRun()
+{
+	if (!mChannel->isOpen())
+	{
+		// The channel has failed while draining, finished() has already been emitted
+		return;
+	}
+
+	// Wait for the legs to send out all the queued data, so that the time covers the actual transfer:
+	if (mChannel->numBytesQueued() > 0)
+	{
+		QTimer::singleShot(DRAIN_CHECK_INTERVAL_MSEC, this, &StripeBenchmark::finishRun);
+		return;
+	}
+
+	auto elapsedMsec = std::max<qint64>(mTimer.elapsed(), 1);
+	auto throughput = static_cast<double>(mNumBytesSent) / 1024 * 1000 / elapsedMsec;
+	auto numLegs = mChannel->numLegs();
+	mChannel->close();
+	if (!mIsAllConnectionsRun)
+	{
+		mLogger.log("Stripe benchmark: %1 KiB over the best connection in %2 msec: %3 KiB/sec.",
+			mNumBytesSent / 1024, elapsedMsec, throughput
+		);
+		printf("Best connection: %lld KiB in %lld msec: %.1f KiB/sec\n",
+			static_cast<long long>(mNumBytesSent / 1024), static_cast<long long>(elapsedMsec), throughput
+		);
+		mSingleThroughput = throughput;
+
+		// Called from within a signal of mChannel, replace it only after the signal returns:
+		QTimer::singleShot(0, this, &StripeBenchmark::startAllConnectionsRun);
+		return;
+	}
+	mLogger.log("Stripe benchmark: %1 KiB over %2 connections in %3 msec: %4 KiB/sec (%5x the best connection).",
+		mNumBytesSent / 1024, numLegs, elapsedMsec, throughput, throughput / std::max(mSingleThroughput, 1.0)
+	);
+	printf("All %d connections: %lld KiB in %lld msec: %.1f KiB/sec (%.2fx the best connection)\n",
+		static_cast<int>(numLegs), static_cast<long long>(mNumBytesSent / 1024), static_cast<long long>(elapsedMsec),
+		throughput, throughput / std::max(mSingleThroughput, 1.0)
+	);
+	emit finished(this, true);
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <QObject>
+#include <QElapsedTimer>
+#include "Comm/StripedChannel.hpp"
+
+
+
+
+
+// fwd:
+class Device;
+class Logger;
+
+
+
+
+
+/** Measures the throughput of a striped channel against a single link.
+Sends the specified amount of data through a striped channel opened over the device's best connection only,
+then through one opened over all of its connections, and logs and prints the throughput of both runs.
+The data is sent to the "stripe-benchmark" service, which the device simulator (tests/DeviceSimulator.lua) counts
+and discards; the phone app doesn't provide it.
+Used by the StripeBenchmark tool (StripeBenchmarkMain.cpp), not part of the client itself. */
+class StripeBenchmark:
+	public QObject
+{
+	using Super = QObject;
+
+	Q_OBJECT
+
+
+public:
+
+	/** Creates a new benchmark for the specified device, sending aNumBytes in each run.
+	Nothing is sent until start() is called. */
+	StripeBenchmark(Device & aDevice, qint64 aNumBytes, Logger & aLogger);
+
+	/** Starts the first run, over the best connection of the device. */
+	void start();
+
+
+protected:
+
+	/** The device whose connections are being measured. */
+	Device & mDevice;
+
+	/** The number of bytes to send in each run. */
+	const qint64 mNumBytes;
+
+	/** The logger used for all messages produced by this class. */
+	Logger & mLogger;
+
+	/** The striped channel of the current run. */
+	StripedChannelPtr mChannel;
+
+	/** True if the current run uses all the connections, false if only the best one. */
+	bool mIsAllConnectionsRun;
+
+	/** The number of bytes sent so far in the current run. */
+	qint64 mNumBytesSent;
+
+	/** Measures the duration of the current run, started when its channel opens. */
+	QElapsedTimer mTimer;
+
+	/** The throughput of the single-connection run, in KiB / sec, to compare against. */
+	double mSingleThroughput;
+
+
+	/** Starts the second run, over all the connections of the device. */
+	void startAllConnectionsRun();
+
+	/** Starts a run using the specified striped channel, which has been requested to open. */
+	void startRun(StripedChannelPtr && aChannel);
+
+	/** Sends the data through mChannel until all of mNumBytes is sent, or until the legs are over their budget
+	(the sending is then resumed by the channel's writable() signal). */
+	void sendMore();
+
+	/** Logs the results of the current run and starts the next one, if any. */
+	void finishRun();
+
+
+signals:
+
+	/** Emitted when both runs have finished (aIsSuccess == true), or when the benchmark fails (aIsSuccess == false). */
+	void finished(StripeBenchmark * aSelf, bool aIsSuccess);
+};
@@ -0,0 +1,156 @@
+// StripeBenchmarkMain.cpp
+
+// The striping benchmark: runs the desktop client's communication components (without the UI), waits for a paired
+// device to connect over more than one link, then sends the data through a striped channel over the device's best
+// connection only and over all of its connections, and prints the throughput of both runs.
+//
+// Usage:
+//   StripeBenchmark [--mib=16] [--timeout=120]
+// Close the desktop client first, the tool uses the same configuration, pairings and TCP port. Then connect the
+// device simulator (tests/DeviceSimulator.lua), or any device that provides the "stripe-benchmark" service, over
+// several links. The tool exits with code 0 once both runs finish, or with code 1 if the benchmark fails or no device
+// connects over multiple links within the timeout. The results are printed and logged (the StripeBenchmark log).
+
+#include <cstdio>
+#include <algorithm>
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QTimer>
+#include "BackgroundTasks.hpp"
+#include "ComponentCollection.hpp"
+#include "Device.hpp"
+#include "DeviceMgr.hpp"
+#include "InstallConfiguration.hpp"
+#include "MultiLogger.hpp"
+#include "Settings.hpp"
+#include "DB/Database.hpp"
+#include "DB/DevicePairings.hpp"
+#include "DB/DeviceBlacklist.hpp"
+#include "Comm/ConnectionMgr.hpp"
+#include "Comm/DetectedDevices.hpp"
+#include "Comm/TcpListener.hpp"
+#include "Comm/TlsSessionCache.hpp"
+#include "Comm/UdpBroadcaster.hpp"
+#include "Comm/UsbDeviceEnumerator.hpp"
+#include "StripeBenchmark.hpp"
+
+
+
+
+
+/** Returns the first device that has more than one established connection, nullptr if there's none. */
+static DevicePtr findMultiLinkDevice(DeviceMgr & aDeviceMgr)
+{
+	for (const auto & dev: aDeviceMgr.devices())
+	{
+		int numEncrypted = 0;
+		for (const auto & conn: dev->connections())
+		{
+			if (conn->state() == Connection::csEncrypted)
+			{
+				numEncrypted += 1;
+			}
+		}
+		if (numEncrypted > 1)
+		{
+			return dev;
+		}
+	}
+	return nullptr;
+}
+
+
+
+
+
+int main(int argc, char * argv[])
+{
+	QCoreApplication app(argc, argv);
+
+	QCommandLineParser parser;
+	parser.setApplicationDescription("Compares the throughput of a striped channel against a single connection.");
+	parser.addHelpOption();
+	parser.addOptions({
+		{"mib",     "The amount of data to send in each run, in MiB.", "num", "16"},
+		{"timeout", "The number of seconds to wait for a device connected over multiple links.", "sec", "120"},
+	});
+	parser.process(app);
+	auto numMiB = std::max(parser.value("mib").toInt(), 1);
+	auto timeoutSec = parser.value("timeout").toInt();
+
+	// Create the same components as the client, minus the UI:
+	BackgroundTasks::get();
+	qRegisterMetaType<DevicePtr>();
+	qRegisterMetaType<Connection *>();
+	qRegisterMetaType<ConnectionPtr>();
+	ComponentCollection cc;
+	auto instConf = std::make_shared<InstallConfiguration>(cc);
+	Settings::init(instConf->dataLocation("Deskemes.ini"));
+	instConf->loadFromSettings();
+	cc.addComponent(instConf);
+	cc.addNew<MultiLogger>(instConf->logsFolder());
+	cc.addNew<Database>();
+	auto devMgr   = cc.addNew<DeviceMgr>();
+	auto connMgr  = cc.addNew<ConnectionMgr>();
+	cc.addNew<UdpBroadcaster>();
+	auto listener = cc.addNew<TcpListener>();
+	cc.addNew<DevicePairings>();
+	cc.addNew<DeviceBlacklist>();
+	cc.addNew<UsbDeviceEnumerator>();
+	cc.addNew<DetectedDevices>();
+	cc.addNew<TlsSessionCache>();
+	cc.start();
+	auto & logger = cc.logger("StripeBenchmark");
+	printf("Waiting for a device connected over more than one link, %d MiB per run...\n", numMiB);
+	fflush(stdout);
+
+	// Wait for the device, then run the benchmark; StripeBenchmark prints and logs the results:
+	int res = 1;
+	StripeBenchmark * benchmark = nullptr;
+	QTimer deviceCheckTimer;
+	QObject::connect(&deviceCheckTimer, &QTimer::timeout,
+		[&]()
+		{
+			auto dev = findMultiLinkDevice(*devMgr);
+			if (dev == nullptr)
+			{
+				return;
+			}
+			deviceCheckTimer.stop();
+			printf("Device %s has %d connections, starting the benchmark.\n",
+				dev->deviceID().constData(), static_cast<int>(dev->connections().size())
+			);
+			fflush(stdout);
+			benchmark = new StripeBenchmark(*dev, static_cast<qint64>(numMiB) * 1024 * 1024, logger);
+			QObject::connect(benchmark, &StripeBenchmark::finished,
+				[&res](StripeBenchmark * aBenchmark, bool aIsSuccess)
+				{
+					res = aIsSuccess ? 0 : 1;
+					aBenchmark->deleteLater();
+					QCoreApplication::exit(res);
+				}
+			);
+			benchmark->start();
+		}
+	);
+	deviceCheckTimer.start(100);
+	if (timeoutSec > 0)
+	{
+		QTimer::singleShot(timeoutSec * 1000, &app,
+			[&benchmark, timeoutSec]()
+			{
+				if (benchmark == nullptr)
+				{
+					printf("No device connected over more than one link within %d seconds.\n", timeoutSec);
+					QCoreApplication::exit(1);
+				}
+			}
+		);
+	}
+	app.exec();
+
+	BackgroundTasks::get().stopAll();
+	listener->stop();
+	connMgr->stop();
+	return res;
+}
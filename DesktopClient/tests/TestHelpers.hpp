@@ -0,0 +1,51 @@
+// TestHelpers.hpp
+
+// The checking scaffolding shared by all the tests: CHECK() reports each failed condition with its line and the
+// test's main() returns reportChecks() at the end.
+
+#pragma once
+
+#include <cstdio>
+
+
+
+
+
+/** Returns the number of checks that have failed so far. */
+inline int & numFailedChecks()
+{
+	static int numFailures = 0;
+	return numFailures;
+}
+
+
+
+
+
+/** Reports a failed check if aCondition is false. */
+inline void check(bool aCondition, const char * aDescription, const char * aFileName, int aLine)
+{
+	if (!aCondition)
+	{
+		printf("FAILED (%s:%d): %s\n", aFileName, aLine, aDescription);
+		numFailedChecks() += 1;
+	}
+}
+
+#define CHECK(aCondition) check(aCondition, #aCondition, __FILE__, __LINE__)
+
+
+
+
+
+/** Prints the summary of the checks and returns the test's exit code: 0 if all passed, 1 if any failed. */
+inline int reportChecks()
+{
+	if (numFailedChecks() > 0)
+	{
+		printf("%d check(s) failed.\n", numFailedChecks());
+		return 1;
+	}
+	printf("All checks passed.\n");
+	return 0;
+}
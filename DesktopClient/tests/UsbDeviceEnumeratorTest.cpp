@@ -0,0 +1,237 @@
+// UsbDeviceEnumeratorTest.cpp
+
+// Runs the UsbDeviceEnumerator against the FakeAdbServer with a mix of simulated devices (one that supports only
+// ShellV1, one that needs authorizing first, one without the app) and checks that each device gets onboarded:
+// the app is started on all the devices that have it, and DetectedDevices reports the expected status and an avatar
+// for each device. Reports the time from the first device appearing until all are onboarded.
+//
+// Usage:
+//   UsbDeviceEnumeratorTest [--devices=6] [--latency=0] [--max-concurrent=2]
+// Run it with different --max-concurrent values (the MaxConcurrentOnboardings setting) on the same device count
+// and latency to compare the concurrency caps; the enumerator's log also reports each onboarding batch.
+
+#include <cstdio>
+#include <algorithm>
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QElapsedTimer>
+#include <QTemporaryDir>
+#include <QTimer>
+#include "Comm/DetectedDevices.hpp"
+#include "Comm/TcpListener.hpp"
+#include "Comm/UsbDeviceEnumerator.hpp"
+#include "BackgroundTasks.hpp"
+#include "ComponentCollection.hpp"
+#include "MultiLogger.hpp"
+#include "Settings.hpp"
+#include "FakeAdbServer.hpp"
+#include "TestHelpers.hpp"
+
+
+
+
+
+/** The TCP port that the devices are told to connect to. Nothing listens there, the test only checks the app start. */
+static const quint16 TCP_LISTENER_PORT = 24816;
+
+/** The time after which the test gives up waiting for the devices to be onboarded. */
+static const int TIMEOUT_MSEC = 30000;
+
+
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+// TcpListener:
+
+// The UsbDeviceEnumerator only needs the port that the app should connect to; the real TcpListener would pull in the
+// whole Connection stack, so the test provides this stand-in instead.
+
+TcpListener::TcpListener(ComponentCollection & aComponents, QObject * aParent):
+	Super(aParent),
+	ComponentSuper(aComponents),
+	mLogger(aComponents.logger("TcpListener"))
+{
+}
+
+
+
+
+
+void TcpListener::start()
+{
+}
+
+
+
+
+
+void TcpListener::stop()
+{
+}
+
+
+
+
+
+quint16 TcpListener::listeningPort()
+{
+	return TCP_LISTENER_PORT;
+}
+
+
+
+
+
+void TcpListener::newConnection()
+{
+}
+
+
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+// The test:
+
+/** Returns the status that the device is expected to have in DetectedDevices once onboarded. */
+static DetectedDevices::Device::Status expectedStatus(const FakeAdbServer & aServer, const QByteArray & aSerial)
+{
+	return aServer.hasApp(aSerial) ? DetectedDevices::Device::dsOnline : DetectedDevices::Device::dsNeedApp;
+}
+
+
+
+
+
+/** Returns true if all the server's devices have been onboarded: their app has been started (if they have it) and
+DetectedDevices has them with the expected status and an avatar. */
+static bool isAllOnboarded(const FakeAdbServer & aServer, DetectedDevices & aDetectedDevices)
+{
+	auto devices = aDetectedDevices.allEnumeratorDevices(ComponentCollection::ckUsbDeviceEnumerator);
+	for (const auto & serial: aServer.serials())
+	{
+		auto itr = devices.find(serial);
+		if (
+			(itr == devices.end()) ||
+			(itr->second->status() != expectedStatus(aServer, serial)) ||
+			itr->second->avatar().isNull() ||
+			(aServer.hasApp(serial) && !aServer.isAppStarted(serial))
+		)
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+
+
+
+
+int main(int argc, char * argv[])
+{
+	QCoreApplication app(argc, argv);
+
+	QCommandLineParser parser;
+	parser.setApplicationDescription("Checks the onboarding of the simulated USB devices, reports its duration.");
+	parser.addHelpOption();
+	parser.addOptions({
+		{"devices",        "The number of the simulated devices.", "num", "6"},
+		{"latency",        "The delay, in milliseconds, before each response of the fake ADB server.", "msec", "0"},
+		{"max-concurrent", "The MaxConcurrentOnboardings setting to use.", "num", "2"},
+	});
+	parser.process(app);
+
+	QTemporaryDir dataDir;
+	CHECK(dataDir.isValid());
+	Settings::init(dataDir.filePath("UsbDeviceEnumeratorTest.ini"));
+
+	// Fewer concurrent onboardings than devices by default, so that the queueing is exercised as well:
+	auto maxConcurrent = parser.value("max-concurrent").toInt();
+	Settings::saveValue("UsbDeviceEnumerator", "MaxConcurrentOnboardings", maxConcurrent);
+
+	// Device 1 has no ShellV2, devices 1 and 2 need authorizing, the last device doesn't have the app:
+	FakeAdbServer::Config config;
+	config.mNumDevices = std::max(parser.value("devices").toInt(), 3);
+	config.mLatencyMsec = parser.value("latency").toInt();
+	config.mNumNoShellV2 = 1;
+	config.mNumUnauthorized = 2;
+	config.mAuthorizeAfterMsec = 1000;
+	config.mNumNoApp = 1;
+	FakeAdbServer server(config);
+	if (!server.start())
+	{
+		printf("Cannot start the fake ADB server.\n");
+		return 1;
+	}
+	qputenv("ANDROID_ADB_SERVER_PORT", QByteArray::number(server.port()));
+
+	BackgroundTasks::get();
+	ComponentCollection cc;
+	cc.addNew<MultiLogger>(dataDir.filePath("logs/"));
+	cc.addNew<TcpListener>();
+	auto detectedDevices = cc.addNew<DetectedDevices>();
+	cc.addNew<UsbDeviceEnumerator>();
+	cc.start();
+
+	// Wait for all devices to be onboarded:
+	QElapsedTimer timer;
+	timer.start();
+	qint64 onboardedMsec = -1;
+	QTimer checkTimer;
+	QObject::connect(&checkTimer, &QTimer::timeout,
+		[&]()
+		{
+			if (isAllOnboarded(server, *detectedDevices))
+			{
+				onboardedMsec = server.msecSinceFirstArrival();
+				app.exit(0);
+			}
+			else if (timer.elapsed() > TIMEOUT_MSEC)
+			{
+				app.exit(1);
+			}
+		}
+	);
+	checkTimer.start(20);
+	app.exec();
+	checkTimer.stop();
+
+	// Check each device, so that a failure says which one and why:
+	CHECK(onboardedMsec >= 0);
+	auto devices = detectedDevices->allEnumeratorDevices(ComponentCollection::ckUsbDeviceEnumerator);
+	for (const auto & serial: server.serials())
+	{
+		auto itr = devices.find(serial);
+		CHECK(itr != devices.end());
+		if (itr == devices.end())
+		{
+			printf("  Device %s is not in DetectedDevices.\n", serial.constData());
+			continue;
+		}
+		CHECK(itr->second->status() == expectedStatus(server, serial));
+		CHECK(!itr->second->avatar().isNull());
+		CHECK(server.isAppStarted(serial) == server.hasApp(serial));
+		printf("  Device %s: status %d, avatar %s, app %s\n",
+			serial.constData(),
+			static_cast<int>(itr->second->status()),
+			itr->second->avatar().isNull() ? "missing" : "present",
+			server.isAppStarted(serial) ? "started" : "not started"
+		);
+	}
+
+	// The ShellV2 support is decided by the device features, the ShellV1 device gets ShellV1:
+	CHECK(server.numRequests("host-serial") > 0);
+	CHECK(server.numRequests("shell") > 0);
+
+	printf("%d devices onboarded %lld msec after the first one appeared (incl. the %d msec authorization wait), "
+		"latency %d msec, MaxConcurrentOnboardings %d\n",
+		config.mNumDevices, static_cast<long long>(onboardedMsec), config.mAuthorizeAfterMsec,
+		config.mLatencyMsec, maxConcurrent
+	);
+	printf("Requests: %s\n", server.requestCountsSummary().toUtf8().constData());
+
+	BackgroundTasks::get().stopAll();
+	return reportChecks();
+}